@@ -0,0 +1,39 @@
+# gmux shell integration for bash 4.4+
+#
+# Marks prompts and commands with OSC 133 so gmux can keep a timeline of
+# each tab's commands: jump between prompts, copy a command's output, see
+# failed commands on the tab and search the commands of every tab. Each
+# command line is sent along too, base64 in gmux's OSC 666 termprop, so the
+# history holds what ran rather than what the screen shows.
+# Source it at the end of ~/.bashrc:
+#
+#   . /usr/local/share/gmux/shell-integration/gmux.bash
+
+[[ $- == *i* ]] || return 0
+[[ -n ${__gmux_marks-} ]] && return 0
+__gmux_marks=1
+
+__gmux_precmd() {
+    local ret=$?
+    # D: the last command's status (ignored if nothing ran), A: a new prompt
+    printf '\033]133;D;%d\033\\\033]133;A\033\\' "$ret"
+    __gmux_last=$(HISTTIMEFORMAT= builtin history 1)
+    return $ret
+}
+
+# Run from PS0, in a subshell, once the line is in the history. A history
+# entry unchanged since the prompt means the line was left out of it
+# (ignorespace, ignoredups), and so is left out of gmux's too.
+__gmux_command() {
+    local line re='^ *([0-9]+)[* ] (.*)$'
+    line=$(HISTTIMEFORMAT= builtin history 1)
+    [[ $line != "$__gmux_last" && $line =~ $re ]] || return 0
+    # "<history number> <line>"; the number makes repeats a change
+    printf '\033]666;vte.ext.gmux.command=%s\033\\' \
+        "$(printf '%s %s' "${BASH_REMATCH[1]}" "${BASH_REMATCH[2]}" | base64 -w0)"
+}
+
+PROMPT_COMMAND="__gmux_precmd${PROMPT_COMMAND:+; $PROMPT_COMMAND}"
+# B: end of the prompt; C: PS0 is printed once a command line is read
+PS1="$PS1\[\033]133;B\033\\\\\]"
+PS0="${PS0-}\$(__gmux_command)\033]133;C\033\\\\"
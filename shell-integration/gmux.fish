@@ -0,0 +1,30 @@
+# gmux shell integration for fish
+#
+# Marks prompts and commands with OSC 133 so gmux can keep a timeline of
+# each tab's commands: jump between prompts, copy a command's output, see
+# failed commands on the tab and search the commands of every tab. Each
+# command line is sent along too, base64 in gmux's OSC 666 termprop, so the
+# history holds what ran rather than what the screen shows.
+# Source it from ~/.config/fish/config.fish:
+#
+#   source /usr/local/share/gmux/shell-integration/gmux.fish
+
+status is-interactive; or exit
+set -q __gmux_marks; and exit
+set -g __gmux_marks 1
+set -g __gmux_seq 0
+
+function __gmux_prompt --on-event fish_prompt
+    printf '\e]133;A\e\\'
+end
+
+function __gmux_preexec --on-event fish_preexec
+    # "<sequence> <command line>"; the sequence makes repeats a change
+    set -g __gmux_seq (math $__gmux_seq + 1)
+    printf '\e]666;vte.ext.gmux.command=%s\e\\' (printf '%s %s' $__gmux_seq "$argv" | base64 -w0)
+    printf '\e]133;C\e\\'
+end
+
+function __gmux_postexec --on-event fish_postexec
+    printf '\e]133;D;%d\e\\' $status
+end
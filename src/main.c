@@ -2,6 +2,8 @@
 // gmux - A GTK4 terminal multiplexer with project-based workflow
 // Uses VTE (Virtual Terminal Emulator) library
 
+#define _GNU_SOURCE             // posix_spawn_file_actions_*_np, ptsname_r
+
 #include <gtk/gtk.h>
 #include <vte/vte.h>
 #include <stdio.h>
@@ -9,7 +11,25 @@
 #include <math.h>
 #include <stdarg.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <glib/gstdio.h>
+#include <glib-unix.h>
 #include <json-glib/json-glib.h>
+#include <gio/gunixsocketaddress.h>
 #include "themes.h"
 
 #ifndef GMUX_VERSION
@@ -20,8 +40,35 @@
 #define GMUX_GIT_COMMIT "unknown"
 #endif
 
+// vte_terminal_get_text_range_format (triggers, command output, export) is
+// VTE 0.72 and the *_with_default getters json-glib 1.6. Shell integration
+// also wants VTE 0.78 but is left out without it (HAVE_PROMPT_MARKS).
+#if !VTE_CHECK_VERSION(0, 72, 0)
+#error "gmux needs VTE 0.72 or newer"
+#endif
+#if !JSON_CHECK_VERSION(1, 6, 0)
+#error "gmux needs json-glib 1.6 or newer"
+#endif
+
 typedef struct _SubTab SubTab;
 typedef struct _Project Project;
+typedef struct _Discovery Discovery;
+typedef struct _GitRepo GitRepo;
+typedef struct _Keymap Keymap;
+typedef struct _KeyNode KeyNode;
+typedef struct _LatencyTracker LatencyTracker;
+typedef struct _FrameHud FrameHud;
+typedef struct _PasteJob PasteJob;
+typedef struct _ScrollbackExport ScrollbackExport;
+typedef struct _ScrollbackJob ScrollbackJob;
+typedef struct _Recipe Recipe;
+typedef struct _RecipeStep RecipeStep;
+typedef struct _TriggerSet TriggerSet;
+typedef struct _CommandMark CommandMark;
+typedef struct _HistoryStore HistoryStore;
+typedef struct _HistorySearch HistorySearch;
+typedef struct _HistoryRun HistoryRun;
+typedef struct _WorkspaceWindow WorkspaceWindow;
 
 typedef struct {
     GdkRGBA foreground;
@@ -43,6 +90,16 @@ typedef struct {
     gboolean loaded;
 } TerminalTheme;
 
+// A parsed theme as stored in the theme cache; see Theme Catalog
+typedef struct {
+    guint32 name_offset;        // Into the cache's name table
+    guint32 dark;
+    GdkRGBA foreground;
+    GdkRGBA background;
+    GdkRGBA cursor;
+    GdkRGBA palette[16];
+} ThemeRecord;
+
 typedef struct {
     char *font_family;    // NULL = use profile value
     double font_size;     // -1.0 = use profile value
@@ -53,40 +110,144 @@ typedef struct {
     char *night_theme_name;
     int day_start_minutes;
     int night_start_minutes;
+    int scrollback_budget_mb; // 0 = don't persist scrollback
+    char *discovery_roots;    // ':'-separated; NULL = no project discovery
+    char *discovery_ignore;   // Extra ','-separated directory name globs
+    int discovery_depth;      // How many levels below a root to look
+    char *keybindings;        // "bind=" values, '\n'-separated, in file order
+    int paste_confirm_kb;     // Ask before pasting more than this; 0 = never
+    gboolean spawn_via_vte;   // spawn_backend=vte: fork through VTE, see Lightweight Spawn
+    char *project_env;        // ','-separated activations to run, see Project Environments
+    char *triggers;           // "trigger=" values, '\n'-separated, in file order
+    char *trigger_command;    // Run by "run" triggers; NULL = none
 } TerminalSettings;
 
 typedef enum {
     SORT_NONE,
     SORT_ALPHA,
-    SORT_MRU
+    SORT_MRU,
+    SORT_FRECENCY
 } SortMode;
 
+typedef enum {
+    CLOSE_TAB,
+    CLOSE_OTHER_TABS,
+    CLOSE_ALL_TABS
+} CloseScope;
+
+typedef enum {
+    EXPORT_TEXT,
+    EXPORT_ANSI,
+    EXPORT_HTML
+} ExportFormat;
+
+// Work the frame HUD counts per frame, see count_hud_work()
+typedef enum {
+    HUD_WORK_THEME_APPLY,
+    HUD_WORK_PTY_RESIZE,
+    HUD_WORK_SESSION_SAVE,
+    HUD_WORK_COUNT
+} HudWork;
+
+// Theme choices in the settings dialog. Browsing only re-colors the
+// preview terminal; Apply writes them to settings and the live terminals.
 typedef struct {
-    GtkWidget *window;
+    GtkWidget *preview;
+    GtkWidget *day_dropdown;
+    GtkWidget *night_dropdown;
+    GtkWidget *apply_button;
+    char *day_name;             // Selected but not yet applied
+    char *night_name;
+} ThemePicker;
+
+// The workspace model, shared by every window. Projects, settings, the
+// session and the background services live here; what a window shows is
+// in its WorkspaceWindow.
+typedef struct {
+    GtkApplication *gtk_app;
+    GList *windows;             // WorkspaceWindow*, in creation order
+    WorkspaceWindow *focus;     // Window most recently active
     GtkWidget *settings_dialog;
-    GtkWidget *sidebar;
-    GtkWidget *notebook;
-    GtkWidget *sidebar_box;
     GList *projects;
-    void *active_project;
     TerminalTheme theme;
     TerminalSettings settings;
     char *theme_name;
     GtkCssProvider *css_provider;
     guint theme_schedule_timer_id;
     guint theme_refresh_idle_id;
-    gboolean theme_preview_active;
+    ThemePicker theme_picker;   // Widgets are NULL while the dialog doesn't exist
     gboolean settings_dialog_closing;
     int last_width;
     int last_height;
     gboolean last_maximized;
     SortMode sort_mode;
-    GtkWidget *sort_button;
+    guint scrollback_timer_id;
+    guint scrollback_idle_id;        // Autosave pass in progress
+    ScrollbackJob *scrollback_job;   // Snapshots taken by that pass, not yet written
+    gboolean shutting_down;
+    GSocketService *control_service;
+    char *control_socket_path;
+    GList *control_clients;     // ControlClient*, one per open connection
+    int bulk_depth;             // >0 while a bulk operation is open
+    gboolean bulk_save_pending; // save_session was requested during it
+    guint session_saves;        // Since startup; bulk-bench reads these
+    guint sort_passes;          // Full sidebar re-sorts
+    guint sort_compares;        // Sort func calls, including on insert
+    Discovery *discovery;
+    GPtrArray *discovered_projects; // Sorted repo paths from the last snapshot
+    char *discovery_query;      // Lowercased picker filter
+    GHashTable *git_repos;      // Project path -> GitRepo
+    GThreadPool *git_pool;
+    guint git_refresh_timer_id;
+    GHashTable *project_envs;   // Project path -> ProjectEnv
+    GThreadPool *env_pool;
+    guint job_poll_id;
+    gint64 job_poll_due;        // Monotonic time job_poll_id fires
+    GArray *job_listeners;      // JobListener, told about job and cwd changes
+    GMemoryMonitor *memory_monitor;
+    int psi_fd;                 // /proc/pressure/memory trigger, -1 if none
+    guint psi_source_id;
+    int memory_tier;            // Highest tier applied in the current episode
+    gint64 memory_last_warning; // Monotonic
+    gint64 memory_last_step;    // Monotonic
+    gint64 activate_time;       // Monotonic, for first-frame timing
+    Keymap *keymap;
+    KeyNode *key_chord;         // Chord prefix typed so far, NULL if none
+    guint key_chord_timer_id;
+    LatencyTracker *latency;    // NULL unless latency tracking is on
+    FrameHud *frame_hud;        // NULL while the frame HUD is hidden
+    TriggerSet *triggers;       // NULL when no trigger is set
+    guint trigger_scan_id;
+    HistoryStore *history;      // Opened on first use, see Command History
+    gboolean history_unavailable; // It failed to open; not retried
 } AppState;
 
+// One top-level window onto the workspace. Each project is shown in exactly
+// one window, and can be moved to another with move_project_to_window.
+struct _WorkspaceWindow {
+    AppState *app;
+    GtkWidget *window;
+    GtkWidget *sidebar;
+    GtkWidget *notebook;
+    GtkWidget *sort_button;
+    GtkWidget *discovery_button;
+    GtkWidget *discovery_search;
+    GtkWidget *discovery_list;
+    GtkWidget *debug_overlay;   // Box over the terminals for debug readouts
+    GtkWidget *history_popover; // Command history picker, built on first use
+    GtkWidget *history_entry;
+    GtkWidget *history_list;
+    HistorySearch *history_search; // Picker's search, NULL once it is closed
+    guint history_idle_id;      // Scans the rest after the first slice
+    guint history_shown;        // Matches in the list when it was last filled
+    Project *active_project;
+};
+
 typedef struct {
     char *name;
     char *working_dir;
+    char *scrollback_id;
+    char *command;              // Typed into the shell once spawned (layouts)
 } SavedSubTab;
 
 struct _SubTab {
@@ -98,6 +259,34 @@ struct _SubTab {
     char *name;
     Project *parent_tab;
     gboolean closing;
+    char *working_dir;           // Directory the shell is (or will be) spawned in
+    gboolean spawned;
+    char *scrollback_id;         // Basename of the on-disk scrollback snapshot
+    gboolean scrollback_dirty;   // Output arrived since the last snapshot
+    gboolean scrollback_queued;  // Waiting for its turn in the autosave pass
+    gboolean restore_pending;    // Snapshot not yet streamed back in
+    GCancellable *restore_cancellable;
+    GBytes *restore_bytes;
+    gsize restore_offset;
+    guint restore_idle_id;
+    GPid child_pid;              // 0 until the shell has been spawned
+    char *pending_input;         // Sent to the shell once it is running
+    pid_t fg_pgrp;               // Foreground process group of the PTY
+    char *job;                   // Foreground command, NULL at the prompt
+    char *cwd;                   // Shell cwd from /proc, when OSC 7 is absent
+    guint job_poll_ms;           // Current backoff interval
+    gint64 job_poll_due;         // Next poll, monotonic
+    PasteJob *paste;             // Paste being streamed in, see start_paste
+    ScrollbackExport *export;    // Running scrollback export, if any
+    RecipeStep *recipe_step;     // Startup recipe step started in this tab
+    long trigger_row;            // Rows above this were searched for triggers
+    gboolean trigger_dirty;      // Output arrived since the last trigger scan
+    gint64 trigger_run_time;     // When trigger_command last ran for this tab
+    GArray *commands;            // CommandMark, oldest first; see Command Timeline
+    int command_nav;             // Timeline entry last jumped to, -1 = none
+    char *failure;               // How the last command failed, NULL if it didn't
+    HistoryRun *history_run;     // Command line waiting for its exit status
+    char *shell_command;         // Sent by the shell for its next 133;C, see Command History
 };
 
 struct _Project {
@@ -116,38 +305,118 @@ struct _Project {
     char *name;
     char *path;
     AppState *app;
+    WorkspaceWindow *win;       // Window the project is shown in
     gboolean initialized;
     gint64 last_used;
+    double frecency;            // Log-domain visit score, see record_project_visit
     int insert_order;
     GList *saved_subtabs;       // List of SavedSubTab* (pending restore)
     int saved_active_subtab;    // Index to activate on restore
     GtkWidget *tab_count_label; // Badge showing number of open tabs
+    GtkWidget *git_label;       // Branch, ahead/behind and dirty marker
+    guint restore_idle_id;      // Pending scrollback restore for active_subtab
+    gboolean tabs_dirty;        // Tab strip needs refreshing when the bulk op ends
+    GtkWidget *tab_menu;        // Right-click menu on the tab strip
+    GMenu *tab_move_menu;       // Its "Move to Project" items, rebuilt on popup
+    SubTab *menu_subtab;        // Tab the menu was opened on
+    Recipe *recipe;             // Last startup recipe run, see Startup Recipes
 };
 
-static Project* create_project(AppState *app, const char *name, const char *path, gboolean init_terminal);
-static SubTab* create_subtab(Project *project, const char *name, const char *working_dir);
+static Project* create_project(WorkspaceWindow *win, const char *name, const char *path,
+                               gboolean init_terminal);
+static Project* find_project_by_path(AppState *app, const char *path);
+static Project* first_window_project(WorkspaceWindow *win);
+static Project* focused_project(AppState *app);
+static WorkspaceWindow* create_workspace_window(AppState *app);
+static WorkspaceWindow* open_workspace_window(AppState *app, Project *project);
+static void move_project_to_window(Project *project, WorkspaceWindow *win);
+static void move_subtab_to_project(SubTab *subtab, Project *project);
+static gboolean subtab_can_move_to_new_window(SubTab *subtab);
+static gboolean move_subtab_to_new_window(SubTab *subtab);
+static SubTab* create_subtab(Project *project, const char *name, const char *working_dir,
+                             const char *scrollback_id);
+static void ensure_project_page(Project *project);
+static void show_project_page(Project *project);
 static void close_subtab(SubTab *subtab);
 static void apply_theme_to_all_terminals(AppState *app);
 static void on_subtab_button_clicked(GtkButton *button, gpointer user_data);
 static void sync_terminal_size_from_widget(SubTab *subtab);
-static char* get_sort_config_path(void);
 static void on_project_selected(GtkListBox *box, GtkListBoxRow *row, gpointer user_data);
 static void setup_tabs_box_drag_reorder(Project *project);
 static void update_tab_overflow_indicator(Project *project);
 static void scroll_subtab_into_view(Project *project, SubTab *subtab);
+static void control_socket_stop(AppState *app);
+static void workspace_begin_bulk(AppState *app);
+static double frecency_visit_weight(gint64 time_usec);
+static void workspace_commit_bulk(AppState *app);
+static void setup_tab_context_menu(Project *project);
+static void start_project_discovery(AppState *app);
+static void stop_project_discovery(AppState *app);
+static void queue_git_badge_refresh(AppState *app);
+static void invalidate_git_status(AppState *app, const char *path);
+static void forget_git_repo(AppState *app, const char *path);
+static void stop_git_badges(AppState *app);
+static void spawn_with_project_env(SubTab *subtab);
+static GPid light_spawn(VteTerminal *terminal, const char *working_dir, char **argv,
+                        char **envv, GError **error);
+static gint64 read_rss_bytes(void);
+static void stop_project_envs(AppState *app);
+static gboolean start_recipe_on_open(Project *project);
+static void recipe_scan_output(SubTab *subtab);
+static void recipe_subtab_closed(SubTab *subtab);
+static void free_project_recipe(Project *project);
+static void queue_trigger_scan(SubTab *subtab);
+static void skip_trigger_rows(SubTab *subtab);
+static void clear_trigger_alert(SubTab *subtab);
+static void reload_triggers(AppState *app);
+static void stop_triggers(AppState *app);
+static void watch_prompt_marks(SubTab *subtab);
+static void note_command_input(SubTab *subtab, const char *text, guint size);
+static void free_command_timeline(SubTab *subtab);
+static void history_command_line(SubTab *subtab, const guint8 *data, gsize size);
+static void history_command_started(SubTab *subtab);
+static void history_command_finished(SubTab *subtab, int exit_status);
+static void stop_history(AppState *app);
+static void kick_job_poll(SubTab *subtab);
+static void cancel_paste(SubTab *subtab);
+static void cancel_scrollback_export(SubTab *subtab);
+static void apply_scrollback_budget(AppState *app);
+static void forget_project_envs(AppState *app);
+static void choose_scrollback_export(SubTab *subtab);
+static char* start_scrollback_export(SubTab *subtab, ExportFormat format, const char *path);
+static void stop_job_poll(AppState *app);
+static void request_close_subtabs(SubTab *subtab, CloseScope scope);
+static void stop_memory_monitor(AppState *app);
+static void reload_keymap(AppState *app);
+static void cancel_key_chord(AppState *app);
+static void latency_key_pressed(AppState *app, gint64 pressed);
+static void latency_mark_write(AppState *app, VteTerminal *terminal);
+static void latency_mark_echo(AppState *app, VteTerminal *terminal);
+static void disable_latency_tracking(AppState *app);
+static void frame_hud_count_work(FrameHud *hud, HudWork kind);
+static void toggle_frame_hud(AppState *app);
+static void hide_frame_hud(AppState *app);
+
+#define count_hud_work(app, kind) \
+    do { if ((app)->frame_hud) frame_hud_count_work((app)->frame_hud, (kind)); } while (0)
 
 static const char* gmux_build_version(void) {
     return "gmux " GMUX_VERSION " (" GMUX_GIT_COMMIT ", built " __DATE__ " " __TIME__ ")";
 }
-static const ThemePreset* find_builtin_theme(const char *name);
+static const ThemeRecord* find_theme(const char *name);
+static char* get_data_dir(void);
 static void apply_theme_name_now(AppState *app, const char *name);
 static void apply_ui_theme(AppState *app);
 static void refresh_scheduled_theme(AppState *app);
 static void queue_theme_refresh(AppState *app);
 
-static void debug_log(const char *fmt, ...) {
+static gboolean debug_enabled(void) {
     const char *enabled = g_getenv("GMUX_DEBUG");
-    if (!enabled || enabled[0] == '\0' || strcmp(enabled, "0") == 0)
+    return enabled && enabled[0] != '\0' && strcmp(enabled, "0") != 0;
+}
+
+static void debug_log(const char *fmt, ...) {
+    if (!debug_enabled())
         return;
 
     va_list args;
@@ -191,138 +460,228 @@ static char* compact_project_path(const char *path) {
 // Config Persistence
 //=============================================================================
 
-static char* get_data_dir(void) {
-    char *dir = g_build_filename(g_get_user_data_dir(), "gmux", NULL);
-    g_mkdir_with_parents(dir, 0755);
-    return dir;
-}
-
-static void migrate_config_to_data(void) {
-    char *data_dir = get_data_dir();
-    char *new_projects = g_build_filename(data_dir, "projects.conf", NULL);
+// All config files live in one data directory. The store resolves it and
+// reads every file that exists in a single pass at startup; after that the
+// load_* functions parse from memory and the save_* functions go through
+// config_store_write(), which skips writes whose content is unchanged and
+// keeps the cache in step so the file monitor can tell our own writes from
+// edits made outside gmux.
 
-    // Only migrate if new location doesn't exist yet
-    if (!g_file_test(new_projects, G_FILE_TEST_EXISTS)) {
-        char *old_dir = g_build_filename(g_get_user_config_dir(), "gmux", NULL);
-        char *old_projects = g_build_filename(old_dir, "projects.conf", NULL);
-        char *old_theme = g_build_filename(old_dir, "theme.conf", NULL);
+typedef enum {
+    CONFIG_FILE_SESSION,
+    CONFIG_FILE_SETTINGS,
+    CONFIG_FILE_WINDOW,
+    CONFIG_FILE_THEME,      // Legacy, superseded by settings.conf
+    CONFIG_FILE_SORT,       // Legacy, superseded by session.json
+    CONFIG_FILE_PROJECTS,   // Legacy, superseded by session.json
+    CONFIG_FILE_COUNT
+} ConfigFile;
+
+static const char *const config_file_names[CONFIG_FILE_COUNT] = {
+    [CONFIG_FILE_SESSION]  = "session.json",
+    [CONFIG_FILE_SETTINGS] = "settings.conf",
+    [CONFIG_FILE_WINDOW]   = "window.conf",
+    [CONFIG_FILE_THEME]    = "theme.conf",
+    [CONFIG_FILE_SORT]     = "sort.conf",
+    [CONFIG_FILE_PROJECTS] = "projects.conf",
+};
 
-        if (g_file_test(old_projects, G_FILE_TEST_EXISTS)) {
-            char *contents = NULL;
-            gsize len = 0;
-            if (g_file_get_contents(old_projects, &contents, &len, NULL)) {
-                g_file_set_contents(new_projects, contents, len, NULL);
-                g_free(contents);
-            }
-        }
+typedef struct {
+    char *data_dir;
+    char *paths[CONFIG_FILE_COUNT];
+    char *contents[CONFIG_FILE_COUNT];  // Last read or written; NULL = missing
+    GFileMonitor *monitor;
+    guint reload_timer_id;
+    int startup_fs_calls;
+} ConfigStore;
+
+static ConfigStore config_store;
+
+// --startup-bench runs against a throwaway data directory, so the user's
+// session, history and scrollback are neither read nor written
+static char *startup_bench_dir = NULL;
+
+static void config_store_load(void) {
+    if (config_store.data_dir) return;
+
+    gint64 start = g_get_monotonic_time();
+    config_store.data_dir = startup_bench_dir
+        ? g_strdup(startup_bench_dir)
+        : g_build_filename(g_get_user_data_dir(), "gmux", NULL);
+    g_mkdir_with_parents(config_store.data_dir, 0755);
+    config_store.startup_fs_calls++;
+
+    for (int i = 0; i < CONFIG_FILE_COUNT; i++) {
+        config_store.paths[i] = g_build_filename(config_store.data_dir,
+                                                 config_file_names[i], NULL);
+    }
 
-        char *new_theme = g_build_filename(data_dir, "theme.conf", NULL);
-        if (g_file_test(old_theme, G_FILE_TEST_EXISTS) &&
-            !g_file_test(new_theme, G_FILE_TEST_EXISTS)) {
-            char *contents = NULL;
-            gsize len = 0;
-            if (g_file_get_contents(old_theme, &contents, &len, NULL)) {
-                g_file_set_contents(new_theme, contents, len, NULL);
-                g_free(contents);
+    GDir *dir = g_dir_open(config_store.data_dir, 0, NULL);
+    config_store.startup_fs_calls++;
+    if (dir) {
+        const char *entry;
+        while ((entry = g_dir_read_name(dir)) != NULL) {
+            for (int i = 0; i < CONFIG_FILE_COUNT; i++) {
+                if (strcmp(entry, config_file_names[i]) != 0) continue;
+                g_file_get_contents(config_store.paths[i], &config_store.contents[i],
+                                    NULL, NULL);
+                config_store.startup_fs_calls++;
+                break;
             }
         }
-
-        g_free(new_theme);
-        g_free(old_projects);
-        g_free(old_theme);
-        g_free(old_dir);
+        g_dir_close(dir);
     }
 
-    g_free(new_projects);
-    g_free(data_dir);
+    debug_log("config store loaded dir=%s fs_calls=%d ms=%.2f",
+              config_store.data_dir, config_store.startup_fs_calls,
+              (g_get_monotonic_time() - start) / 1000.0);
 }
 
-static char* get_session_config_path(void) {
-    char *dir = get_data_dir();
-    char *path = g_build_filename(dir, "session.json", NULL);
-    g_free(dir);
-    return path;
+static const char* config_store_get(ConfigFile file) {
+    config_store_load();
+    return config_store.contents[file];
 }
 
-static char* get_legacy_projects_path(void) {
-    char *dir = get_data_dir();
-    char *path = g_build_filename(dir, "projects.conf", NULL);
-    g_free(dir);
-    return path;
+static void config_store_write(ConfigFile file, const char *text) {
+    config_store_load();
+    if (g_strcmp0(config_store.contents[file], text) == 0)
+        return;
+
+    GError *error = NULL;
+    if (!g_file_set_contents(config_store.paths[file], text, -1, &error)) {
+        g_warning("Failed to write %s: %s", config_store.paths[file], error->message);
+        g_error_free(error);
+        return;
+    }
+
+    g_free(config_store.contents[file]);
+    config_store.contents[file] = g_strdup(text);
 }
 
-static char* get_theme_config_path(void) {
-    char *dir = get_data_dir();
-    char *path = g_build_filename(dir, "theme.conf", NULL);
-    g_free(dir);
-    return path;
+static char* get_data_dir(void) {
+    config_store_load();
+    return g_strdup(config_store.data_dir);
 }
 
-static char* get_window_config_path(void) {
-    char *dir = get_data_dir();
-    char *path = g_build_filename(dir, "window.conf", NULL);
-    g_free(dir);
-    return path;
+static void migrate_config_to_data(void) {
+    // Only migrate on a first run in the new location
+    if (config_store_get(CONFIG_FILE_SESSION) || config_store_get(CONFIG_FILE_PROJECTS))
+        return;
+
+    char *old_dir = g_build_filename(g_get_user_config_dir(), "gmux", NULL);
+    char *old_projects = g_build_filename(old_dir, "projects.conf", NULL);
+    char *old_theme = g_build_filename(old_dir, "theme.conf", NULL);
+    char *contents = NULL;
+
+    if (g_file_get_contents(old_projects, &contents, NULL, NULL)) {
+        config_store_write(CONFIG_FILE_PROJECTS, contents);
+        g_free(contents);
+    }
+
+    if (!config_store_get(CONFIG_FILE_THEME) &&
+        g_file_get_contents(old_theme, &contents, NULL, NULL)) {
+        config_store_write(CONFIG_FILE_THEME, contents);
+        g_free(contents);
+    }
+
+    g_free(old_projects);
+    g_free(old_theme);
+    g_free(old_dir);
 }
 
 static void save_window_geometry(AppState *app) {
     if (app->last_width <= 0 || app->last_height <= 0) return;
 
-    char *path = get_window_config_path();
-    FILE *fp = fopen(path, "w");
-    g_free(path);
-    if (!fp) return;
-
-    fprintf(fp, "%d\n%d\n%d\n", app->last_width, app->last_height,
-            app->last_maximized ? 1 : 0);
-    fclose(fp);
+    char *text = g_strdup_printf("%d\n%d\n%d\n", app->last_width, app->last_height,
+                                 app->last_maximized ? 1 : 0);
+    config_store_write(CONFIG_FILE_WINDOW, text);
+    g_free(text);
 }
 
+// Only the first window's geometry is remembered
 static void on_window_size_changed(GtkWidget *widget, GParamSpec *pspec,
                                    gpointer user_data) {
-    AppState *app = (AppState *)user_data;
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
+    AppState *app = win->app;
     (void)pspec;
     (void)widget;
+    if (!app->windows || app->windows->data != win) return;
 
-    gboolean maximized = gtk_window_is_maximized(GTK_WINDOW(app->window));
+    gboolean maximized = gtk_window_is_maximized(GTK_WINDOW(win->window));
     app->last_maximized = maximized;
 
     // Only track size when not maximized, so we restore the windowed size
     if (!maximized) {
-        app->last_width = gtk_widget_get_width(app->window);
-        app->last_height = gtk_widget_get_height(app->window);
+        app->last_width = gtk_widget_get_width(win->window);
+        app->last_height = gtk_widget_get_height(win->window);
     }
 }
 
-static void load_window_geometry(AppState *app) {
-    char *path = get_window_config_path();
-    FILE *fp = fopen(path, "r");
-    g_free(path);
-    if (!fp) return;
+static void load_window_geometry(WorkspaceWindow *win) {
+    const char *text = config_store_get(CONFIG_FILE_WINDOW);
+    if (!text) return;
 
     int width = 0, height = 0, maximized = 0;
-    if (fscanf(fp, "%d\n%d\n%d", &width, &height, &maximized) == 3) {
+    if (sscanf(text, "%d\n%d\n%d", &width, &height, &maximized) == 3) {
         if (width > 0 && height > 0) {
-            gtk_window_set_default_size(GTK_WINDOW(app->window), width, height);
+            gtk_window_set_default_size(GTK_WINDOW(win->window), width, height);
         }
         if (maximized) {
-            gtk_window_maximize(GTK_WINDOW(app->window));
+            gtk_window_maximize(GTK_WINDOW(win->window));
         }
     }
-    fclose(fp);
+}
+
+// Where the shell is now: OSC 7 if the shell reports it, else what the job
+// poller last read from /proc, else the directory it was spawned in.
+static char* subtab_current_dir(SubTab *subtab) {
+    if (subtab->terminal) {
+        const char *uri = vte_terminal_get_current_directory_uri(subtab->terminal);
+        char *path = uri ? g_filename_from_uri(uri, NULL, NULL) : NULL;
+        if (path) return path;
+    }
+    if (subtab->cwd) return g_strdup(subtab->cwd);
+    return g_strdup(subtab->working_dir ? subtab->working_dir : subtab->parent_tab->path);
+}
+
+// Position of win among the windows showing a project; -1 if it shows none
+static int session_window_index(AppState *app, WorkspaceWindow *win) {
+    if (!first_window_project(win)) return -1;
+    int index = 0;
+    for (GList *w = app->windows; w != NULL && w->data != win; w = w->next) {
+        if (first_window_project((WorkspaceWindow *)w->data)) index++;
+    }
+    return index;
 }
 
 static void save_session(AppState *app) {
+    // Bulk operations write the session once, when they commit
+    if (app->bulk_depth > 0) {
+        app->bulk_save_pending = TRUE;
+        return;
+    }
+    count_hud_work(app, HUD_WORK_SESSION_SAVE);
+    app->session_saves++;
+
     JsonBuilder *builder = json_builder_new();
 
     json_builder_begin_object(builder);
 
-    // active_project_index
+    // Each window's active project; the first window's is also written as
+    // active_project_index for older versions. Windows without projects
+    // aren't kept, so opening one doesn't have to write the session.
     int active_idx = 0;
-    if (app->active_project) {
-        int idx = g_list_index(app->projects, app->active_project);
-        if (idx >= 0) active_idx = idx;
+    json_builder_set_member_name(builder, "windows");
+    json_builder_begin_array(builder);
+    for (GList *w = app->windows; w != NULL; w = w->next) {
+        WorkspaceWindow *win = (WorkspaceWindow *)w->data;
+        int window_idx = session_window_index(app, win);
+        if (window_idx < 0) continue;
+        int idx = win->active_project ? g_list_index(app->projects, win->active_project) : -1;
+        if (window_idx == 0 && idx >= 0) active_idx = idx;
+        json_builder_add_int_value(builder, idx);
     }
+    json_builder_end_array(builder);
     json_builder_set_member_name(builder, "active_project_index");
     json_builder_add_int_value(builder, active_idx);
 
@@ -331,6 +690,7 @@ static void save_session(AppState *app) {
     switch (app->sort_mode) {
         case SORT_ALPHA: json_builder_add_string_value(builder, "alpha"); break;
         case SORT_MRU:   json_builder_add_string_value(builder, "mru");   break;
+        case SORT_FRECENCY: json_builder_add_string_value(builder, "frecency"); break;
         default:         json_builder_add_string_value(builder, "none");   break;
     }
 
@@ -352,6 +712,17 @@ static void save_session(AppState *app) {
         json_builder_set_member_name(builder, "last_used");
         json_builder_add_int_value(builder, project->last_used);
 
+        int window_idx = session_window_index(app, project->win);
+        if (window_idx > 0) {
+            json_builder_set_member_name(builder, "window");
+            json_builder_add_int_value(builder, window_idx);
+        }
+
+        if (project->frecency != 0.0) {
+            json_builder_set_member_name(builder, "frecency");
+            json_builder_add_double_value(builder, project->frecency);
+        }
+
         if (project->initialized) {
             int active_sub_idx = 0;
             if (project->active_subtab) {
@@ -371,22 +742,14 @@ static void save_session(AppState *app) {
                 json_builder_set_member_name(builder, "name");
                 json_builder_add_string_value(builder, subtab->name);
 
-                const char *cwd = NULL;
-                if (subtab->terminal) {
-                    const char *uri = vte_terminal_get_current_directory_uri(subtab->terminal);
-                    if (uri) {
-                        char *path = g_filename_from_uri(uri, NULL, NULL);
-                        if (path) {
-                            json_builder_set_member_name(builder, "working_dir");
-                            json_builder_add_string_value(builder, path);
-                            g_free(path);
-                            cwd = "set";
-                        }
-                    }
-                }
-                if (!cwd) {
-                    json_builder_set_member_name(builder, "working_dir");
-                    json_builder_add_string_value(builder, project->path);
+                char *cwd = subtab_current_dir(subtab);
+                json_builder_set_member_name(builder, "working_dir");
+                json_builder_add_string_value(builder, cwd);
+                g_free(cwd);
+
+                if (subtab->scrollback_id) {
+                    json_builder_set_member_name(builder, "scrollback");
+                    json_builder_add_string_value(builder, subtab->scrollback_id);
                 }
 
                 json_builder_end_object(builder);
@@ -407,6 +770,10 @@ static void save_session(AppState *app) {
                 json_builder_add_string_value(builder, saved->name);
                 json_builder_set_member_name(builder, "working_dir");
                 json_builder_add_string_value(builder, saved->working_dir);
+                if (saved->scrollback_id) {
+                    json_builder_set_member_name(builder, "scrollback");
+                    json_builder_add_string_value(builder, saved->scrollback_id);
+                }
                 json_builder_end_object(builder);
             }
 
@@ -430,32 +797,50 @@ static void save_session(AppState *app) {
     JsonNode *root = json_builder_get_root(builder);
     json_generator_set_root(gen, root);
 
-    char *session_path = get_session_config_path();
-    json_generator_to_file(gen, session_path, NULL);
-    g_free(session_path);
+    char *data = json_generator_to_data(gen, NULL);
+    config_store_write(CONFIG_FILE_SESSION, data);
+    g_free(data);
 
     json_node_free(root);
     g_object_unref(gen);
     g_object_unref(builder);
 }
 
-static void load_session(AppState *app) {
-    char *session_path = get_session_config_path();
-    gboolean session_exists = g_file_test(session_path, G_FILE_TEST_EXISTS);
+// Appends a session entry's tabs to project's saved ones (not spawned yet)
+static void load_saved_subtabs(Project *project, JsonObject *proj_obj, const char *path) {
+    if (!json_object_has_member(proj_obj, "subtabs")) return;
+    JsonArray *subtabs_arr = json_object_get_array_member(proj_obj, "subtabs");
+    guint n_subtabs = json_array_get_length(subtabs_arr);
+
+    for (guint j = 0; j < n_subtabs; j++) {
+        JsonObject *sub_obj = json_array_get_object_element(subtabs_arr, j);
+        if (!sub_obj) continue;
+
+        const char *sub_name = json_object_get_string_member(sub_obj, "name");
+        const char *working_dir = json_object_get_string_member(sub_obj, "working_dir");
+        if (!sub_name) sub_name = "Tab";
+        if (!working_dir) working_dir = path;
+
+        SavedSubTab *saved = g_new0(SavedSubTab, 1);
+        saved->name = g_strdup(sub_name);
+        saved->working_dir = g_strdup(working_dir);
+        if (json_object_has_member(sub_obj, "scrollback"))
+            saved->scrollback_id = g_strdup(json_object_get_string_member(sub_obj, "scrollback"));
+        project->saved_subtabs = g_list_append(project->saved_subtabs, saved);
+    }
+}
 
-    if (!session_exists) {
-        g_free(session_path);
+static void load_session(AppState *app) {
+    const char *session_text = config_store_get(CONFIG_FILE_SESSION);
 
+    if (!session_text) {
         // Migration: try loading legacy projects.conf
-        char *legacy_path = get_legacy_projects_path();
-        FILE *fp = fopen(legacy_path, "r");
-        g_free(legacy_path);
-        if (!fp) return;
-
-        char line[4096];
-        while (fgets(line, sizeof(line), fp)) {
-            size_t len = strlen(line);
-            if (len > 0 && line[len - 1] == '\n') line[len - 1] = '\0';
+        const char *legacy_text = config_store_get(CONFIG_FILE_PROJECTS);
+        if (!legacy_text) return;
+
+        char **lines = g_strsplit(legacy_text, "\n", -1);
+        for (char **lp = lines; *lp != NULL; lp++) {
+            char *line = *lp;
             if (line[0] == '\0') continue;
 
             gint64 last_used = 0;
@@ -469,27 +854,21 @@ static void load_session(AppState *app) {
             }
 
             char *basename = g_path_get_basename(path);
-            Project *project = create_project(app, basename, path, FALSE);
+            Project *project = create_project(app->windows->data, basename, path, FALSE);
             project->last_used = last_used;
+            if (last_used > 0)
+                project->frecency = frecency_visit_weight(last_used);
             g_free(basename);
         }
-        fclose(fp);
+        g_strfreev(lines);
 
         // Also load legacy sort mode
-        char *sort_path = get_sort_config_path();
-        FILE *sfp = fopen(sort_path, "r");
-        g_free(sort_path);
-        if (sfp) {
-            char sline[64];
-            if (fgets(sline, sizeof(sline), sfp)) {
-                size_t slen = strlen(sline);
-                if (slen > 0 && sline[slen - 1] == '\n') sline[slen - 1] = '\0';
-                if (strcmp(sline, "alpha") == 0)
-                    app->sort_mode = SORT_ALPHA;
-                else if (strcmp(sline, "mru") == 0)
-                    app->sort_mode = SORT_MRU;
-            }
-            fclose(sfp);
+        const char *sort_text = config_store_get(CONFIG_FILE_SORT);
+        if (sort_text) {
+            if (g_str_has_prefix(sort_text, "alpha"))
+                app->sort_mode = SORT_ALPHA;
+            else if (g_str_has_prefix(sort_text, "mru"))
+                app->sort_mode = SORT_MRU;
         }
 
         // Save as session.json so migration only happens once
@@ -499,12 +878,10 @@ static void load_session(AppState *app) {
 
     // Parse session.json
     JsonParser *parser = json_parser_new();
-    if (!json_parser_load_from_file(parser, session_path, NULL)) {
-        g_free(session_path);
+    if (!json_parser_load_from_data(parser, session_text, -1, NULL)) {
         g_object_unref(parser);
         return;
     }
-    g_free(session_path);
 
     JsonNode *root = json_parser_get_root(parser);
     if (!root || !JSON_NODE_HOLDS_OBJECT(root)) {
@@ -521,14 +898,22 @@ static void load_session(AppState *app) {
             app->sort_mode = SORT_ALPHA;
         else if (g_strcmp0(mode_str, "mru") == 0)
             app->sort_mode = SORT_MRU;
+        else if (g_strcmp0(mode_str, "frecency") == 0)
+            app->sort_mode = SORT_FRECENCY;
         else
             app->sort_mode = SORT_NONE;
     }
 
-    // Read active_project_index
+    // Read active_project_index, and open the windows the session had
     int active_project_index = 0;
     if (json_object_has_member(root_obj, "active_project_index"))
         active_project_index = (int)json_object_get_int_member(root_obj, "active_project_index");
+    JsonArray *windows_arr = json_object_has_member(root_obj, "windows")
+        ? json_object_get_array_member(root_obj, "windows") : NULL;
+    guint n_windows = windows_arr ? json_array_get_length(windows_arr) : 0;
+    while (g_list_length(app->windows) < MAX(n_windows, 1)) {
+        create_workspace_window(app);
+    }
 
     // Read projects array
     if (!json_object_has_member(root_obj, "projects")) {
@@ -538,6 +923,8 @@ static void load_session(AppState *app) {
 
     JsonArray *projects_arr = json_object_get_array_member(root_obj, "projects");
     guint n_projects = json_array_get_length(projects_arr);
+    // The project each entry became, which the active indexes refer to
+    Project **loaded = g_new0(Project *, n_projects);
 
     for (guint i = 0; i < n_projects; i++) {
         JsonObject *proj_obj = json_array_get_object_element(projects_arr, i);
@@ -547,85 +934,75 @@ static void load_session(AppState *app) {
         const char *path = json_object_get_string_member(proj_obj, "path");
         if (!name || !path) continue;
 
-        Project *project = create_project(app, name, path, FALSE);
+        // Older sessions could hold a path twice, from a tab torn off into a
+        // new window: its tabs join the first entry
+        Project *existing = find_project_by_path(app, path);
+        if (existing) {
+            loaded[i] = existing;
+            load_saved_subtabs(existing, proj_obj, path);
+            continue;
+        }
+
+        gint64 window_idx = json_object_get_int_member_with_default(proj_obj, "window", 0);
+        WorkspaceWindow *win = g_list_nth_data(app->windows, (guint)CLAMP(window_idx, 0, G_MAXINT));
+        Project *project = create_project(win ? win : app->windows->data, name, path, FALSE);
+        loaded[i] = project;
 
         if (json_object_has_member(proj_obj, "last_used"))
             project->last_used = json_object_get_int_member(proj_obj, "last_used");
 
+        // Sessions from before frecency count their last use as one visit
+        project->frecency = json_object_get_double_member_with_default(proj_obj, "frecency", 0.0);
+        if (project->frecency == 0.0 && project->last_used > 0)
+            project->frecency = frecency_visit_weight(project->last_used);
+
         // Store subtab metadata for lazy restore (don't spawn terminals yet)
         if (json_object_has_member(proj_obj, "subtabs")) {
-            JsonArray *subtabs_arr = json_object_get_array_member(proj_obj, "subtabs");
-            guint n_subtabs = json_array_get_length(subtabs_arr);
-
-            for (guint j = 0; j < n_subtabs; j++) {
-                JsonObject *sub_obj = json_array_get_object_element(subtabs_arr, j);
-                if (!sub_obj) continue;
-
-                const char *sub_name = json_object_get_string_member(sub_obj, "name");
-                const char *working_dir = json_object_get_string_member(sub_obj, "working_dir");
-                if (!sub_name) sub_name = "Tab";
-                if (!working_dir) working_dir = path;
-
-                SavedSubTab *saved = g_new0(SavedSubTab, 1);
-                saved->name = g_strdup(sub_name);
-                saved->working_dir = g_strdup(working_dir);
-                project->saved_subtabs = g_list_append(project->saved_subtabs, saved);
-            }
-
+            load_saved_subtabs(project, proj_obj, path);
             project->saved_active_subtab = 0;
             if (json_object_has_member(proj_obj, "active_subtab_index"))
                 project->saved_active_subtab = (int)json_object_get_int_member(proj_obj, "active_subtab_index");
         }
     }
 
-    // Select the active project
-    GList *active_link = g_list_nth(app->projects, active_project_index);
-    if (active_link) {
-        Project *active_proj = (Project *)active_link->data;
-        app->active_project = active_proj;
-        gtk_notebook_set_current_page(GTK_NOTEBOOK(app->notebook), active_project_index);
-        gtk_list_box_select_row(GTK_LIST_BOX(app->sidebar),
-                               GTK_LIST_BOX_ROW(active_proj->list_row));
+    // Select each window's active project
+    for (GList *w = app->windows; w != NULL; w = w->next) {
+        WorkspaceWindow *win = (WorkspaceWindow *)w->data;
+        guint i = g_list_position(app->windows, w);
+        int index = i < n_windows ? (int)json_array_get_int_element(windows_arr, i)
+                  : i == 0 ? active_project_index : -1;
+        Project *active_proj = index >= 0 && (guint)index < n_projects ? loaded[index] : NULL;
+        if (!active_proj || active_proj->win != win) active_proj = first_window_project(win);
+        win->active_project = active_proj;
+        if (active_proj) {
+            show_project_page(active_proj);
+            gtk_list_box_select_row(GTK_LIST_BOX(win->sidebar),
+                                   GTK_LIST_BOX_ROW(active_proj->list_row));
+        }
     }
 
+    g_free(loaded);
     g_object_unref(parser);
 }
 
 static void save_theme_name(const char *name) {
-    char *config_path = get_theme_config_path();
-    FILE *fp = fopen(config_path, "w");
-    g_free(config_path);
-    if (!fp) return;
-    fprintf(fp, "%s\n", name);
-    fclose(fp);
+    char *text = g_strconcat(name, "\n", NULL);
+    config_store_write(CONFIG_FILE_THEME, text);
+    g_free(text);
 }
 
 static char* load_theme_name(void) {
-    char *config_path = get_theme_config_path();
-    FILE *fp = fopen(config_path, "r");
-    g_free(config_path);
-    if (!fp) return NULL;
-
-    char line[256];
-    char *name = NULL;
-    if (fgets(line, sizeof(line), fp)) {
-        size_t len = strlen(line);
-        if (len > 0 && line[len - 1] == '\n') line[len - 1] = '\0';
-        if (line[0] != '\0') {
-            name = g_strdup(line);
-        }
+    const char *text = config_store_get(CONFIG_FILE_THEME);
+    if (!text) return NULL;
+
+    char *name = g_strndup(text, strcspn(text, "\r\n"));
+    if (name[0] == '\0') {
+        g_free(name);
+        return NULL;
     }
-    fclose(fp);
     return name;
 }
 
-static char* get_settings_config_path(void) {
-    char *dir = get_data_dir();
-    char *path = g_build_filename(dir, "settings.conf", NULL);
-    g_free(dir);
-    return path;
-}
-
 static int clamp_minutes(int minutes) {
     if (minutes < 0) return 0;
     if (minutes > (23 * 60 + 59)) return 23 * 60 + 59;
@@ -643,56 +1020,83 @@ static gboolean parse_time_value(const char *value, int *minutes_out) {
     return TRUE;
 }
 
+static guint theme_count(void);
+static const ThemeRecord* theme_at(guint index);
+static const char* theme_record_name(const ThemeRecord *record);
+
 static const char* get_default_theme_name_for_variant(const char *preferred_name,
-                                                      const char *variant) {
-    if (preferred_name && find_builtin_theme(preferred_name))
+                                                      gboolean dark) {
+    if (preferred_name && find_theme(preferred_name))
         return preferred_name;
 
-    for (size_t i = 0; i < BUILTIN_THEME_COUNT; i++) {
-        if (g_strcmp0(builtin_themes[i].variant, variant) == 0)
-            return builtin_themes[i].name;
+    for (guint i = 0; i < theme_count(); i++) {
+        if (!theme_at(i)->dark == !dark)
+            return theme_record_name(theme_at(i));
     }
 
-    return builtin_themes[0].name;
+    return theme_record_name(theme_at(0));
 }
 
 static const char* get_default_day_theme_name(void) {
-    return get_default_theme_name_for_variant("Nord Light", "light");
+    return get_default_theme_name_for_variant("Nord Light", FALSE);
 }
 
 static const char* get_default_night_theme_name(void) {
-    return get_default_theme_name_for_variant("Dracula", "dark");
+    return get_default_theme_name_for_variant("Dracula", TRUE);
 }
 
 static void save_terminal_settings(TerminalSettings *s) {
-    char *path = get_settings_config_path();
-    FILE *fp = fopen(path, "w");
-    g_free(path);
-    if (!fp) return;
+    GString *text = g_string_new("");
 
     if (s->font_family)
-        fprintf(fp, "font_family=%s\n", s->font_family);
+        g_string_append_printf(text, "font_family=%s\n", s->font_family);
     if (s->font_size > 0)
-        fprintf(fp, "font_size=%.1f\n", s->font_size);
+        g_string_append_printf(text, "font_size=%.1f\n", s->font_size);
     if (s->opacity < 1.0)
-        fprintf(fp, "opacity=%.2f\n", s->opacity);
+        g_string_append_printf(text, "opacity=%.2f\n", s->opacity);
     if (s->cursor_shape >= 0)
-        fprintf(fp, "cursor_shape=%d\n", s->cursor_shape);
+        g_string_append_printf(text, "cursor_shape=%d\n", s->cursor_shape);
     if (s->cursor_blink >= 0)
-        fprintf(fp, "cursor_blink=%d\n", s->cursor_blink);
+        g_string_append_printf(text, "cursor_blink=%d\n", s->cursor_blink);
     if (s->day_theme_name)
-        fprintf(fp, "day_theme=%s\n", s->day_theme_name);
+        g_string_append_printf(text, "day_theme=%s\n", s->day_theme_name);
     if (s->night_theme_name)
-        fprintf(fp, "night_theme=%s\n", s->night_theme_name);
-    fprintf(fp, "day_start=%02d:%02d\n",
-            s->day_start_minutes / 60, s->day_start_minutes % 60);
-    fprintf(fp, "night_start=%02d:%02d\n",
-            s->night_start_minutes / 60, s->night_start_minutes % 60);
+        g_string_append_printf(text, "night_theme=%s\n", s->night_theme_name);
+    g_string_append_printf(text, "day_start=%02d:%02d\n",
+                           s->day_start_minutes / 60, s->day_start_minutes % 60);
+    g_string_append_printf(text, "night_start=%02d:%02d\n",
+                           s->night_start_minutes / 60, s->night_start_minutes % 60);
+    g_string_append_printf(text, "scrollback_budget_mb=%d\n", s->scrollback_budget_mb);
+    if (s->discovery_roots)
+        g_string_append_printf(text, "discovery_roots=%s\n", s->discovery_roots);
+    if (s->discovery_ignore)
+        g_string_append_printf(text, "discovery_ignore=%s\n", s->discovery_ignore);
+    g_string_append_printf(text, "discovery_depth=%d\n", s->discovery_depth);
+    g_string_append_printf(text, "paste_confirm_kb=%d\n", s->paste_confirm_kb);
+    g_string_append_printf(text, "spawn_backend=%s\n", s->spawn_via_vte ? "vte" : "posix");
+    g_string_append_printf(text, "project_env=%s\n", s->project_env);
+    if (s->keybindings) {
+        char **bindings = g_strsplit(s->keybindings, "\n", -1);
+        for (char **b = bindings; *b; b++)
+            g_string_append_printf(text, "bind=%s\n", *b);
+        g_strfreev(bindings);
+    }
+    if (s->triggers) {
+        char **triggers = g_strsplit(s->triggers, "\n", -1);
+        for (char **t = triggers; *t; t++)
+            g_string_append_printf(text, "trigger=%s\n", *t);
+        g_strfreev(triggers);
+    }
+    if (s->trigger_command)
+        g_string_append_printf(text, "trigger_command=%s\n", s->trigger_command);
 
-    fclose(fp);
+    config_store_write(CONFIG_FILE_SETTINGS, text->str);
+    g_string_free(text, TRUE);
 }
 
-static void load_terminal_settings(TerminalSettings *s) {
+// Fills s from settings.conf text; NULL text falls back to the legacy
+// theme.conf so upgrades keep the previously chosen theme.
+static void parse_terminal_settings(TerminalSettings *s, const char *text) {
     // Set defaults
     s->font_family = NULL;
     s->font_size = -1.0;
@@ -703,18 +1107,25 @@ static void load_terminal_settings(TerminalSettings *s) {
     s->night_theme_name = g_strdup(get_default_night_theme_name());
     s->day_start_minutes = 7 * 60 + 30;
     s->night_start_minutes = 20 * 60;
-
-    char *path = get_settings_config_path();
-    FILE *fp = fopen(path, "r");
-    g_free(path);
-    if (!fp) {
+    s->scrollback_budget_mb = 64;
+    s->discovery_roots = NULL;
+    s->discovery_ignore = NULL;
+    s->discovery_depth = 4;
+    s->keybindings = NULL;
+    s->paste_confirm_kb = 1024;
+    s->spawn_via_vte = FALSE;
+    s->project_env = g_strdup("direnv");
+    s->triggers = NULL;
+    s->trigger_command = NULL;
+
+    if (!text) {
         char *legacy_theme = load_theme_name();
         if (legacy_theme) {
-            const ThemePreset *legacy_preset = find_builtin_theme(legacy_theme);
-            if (legacy_preset && g_strcmp0(legacy_preset->variant, "light") == 0) {
+            const ThemeRecord *legacy_record = find_theme(legacy_theme);
+            if (legacy_record && !legacy_record->dark) {
                 g_free(s->day_theme_name);
                 s->day_theme_name = legacy_theme;
-            } else if (legacy_preset && g_strcmp0(legacy_preset->variant, "dark") == 0) {
+            } else if (legacy_record) {
                 g_free(s->night_theme_name);
                 s->night_theme_name = legacy_theme;
             } else {
@@ -724,10 +1135,11 @@ static void load_terminal_settings(TerminalSettings *s) {
         return;
     }
 
-    char line[512];
-    while (fgets(line, sizeof(line), fp)) {
+    char **lines = g_strsplit(text, "\n", -1);
+    for (char **lp = lines; *lp != NULL; lp++) {
+        char *line = *lp;
         size_t len = strlen(line);
-        if (len > 0 && line[len - 1] == '\n') line[len - 1] = '\0';
+        if (len > 0 && line[len - 1] == '\r') line[len - 1] = '\0';
         if (line[0] == '\0') continue;
 
         char *eq = strchr(line, '=');
@@ -750,12 +1162,12 @@ static void load_terminal_settings(TerminalSettings *s) {
         } else if (strcmp(key, "cursor_blink") == 0) {
             s->cursor_blink = atoi(val);
         } else if (strcmp(key, "day_theme") == 0) {
-            if (find_builtin_theme(val)) {
+            if (find_theme(val)) {
                 g_free(s->day_theme_name);
                 s->day_theme_name = g_strdup(val);
             }
         } else if (strcmp(key, "night_theme") == 0) {
-            if (find_builtin_theme(val)) {
+            if (find_theme(val)) {
                 g_free(s->night_theme_name);
                 s->night_theme_name = g_strdup(val);
             }
@@ -767,23 +1179,81 @@ static void load_terminal_settings(TerminalSettings *s) {
             int minutes = 0;
             if (parse_time_value(val, &minutes))
                 s->night_start_minutes = minutes;
+        } else if (strcmp(key, "scrollback_budget_mb") == 0) {
+            s->scrollback_budget_mb = MAX(0, atoi(val));
+        } else if (strcmp(key, "discovery_roots") == 0) {
+            g_free(s->discovery_roots);
+            s->discovery_roots = val[0] ? g_strdup(val) : NULL;
+        } else if (strcmp(key, "discovery_ignore") == 0) {
+            g_free(s->discovery_ignore);
+            s->discovery_ignore = val[0] ? g_strdup(val) : NULL;
+        } else if (strcmp(key, "discovery_depth") == 0) {
+            s->discovery_depth = CLAMP(atoi(val), 1, 32);
+        } else if (strcmp(key, "paste_confirm_kb") == 0) {
+            s->paste_confirm_kb = MAX(0, atoi(val));
+        } else if (strcmp(key, "spawn_backend") == 0) {
+            s->spawn_via_vte = strcmp(val, "vte") == 0;
+        } else if (strcmp(key, "project_env") == 0) {
+            g_free(s->project_env);
+            s->project_env = g_strdup(val);
+        } else if (strcmp(key, "bind") == 0 && val[0]) {
+            char *joined = s->keybindings ? g_strconcat(s->keybindings, "\n", val, NULL)
+                                          : g_strdup(val);
+            g_free(s->keybindings);
+            s->keybindings = joined;
+        } else if (strcmp(key, "trigger") == 0 && val[0]) {
+            char *joined = s->triggers ? g_strconcat(s->triggers, "\n", val, NULL)
+                                       : g_strdup(val);
+            g_free(s->triggers);
+            s->triggers = joined;
+        } else if (strcmp(key, "trigger_command") == 0) {
+            g_free(s->trigger_command);
+            s->trigger_command = val[0] ? g_strdup(val) : NULL;
         }
     }
-    fclose(fp);
+    g_strfreev(lines);
 
     s->day_start_minutes = clamp_minutes(s->day_start_minutes);
     s->night_start_minutes = clamp_minutes(s->night_start_minutes);
 }
 
+static void load_terminal_settings(TerminalSettings *s) {
+    parse_terminal_settings(s, config_store_get(CONFIG_FILE_SETTINGS));
+}
+
 //=============================================================================
 // Sort Mode Persistence & Sorting
 //=============================================================================
 
-static char* get_sort_config_path(void) {
-    char *dir = get_data_dir();
-    char *path = g_build_filename(dir, "sort.conf", NULL);
-    g_free(dir);
-    return path;
+// Frecency: every visit contributes exp(-rate * age), so a visit loses half
+// its weight per FRECENCY_HALF_LIFE_DAYS. Rather than decaying every score
+// as time passes, a project stores log(sum(exp(rate * visit_time))). That
+// key only changes when the project itself is visited, and ordering by it
+// equals ordering by the decayed score at any moment, so one visit moves
+// one row and never reorders the others.
+#define FRECENCY_HALF_LIFE_DAYS 3.0
+
+static double frecency_visit_weight(gint64 time_usec) {
+    double rate = G_LN2 / (FRECENCY_HALF_LIFE_DAYS * 24 * 3600);
+    return rate * ((double)time_usec / G_USEC_PER_SEC);
+}
+
+// O(1): log-add one visit at time_usec. 0.0 means never visited.
+static void record_project_visit(Project *project, gint64 time_usec) {
+    double visit = frecency_visit_weight(time_usec);
+    double key = project->frecency;
+
+    if (key == 0.0) {
+        project->frecency = visit;
+    } else {
+        project->frecency = MAX(key, visit) + log1p(exp(-fabs(key - visit)));
+    }
+}
+
+// Decayed score now, in units of "visits made just now"
+static double project_frecency_score(Project *project) {
+    if (project->frecency == 0.0) return 0.0;
+    return exp(project->frecency - frecency_visit_weight(g_get_real_time()));
 }
 
 static int compare_project_tiebreak(Project *p1, Project *p2,
@@ -810,7 +1280,7 @@ static int compare_project_tiebreak(Project *p1, Project *p2,
 }
 
 static int sort_func_insertion(GtkListBoxRow *row1, GtkListBoxRow *row2, gpointer user_data) {
-    (void)user_data;
+    ((AppState *)user_data)->sort_compares++;
     Project *p1 = (Project *)g_object_get_data(G_OBJECT(row1), "project");
     Project *p2 = (Project *)g_object_get_data(G_OBJECT(row2), "project");
     if (!p1 || !p2) return 0;
@@ -821,7 +1291,7 @@ static int sort_func_insertion(GtkListBoxRow *row1, GtkListBoxRow *row2, gpointe
 }
 
 static int sort_func_alpha(GtkListBoxRow *row1, GtkListBoxRow *row2, gpointer user_data) {
-    (void)user_data;
+    ((AppState *)user_data)->sort_compares++;
     Project *p1 = (Project *)g_object_get_data(G_OBJECT(row1), "project");
     Project *p2 = (Project *)g_object_get_data(G_OBJECT(row2), "project");
     if (!p1 || !p2) return 0;
@@ -832,8 +1302,27 @@ static int sort_func_alpha(GtkListBoxRow *row1, GtkListBoxRow *row2, gpointer us
     return result;
 }
 
+// Descending frecency; shared by the sidebar and anything that lists projects
+static int compare_project_frecency(Project *p1, Project *p2) {
+    if (p1->frecency > p2->frecency) return -1;
+    if (p1->frecency < p2->frecency) return 1;
+    return 0;
+}
+
+static int sort_func_frecency(GtkListBoxRow *row1, GtkListBoxRow *row2, gpointer user_data) {
+    ((AppState *)user_data)->sort_compares++;
+    Project *p1 = (Project *)g_object_get_data(G_OBJECT(row1), "project");
+    Project *p2 = (Project *)g_object_get_data(G_OBJECT(row2), "project");
+    if (!p1 || !p2) return 0;
+    int result = compare_project_frecency(p1, p2);
+    if (result == 0) {
+        result = compare_project_tiebreak(p1, p2, row1, row2);
+    }
+    return result;
+}
+
 static int sort_func_mru(GtkListBoxRow *row1, GtkListBoxRow *row2, gpointer user_data) {
-    (void)user_data;
+    ((AppState *)user_data)->sort_compares++;
     Project *p1 = (Project *)g_object_get_data(G_OBJECT(row1), "project");
     Project *p2 = (Project *)g_object_get_data(G_OBJECT(row2), "project");
     if (!p1 || !p2) return 0;
@@ -845,9 +1334,8 @@ static int sort_func_mru(GtkListBoxRow *row1, GtkListBoxRow *row2, gpointer user
     return result;
 }
 
+// The sort mode is shared; every window's button shows it
 static void update_sort_button(AppState *app) {
-    if (!app->sort_button) return;
-
     const char *icon;
     const char *tooltip;
     switch (app->sort_mode) {
@@ -859,179 +1347,802 @@ static void update_sort_button(AppState *app) {
             icon = "document-open-recent-symbolic";
             tooltip = "Sort: Recent";
             break;
+        case SORT_FRECENCY:
+            icon = "starred-symbolic";
+            tooltip = "Sort: Frequent";
+            break;
         default:
             icon = "view-list-symbolic";
             tooltip = "Sort: Manual";
             break;
     }
-    gtk_button_set_icon_name(GTK_BUTTON(app->sort_button), icon);
-    gtk_widget_set_tooltip_text(app->sort_button, tooltip);
+    for (GList *w = app->windows; w != NULL; w = w->next) {
+        WorkspaceWindow *win = (WorkspaceWindow *)w->data;
+        if (!win->sort_button) continue;
+        gtk_button_set_icon_name(GTK_BUTTON(win->sort_button), icon);
+        gtk_widget_set_tooltip_text(win->sort_button, tooltip);
+    }
 }
 
 static void apply_sort(AppState *app) {
+    update_sort_button(app);
+
+    // Rows are appended unsorted during bulk operations; commit sorts once
+    if (app->bulk_depth > 0) return;
+
+    GtkListBoxSortFunc func;
     switch (app->sort_mode) {
-        case SORT_ALPHA:
-            gtk_list_box_set_sort_func(GTK_LIST_BOX(app->sidebar),
-                                       sort_func_alpha, app, NULL);
-            break;
-        case SORT_MRU:
-            gtk_list_box_set_sort_func(GTK_LIST_BOX(app->sidebar),
-                                       sort_func_mru, app, NULL);
-            break;
-        default:
-            gtk_list_box_set_sort_func(GTK_LIST_BOX(app->sidebar),
-                                       sort_func_insertion, app, NULL);
-            break;
+        case SORT_ALPHA:    func = sort_func_alpha;     break;
+        case SORT_MRU:      func = sort_func_mru;       break;
+        case SORT_FRECENCY: func = sort_func_frecency;  break;
+        default:            func = sort_func_insertion; break;
+    }
+
+    // Setting the sort func re-sorts the list
+    app->sort_passes++;
+    for (GList *w = app->windows; w != NULL; w = w->next) {
+        WorkspaceWindow *win = (WorkspaceWindow *)w->data;
+        gtk_list_box_set_sort_func(GTK_LIST_BOX(win->sidebar), func, app, NULL);
     }
-    gtk_list_box_invalidate_sort(GTK_LIST_BOX(app->sidebar));
-    update_sort_button(app);
 }
 
 static void on_sort_clicked(GtkButton *button, gpointer user_data) {
     AppState *app = (AppState *)user_data;
     (void)button;
 
-    // Cycle: NONE -> ALPHA -> MRU -> NONE
+    // Cycle: NONE -> ALPHA -> MRU -> FRECENCY -> NONE
     switch (app->sort_mode) {
-        case SORT_NONE:  app->sort_mode = SORT_ALPHA; break;
-        case SORT_ALPHA: app->sort_mode = SORT_MRU;   break;
-        case SORT_MRU:   app->sort_mode = SORT_NONE;  break;
+        case SORT_NONE:     app->sort_mode = SORT_ALPHA;     break;
+        case SORT_ALPHA:    app->sort_mode = SORT_MRU;       break;
+        case SORT_MRU:      app->sort_mode = SORT_FRECENCY;  break;
+        case SORT_FRECENCY: app->sort_mode = SORT_NONE;      break;
     }
     apply_sort(app);
     save_session(app);
 }
 
 //=============================================================================
-// Built-in Theme System
+// Theme Catalog
 //=============================================================================
 
-static const ThemePreset* find_builtin_theme(const char *name) {
-    for (size_t i = 0; i < BUILTIN_THEME_COUNT; i++) {
-        if (g_strcmp0(builtin_themes[i].name, name) == 0)
-            return &builtin_themes[i];
-    }
-    return NULL;
-}
+// The built-in themes plus files in <data dir>/themes, parsed once into a
+// binary cache that later startups mmap. The cache is keyed by a stamp of
+// the built-in table and each theme file's name, size and mtime (to the
+// nanosecond), so it is only rebuilt when something changed.
 
-static gboolean is_day_theme_active(const TerminalSettings *settings, int minutes_now) {
-    int day_start = clamp_minutes(settings->day_start_minutes);
-    int night_start = clamp_minutes(settings->night_start_minutes);
+#define THEME_DIR_NAME "themes"
+#define THEME_CACHE_NAME "themes.cache"
+#define THEME_CACHE_MAGIC "GMUXTHM"
+#define THEME_CACHE_VERSION 1
 
-    if (day_start == night_start) return TRUE;
-    if (day_start < night_start)
-        return minutes_now >= day_start && minutes_now < night_start;
+// Followed by ThemeRecord[n_themes], guint32 buckets[n_buckets] (record
+// index + 1, 0 = empty) and the NUL-terminated names.
+typedef struct {
+    char magic[8];
+    guint32 version;
+    guint32 record_size;
+    guint32 n_themes;
+    guint32 n_buckets;          // Power of two, linear probing
+    guint32 names_size;
+    guint32 reserved;
+    guint64 stamp;
+} ThemeCacheHeader;
 
-    return minutes_now >= day_start || minutes_now < night_start;
-}
+typedef struct {
+    GBytes *bytes;              // Mapped cache, or built in memory
+    const ThemeCacheHeader *header;
+    const ThemeRecord *records;
+    const guint32 *buckets;
+    const char *names;
+} ThemeCatalog;
 
-static const char* get_scheduled_theme_name(const TerminalSettings *settings, int minutes_now) {
-    return is_day_theme_active(settings, minutes_now)
-        ? settings->day_theme_name
-        : settings->night_theme_name;
+static ThemeCatalog theme_catalog;
+
+typedef enum {
+    THEME_FORMAT_NONE,
+    THEME_FORMAT_YAML,          // Gogh or base16
+    THEME_FORMAT_ITERM,
+    THEME_FORMAT_XRESOURCES,
+} ThemeFormat;
+
+// Color slots while parsing: palette, then these
+enum { THEME_FG = 16, THEME_BG, THEME_CURSOR, THEME_COLOR_COUNT };
+
+typedef struct {
+    char *name;
+    int dark;                   // -1 = guess from the background
+    GdkRGBA colors[THEME_COLOR_COUNT];
+    guint32 set;                // Bit per parsed color
+} ParsedTheme;
+
+static ThemeFormat theme_file_format(const char *filename) {
+    if (filename[0] == '.') return THEME_FORMAT_NONE;
+    if (g_str_has_suffix(filename, ".yml") || g_str_has_suffix(filename, ".yaml"))
+        return THEME_FORMAT_YAML;
+    if (g_str_has_suffix(filename, ".itermcolors"))
+        return THEME_FORMAT_ITERM;
+    if (g_str_has_suffix(filename, ".Xresources") || g_str_has_suffix(filename, ".xresources") ||
+        g_str_has_suffix(filename, ".Xdefaults") || g_str_has_suffix(filename, ".xrdb"))
+        return THEME_FORMAT_XRESOURCES;
+    return THEME_FORMAT_NONE;
 }
 
-static gboolean is_day_theme_active_now(const TerminalSettings *settings) {
-    GDateTime *now = g_date_time_new_now_local();
-    int minutes_now = g_date_time_get_hour(now) * 60 + g_date_time_get_minute(now);
-    gboolean day_active = is_day_theme_active(settings, minutes_now);
-    g_date_time_unref(now);
-    return day_active;
+// Strips whitespace and one pair of quotes in place
+static char* theme_unquote(char *value) {
+    g_strstrip(value);
+    size_t len = strlen(value);
+    if (len >= 2 && (value[0] == '"' || value[0] == '\'') && value[len - 1] == value[0]) {
+        value[len - 1] = '\0';
+        value++;
+    }
+    return value;
 }
 
-static gboolean on_theme_refresh_idle(gpointer user_data) {
-    AppState *app = (AppState *)user_data;
-    debug_log("theme_refresh_idle begin preview=%d current=%s",
-              app->theme_preview_active,
-              app->theme_name ? app->theme_name : "(null)");
-    app->theme_refresh_idle_id = 0;
-    refresh_scheduled_theme(app);
-    debug_log("theme_refresh_idle end current=%s",
-              app->theme_name ? app->theme_name : "(null)");
-    return G_SOURCE_REMOVE;
+static void parsed_theme_set(ParsedTheme *theme, int slot, const char *text) {
+    char buf[16];
+    // base16 writes bare hex
+    if (strlen(text) == 6 && strspn(text, "0123456789abcdefABCDEF") == 6) {
+        g_snprintf(buf, sizeof(buf), "#%s", text);
+        text = buf;
+    }
+    if (slot >= 0 && slot < THEME_COLOR_COUNT && gdk_rgba_parse(&theme->colors[slot], text))
+        theme->set |= 1u << slot;
 }
 
-static void queue_theme_refresh(AppState *app) {
-    if (app->settings_dialog_closing) {
-        debug_log("queue_theme_refresh skipped settings_dialog_closing=1");
-        return;
+// Gogh (color_01..color_16, foreground, background, cursor) and base16
+// (base00..base0F) schemes; both are flat enough to read line by line.
+static void parse_yaml_theme(const char *text, ParsedTheme *theme) {
+    char *base16[16] = { NULL };
+    char **lines = g_strsplit(text, "\n", -1);
+
+    for (char **lp = lines; *lp; lp++) {
+        char *line = g_strstrip(*lp);
+        char *colon = strchr(line, ':');
+        if (line[0] == '#' || !colon) continue;
+        *colon = '\0';
+        char *key = theme_unquote(line);
+        char *value = g_strchug(colon + 1);
+        // Unquoted values may carry a trailing comment; quoted ones hold the color's '#'
+        char *comment = strstr(value, " #");
+        if (comment && !strchr(value, '"') && !strchr(value, '\'')) *comment = '\0';
+        value = theme_unquote(value);
+
+        int n = 0;
+        if (strcmp(key, "name") == 0 || strcmp(key, "scheme") == 0) {
+            if (value[0] && !theme->name) theme->name = g_strdup(value);
+        } else if (strcmp(key, "variant") == 0) {
+            theme->dark = strcmp(value, "light") == 0 ? 0 : 1;
+        } else if (sscanf(key, "color_%d", &n) == 1 && n >= 1 && n <= 16) {
+            parsed_theme_set(theme, n - 1, value);
+        } else if (strcmp(key, "foreground") == 0) {
+            parsed_theme_set(theme, THEME_FG, value);
+        } else if (strcmp(key, "background") == 0) {
+            parsed_theme_set(theme, THEME_BG, value);
+        } else if (strcmp(key, "cursor") == 0) {
+            parsed_theme_set(theme, THEME_CURSOR, value);
+        } else if (strlen(key) == 6 && g_str_has_prefix(key, "base") &&
+                   g_ascii_isxdigit(key[4]) && g_ascii_isxdigit(key[5])) {
+            int idx = g_ascii_xdigit_value(key[4]) * 16 + g_ascii_xdigit_value(key[5]);
+            if (idx < 16) base16[idx] = value;
+        }
     }
-    if (app->theme_refresh_idle_id != 0) {
-        debug_log("queue_theme_refresh skipped existing_idle=%u", app->theme_refresh_idle_id);
-        return;
+
+    if (base16[0] && (theme->set & 0xffff) == 0) {
+        // The base16-shell mapping of scheme slots to ANSI colors
+        static const int ansi_from_base16[16] = {
+            0x00, 0x08, 0x0B, 0x0A, 0x0D, 0x0E, 0x0C, 0x05,
+            0x03, 0x08, 0x0B, 0x0A, 0x0D, 0x0E, 0x0C, 0x07,
+        };
+        for (int i = 0; i < 16; i++) {
+            if (base16[ansi_from_base16[i]])
+                parsed_theme_set(theme, i, base16[ansi_from_base16[i]]);
+        }
+        if (base16[0x05]) parsed_theme_set(theme, THEME_FG, base16[0x05]);
+        if (base16[0x00]) parsed_theme_set(theme, THEME_BG, base16[0x00]);
     }
+    g_strfreev(lines);
+}
 
-    app->theme_refresh_idle_id = g_idle_add(on_theme_refresh_idle, app);
-    debug_log("queue_theme_refresh queued idle=%u", app->theme_refresh_idle_id);
+typedef struct {
+    ParsedTheme *theme;
+    int dict_depth;
+    int slot;                   // Color dict being read, -1 if not one we use
+    char *key;                  // Last <key> seen
+    GString *text;
+    GdkRGBA color;
+} ItermParse;
+
+static int iterm_color_slot(const char *key) {
+    int n = 0;
+    if (!key) return -1;
+    if (sscanf(key, "Ansi %d Color", &n) == 1 && n >= 0 && n < 16) return n;
+    if (strcmp(key, "Foreground Color") == 0) return THEME_FG;
+    if (strcmp(key, "Background Color") == 0) return THEME_BG;
+    if (strcmp(key, "Cursor Color") == 0) return THEME_CURSOR;
+    return -1;
 }
 
-static gboolean on_theme_schedule_tick(gpointer user_data) {
-    AppState *app = (AppState *)user_data;
-    if (app->theme_preview_active) {
-        debug_log("theme_schedule_tick skipped preview_active=1");
-        return G_SOURCE_CONTINUE;
-    }
-    if (app->settings_dialog_closing) {
-        debug_log("theme_schedule_tick skipped settings_dialog_closing=1");
-        return G_SOURCE_CONTINUE;
+static void on_iterm_start(GMarkupParseContext *ctx, const char *element,
+                           const char **names, const char **values,
+                           gpointer user_data, GError **error) {
+    ItermParse *p = user_data;
+    (void)ctx; (void)names; (void)values; (void)error;
+    g_string_truncate(p->text, 0);
+    if (strcmp(element, "dict") == 0 && ++p->dict_depth == 2) {
+        p->slot = iterm_color_slot(p->key);
+        p->color = (GdkRGBA){ 0, 0, 0, 1 };
     }
-    debug_log("theme_schedule_tick queueing refresh");
-    queue_theme_refresh(app);
-    return G_SOURCE_CONTINUE;
 }
 
-static void load_builtin_theme(AppState *app, const char *name) {
-    const ThemePreset *preset = find_builtin_theme(name);
-    if (!preset) {
-        preset = &builtin_themes[0]; // Default to first theme (Dracula)
-        name = preset->name;
+static void on_iterm_end(GMarkupParseContext *ctx, const char *element,
+                         gpointer user_data, GError **error) {
+    ItermParse *p = user_data;
+    (void)ctx; (void)error;
+    if (strcmp(element, "key") == 0) {
+        g_free(p->key);
+        p->key = g_strdup(p->text->str);
+    } else if ((strcmp(element, "real") == 0 || strcmp(element, "integer") == 0) &&
+               p->dict_depth == 2 && p->slot >= 0 && p->key) {
+        float v = (float)CLAMP(g_ascii_strtod(p->text->str, NULL), 0.0, 1.0);
+        if (strcmp(p->key, "Red Component") == 0) p->color.red = v;
+        else if (strcmp(p->key, "Green Component") == 0) p->color.green = v;
+        else if (strcmp(p->key, "Blue Component") == 0) p->color.blue = v;
+    } else if (strcmp(element, "dict") == 0) {
+        if (p->dict_depth == 2 && p->slot >= 0) {
+            p->theme->colors[p->slot] = p->color;
+            p->theme->set |= 1u << p->slot;
+        }
+        p->dict_depth--;
+        // The next color dict is named by the following <key>
+        g_clear_pointer(&p->key, g_free);
     }
+}
 
-    TerminalTheme *theme = &app->theme;
-    if (theme->font) {
-        pango_font_description_free(theme->font);
-    }
-    memset(theme, 0, sizeof(TerminalTheme));
+static void on_iterm_text(GMarkupParseContext *ctx, const char *text, gsize len,
+                          gpointer user_data, GError **error) {
+    ItermParse *p = user_data;
+    (void)ctx; (void)error;
+    g_string_append_len(p->text, text, (gssize)len);
+}
 
-    // Parse colors from preset
-    gdk_rgba_parse(&theme->foreground, preset->foreground);
-    gdk_rgba_parse(&theme->background, preset->background);
+static void parse_iterm_theme(const char *text, gsize len, ParsedTheme *theme,
+                              const char *path) {
+    static const GMarkupParser parser = { on_iterm_start, on_iterm_end, on_iterm_text, NULL, NULL };
+    ItermParse p = { .theme = theme, .slot = -1, .text = g_string_new(NULL) };
+    GMarkupParseContext *ctx = g_markup_parse_context_new(&parser, 0, &p, NULL);
+    GError *error = NULL;
 
-    for (int i = 0; i < 16; i++) {
-        gdk_rgba_parse(&theme->palette[i], preset->palette[i]);
+    if (!g_markup_parse_context_parse(ctx, text, (gssize)len, &error) ||
+        !g_markup_parse_context_end_parse(ctx, &error)) {
+        g_warning("Failed to parse %s: %s", path, error->message);
+        g_error_free(error);
+        theme->set = 0;
     }
+    g_markup_parse_context_free(ctx);
+    g_free(p.key);
+    g_string_free(p.text, TRUE);
+}
 
-    // Cursor color
-    theme->cursor_colors_set = TRUE;
-    gdk_rgba_parse(&theme->cursor_bg, preset->cursor);
-    theme->cursor_fg = theme->background;
+// *foreground, *.color0, URxvt*cursorColor and friends, with #define
+// substitution since many published schemes use it
+static void parse_xresources_theme(const char *text, ParsedTheme *theme) {
+    GHashTable *defines = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    char **lines = g_strsplit(text, "\n", -1);
+
+    for (char **lp = lines; *lp; lp++) {
+        char *line = g_strstrip(*lp);
+        if (line[0] == '!' || line[0] == '\0') continue;
+
+        if (g_str_has_prefix(line, "#define")) {
+            char **parts = g_strsplit_set(line + 7, " \t", -1);
+            const char *name = NULL, *value = NULL;
+            for (char **pp = parts; *pp; pp++) {
+                if (!**pp) continue;
+                if (!name) name = *pp;
+                else if (!value) value = *pp;
+            }
+            if (name && value)
+                g_hash_table_replace(defines, g_strdup(name), g_strdup(value));
+            g_strfreev(parts);
+            continue;
+        }
 
-    theme->use_theme_colors = FALSE;
-    theme->cursor_shape = VTE_CURSOR_SHAPE_BLOCK;
+        char *colon = strchr(line, ':');
+        if (!colon) continue;
+        *colon = '\0';
+        char *key = g_strstrip(line);
+        const char *value = g_strstrip(colon + 1);
+        const char *defined = g_hash_table_lookup(defines, value);
+        if (defined) value = defined;
+
+        // The last component, after whichever of '.' and '*' comes last
+        const char *resource = key;
+        for (const char *p = key; *p; p++) {
+            if (*p == '.' || *p == '*') resource = p + 1;
+        }
+
+        int n = 0;
+        char tail = '\0';
+        if (strcmp(resource, "foreground") == 0)
+            parsed_theme_set(theme, THEME_FG, value);
+        else if (strcmp(resource, "background") == 0)
+            parsed_theme_set(theme, THEME_BG, value);
+        else if (strcmp(resource, "cursorColor") == 0)
+            parsed_theme_set(theme, THEME_CURSOR, value);
+        else if (sscanf(resource, "color%d%c", &n, &tail) == 1 && n >= 0 && n < 16)
+            parsed_theme_set(theme, n, value);
+    }
+
+    g_strfreev(lines);
+    g_hash_table_unref(defines);
+}
+
+// Returns FALSE, with a warning, for files missing required colors
+static gboolean parse_theme_file(const char *path, const char *filename, ParsedTheme *theme) {
+    char *text = NULL;
+    gsize len = 0;
+    GError *error = NULL;
+
+    memset(theme, 0, sizeof(*theme));
+    theme->dark = -1;
+    if (!g_file_get_contents(path, &text, &len, &error)) {
+        g_warning("Failed to read %s: %s", path, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    switch (theme_file_format(filename)) {
+        case THEME_FORMAT_YAML:       parse_yaml_theme(text, theme);             break;
+        case THEME_FORMAT_ITERM:      parse_iterm_theme(text, len, theme, path); break;
+        case THEME_FORMAT_XRESOURCES: parse_xresources_theme(text, theme);       break;
+        case THEME_FORMAT_NONE:                                                  break;
+    }
+    g_free(text);
+
+    guint32 required = (1u << THEME_CURSOR) - 1;
+    if ((theme->set & required) != required) {
+        g_warning("Skipping theme %s: it needs a foreground, background and 16 colors", path);
+        g_free(theme->name);
+        return FALSE;
+    }
+
+    if (!theme->name) {
+        const char *dot = strrchr(filename, '.');
+        theme->name = g_strndup(filename, dot ? (gsize)(dot - filename) : strlen(filename));
+    }
+    if (!(theme->set & (1u << THEME_CURSOR)))
+        theme->colors[THEME_CURSOR] = theme->colors[THEME_FG];
+    if (theme->dark < 0) {
+        const GdkRGBA *bg = &theme->colors[THEME_BG];
+        theme->dark = 0.2126 * bg->red + 0.7152 * bg->green + 0.0722 * bg->blue < 0.5;
+    }
+    return TRUE;
+}
+
+static guint64 theme_stamp_add(guint64 hash, const void *data, gsize len) {
+    const guint8 *bytes = data;
+    for (gsize i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;   // 64-bit FNV-1a
+    }
+    return hash;
+}
+
+static guint64 theme_stamp_add_string(guint64 hash, const char *s) {
+    return theme_stamp_add(hash, s, strlen(s) + 1);
+}
+
+static int compare_theme_filenames(gconstpointer a, gconstpointer b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Theme files in dir, sorted so the stamp and the catalog order don't
+// depend on readdir order
+static GPtrArray* list_theme_files(const char *dir) {
+    GPtrArray *files = g_ptr_array_new_with_free_func(g_free);
+    GDir *d = g_dir_open(dir, 0, NULL);
+    if (!d) return files;
+
+    const char *filename;
+    while ((filename = g_dir_read_name(d)) != NULL) {
+        if (theme_file_format(filename) != THEME_FORMAT_NONE)
+            g_ptr_array_add(files, g_strdup(filename));
+    }
+    g_dir_close(d);
+    g_ptr_array_sort(files, compare_theme_filenames);
+    return files;
+}
+
+static guint64 compute_theme_stamp(const char *dir, GPtrArray *files) {
+    guint64 hash = 14695981039346656037ULL;
+    guint32 version = THEME_CACHE_VERSION;
+    hash = theme_stamp_add(hash, &version, sizeof(version));
+
+    for (size_t i = 0; i < BUILTIN_THEME_COUNT; i++) {
+        const ThemePreset *preset = &builtin_themes[i];
+        hash = theme_stamp_add_string(hash, preset->name);
+        hash = theme_stamp_add_string(hash, preset->variant);
+        hash = theme_stamp_add_string(hash, preset->foreground);
+        hash = theme_stamp_add_string(hash, preset->background);
+        hash = theme_stamp_add_string(hash, preset->cursor);
+        for (int c = 0; c < 16; c++)
+            hash = theme_stamp_add_string(hash, preset->palette[c]);
+    }
+
+    for (guint i = 0; i < files->len; i++) {
+        const char *filename = g_ptr_array_index(files, i);
+        char *path = g_build_filename(dir, filename, NULL);
+        GStatBuf st;
+        gint64 key[3] = { 0, 0, 0 };
+        if (g_stat(path, &st) == 0) {
+            // Nanoseconds too: an edit within the same second must show
+            key[0] = (gint64)st.st_mtim.tv_sec;
+            key[1] = (gint64)st.st_mtim.tv_nsec;
+            key[2] = (gint64)st.st_size;
+        }
+        hash = theme_stamp_add_string(hash, filename);
+        hash = theme_stamp_add(hash, key, sizeof(key));
+        g_free(path);
+    }
+    return hash;
+}
+
+typedef struct {
+    GArray *records;            // ThemeRecord
+    GString *names;
+    GHashTable *index;          // name -> record index + 1
+} ThemeCacheBuilder;
+
+// A later theme with an existing name replaces it, so user files can
+// override built-ins
+static void theme_cache_add(ThemeCacheBuilder *b, const char *name, gboolean dark,
+                            const GdkRGBA colors[THEME_COLOR_COUNT]) {
+    ThemeRecord record = {
+        .name_offset = (guint32)b->names->len,
+        .dark = dark ? 1 : 0,
+        .foreground = colors[THEME_FG],
+        .background = colors[THEME_BG],
+        .cursor = colors[THEME_CURSOR],
+    };
+    memcpy(record.palette, colors, sizeof(record.palette));
+
+    guint existing = GPOINTER_TO_UINT(g_hash_table_lookup(b->index, name));
+    if (existing) {
+        record.name_offset = g_array_index(b->records, ThemeRecord, existing - 1).name_offset;
+        g_array_index(b->records, ThemeRecord, existing - 1) = record;
+        return;
+    }
+
+    g_string_append_len(b->names, name, (gssize)strlen(name) + 1);
+    g_array_append_val(b->records, record);
+    g_hash_table_insert(b->index, g_strdup(name), GUINT_TO_POINTER(b->records->len));
+}
+
+static GBytes* build_theme_cache(const char *dir, GPtrArray *files, guint64 stamp) {
+    ThemeCacheBuilder b = {
+        .records = g_array_new(FALSE, FALSE, sizeof(ThemeRecord)),
+        .names = g_string_new(NULL),
+        .index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL),
+    };
+
+    for (size_t i = 0; i < BUILTIN_THEME_COUNT; i++) {
+        const ThemePreset *preset = &builtin_themes[i];
+        GdkRGBA colors[THEME_COLOR_COUNT];
+        for (int c = 0; c < 16; c++)
+            gdk_rgba_parse(&colors[c], preset->palette[c]);
+        gdk_rgba_parse(&colors[THEME_FG], preset->foreground);
+        gdk_rgba_parse(&colors[THEME_BG], preset->background);
+        gdk_rgba_parse(&colors[THEME_CURSOR], preset->cursor);
+        theme_cache_add(&b, preset->name, g_strcmp0(preset->variant, "light") != 0, colors);
+    }
+
+    for (guint i = 0; i < files->len; i++) {
+        const char *filename = g_ptr_array_index(files, i);
+        char *path = g_build_filename(dir, filename, NULL);
+        ParsedTheme theme;
+        if (parse_theme_file(path, filename, &theme)) {
+            theme_cache_add(&b, theme.name, theme.dark, theme.colors);
+            g_free(theme.name);
+        }
+        g_free(path);
+    }
+
+    guint32 n_buckets = 16;
+    while (n_buckets < b.records->len * 2) n_buckets *= 2;
+    guint32 *buckets = g_new0(guint32, n_buckets);
+    for (guint i = 0; i < b.records->len; i++) {
+        const ThemeRecord *record = &g_array_index(b.records, ThemeRecord, i);
+        guint32 slot = g_str_hash(b.names->str + record->name_offset) & (n_buckets - 1);
+        while (buckets[slot]) slot = (slot + 1) & (n_buckets - 1);
+        buckets[slot] = i + 1;
+    }
+
+    ThemeCacheHeader header = {
+        .magic = THEME_CACHE_MAGIC,
+        .version = THEME_CACHE_VERSION,
+        .record_size = sizeof(ThemeRecord),
+        .n_themes = b.records->len,
+        .n_buckets = n_buckets,
+        .names_size = (guint32)b.names->len,
+        .stamp = stamp,
+    };
+    GByteArray *out = g_byte_array_new();
+    g_byte_array_append(out, (const guint8 *)&header, sizeof(header));
+    g_byte_array_append(out, (const guint8 *)b.records->data,
+                        b.records->len * sizeof(ThemeRecord));
+    g_byte_array_append(out, (const guint8 *)buckets, n_buckets * sizeof(guint32));
+    g_byte_array_append(out, (const guint8 *)b.names->str, b.names->len);
+
+    g_free(buckets);
+    g_array_free(b.records, TRUE);
+    g_string_free(b.names, TRUE);
+    g_hash_table_unref(b.index);
+    return g_byte_array_free_to_bytes(out);
+}
+
+// Takes bytes on success. Anything inconsistent means a stale or damaged
+// cache, which is rebuilt rather than trusted.
+static gboolean theme_catalog_use(GBytes *bytes, guint64 stamp) {
+    gsize size = 0;
+    const guint8 *data = g_bytes_get_data(bytes, &size);
+    const ThemeCacheHeader *header = (const ThemeCacheHeader *)data;
+
+    if (size < sizeof(*header) ||
+        memcmp(header->magic, THEME_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != THEME_CACHE_VERSION ||
+        header->record_size != sizeof(ThemeRecord) ||
+        header->stamp != stamp ||
+        header->n_themes == 0 || header->n_buckets <= header->n_themes ||
+        (header->n_buckets & (header->n_buckets - 1)) != 0 ||
+        header->names_size == 0)
+        return FALSE;
+
+    gsize expected = sizeof(*header) + (gsize)header->n_themes * sizeof(ThemeRecord) +
+                     (gsize)header->n_buckets * sizeof(guint32) + header->names_size;
+    if (size != expected) return FALSE;
+
+    const ThemeRecord *records = (const ThemeRecord *)(data + sizeof(*header));
+    const guint32 *buckets = (const guint32 *)(records + header->n_themes);
+    const char *names = (const char *)(buckets + header->n_buckets);
+    if (names[header->names_size - 1] != '\0') return FALSE;
+    for (guint32 i = 0; i < header->n_themes; i++) {
+        if (records[i].name_offset >= header->names_size) return FALSE;
+    }
+    // find_theme probes until an empty bucket, so there must be one
+    gboolean has_empty = FALSE;
+    for (guint32 i = 0; i < header->n_buckets; i++) {
+        if (buckets[i] > header->n_themes) return FALSE;
+        if (buckets[i] == 0) has_empty = TRUE;
+    }
+    if (!has_empty) return FALSE;
+
+    theme_catalog.bytes = bytes;
+    theme_catalog.header = header;
+    theme_catalog.records = records;
+    theme_catalog.buckets = buckets;
+    theme_catalog.names = names;
+    return TRUE;
+}
+
+// The built-in table alone, which always makes a valid catalog
+static void theme_catalog_use_builtin(const char *dir) {
+    GPtrArray *none = g_ptr_array_new();
+    guint64 stamp = compute_theme_stamp(dir, none);
+    GBytes *bytes = build_theme_cache(dir, none, stamp);
+    if (!theme_catalog_use(bytes, stamp)) {
+        g_critical("The built-in theme table makes an invalid catalog");
+        g_bytes_unref(bytes);
+    }
+    g_ptr_array_unref(none);
+}
+
+static void theme_catalog_load(void) {
+    if (theme_catalog.bytes) return;
+
+    gint64 start = g_get_monotonic_time();
+    char *data_dir = get_data_dir();
+    char *dir = g_build_filename(data_dir, THEME_DIR_NAME, NULL);
+    char *cache_path = g_build_filename(data_dir, THEME_CACHE_NAME, NULL);
+    GPtrArray *files = list_theme_files(dir);
+    guint64 stamp = compute_theme_stamp(dir, files);
+    gboolean cached = FALSE;
+
+    GMappedFile *mapped = g_mapped_file_new(cache_path, FALSE, NULL);
+    if (mapped) {
+        GBytes *bytes = g_mapped_file_get_bytes(mapped);
+        g_mapped_file_unref(mapped);
+        cached = theme_catalog_use(bytes, stamp);
+        if (!cached) g_bytes_unref(bytes);
+    }
+
+    if (!cached) {
+        // Used from memory; the next startup maps the file
+        GBytes *bytes = build_theme_cache(dir, files, stamp);
+        gsize size = 0;
+        const char *data = g_bytes_get_data(bytes, &size);
+        if (theme_catalog_use(bytes, stamp)) {
+            GError *error = NULL;
+            if (!g_file_set_contents(cache_path, data, (gssize)size, &error)) {
+                g_warning("Failed to write %s: %s", cache_path, error->message);
+                g_error_free(error);
+            }
+        } else {
+            // Not written, so the next startup tries the files again
+            g_warning("Theme catalog from %s failed its own checks; using the built-in themes",
+                      dir);
+            g_bytes_unref(bytes);
+            theme_catalog_use_builtin(dir);
+        }
+    }
+
+    debug_log("theme catalog loaded themes=%u files=%u cached=%d ms=%.2f",
+              theme_catalog.header->n_themes, files->len, cached,
+              (g_get_monotonic_time() - start) / 1000.0);
+    g_ptr_array_unref(files);
+    g_free(cache_path);
+    g_free(dir);
+    g_free(data_dir);
+}
+
+// Under memory pressure. The next lookup maps or rebuilds the catalog;
+// live terminals keep the colors they were given.
+static gsize theme_catalog_unload(void) {
+    if (!theme_catalog.bytes) return 0;
+    gsize size = g_bytes_get_size(theme_catalog.bytes);
+    g_bytes_unref(theme_catalog.bytes);
+    memset(&theme_catalog, 0, sizeof(theme_catalog));
+    return size;
+}
+
+static guint theme_count(void) {
+    theme_catalog_load();
+    return theme_catalog.header->n_themes;
+}
+
+static const ThemeRecord* theme_at(guint index) {
+    theme_catalog_load();
+    g_return_val_if_fail(index < theme_catalog.header->n_themes, theme_catalog.records);
+    return &theme_catalog.records[index];
+}
+
+static const char* theme_record_name(const ThemeRecord *record) {
+    return theme_catalog.names + record->name_offset;
+}
+
+static guint theme_record_index(const ThemeRecord *record) {
+    return (guint)(record - theme_catalog.records);
+}
+
+static const ThemeRecord* find_theme(const char *name) {
+    if (!name) return NULL;
+    theme_catalog_load();
+
+    guint32 mask = theme_catalog.header->n_buckets - 1;
+    for (guint32 slot = g_str_hash(name) & mask; theme_catalog.buckets[slot];
+         slot = (slot + 1) & mask) {
+        const ThemeRecord *record = &theme_catalog.records[theme_catalog.buckets[slot] - 1];
+        if (strcmp(theme_record_name(record), name) == 0)
+            return record;
+    }
+    return NULL;
+}
+
+//=============================================================================
+// Theme Scheduling
+//=============================================================================
+
+static gboolean is_day_theme_active(const TerminalSettings *settings, int minutes_now) {
+    int day_start = clamp_minutes(settings->day_start_minutes);
+    int night_start = clamp_minutes(settings->night_start_minutes);
+
+    if (day_start == night_start) return TRUE;
+    if (day_start < night_start)
+        return minutes_now >= day_start && minutes_now < night_start;
+
+    return minutes_now >= day_start || minutes_now < night_start;
+}
+
+static const char* get_scheduled_theme_name(const TerminalSettings *settings, int minutes_now) {
+    return is_day_theme_active(settings, minutes_now)
+        ? settings->day_theme_name
+        : settings->night_theme_name;
+}
+
+static gboolean is_day_theme_active_now(const TerminalSettings *settings) {
+    GDateTime *now = g_date_time_new_now_local();
+    int minutes_now = g_date_time_get_hour(now) * 60 + g_date_time_get_minute(now);
+    gboolean day_active = is_day_theme_active(settings, minutes_now);
+    g_date_time_unref(now);
+    return day_active;
+}
+
+static gboolean on_theme_refresh_idle(gpointer user_data) {
+    AppState *app = (AppState *)user_data;
+    debug_log("theme_refresh_idle begin current=%s",
+              app->theme_name ? app->theme_name : "(null)");
+    app->theme_refresh_idle_id = 0;
+    refresh_scheduled_theme(app);
+    debug_log("theme_refresh_idle end current=%s",
+              app->theme_name ? app->theme_name : "(null)");
+    return G_SOURCE_REMOVE;
+}
+
+static void queue_theme_refresh(AppState *app) {
+    if (app->settings_dialog_closing) {
+        debug_log("queue_theme_refresh skipped settings_dialog_closing=1");
+        return;
+    }
+    if (app->theme_refresh_idle_id != 0) {
+        debug_log("queue_theme_refresh skipped existing_idle=%u", app->theme_refresh_idle_id);
+        return;
+    }
+
+    app->theme_refresh_idle_id = g_idle_add(on_theme_refresh_idle, app);
+    debug_log("queue_theme_refresh queued idle=%u", app->theme_refresh_idle_id);
+}
+
+static gboolean on_theme_schedule_tick(gpointer user_data) {
+    AppState *app = (AppState *)user_data;
+    if (app->settings_dialog_closing) {
+        debug_log("theme_schedule_tick skipped settings_dialog_closing=1");
+        return G_SOURCE_CONTINUE;
+    }
+    debug_log("theme_schedule_tick queueing refresh");
+    queue_theme_refresh(app);
+    return G_SOURCE_CONTINUE;
+}
+
+// Fills theme from a catalog entry; theme must hold no font
+static void theme_from_record(TerminalTheme *theme, const ThemeRecord *record) {
+    memset(theme, 0, sizeof(TerminalTheme));
+
+    theme->foreground = record->foreground;
+    theme->background = record->background;
+    memcpy(theme->palette, record->palette, sizeof(theme->palette));
+
+    // Cursor color
+    theme->cursor_colors_set = TRUE;
+    theme->cursor_bg = record->cursor;
+    theme->cursor_fg = theme->background;
+
+    theme->use_theme_colors = FALSE;
+    theme->cursor_shape = VTE_CURSOR_SHAPE_BLOCK;
     theme->cursor_blink = VTE_CURSOR_BLINK_SYSTEM;
     theme->loaded = TRUE;
+}
+
+static void load_theme(AppState *app, const char *name) {
+    const ThemeRecord *record = find_theme(name);
+    if (!record) {
+        record = theme_at(0); // Default to first theme (Dracula)
+    }
+
+    if (app->theme.font) {
+        pango_font_description_free(app->theme.font);
+    }
+    theme_from_record(&app->theme, record);
 
     // Update stored theme name
     g_free(app->theme_name);
-    app->theme_name = g_strdup(name);
+    app->theme_name = g_strdup(theme_record_name(record));
 
 }
 
 static void apply_theme_name_now(AppState *app, const char *name) {
-    debug_log("apply_theme_name_now target=%s current=%s preview=%d",
+    debug_log("apply_theme_name_now target=%s current=%s",
               name ? name : "(null)",
-              app->theme_name ? app->theme_name : "(null)",
-              app->theme_preview_active);
+              app->theme_name ? app->theme_name : "(null)");
     if (app->settings_dialog_closing) {
         debug_log("apply_theme_name_now skipped settings_dialog_closing=1");
         return;
     }
-    if (!name || !find_builtin_theme(name))
+    if (!name || !find_theme(name))
         return;
 
     if (g_strcmp0(app->theme_name, name) == 0)
         return;
 
-    load_builtin_theme(app, name);
+    load_theme(app, name);
     save_theme_name(name);
     apply_theme_to_all_terminals(app);
     apply_ui_theme(app);
@@ -1077,6 +2188,7 @@ static void apply_theme_to_all_terminals(AppState *app) {
         for (GList *sl = project->subtabs; sl != NULL; sl = sl->next) {
             SubTab *subtab = (SubTab *)sl->data;
             apply_theme(subtab->terminal, &app->theme);
+            count_hud_work(app, HUD_WORK_THEME_APPLY);
         }
     }
     apply_settings_overrides(app);
@@ -1086,14 +2198,13 @@ static void refresh_scheduled_theme(AppState *app) {
     GDateTime *now = g_date_time_new_now_local();
     int minutes_now = g_date_time_get_hour(now) * 60 + g_date_time_get_minute(now);
     const char *name = get_scheduled_theme_name(&app->settings, minutes_now);
-    debug_log("refresh_scheduled_theme now=%02d:%02d chosen=%s current=%s preview=%d",
+    debug_log("refresh_scheduled_theme now=%02d:%02d chosen=%s current=%s",
               g_date_time_get_hour(now), g_date_time_get_minute(now),
               name ? name : "(null)",
-              app->theme_name ? app->theme_name : "(null)",
-              app->theme_preview_active);
+              app->theme_name ? app->theme_name : "(null)");
     g_date_time_unref(now);
 
-    if (!name || !find_builtin_theme(name))
+    if (!name || !find_theme(name))
         name = get_default_night_theme_name();
 
     apply_theme_name_now(app, name);
@@ -1190,6 +2301,9 @@ static void apply_ui_theme(AppState *app) {
         ".gmux-tab-item-active > .gmux-tab-close { opacity: 0.58; }\n"
         ".gmux-tab-close:hover { opacity: 1.0; background-color: alpha(@theme_fg_color, 0.16); }\n"
         ".gmux-tab-dragging { opacity: 0.5; }\n"
+        ".gmux-tab-item.gmux-tab-alert > button:not(.gmux-tab-close) { color: @error_color; }\n"
+        ".gmux-tab-item.gmux-tab-failed { box-shadow: inset 0 -2px @error_color; }\n"
+        ".gmux-tab-drop-target { box-shadow: inset 0 0 0 2px alpha(@theme_selected_bg_color, 0.8); }\n"
         ".gmux-tab-overflow-indicator { margin: 0 6px 0 2px; opacity: 0.6; }\n"
         ".gmux-terminal-pane, .gmux-terminal-pane > * { border: none; box-shadow: none; outline: none; }\n"
         "window.background.csd,"
@@ -1228,6 +2342,8 @@ static void apply_ui_theme(AppState *app) {
     GdkRGBA fg_faint   = is_dark ? mix_rgba(ui_fg, ui_base, 0.62) : mix_rgba(fg, bg, 0.62);
     GdkRGBA accent     = is_dark ? mix_rgba(theme->palette[4], slate_fg, 0.36) : theme->palette[4];
     accent.alpha = 1.0;
+    GdkRGBA alert = theme->palette[1];
+    alert.alpha = 1.0;
 
     char *s_bg       = gdk_rgba_to_string(&bg);
     char *s_fg       = gdk_rgba_to_string(&ui_fg);
@@ -1244,6 +2360,7 @@ static void apply_ui_theme(AppState *app) {
     char *s_fg_muted = gdk_rgba_to_string(&fg_muted);
     char *s_fg_faint = gdk_rgba_to_string(&fg_faint);
     char *s_accent   = gdk_rgba_to_string(&accent);
+    char *s_alert    = gdk_rgba_to_string(&alert);
 
     // Window
     g_string_append_printf(css,
@@ -1317,10 +2434,13 @@ static void apply_ui_theme(AppState *app) {
         ".gmux-project-copy { min-width: 0; }\n"
         ".gmux-project-name { color: %s; font-size: 0.92em; font-weight: 500; }\n"
         ".gmux-project-meta { color: %s; font-size: 0.74em; }\n"
+        ".gmux-project-git { margin-right: 6px; font-weight: 600; }\n"
         ".gmux-sidebar label { color: %s; }\n", s_fg_dim, s_fg_faint, s_fg_dim);
     g_string_append_printf(css,
         ".gmux-sidebar list > row:selected .gmux-project-name,"
         ".gmux-sidebar listbox > row:selected .gmux-project-name { color: %s; font-weight: 600; }\n", s_fg);
+    g_string_append_printf(css,
+        ".gmux-project-git-dirty { color: %s; }\n", s_accent);
     g_string_append_printf(css,
         ".gmux-sidebar list > row:selected .gmux-project-meta,"
         ".gmux-sidebar listbox > row:selected .gmux-project-meta { color: %s; }\n", s_fg_muted);
@@ -1448,6 +2568,11 @@ static void apply_ui_theme(AppState *app) {
         ".gmux-tab-close:hover { opacity: 1.0; background-color: alpha(%s, 0.2); }\n", s_fg);
     g_string_append_printf(css,
         ".gmux-tab-dragging { opacity: 0.5; }\n");
+    g_string_append_printf(css,
+        ".gmux-tab-item.gmux-tab-alert > button:not(.gmux-tab-close) { color: %s; }\n"
+        ".gmux-tab-item.gmux-tab-failed { box-shadow: inset 0 -2px %s; }\n", s_alert, s_alert);
+    g_string_append_printf(css,
+        ".gmux-tab-drop-target { box-shadow: inset 0 0 0 2px %s; }\n", s_accent);
     g_string_append_printf(css,
         ".gmux-tab-overflow-indicator {"
         "  color: %s;"
@@ -1549,6 +2674,20 @@ static void apply_ui_theme(AppState *app) {
     g_string_append_printf(css,
         ".gmux-settings separator { background-color: alpha(%s, 0.2); min-height: 1px; }\n", s_fg);
 
+    // Paste and export progress, squeezed between a tab's label and close button
+    g_string_append_printf(css,
+        ".gmux-tab-progress { margin: 0 2px; }\n"
+        ".gmux-tab-progress trough, .gmux-tab-progress progress { min-height: 3px; }\n"
+        ".gmux-tab-progress progress { background-color: %s; }\n", s_accent);
+
+    // Debug overlay (GMUX_LATENCY and friends)
+    g_string_append_printf(css,
+        ".gmux-debug-overlay {"
+        "  margin: 8px 8px 0 0; padding: 6px 8px; border-radius: 4px;"
+        "  background-color: alpha(%s, 0.85); color: %s;"
+        "  font-family: monospace; font-size: 0.85em;"
+        "}\n", s_sidebar, s_fg);
+
     gtk_css_provider_load_from_string(app->css_provider, css->str);
 
     g_string_free(css, TRUE);
@@ -1567,78 +2706,312 @@ static void apply_ui_theme(AppState *app) {
     g_free(s_fg_muted);
     g_free(s_fg_faint);
     g_free(s_accent);
+    g_free(s_alert);
 }
 
 //=============================================================================
-// Settings Panel
+// Live Config Reload
 //=============================================================================
 
-static guint get_theme_dropdown_index(const char *selected_name) {
-    for (size_t i = 0; i < BUILTIN_THEME_COUNT; i++) {
-        if (g_strcmp0(selected_name, builtin_themes[i].name) == 0)
-            return (guint)i;
+#define CONFIG_RELOAD_DELAY_MS 200
+
+typedef enum {
+    SETTINGS_CHANGED_APPEARANCE = 1 << 0,  // Font, opacity, cursor
+    SETTINGS_CHANGED_SCHEDULE   = 1 << 1,  // Day/night themes and start times
+    SETTINGS_CHANGED_SCROLLBACK = 1 << 2,  // Snapshot disk budget
+    SETTINGS_CHANGED_DISCOVERY  = 1 << 3,
+    SETTINGS_CHANGED_KEYBINDINGS = 1 << 4,
+    SETTINGS_CHANGED_TRIGGERS   = 1 << 5,
+    SETTINGS_CHANGED_PROJECT_ENV = 1 << 6,
+} SettingsChange;
+
+static void free_terminal_settings(TerminalSettings *s) {
+    g_free(s->font_family);
+    g_free(s->day_theme_name);
+    g_free(s->night_theme_name);
+    g_free(s->discovery_roots);
+    g_free(s->discovery_ignore);
+    g_free(s->keybindings);
+    g_free(s->triggers);
+    g_free(s->trigger_command);
+    g_free(s->project_env);
+}
+
+static guint diff_terminal_settings(const TerminalSettings *a, const TerminalSettings *b) {
+    guint changed = 0;
+
+    if (g_strcmp0(a->font_family, b->font_family) != 0 ||
+        a->font_size != b->font_size ||
+        a->opacity != b->opacity ||
+        a->cursor_shape != b->cursor_shape ||
+        a->cursor_blink != b->cursor_blink)
+        changed |= SETTINGS_CHANGED_APPEARANCE;
+
+    if (g_strcmp0(a->day_theme_name, b->day_theme_name) != 0 ||
+        g_strcmp0(a->night_theme_name, b->night_theme_name) != 0 ||
+        a->day_start_minutes != b->day_start_minutes ||
+        a->night_start_minutes != b->night_start_minutes)
+        changed |= SETTINGS_CHANGED_SCHEDULE;
+
+    if (a->scrollback_budget_mb != b->scrollback_budget_mb)
+        changed |= SETTINGS_CHANGED_SCROLLBACK;
+
+    if (g_strcmp0(a->discovery_roots, b->discovery_roots) != 0 ||
+        g_strcmp0(a->discovery_ignore, b->discovery_ignore) != 0 ||
+        a->discovery_depth != b->discovery_depth)
+        changed |= SETTINGS_CHANGED_DISCOVERY;
+
+    if (g_strcmp0(a->keybindings, b->keybindings) != 0)
+        changed |= SETTINGS_CHANGED_KEYBINDINGS;
+
+    if (g_strcmp0(a->triggers, b->triggers) != 0)
+        changed |= SETTINGS_CHANGED_TRIGGERS;
+
+    if (g_strcmp0(a->project_env, b->project_env) != 0)
+        changed |= SETTINGS_CHANGED_PROJECT_ENV;
+
+    return changed;
+}
+
+static void reload_settings_from_store(AppState *app) {
+    TerminalSettings updated;
+    parse_terminal_settings(&updated, config_store_get(CONFIG_FILE_SETTINGS));
+
+    guint changed = diff_terminal_settings(&app->settings, &updated);
+    debug_log("settings reload changed=0x%x", changed);
+
+    TerminalSettings old = app->settings;
+    app->settings = updated;
+    free_terminal_settings(&old);
+
+    // Re-applying the theme first resets anything an override no longer sets.
+    if (changed & SETTINGS_CHANGED_APPEARANCE) {
+        apply_theme_to_all_terminals(app);
+    }
+    if (changed & SETTINGS_CHANGED_SCHEDULE) {
+        queue_theme_refresh(app);
+    }
+    if (changed & SETTINGS_CHANGED_SCROLLBACK) {
+        apply_scrollback_budget(app);
+    }
+    if (changed & SETTINGS_CHANGED_DISCOVERY) {
+        start_project_discovery(app);
+    }
+    if (changed & SETTINGS_CHANGED_KEYBINDINGS) {
+        reload_keymap(app);
+    }
+    if (changed & SETTINGS_CHANGED_TRIGGERS) {
+        reload_triggers(app);
+    }
+    if (changed & SETTINGS_CHANGED_PROJECT_ENV) {
+        forget_project_envs(app);
     }
-    return 0;
 }
 
-static void on_day_theme_dropdown_changed(GtkDropDown *dropdown, GParamSpec *pspec,
-                                          gpointer user_data) {
-    (void)pspec;
+static gboolean on_config_reload_timeout(gpointer user_data) {
     AppState *app = (AppState *)user_data;
+    config_store.reload_timer_id = 0;
 
-    if (app->settings_dialog_closing) {
-        debug_log("day_theme_dropdown_changed ignored settings_dialog_closing=1");
-        return;
+    char *text = NULL;
+    if (!g_file_get_contents(config_store.paths[CONFIG_FILE_SETTINGS], &text, NULL, NULL))
+        return G_SOURCE_REMOVE;
+
+    // Our own writes land here too; they match the cache and are ignored.
+    if (g_strcmp0(text, config_store.contents[CONFIG_FILE_SETTINGS]) == 0) {
+        g_free(text);
+        return G_SOURCE_REMOVE;
     }
 
-    guint sel = gtk_drop_down_get_selected(dropdown);
-    if (sel == GTK_INVALID_LIST_POSITION || sel >= BUILTIN_THEME_COUNT) return;
+    g_free(config_store.contents[CONFIG_FILE_SETTINGS]);
+    config_store.contents[CONFIG_FILE_SETTINGS] = text;
+    reload_settings_from_store(app);
+    return G_SOURCE_REMOVE;
+}
 
-    const char *name = builtin_themes[sel].name;
-    debug_log("day_theme_dropdown_changed sel=%u name=%s", sel, name);
-    if (g_strcmp0(app->settings.day_theme_name, name) == 0) return;
+static void on_config_dir_changed(GFileMonitor *monitor, GFile *file, GFile *other_file,
+                                  GFileMonitorEvent event, gpointer user_data) {
+    AppState *app = (AppState *)user_data;
+    (void)monitor;
+
+    // Editors and g_file_set_contents() save by renaming a temp file over
+    // the target, so the interesting name may be the rename destination.
+    GFile *target = (event == G_FILE_MONITOR_EVENT_RENAMED) ? other_file : file;
+    switch (event) {
+        case G_FILE_MONITOR_EVENT_CHANGED:
+        case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+        case G_FILE_MONITOR_EVENT_CREATED:
+        case G_FILE_MONITOR_EVENT_MOVED_IN:
+        case G_FILE_MONITOR_EVENT_RENAMED:
+            break;
+        default:
+            return;
+    }
+    if (!target) return;
+
+    char *name = g_file_get_basename(target);
+    gboolean is_settings = g_strcmp0(name, config_file_names[CONFIG_FILE_SETTINGS]) == 0;
+    g_free(name);
+    if (!is_settings) return;
+
+    // Coalesce the burst of events a single save produces.
+    if (config_store.reload_timer_id != 0)
+        g_source_remove(config_store.reload_timer_id);
+    config_store.reload_timer_id = g_timeout_add(CONFIG_RELOAD_DELAY_MS,
+                                                 on_config_reload_timeout, app);
+}
 
-    g_free(app->settings.day_theme_name);
-    app->settings.day_theme_name = g_strdup(name);
-    save_terminal_settings(&app->settings);
+static void config_store_watch(AppState *app) {
+    if (config_store.monitor) return;
 
-    if (is_day_theme_active_now(&app->settings)) {
-        app->theme_preview_active = TRUE;
-        debug_log("day_theme_dropdown_changed applying active day theme=%s", name);
-        apply_theme_name_now(app, name);
-    } else {
-        debug_log("day_theme_dropdown_changed deferred inactive day theme=%s", name);
+    GError *error = NULL;
+    GFile *dir = g_file_new_for_path(config_store.data_dir);
+    config_store.monitor = g_file_monitor_directory(dir, G_FILE_MONITOR_WATCH_MOVES,
+                                                    NULL, &error);
+    g_object_unref(dir);
+
+    if (!config_store.monitor) {
+        g_warning("Config changes will need a restart: %s", error->message);
+        g_error_free(error);
+        return;
+    }
+    g_signal_connect(config_store.monitor, "changed", G_CALLBACK(on_config_dir_changed), app);
+}
+
+static void config_store_unwatch(void) {
+    if (config_store.reload_timer_id != 0) {
+        g_source_remove(config_store.reload_timer_id);
+        config_store.reload_timer_id = 0;
     }
+    if (config_store.monitor) {
+        g_file_monitor_cancel(config_store.monitor);
+        g_clear_object(&config_store.monitor);
+    }
+}
+
+//=============================================================================
+// Settings Panel
+//=============================================================================
+
+static guint get_theme_dropdown_index(const char *selected_name) {
+    const ThemeRecord *record = find_theme(selected_name);
+    return record ? theme_record_index(record) : 0;
+}
+
+static void preview_theme(AppState *app, const char *name) {
+    ThemePicker *picker = &app->theme_picker;
+    const ThemeRecord *record = find_theme(name);
+    if (!picker->preview || !record) return;
+
+    TerminalTheme theme;
+    theme_from_record(&theme, record);
+    apply_theme(VTE_TERMINAL(picker->preview), &theme);
+}
+
+static void update_theme_apply_button(AppState *app) {
+    ThemePicker *picker = &app->theme_picker;
+    if (!picker->apply_button) return;
+    gboolean pending = g_strcmp0(picker->day_name, app->settings.day_theme_name) != 0 ||
+                       g_strcmp0(picker->night_name, app->settings.night_theme_name) != 0;
+    gtk_widget_set_sensitive(picker->apply_button, pending);
 }
 
-static void on_night_theme_dropdown_changed(GtkDropDown *dropdown, GParamSpec *pspec,
-                                            gpointer user_data) {
+static void on_theme_dropdown_changed(GtkDropDown *dropdown, GParamSpec *pspec,
+                                      gpointer user_data) {
     (void)pspec;
     AppState *app = (AppState *)user_data;
+    ThemePicker *picker = &app->theme_picker;
 
     if (app->settings_dialog_closing) {
-        debug_log("night_theme_dropdown_changed ignored settings_dialog_closing=1");
+        debug_log("theme_dropdown_changed ignored settings_dialog_closing=1");
         return;
     }
 
     guint sel = gtk_drop_down_get_selected(dropdown);
-    if (sel == GTK_INVALID_LIST_POSITION || sel >= BUILTIN_THEME_COUNT) return;
+    if (sel == GTK_INVALID_LIST_POSITION || sel >= theme_count()) return;
 
-    const char *name = builtin_themes[sel].name;
-    debug_log("night_theme_dropdown_changed sel=%u name=%s", sel, name);
-    if (g_strcmp0(app->settings.night_theme_name, name) == 0) return;
+    const char *name = theme_record_name(theme_at(sel));
+    gboolean is_day = GTK_WIDGET(dropdown) == picker->day_dropdown;
+    debug_log("theme_dropdown_changed day=%d sel=%u name=%s", is_day, sel, name);
 
-    g_free(app->settings.night_theme_name);
-    app->settings.night_theme_name = g_strdup(name);
-    save_terminal_settings(&app->settings);
-
-    if (!is_day_theme_active_now(&app->settings)) {
-        app->theme_preview_active = TRUE;
-        debug_log("night_theme_dropdown_changed applying active night theme=%s", name);
-        apply_theme_name_now(app, name);
-    } else {
-        debug_log("night_theme_dropdown_changed deferred inactive night theme=%s", name);
-    }
+    char **pending = is_day ? &picker->day_name : &picker->night_name;
+    g_free(*pending);
+    *pending = g_strdup(name);
+    preview_theme(app, name);
+    update_theme_apply_button(app);
+}
+
+// Writes the selection once and re-themes the live terminals once
+static void on_theme_apply_clicked(GtkButton *button, gpointer user_data) {
+    AppState *app = (AppState *)user_data;
+    ThemePicker *picker = &app->theme_picker;
+    (void)button;
+
+    if (picker->day_name && g_strcmp0(picker->day_name, app->settings.day_theme_name) != 0) {
+        g_free(app->settings.day_theme_name);
+        app->settings.day_theme_name = g_strdup(picker->day_name);
+    }
+    if (picker->night_name && g_strcmp0(picker->night_name, app->settings.night_theme_name) != 0) {
+        g_free(app->settings.night_theme_name);
+        app->settings.night_theme_name = g_strdup(picker->night_name);
+    }
+    debug_log("theme_apply day=%s night=%s", app->settings.day_theme_name,
+              app->settings.night_theme_name);
+    save_terminal_settings(&app->settings);
+    refresh_scheduled_theme(app);
+    update_theme_apply_button(app);
+}
+
+// Drops unapplied choices: the dropdowns and preview go back to the
+// saved day/night themes and the one in use.
+static void reset_theme_picker(AppState *app) {
+    ThemePicker *picker = &app->theme_picker;
+    g_clear_pointer(&picker->day_name, g_free);
+    g_clear_pointer(&picker->night_name, g_free);
+    picker->day_name = g_strdup(app->settings.day_theme_name);
+    picker->night_name = g_strdup(app->settings.night_theme_name);
+
+    if (picker->day_dropdown) {
+        gtk_drop_down_set_selected(GTK_DROP_DOWN(picker->day_dropdown),
+                                   get_theme_dropdown_index(picker->day_name));
+        gtk_drop_down_set_selected(GTK_DROP_DOWN(picker->night_dropdown),
+                                   get_theme_dropdown_index(picker->night_name));
+    }
+    preview_theme(app, app->theme_name);
+    update_theme_apply_button(app);
+}
+
+// Canned output for the preview: a prompt, colored ls and diff output,
+// text attributes and the 16-color palette.
+static void feed_theme_preview_sample(VteTerminal *terminal) {
+    GString *sample = g_string_new(
+        "\x1b[1;32muser@host\x1b[0m:\x1b[1;34m~/src/app\x1b[0m$ ls\r\n"
+        "\x1b[1;34mbuild\x1b[0m  \x1b[1;32mrun.sh\x1b[0m  \x1b[1;36mlib\x1b[0m  "
+        "Makefile  \x1b[31marchive.tar\x1b[0m\r\n"
+        "\x1b[1;32muser@host\x1b[0m:\x1b[1;34m~/src/app\x1b[0m$ git diff --stat\r\n"
+        " src/main.c | 12 \x1b[32m++++++++\x1b[31m----\x1b[0m\r\n"
+        "\x1b[1mbold\x1b[0m \x1b[2mdim\x1b[0m \x1b[3mitalic\x1b[0m "
+        "\x1b[4munderline\x1b[0m \x1b[7mreverse\x1b[0m \x1b[33mwarning\x1b[0m\r\n");
+    for (int bright = 0; bright < 2; bright++) {
+        for (int i = 0; i < 8; i++) {
+            g_string_append_printf(sample, "\x1b[%dm   ", (bright ? 100 : 40) + i);
+        }
+        g_string_append(sample, "\x1b[0m\r\n");
+    }
+    g_string_append(sample, "\x1b[1;32muser@host\x1b[0m:\x1b[1;34m~/src/app\x1b[0m$ ");
+    vte_terminal_feed(terminal, sample->str, (gssize)sample->len);
+    g_string_free(sample, TRUE);
+}
+
+static GtkWidget* build_theme_preview(AppState *app) {
+    VteTerminal *preview = VTE_TERMINAL(vte_terminal_new());
+    vte_terminal_set_input_enabled(preview, FALSE);
+    vte_terminal_set_scrollback_lines(preview, 0);
+    vte_terminal_set_size(preview, 48, 8);
+    gtk_widget_set_can_focus(GTK_WIDGET(preview), FALSE);
+    gtk_widget_set_hexpand(GTK_WIDGET(preview), TRUE);
+    app->theme_picker.preview = GTK_WIDGET(preview);
+    feed_theme_preview_sample(preview);
+    return GTK_WIDGET(preview);
 }
 
 static void on_schedule_time_changed(GtkSpinButton *spin, gpointer user_data) {
@@ -1659,13 +3032,10 @@ static void on_schedule_time_changed(GtkSpinButton *spin, gpointer user_data) {
     else
         app->settings.night_start_minutes = clamp_minutes(minutes);
 
-    debug_log("schedule_time_changed is_day=%d value=%02d:%02d preview=%d",
-              is_day,
-              minutes / 60, minutes % 60,
-              app->theme_preview_active);
+    debug_log("schedule_time_changed is_day=%d value=%02d:%02d",
+              is_day, minutes / 60, minutes % 60);
     save_terminal_settings(&app->settings);
-    if (!app->theme_preview_active)
-        queue_theme_refresh(app);
+    queue_theme_refresh(app);
 }
 
 static GtkWidget* build_time_control(AppState *app, int minutes, gboolean is_day) {
@@ -1712,31 +3082,38 @@ static GtkWidget* build_theme_section(AppState *app) {
     gtk_grid_set_column_spacing(GTK_GRID(grid), 12);
 
     GtkStringList *names = gtk_string_list_new(NULL);
-    for (size_t i = 0; i < BUILTIN_THEME_COUNT; i++) {
-        gtk_string_list_append(names, builtin_themes[i].name);
+    for (guint i = 0; i < theme_count(); i++) {
+        gtk_string_list_append(names, theme_record_name(theme_at(i)));
     }
+    // Typing filters the list, which matters once a themes directory is in use
+    GtkExpression *name_expr = gtk_property_expression_new(GTK_TYPE_STRING_OBJECT, NULL, "string");
 
     GtkWidget *day_label = gtk_label_new("Day Theme");
     gtk_label_set_xalign(GTK_LABEL(day_label), 0.0);
     gtk_widget_set_hexpand(day_label, TRUE);
     gtk_grid_attach(GTK_GRID(grid), day_label, 0, 0, 1, 1);
 
-    GtkWidget *day_dropdown = gtk_drop_down_new(G_LIST_MODEL(names), NULL);
+    ThemePicker *picker = &app->theme_picker;
+    GtkWidget *day_dropdown = gtk_drop_down_new(G_LIST_MODEL(names), gtk_expression_ref(name_expr));
+    gtk_drop_down_set_enable_search(GTK_DROP_DOWN(day_dropdown), TRUE);
+    picker->day_dropdown = day_dropdown;
     gtk_drop_down_set_selected(GTK_DROP_DOWN(day_dropdown),
                                get_theme_dropdown_index(app->settings.day_theme_name));
     g_signal_connect(day_dropdown, "notify::selected",
-                     G_CALLBACK(on_day_theme_dropdown_changed), app);
+                     G_CALLBACK(on_theme_dropdown_changed), app);
     gtk_grid_attach(GTK_GRID(grid), day_dropdown, 1, 0, 1, 1);
 
     GtkWidget *night_label = gtk_label_new("Night Theme");
     gtk_label_set_xalign(GTK_LABEL(night_label), 0.0);
     gtk_grid_attach(GTK_GRID(grid), night_label, 0, 1, 1, 1);
 
-    GtkWidget *night_dropdown = gtk_drop_down_new(G_LIST_MODEL(names), NULL);
+    GtkWidget *night_dropdown = gtk_drop_down_new(G_LIST_MODEL(names), name_expr);
+    gtk_drop_down_set_enable_search(GTK_DROP_DOWN(night_dropdown), TRUE);
+    picker->night_dropdown = night_dropdown;
     gtk_drop_down_set_selected(GTK_DROP_DOWN(night_dropdown),
                                get_theme_dropdown_index(app->settings.night_theme_name));
     g_signal_connect(night_dropdown, "notify::selected",
-                     G_CALLBACK(on_night_theme_dropdown_changed), app);
+                     G_CALLBACK(on_theme_dropdown_changed), app);
     gtk_grid_attach(GTK_GRID(grid), night_dropdown, 1, 1, 1, 1);
 
     GtkWidget *day_start_label = gtk_label_new("Day Starts");
@@ -1754,6 +3131,14 @@ static GtkWidget* build_theme_section(AppState *app) {
                     1, 3, 1, 1);
 
     gtk_box_append(GTK_BOX(section), grid);
+    gtk_box_append(GTK_BOX(section), build_theme_preview(app));
+
+    picker->apply_button = gtk_button_new_with_label("Apply Themes");
+    gtk_widget_set_halign(picker->apply_button, GTK_ALIGN_END);
+    g_signal_connect(picker->apply_button, "clicked", G_CALLBACK(on_theme_apply_clicked), app);
+    gtk_box_append(GTK_BOX(section), picker->apply_button);
+
+    reset_theme_picker(app);
     return section;
 }
 
@@ -1993,10 +3378,9 @@ static GtkWidget* build_about_section(void) {
 static gboolean on_settings_dialog_close_request(GtkWindow *window, gpointer user_data) {
     AppState *app = (AppState *)user_data;
     app->settings_dialog_closing = TRUE;
-    debug_log("settings_dialog close-request window=%p current=%s preview=%d day=%s night=%s",
+    debug_log("settings_dialog close-request window=%p current=%s day=%s night=%s",
               (void *)window,
               app->theme_name ? app->theme_name : "(null)",
-              app->theme_preview_active,
               app->settings.day_theme_name ? app->settings.day_theme_name : "(null)",
               app->settings.night_theme_name ? app->settings.night_theme_name : "(null)");
     gtk_widget_set_visible(GTK_WIDGET(window), FALSE);
@@ -2005,20 +3389,20 @@ static gboolean on_settings_dialog_close_request(GtkWindow *window, gpointer use
 
 static void on_settings_dialog_hide(GtkWidget *widget, gpointer user_data) {
     AppState *app = (AppState *)user_data;
-    debug_log("settings_dialog hide widget=%p current=%s preview=%d",
+    debug_log("settings_dialog hide widget=%p current=%s",
               (void *)widget,
-              app->theme_name ? app->theme_name : "(null)",
-              app->theme_preview_active);
-    app->theme_preview_active = FALSE;
+              app->theme_name ? app->theme_name : "(null)");
+    // Closing without Apply discards the choices; the dropdowns are reset
+    // before closing is cleared so they don't preview on the way back
+    reset_theme_picker(app);
     app->settings_dialog_closing = FALSE;
 }
 
 static void on_settings_dialog_destroy(GtkWidget *widget, gpointer user_data) {
     AppState *app = (AppState *)user_data;
-    debug_log("settings_dialog destroy widget=%p current=%s preview=%d idle=%u",
+    debug_log("settings_dialog destroy widget=%p current=%s idle=%u",
               (void *)widget,
               app->theme_name ? app->theme_name : "(null)",
-              app->theme_preview_active,
               app->theme_refresh_idle_id);
 
     if (app->theme_refresh_idle_id > 0) {
@@ -2029,17 +3413,23 @@ static void on_settings_dialog_destroy(GtkWidget *widget, gpointer user_data) {
     if (app->settings_dialog == widget)
         app->settings_dialog = NULL;
 
-    app->theme_preview_active = FALSE;
+    ThemePicker *picker = &app->theme_picker;
+    g_clear_pointer(&picker->day_name, g_free);
+    g_clear_pointer(&picker->night_name, g_free);
+    memset(picker, 0, sizeof(*picker));
     app->settings_dialog_closing = FALSE;
-    debug_log("settings_dialog destroy complete preview=%d", app->theme_preview_active);
+    debug_log("settings_dialog destroy complete");
 }
 
 static void on_settings_clicked(GtkButton *button, gpointer user_data) {
-    AppState *app = (AppState *)user_data;
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
+    AppState *app = win->app;
     (void)button;
 
+    // One settings window for the workspace, over whichever window asked
     if (app->settings_dialog) {
         debug_log("settings_dialog reuse window=%p", (void *)app->settings_dialog);
+        gtk_window_set_transient_for(GTK_WINDOW(app->settings_dialog), GTK_WINDOW(win->window));
         gtk_window_present(GTK_WINDOW(app->settings_dialog));
         return;
     }
@@ -2049,7 +3439,7 @@ static void on_settings_clicked(GtkButton *button, gpointer user_data) {
     gtk_window_set_title(GTK_WINDOW(dialog), "Settings");
     gtk_window_set_default_size(GTK_WINDOW(dialog), 400, 550);
     gtk_window_set_modal(GTK_WINDOW(dialog), TRUE);
-    gtk_window_set_transient_for(GTK_WINDOW(dialog), GTK_WINDOW(app->window));
+    gtk_window_set_transient_for(GTK_WINDOW(dialog), GTK_WINDOW(win->window));
     gtk_window_set_hide_on_close(GTK_WINDOW(dialog), TRUE);
     gtk_widget_add_css_class(dialog, "gmux-settings");
     app->settings_dialog_closing = FALSE;
@@ -2133,6 +3523,26 @@ static void on_terminal_clicked(GtkGestureClick *gesture, int n_press,
 // Terminal Callbacks
 //=============================================================================
 
+// The label leads with the running job ("vim · Tab 2") unless the title
+// already names it, as shells that retitle per command do. A failed last
+// command (see Command Timeline) adds a mark in front.
+static void update_subtab_label(SubTab *subtab) {
+    if (!subtab->tab_label || !GTK_IS_LABEL(subtab->tab_label)) return;
+
+    const char *mark = subtab->failure ? "✗ " : "";
+    char *text = subtab->job && !strstr(subtab->name, subtab->job)
+                 ? g_strdup_printf("%s%s · %s", mark, subtab->job, subtab->name)
+                 : g_strdup_printf("%s%s", mark, subtab->name);
+    gtk_label_set_text(GTK_LABEL(subtab->tab_label), text);
+    g_free(text);
+
+    GString *tooltip = g_string_new(subtab->name);
+    if (subtab->job) g_string_append_printf(tooltip, "\nRunning: %s", subtab->job);
+    if (subtab->failure) g_string_append_printf(tooltip, "\nLast command %s", subtab->failure);
+    gtk_widget_set_tooltip_text(subtab->tab_label, tooltip->str);
+    g_string_free(tooltip, TRUE);
+}
+
 static void on_terminal_title_changed(VteTerminal *terminal, gpointer user_data) {
     SubTab *subtab = (SubTab *)user_data;
     const char *title = vte_terminal_get_window_title(terminal);
@@ -2140,14 +3550,18 @@ static void on_terminal_title_changed(VteTerminal *terminal, gpointer user_data)
     if (title && *title) {
         g_free(subtab->name);
         subtab->name = g_strdup(title);
-
-        if (subtab->tab_label && GTK_IS_LABEL(subtab->tab_label)) {
-            gtk_label_set_text(GTK_LABEL(subtab->tab_label), subtab->name);
-            gtk_widget_set_tooltip_text(subtab->tab_label, subtab->name);
-        }
+        update_subtab_label(subtab);
     }
 }
 
+// Typed input is what usually starts or ends a job; poll this tab soon.
+static void on_terminal_commit(VteTerminal *terminal, char *text, guint size, gpointer user_data) {
+    SubTab *subtab = (SubTab *)user_data;
+    if (subtab->parent_tab->app->latency) latency_mark_write(subtab->parent_tab->app, terminal);
+    note_command_input(subtab, text, size);
+    kick_job_poll(subtab);
+}
+
 static void on_terminal_child_exited(VteTerminal *terminal, int status, gpointer user_data) {
     SubTab *subtab = (SubTab *)user_data;
     (void)status;
@@ -2163,6 +3577,559 @@ static void on_terminal_child_exited(VteTerminal *terminal, int status, gpointer
     close_subtab(subtab);
 }
 
+//=============================================================================
+// Scrollback Persistence
+//=============================================================================
+
+// Each subtab's scrollback is snapshotted on quit and periodically into
+// <data>/scrollback/<id>.txt.gz. VTE may only be touched from the main
+// thread, so the snapshot itself is a memory copy there; compression, the
+// file write and disk budget enforcement happen on a worker thread. The
+// periodic pass copies one dirty tab per idle tick rather than all of them
+// at once, and hands the copies to the writer whenever they add up to
+// SCROLLBACK_JOB_BYTES. Restoring is lazy: nothing is read until a tab is
+// first shown.
+
+#define SCROLLBACK_AUTOSAVE_SECONDS 60
+#define SCROLLBACK_JOB_BYTES (8 * 1024 * 1024)
+#define SCROLLBACK_RESTORE_CHUNK (64 * 1024)
+#define SCROLLBACK_FILE_SUFFIX ".txt.gz"
+
+static void spawn_subtab_shell(SubTab *subtab);
+
+static GMutex scrollback_dir_lock;
+
+struct _ScrollbackJob {
+    char *dir;
+    gint64 budget_bytes;
+    GPtrArray *paths;     // char*, parallel to contents
+    GPtrArray *contents;  // GBytes*
+    gsize bytes;          // Total size of contents
+    GHashTable *keep;     // Basenames to keep when pruning orphans, or NULL
+};
+
+typedef struct {
+    char *path;
+    gint64 mtime;
+    gint64 size;
+} ScrollbackFile;
+
+static char* get_scrollback_dir(void) {
+    static gboolean created = FALSE;
+    char *dir = get_data_dir();
+    char *path = g_build_filename(dir, "scrollback", NULL);
+    g_free(dir);
+    if (!created) {
+        g_mkdir_with_parents(path, 0700);
+        created = TRUE;
+    }
+    return path;
+}
+
+static char* get_scrollback_path(const char *dir, const char *id) {
+    char *name = g_strconcat(id, SCROLLBACK_FILE_SUFFIX, NULL);
+    char *path = g_build_filename(dir, name, NULL);
+    g_free(name);
+    return path;
+}
+
+static ScrollbackJob* scrollback_job_new(AppState *app) {
+    ScrollbackJob *job = g_new0(ScrollbackJob, 1);
+    job->dir = get_scrollback_dir();
+    job->budget_bytes = (gint64)app->settings.scrollback_budget_mb * 1024 * 1024;
+    job->paths = g_ptr_array_new_with_free_func(g_free);
+    job->contents = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+    return job;
+}
+
+static void scrollback_job_free(ScrollbackJob *job) {
+    g_free(job->dir);
+    g_ptr_array_unref(job->paths);
+    g_ptr_array_unref(job->contents);
+    if (job->keep)
+        g_hash_table_unref(job->keep);
+    g_free(job);
+}
+
+static void scrollback_file_free(ScrollbackFile *file) {
+    g_free(file->path);
+    g_free(file);
+}
+
+static int compare_scrollback_file_age(gconstpointer a, gconstpointer b) {
+    const ScrollbackFile *f1 = *(ScrollbackFile * const *)a;
+    const ScrollbackFile *f2 = *(ScrollbackFile * const *)b;
+    if (f1->mtime != f2->mtime)
+        return f1->mtime < f2->mtime ? -1 : 1;
+    return g_strcmp0(f1->path, f2->path);
+}
+
+static gboolean write_compressed_file(const char *path, GBytes *contents, GError **error) {
+    GFile *file = g_file_new_for_path(path);
+    GFileOutputStream *out = g_file_replace(file, NULL, FALSE,
+                                            G_FILE_CREATE_PRIVATE |
+                                            G_FILE_CREATE_REPLACE_DESTINATION,
+                                            NULL, error);
+    g_object_unref(file);
+    if (!out) return FALSE;
+
+    GZlibCompressor *compressor = g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP, 6);
+    GOutputStream *gz = g_converter_output_stream_new(G_OUTPUT_STREAM(out),
+                                                      G_CONVERTER(compressor));
+    g_object_unref(compressor);
+
+    gsize len = 0;
+    const char *data = g_bytes_get_data(contents, &len);
+    gboolean ok = g_output_stream_write_all(gz, data, len, NULL, NULL, error) &&
+                  g_output_stream_close(gz, NULL, error);
+
+    g_object_unref(gz);
+    g_object_unref(out);
+    return ok;
+}
+
+// Deletes orphaned snapshots (when keep is set), then the oldest snapshots
+// until the directory fits in budget_bytes. Files just written are spared.
+static void prune_scrollback_dir(ScrollbackJob *job) {
+    GDir *dir = g_dir_open(job->dir, 0, NULL);
+    if (!dir) return;
+
+    GPtrArray *files = g_ptr_array_new_with_free_func((GDestroyNotify)scrollback_file_free);
+    gint64 total = 0;
+    const char *entry;
+
+    while ((entry = g_dir_read_name(dir)) != NULL) {
+        if (!g_str_has_suffix(entry, SCROLLBACK_FILE_SUFFIX)) continue;
+
+        char *path = g_build_filename(job->dir, entry, NULL);
+        if (job->keep && !g_hash_table_contains(job->keep, entry)) {
+            g_unlink(path);
+            g_free(path);
+            continue;
+        }
+
+        GStatBuf st;
+        if (g_stat(path, &st) != 0) {
+            g_free(path);
+            continue;
+        }
+
+        ScrollbackFile *file = g_new0(ScrollbackFile, 1);
+        file->path = path;
+        file->mtime = (gint64)st.st_mtime;
+        file->size = (gint64)st.st_size;
+        total += file->size;
+        g_ptr_array_add(files, file);
+    }
+    g_dir_close(dir);
+
+    g_ptr_array_sort(files, compare_scrollback_file_age);
+    for (guint i = 0; i < files->len && total > job->budget_bytes; i++) {
+        ScrollbackFile *file = g_ptr_array_index(files, i);
+        gboolean just_written = FALSE;
+        for (guint j = 0; j < job->paths->len; j++) {
+            if (g_strcmp0(file->path, g_ptr_array_index(job->paths, j)) == 0) {
+                just_written = TRUE;
+                break;
+            }
+        }
+        if (just_written) continue;
+
+        debug_log("scrollback budget: dropping %s (%lld bytes)",
+                  file->path, (long long)file->size);
+        g_unlink(file->path);
+        total -= file->size;
+    }
+
+    g_ptr_array_unref(files);
+}
+
+static void scrollback_job_thread(GTask *task, gpointer source_object,
+                                  gpointer task_data, GCancellable *cancellable) {
+    ScrollbackJob *job = (ScrollbackJob *)task_data;
+    (void)source_object;
+    (void)cancellable;
+
+    g_mutex_lock(&scrollback_dir_lock);
+
+    for (guint i = 0; i < job->paths->len; i++) {
+        GError *error = NULL;
+        if (!write_compressed_file(g_ptr_array_index(job->paths, i),
+                                   g_ptr_array_index(job->contents, i), &error)) {
+            g_warning("Failed to save scrollback: %s", error->message);
+            g_error_free(error);
+        }
+    }
+    prune_scrollback_dir(job);
+
+    g_mutex_unlock(&scrollback_dir_lock);
+    g_task_return_boolean(task, TRUE);
+}
+
+static void run_scrollback_job(ScrollbackJob *job, gboolean wait) {
+    GTask *task = g_task_new(NULL, NULL, NULL, NULL);
+    g_task_set_task_data(task, job, (GDestroyNotify)scrollback_job_free);
+    if (wait)
+        g_task_run_in_thread_sync(task, scrollback_job_thread);
+    else
+        g_task_run_in_thread(task, scrollback_job_thread);
+    g_object_unref(task);
+}
+
+static GBytes* snapshot_subtab_scrollback(SubTab *subtab) {
+    GOutputStream *mem = g_memory_output_stream_new_resizable();
+    GError *error = NULL;
+    GBytes *bytes = NULL;
+
+    if (vte_terminal_write_contents_sync(subtab->terminal, mem, VTE_WRITE_DEFAULT,
+                                         NULL, &error) &&
+        g_output_stream_close(mem, NULL, &error)) {
+        bytes = g_memory_output_stream_steal_as_bytes(G_MEMORY_OUTPUT_STREAM(mem));
+    } else {
+        g_warning("Failed to snapshot scrollback for '%s': %s",
+                  subtab->name, error ? error->message : "unknown error");
+        g_clear_error(&error);
+    }
+
+    g_object_unref(mem);
+    return bytes;
+}
+
+static gboolean scrollback_snapshot_due(SubTab *subtab) {
+    return subtab->spawned && !subtab->restore_pending && subtab->scrollback_dirty;
+}
+
+// Copies one tab's scrollback into the pending job.
+static void queue_subtab_snapshot(AppState *app, SubTab *subtab) {
+    GBytes *bytes = snapshot_subtab_scrollback(subtab);
+    if (!bytes) return;
+    subtab->scrollback_dirty = FALSE;
+
+    if (!app->scrollback_job) app->scrollback_job = scrollback_job_new(app);
+    ScrollbackJob *job = app->scrollback_job;
+    g_ptr_array_add(job->paths, get_scrollback_path(job->dir, subtab->scrollback_id));
+    g_ptr_array_add(job->contents, bytes);
+    job->bytes += g_bytes_get_size(bytes);
+}
+
+static void flush_scrollback_job(AppState *app, gboolean wait) {
+    ScrollbackJob *job = g_steal_pointer(&app->scrollback_job);
+    if (job) run_scrollback_job(job, wait);
+}
+
+// One step of the autosave pass: snapshots the next queued tab, or writes
+// what is left and ends the pass once none remain.
+static gboolean on_scrollback_snapshot_idle(gpointer user_data) {
+    AppState *app = (AppState *)user_data;
+
+    for (GList *l = app->projects; l != NULL; l = l->next) {
+        Project *project = (Project *)l->data;
+        for (GList *sl = project->subtabs; sl != NULL; sl = sl->next) {
+            SubTab *subtab = (SubTab *)sl->data;
+            if (!subtab->scrollback_queued) continue;
+
+            subtab->scrollback_queued = FALSE;
+            if (!scrollback_snapshot_due(subtab)) return G_SOURCE_CONTINUE;
+
+            gint64 start = g_get_monotonic_time();
+            queue_subtab_snapshot(app, subtab);
+            debug_log("scrollback snapshot '%s' main_thread_ms=%.2f",
+                      subtab->name, (g_get_monotonic_time() - start) / 1000.0);
+            if (app->scrollback_job && app->scrollback_job->bytes >= SCROLLBACK_JOB_BYTES)
+                flush_scrollback_job(app, FALSE);
+            return G_SOURCE_CONTINUE;
+        }
+    }
+
+    flush_scrollback_job(app, FALSE);
+    app->scrollback_idle_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+// Snapshots every spawned tab whose output changed since the last save, in
+// one go. Used on quit, where the write finishes before returning.
+static void save_scrollback_snapshots(AppState *app) {
+    if (app->scrollback_idle_id > 0) {
+        g_source_remove(app->scrollback_idle_id);
+        app->scrollback_idle_id = 0;
+    }
+    if (app->settings.scrollback_budget_mb <= 0) {
+        g_clear_pointer(&app->scrollback_job, scrollback_job_free);
+        return;
+    }
+
+    gint64 start = g_get_monotonic_time();
+    for (GList *l = app->projects; l != NULL; l = l->next) {
+        Project *project = (Project *)l->data;
+        for (GList *sl = project->subtabs; sl != NULL; sl = sl->next) {
+            SubTab *subtab = (SubTab *)sl->data;
+            subtab->scrollback_queued = FALSE;
+            if (scrollback_snapshot_due(subtab)) queue_subtab_snapshot(app, subtab);
+        }
+    }
+
+    if (!app->scrollback_job) return;
+    debug_log("scrollback snapshot tabs=%u main_thread_ms=%.2f",
+              app->scrollback_job->paths->len, (g_get_monotonic_time() - start) / 1000.0);
+    flush_scrollback_job(app, TRUE);
+}
+
+// Applies a changed scrollback_budget_mb. 0 stops persisting and drops an
+// autosave pass in progress; a new budget is enforced on disk right away
+// instead of at the next write.
+static void apply_scrollback_budget(AppState *app) {
+    if (app->settings.scrollback_budget_mb <= 0) {
+        if (app->scrollback_idle_id > 0) {
+            g_source_remove(app->scrollback_idle_id);
+            app->scrollback_idle_id = 0;
+        }
+        g_clear_pointer(&app->scrollback_job, scrollback_job_free);
+        return;
+    }
+
+    ScrollbackJob *job = scrollback_job_new(app);
+    if (app->scrollback_job) app->scrollback_job->budget_bytes = job->budget_bytes;
+    run_scrollback_job(job, FALSE);  // Nothing to write, so this only prunes
+}
+
+// Removes snapshots that no subtab (live or pending restore) refers to.
+static void prune_orphan_scrollback(AppState *app) {
+    ScrollbackJob *job = scrollback_job_new(app);
+    job->keep = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    for (GList *l = app->projects; l != NULL; l = l->next) {
+        Project *project = (Project *)l->data;
+        for (GList *sl = project->subtabs; sl != NULL; sl = sl->next) {
+            SubTab *subtab = (SubTab *)sl->data;
+            g_hash_table_add(job->keep,
+                             g_strconcat(subtab->scrollback_id, SCROLLBACK_FILE_SUFFIX, NULL));
+        }
+        for (GList *sl = project->saved_subtabs; sl != NULL; sl = sl->next) {
+            SavedSubTab *saved = (SavedSubTab *)sl->data;
+            if (saved->scrollback_id)
+                g_hash_table_add(job->keep,
+                                 g_strconcat(saved->scrollback_id, SCROLLBACK_FILE_SUFFIX, NULL));
+        }
+    }
+
+    run_scrollback_job(job, FALSE);
+}
+
+static void delete_subtab_scrollback(SubTab *subtab) {
+    if (!subtab->scrollback_id) return;
+    char *dir = get_scrollback_dir();
+    char *path = get_scrollback_path(dir, subtab->scrollback_id);
+
+    // Don't let an autosave pass write the file back
+    ScrollbackJob *job = subtab->parent_tab->app->scrollback_job;
+    for (guint i = 0; job && i < job->paths->len; i++) {
+        if (strcmp(g_ptr_array_index(job->paths, i), path) != 0) continue;
+        job->bytes -= g_bytes_get_size(g_ptr_array_index(job->contents, i));
+        g_ptr_array_remove_index(job->paths, i);
+        g_ptr_array_remove_index(job->contents, i);
+        break;
+    }
+    g_unlink(path);
+    g_free(path);
+    g_free(dir);
+}
+
+// Queues the dirty tabs and starts a pass, unless the last one is still going.
+static gboolean on_scrollback_autosave_tick(gpointer user_data) {
+    AppState *app = (AppState *)user_data;
+    if (app->scrollback_idle_id > 0 || app->settings.scrollback_budget_mb <= 0)
+        return G_SOURCE_CONTINUE;
+
+    gboolean queued = FALSE;
+    for (GList *l = app->projects; l != NULL; l = l->next) {
+        Project *project = (Project *)l->data;
+        for (GList *sl = project->subtabs; sl != NULL; sl = sl->next) {
+            SubTab *subtab = (SubTab *)sl->data;
+            subtab->scrollback_queued = scrollback_snapshot_due(subtab);
+            queued |= subtab->scrollback_queued;
+        }
+    }
+    if (queued)
+        app->scrollback_idle_id = g_idle_add_full(G_PRIORITY_LOW, on_scrollback_snapshot_idle,
+                                                  app, NULL);
+    return G_SOURCE_CONTINUE;
+}
+
+static void on_terminal_contents_changed(VteTerminal *terminal, gpointer user_data) {
+    SubTab *subtab = (SubTab *)user_data;
+    subtab->scrollback_dirty = TRUE;
+    if (subtab->parent_tab->app->latency) latency_mark_echo(subtab->parent_tab->app, terminal);
+    if (subtab->recipe_step) recipe_scan_output(subtab);
+    if (subtab->parent_tab->app->triggers && !subtab->trigger_dirty) queue_trigger_scan(subtab);
+}
+
+static void scrollback_restore_thread(GTask *task, gpointer source_object,
+                                      gpointer task_data, GCancellable *cancellable) {
+    const char *path = (const char *)task_data;
+    GError *error = NULL;
+    (void)source_object;
+
+    GFile *file = g_file_new_for_path(path);
+    GFileInputStream *in = g_file_read(file, cancellable, &error);
+    g_object_unref(file);
+    if (!in) {
+        if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+            g_error_free(error);
+            g_task_return_pointer(task, NULL, NULL);
+        } else {
+            g_task_return_error(task, error);
+        }
+        return;
+    }
+
+    GZlibDecompressor *decompressor = g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+    GInputStream *gz = g_converter_input_stream_new(G_INPUT_STREAM(in),
+                                                    G_CONVERTER(decompressor));
+    g_object_unref(decompressor);
+    g_object_unref(in);
+
+    // The snapshot uses bare LF line endings; the terminal needs CRLF.
+    GString *text = g_string_new(NULL);
+    char buf[16384];
+    gssize n;
+    while ((n = g_input_stream_read(gz, buf, sizeof(buf), cancellable, &error)) > 0) {
+        const char *p = buf, *end = buf + n;
+        const char *newline;
+        while ((newline = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+            g_string_append_len(text, p, newline - p);
+            g_string_append_len(text, "\r\n", 2);
+            p = newline + 1;
+        }
+        g_string_append_len(text, p, end - p);
+    }
+    g_object_unref(gz);
+
+    if (n < 0) {
+        g_string_free(text, TRUE);
+        g_task_return_error(task, error);
+        return;
+    }
+
+    // Drop the blank rows below the last prompt so the separator follows it.
+    while (text->len > 0) {
+        char c = text->str[text->len - 1];
+        if (c != ' ' && c != '\r' && c != '\n') break;
+        g_string_truncate(text, text->len - 1);
+    }
+
+    g_task_return_pointer(task, g_string_free_to_bytes(text), (GDestroyNotify)g_bytes_unref);
+}
+
+static void finish_subtab_restore(SubTab *subtab, gboolean restored) {
+    if (restored) {
+        static const char separator[] =
+            "\r\n\033[2m──────── restored from previous session ────────\033[0m\r\n";
+        vte_terminal_feed(subtab->terminal, separator, -1);
+    }
+    subtab->restore_pending = FALSE;
+    skip_trigger_rows(subtab);
+    spawn_subtab_shell(subtab);
+}
+
+static gboolean on_scrollback_feed_idle(gpointer user_data) {
+    SubTab *subtab = (SubTab *)user_data;
+    gsize len = 0;
+    const char *data = g_bytes_get_data(subtab->restore_bytes, &len);
+    gsize chunk = MIN((gsize)SCROLLBACK_RESTORE_CHUNK, len - subtab->restore_offset);
+
+    vte_terminal_feed(subtab->terminal, data + subtab->restore_offset, (gssize)chunk);
+    subtab->restore_offset += chunk;
+    if (subtab->restore_offset < len)
+        return G_SOURCE_CONTINUE;
+
+    subtab->restore_idle_id = 0;
+    g_clear_pointer(&subtab->restore_bytes, g_bytes_unref);
+    finish_subtab_restore(subtab, TRUE);
+    return G_SOURCE_REMOVE;
+}
+
+static void on_scrollback_restored(GObject *source, GAsyncResult *result, gpointer user_data) {
+    SubTab *subtab = (SubTab *)user_data;
+    GError *error = NULL;
+    (void)source;
+
+    GBytes *bytes = g_task_propagate_pointer(G_TASK(result), &error);
+    if (error) {
+        // Cancelled means the subtab has been closed and freed.
+        if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_error_free(error);
+            return;
+        }
+        g_warning("Failed to restore scrollback for '%s': %s", subtab->name, error->message);
+        g_error_free(error);
+    }
+    g_clear_object(&subtab->restore_cancellable);
+
+    if (!bytes || g_bytes_get_size(bytes) == 0) {
+        if (bytes) g_bytes_unref(bytes);
+        finish_subtab_restore(subtab, FALSE);
+        return;
+    }
+
+    subtab->restore_bytes = bytes;
+    subtab->restore_offset = 0;
+    subtab->restore_idle_id = g_idle_add(on_scrollback_feed_idle, subtab);
+}
+
+static void start_subtab_restore(SubTab *subtab) {
+    if (!subtab->restore_pending || subtab->restore_cancellable || subtab->restore_idle_id)
+        return;
+
+    char *dir = get_scrollback_dir();
+    char *path = get_scrollback_path(dir, subtab->scrollback_id);
+    g_free(dir);
+
+    subtab->restore_cancellable = g_cancellable_new();
+    GTask *task = g_task_new(NULL, subtab->restore_cancellable, on_scrollback_restored, subtab);
+    g_task_set_task_data(task, path, g_free);
+    g_task_run_in_thread(task, scrollback_restore_thread);
+    g_object_unref(task);
+}
+
+static void cancel_subtab_restore(SubTab *subtab) {
+    if (subtab->restore_cancellable) {
+        g_cancellable_cancel(subtab->restore_cancellable);
+        g_clear_object(&subtab->restore_cancellable);
+    }
+    if (subtab->restore_idle_id > 0) {
+        g_source_remove(subtab->restore_idle_id);
+        subtab->restore_idle_id = 0;
+    }
+    g_clear_pointer(&subtab->restore_bytes, g_bytes_unref);
+}
+
+// Restoring goes through an idle so that bulk subtab creation, which
+// switches to every new tab in turn, only restores the one left visible.
+static gboolean on_project_restore_idle(gpointer user_data) {
+    Project *project = (Project *)user_data;
+    project->restore_idle_id = 0;
+
+    SubTab *subtab = project->active_subtab;
+    if (subtab && subtab->restore_pending &&
+        gtk_widget_get_mapped(GTK_WIDGET(subtab->terminal))) {
+        start_subtab_restore(subtab);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void queue_subtab_restore(Project *project) {
+    if (project->restore_idle_id != 0) return;
+    if (!project->active_subtab || !project->active_subtab->restore_pending) return;
+    project->restore_idle_id = g_idle_add(on_project_restore_idle, project);
+}
+
+static void on_terminal_map(GtkWidget *widget, gpointer user_data) {
+    SubTab *subtab = (SubTab *)user_data;
+    (void)widget;
+    if (subtab->parent_tab->active_subtab == subtab)
+        queue_subtab_restore(subtab->parent_tab);
+}
+
 //=============================================================================
 // SubTab Management
 //=============================================================================
@@ -2199,6 +4166,7 @@ static void sync_terminal_size_from_widget(SubTab *subtab) {
     }
 
     vte_pty_set_size(pty, rows, columns, NULL);
+    count_hud_work(subtab->parent_tab->app, HUD_WORK_PTY_RESIZE);
 }
 
 static void on_terminal_widget_size_changed(GObject *object, GParamSpec *pspec, gpointer user_data) {
@@ -2214,39 +4182,47 @@ static void on_terminal_char_size_changed(VteTerminal *terminal, guint width, gu
     sync_terminal_size_from_widget((SubTab *)user_data);
 }
 
-static void on_subtab_button_clicked(GtkButton *button, gpointer user_data) {
-    SubTab *subtab = (SubTab *)user_data;
-    Project *project = subtab->parent_tab;
-    (void)button;
-
-    // Switch to this subtab in the stack
-    gtk_stack_set_visible_child(GTK_STACK(project->terminal_stack), subtab->container);
-    project->active_subtab = subtab;
-
-    // Update tab styles - active state is on the whole tab row
+// Active state is on the whole tab row
+static void update_active_tab_style(Project *project) {
     for (GList *l = project->subtabs; l != NULL; l = l->next) {
         SubTab *st = (SubTab *)l->data;
         GtkWidget *row = st->tab_widget;
         GtkWidget *btn = st->tab_button;
         if (!row || !btn) continue;
-        if (st == subtab) {
+        if (st == project->active_subtab) {
             gtk_widget_add_css_class(row, "gmux-tab-item-active");
         } else {
             gtk_widget_remove_css_class(row, "gmux-tab-item-active");
         }
     }
+}
+
+static void on_subtab_button_clicked(GtkButton *button, gpointer user_data) {
+    SubTab *subtab = (SubTab *)user_data;
+    Project *project = subtab->parent_tab;
+    (void)button;
+
+    // Switch to this subtab in the stack
+    gtk_stack_set_visible_child(GTK_STACK(project->terminal_stack), subtab->container);
+    project->active_subtab = subtab;
+    clear_trigger_alert(subtab);
+
+    update_active_tab_style(project);
 
     scroll_subtab_into_view(project, subtab);
     update_tab_overflow_indicator(project);
+    queue_subtab_restore(project);
 
     // Focus the terminal
     gtk_widget_grab_focus(GTK_WIDGET(subtab->terminal));
 }
 
-static SubTab* create_subtab(Project *project, const char *name, const char *working_dir);
-
 static void update_tab_count_badge(Project *project) {
     if (!project->tab_count_label) return;
+    if (project->app->bulk_depth > 0) {
+        project->tabs_dirty = TRUE;
+        return;
+    }
     guint count = g_list_length(project->subtabs);
     if (count > 0) {
         char buf[16];
@@ -2262,6 +4238,10 @@ static void update_tab_overflow_indicator(Project *project) {
     if (!project || !project->tabs_hadjustment || !project->tabs_overflow_indicator) {
         return;
     }
+    if (project->app->bulk_depth > 0) {
+        project->tabs_dirty = TRUE;
+        return;
+    }
 
     double value = gtk_adjustment_get_value(project->tabs_hadjustment);
     double upper = gtk_adjustment_get_upper(project->tabs_hadjustment);
@@ -2340,6 +4320,29 @@ static gboolean on_tabs_scroll(GtkEventControllerScroll *controller, double dx,
     return TRUE;
 }
 
+// Stops terminal signals and callbacks from reaching the SubTab; call while
+// the terminal is still alive, before the SubTab is freed.
+static void detach_subtab_terminal(SubTab *subtab) {
+    if (!subtab->terminal) return;
+    g_signal_handlers_disconnect_by_data(subtab->terminal, subtab);
+    g_object_set_data(G_OBJECT(subtab->terminal), "subtab", NULL);
+}
+
+static void free_subtab(SubTab *subtab) {
+    recipe_subtab_closed(subtab);
+    cancel_subtab_restore(subtab);
+    cancel_paste(subtab);
+    cancel_scrollback_export(subtab);
+    free_command_timeline(subtab);
+    g_free(subtab->pending_input);
+    g_free(subtab->job);
+    g_free(subtab->cwd);
+    g_free(subtab->name);
+    g_free(subtab->working_dir);
+    g_free(subtab->scrollback_id);
+    g_free(subtab);
+}
+
 static void close_subtab(SubTab *subtab) {
     if (!subtab || subtab->closing) {
         return;
@@ -2349,8 +4352,13 @@ static void close_subtab(SubTab *subtab) {
     Project *project = subtab->parent_tab;
     gboolean was_last = (g_list_length(project->subtabs) == 1);
 
-    if (subtab->terminal) {
-        g_signal_handlers_disconnect_by_data(subtab->terminal, subtab);
+    if (project->menu_subtab == subtab) {
+        project->menu_subtab = NULL;
+    }
+    detach_subtab_terminal(subtab);
+    cancel_subtab_restore(subtab);
+    if (!project->app->shutting_down) {
+        delete_subtab_scrollback(subtab);
     }
 
     // If this was the active subtab, switch to an adjacent one first
@@ -2378,8 +4386,7 @@ static void close_subtab(SubTab *subtab) {
     }
 
     // Free subtab resources
-    g_free(subtab->name);
-    g_free(subtab);
+    free_subtab(subtab);
 
     // Mark as uninitialized when all tabs are closed; tab creation remains lazy.
     if (was_last) {
@@ -2394,7 +4401,7 @@ static void close_subtab(SubTab *subtab) {
 static void on_close_subtab_clicked(GtkButton *button, gpointer user_data) {
     SubTab *subtab = (SubTab *)user_data;
     (void)button;
-    close_subtab(subtab);
+    request_close_subtabs(subtab, CLOSE_TAB);
 }
 
 static void free_saved_subtabs(Project *project) {
@@ -2402,29 +4409,36 @@ static void free_saved_subtabs(Project *project) {
         SavedSubTab *saved = (SavedSubTab *)sl->data;
         g_free(saved->name);
         g_free(saved->working_dir);
+        g_free(saved->scrollback_id);
+        g_free(saved->command);
         g_free(saved);
     }
     g_list_free(project->saved_subtabs);
     project->saved_subtabs = NULL;
 }
 
-static void on_add_subtab_clicked(GtkButton *button, gpointer user_data) {
-    Project *project = (Project *)user_data;
-    (void)button;
-
+// Adds a numbered tab to the project; the first one replaces any tabs still
+// pending restore from the saved session.
+static SubTab* add_project_subtab(Project *project, const char *working_dir) {
     if (!project->initialized) {
         free_saved_subtabs(project);
-        create_subtab(project, "Tab 1", project->path);
+        SubTab *subtab = create_subtab(project, "Tab 1", working_dir, NULL);
         project->subtab_counter = 1;
         project->initialized = TRUE;
-        return;
+        return subtab;
     }
 
     project->subtab_counter++;
     char name[64];
     snprintf(name, sizeof(name), "Tab %d", project->subtab_counter);
 
-    create_subtab(project, name, project->path);
+    return create_subtab(project, name, working_dir, NULL);
+}
+
+static void on_add_subtab_clicked(GtkButton *button, gpointer user_data) {
+    Project *project = (Project *)user_data;
+    (void)button;
+    add_project_subtab(project, project->path);
 }
 
 //=============================================================================
@@ -2484,9 +4498,39 @@ static void on_tab_drag_begin(GtkGestureDrag *gesture, double start_x, double st
     g_object_set_data_full(G_OBJECT(project->tabs_box), "drag-start-x", sx, g_free);
 }
 
+// Where a tab dragged to (x, y) in tabs_box coordinates would go: another
+// project's sidebar row, or NULL. *outside is set when the point has left
+// the window, which moves the tab into a window of its own.
+static GtkWidget* tab_drop_row_at(Project *project, double x, double y, gboolean *outside) {
+    GtkWidget *root = project->win->window;
+    graphene_point_t point;
+    *outside = FALSE;
+    if (!gtk_widget_compute_point(project->tabs_box, root,
+                                  &GRAPHENE_POINT_INIT((float)x, (float)y), &point)) {
+        return NULL;
+    }
+    if (point.x < 0 || point.y < 0 ||
+        point.x >= gtk_widget_get_width(root) || point.y >= gtk_widget_get_height(root)) {
+        *outside = TRUE;
+        return NULL;
+    }
+
+    GtkWidget *picked = gtk_widget_pick(root, point.x, point.y, GTK_PICK_DEFAULT);
+    GtkWidget *row = picked ? gtk_widget_get_ancestor(picked, GTK_TYPE_LIST_BOX_ROW) : NULL;
+    Project *target = row ? g_object_get_data(G_OBJECT(row), "project") : NULL;
+    return target && target != project ? row : NULL;
+}
+
+static void set_tab_drop_row(Project *project, GtkWidget *row) {
+    GtkWidget *previous = g_object_get_data(G_OBJECT(project->tabs_box), "drag-drop-row");
+    if (previous == row) return;
+    if (previous) gtk_widget_remove_css_class(previous, "gmux-tab-drop-target");
+    if (row) gtk_widget_add_css_class(row, "gmux-tab-drop-target");
+    g_object_set_data(G_OBJECT(project->tabs_box), "drag-drop-row", row);
+}
+
 static void on_tab_drag_update(GtkGestureDrag *gesture, double offset_x, double offset_y, gpointer user_data) {
     Project *project = (Project *)user_data;
-    (void)offset_y;
 
     GtkWidget *dragged_btn = g_object_get_data(G_OBJECT(project->tabs_box), "drag-tab");
     if (!dragged_btn) return;
@@ -2506,6 +4550,14 @@ static void on_tab_drag_update(GtkGestureDrag *gesture, double offset_x, double
 
     double current_x = *start_x_ptr + offset_x;
 
+    // Over another project's row the tab would move there; don't reorder
+    double start_y = 0.0;
+    gtk_gesture_drag_get_start_point(gesture, NULL, &start_y);
+    gboolean outside;
+    GtkWidget *drop_row = tab_drop_row_at(project, current_x, start_y + offset_y, &outside);
+    set_tab_drop_row(project, drop_row);
+    if (drop_row) return;
+
     // Reorder in real-time based on midpoint crossing
     for (GtkWidget *child = gtk_widget_get_first_child(project->tabs_box);
          child != NULL;
@@ -2536,14 +4588,36 @@ static void on_tab_drag_update(GtkGestureDrag *gesture, double offset_x, double
 
 static void on_tab_drag_end(GtkGestureDrag *gesture, double offset_x, double offset_y, gpointer user_data) {
     Project *project = (Project *)user_data;
-    (void)gesture; (void)offset_x; (void)offset_y;
 
     GtkWidget *dragged_btn = g_object_get_data(G_OBJECT(project->tabs_box), "drag-tab");
     gboolean active = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(project->tabs_box), "drag-active"));
 
     if (dragged_btn && active) {
         gtk_widget_remove_css_class(dragged_btn, "gmux-tab-dragging");
+        set_tab_drop_row(project, NULL);
         rebuild_subtabs_list(project);
+
+        // Dropped on another project's row, or outside the window
+        double start_x = 0.0, start_y = 0.0;
+        gtk_gesture_drag_get_start_point(gesture, &start_x, &start_y);
+        gboolean outside;
+        GtkWidget *drop_row = tab_drop_row_at(project, start_x + offset_x,
+                                              start_y + offset_y, &outside);
+        SubTab *dragged = g_object_get_data(G_OBJECT(dragged_btn), "subtab");
+        // Dropping outside only tears off a project's last tab; others
+        // stay where they are
+        if (outside && !subtab_can_move_to_new_window(dragged)) outside = FALSE;
+        if (drop_row || outside) {
+            g_object_set_data(G_OBJECT(project->tabs_box), "drag-tab", NULL);
+            g_object_set_data(G_OBJECT(project->tabs_box), "drag-active", GINT_TO_POINTER(FALSE));
+            if (drop_row) {
+                move_subtab_to_project(dragged, g_object_get_data(G_OBJECT(drop_row), "project"));
+            } else {
+                move_subtab_to_new_window(dragged);
+            }
+            return;
+        }
+
         if (project->active_subtab) {
             scroll_subtab_into_view(project, project->active_subtab);
         }
@@ -2565,10 +4639,97 @@ static void setup_tabs_box_drag_reorder(Project *project) {
     gtk_widget_add_controller(project->tabs_box, GTK_EVENT_CONTROLLER(drag));
 }
 
-static SubTab* create_subtab(Project *project, const char *name, const char *working_dir) {
+static void on_subtab_spawned(VteTerminal *terminal, GPid pid, GError *error,
+                              gpointer user_data) {
+    (void)user_data;
+
+    // The terminal outlives its SubTab when a tab is closed mid-spawn.
+    SubTab *subtab = (SubTab *)g_object_get_data(G_OBJECT(terminal), "subtab");
+    if (!subtab) return;
+
+    if (error) {
+        g_warning("Failed to spawn shell for '%s': %s", subtab->name, error->message);
+        return;
+    }
+
+    subtab->child_pid = pid;
+    kick_job_poll(subtab);
+    if (subtab->pending_input) {
+        vte_terminal_feed_child(terminal, subtab->pending_input, -1);
+        g_clear_pointer(&subtab->pending_input, g_free);
+    }
+}
+
+// Writes text to the tab's shell, queueing it if the shell isn't up yet.
+static void send_text_to_subtab(SubTab *subtab, const char *text) {
+    if (subtab->child_pid > 0) {
+        vte_terminal_feed_child(subtab->terminal, text, -1);
+        return;
+    }
+
+    char *queued = g_strconcat(subtab->pending_input ? subtab->pending_input : "", text, NULL);
+    g_free(subtab->pending_input);
+    subtab->pending_input = queued;
+}
+
+// envv replaces the inherited environment when set; see Project Environments
+static void start_subtab_shell(SubTab *subtab, char **envv) {
+    char *argv[] = { g_strdup(g_getenv("SHELL") ?: "/bin/bash"), NULL };
+
+    if (!subtab->parent_tab->app->settings.spawn_via_vte) {
+        GError *error = NULL;
+        gint64 start = g_get_monotonic_time();
+        GPid pid = light_spawn(subtab->terminal, subtab->working_dir, argv, envv, &error);
+        if (pid > 0) {
+            debug_log("spawn: %s pid=%d ms=%.2f", argv[0], (int)pid,
+                      (g_get_monotonic_time() - start) / 1000.0);
+            on_subtab_spawned(subtab->terminal, pid, NULL, NULL);
+            g_free(argv[0]);
+            return;
+        }
+        // e.g. a working directory that is gone; VTE's path copes with that
+        debug_log("spawn: posix_spawn failed, using VTE: %s", error->message);
+        g_error_free(error);
+    }
+
+    vte_terminal_spawn_async(
+        subtab->terminal,
+        VTE_PTY_DEFAULT,
+        subtab->working_dir,
+        argv,
+        envv,
+        envv ? VTE_SPAWN_NO_PARENT_ENVV : G_SPAWN_DEFAULT,
+        NULL, NULL,  // child setup
+        NULL,  // child setup data
+        -1,  // timeout
+        NULL,  // cancellable
+        on_subtab_spawned,
+        NULL   // user data
+    );
+
+    g_free(argv[0]);
+}
+
+static void spawn_subtab_shell(SubTab *subtab) {
+    if (subtab->spawned) return;
+    subtab->spawned = TRUE;
+    spawn_with_project_env(subtab);
+}
+
+// scrollback_id names a snapshot saved by a previous session; the shell is
+// only spawned once that snapshot has been streamed back in, which happens
+// the first time the tab is shown. Pass NULL for a fresh tab.
+static SubTab* create_subtab(Project *project, const char *name, const char *working_dir,
+                             const char *scrollback_id) {
+    ensure_project_page(project);
+
     SubTab *subtab = g_new0(SubTab, 1);
     subtab->name = g_strdup(name);
     subtab->parent_tab = project;
+    subtab->working_dir = g_strdup(working_dir);
+    subtab->scrollback_id = scrollback_id ? g_strdup(scrollback_id) : g_uuid_string_random();
+    subtab->restore_pending = scrollback_id != NULL &&
+                              project->app->settings.scrollback_budget_mb > 0;
 
     // Create VTE terminal
     subtab->terminal = VTE_TERMINAL(vte_terminal_new());
@@ -2612,6 +4773,13 @@ static SubTab* create_subtab(Project *project, const char *name, const char *wor
                      G_CALLBACK(on_terminal_widget_size_changed), subtab);
     g_signal_connect(subtab->terminal, "char-size-changed",
                      G_CALLBACK(on_terminal_char_size_changed), subtab);
+    g_signal_connect(subtab->terminal, "contents-changed",
+                     G_CALLBACK(on_terminal_contents_changed), subtab);
+    g_signal_connect(subtab->terminal, "map",
+                     G_CALLBACK(on_terminal_map), subtab);
+    g_signal_connect(subtab->terminal, "commit",
+                     G_CALLBACK(on_terminal_commit), subtab);
+    watch_prompt_marks(subtab);
 
     // Add to stack
     gtk_stack_add_child(GTK_STACK(project->terminal_stack), subtab->container);
@@ -2641,37 +4809,32 @@ static SubTab* create_subtab(Project *project, const char *name, const char *wor
 
     gtk_box_append(GTK_BOX(project->tabs_box), subtab->tab_widget);
 
-    // Store subtab pointer on the button for drag-reorder lookups
+    // Store subtab pointer on the button for drag-reorder lookups, and on
+    // the terminal for callbacks that may outlive the tab
     g_object_set_data(G_OBJECT(subtab->tab_widget), "subtab", subtab);
+    g_object_set_data(G_OBJECT(subtab->terminal), "subtab", subtab);
 
-    // Spawn shell in terminal
-    char *argv[] = { g_strdup(g_getenv("SHELL") ?: "/bin/bash"), NULL };
-
-    vte_terminal_spawn_async(
-        subtab->terminal,
-        VTE_PTY_DEFAULT,
-        working_dir,
-        argv,
-        NULL,  // inherit parent environment
-        G_SPAWN_DEFAULT,
-        NULL, NULL,  // child setup
-        NULL,  // child setup data
-        -1,  // timeout
-        NULL,  // cancellable
-        NULL,  // callback
-        NULL   // user data
-    );
-
-    g_free(argv[0]);
+    // Spawn shell in terminal (deferred until the saved scrollback is back)
+    if (!subtab->restore_pending) {
+        spawn_subtab_shell(subtab);
+    }
 
     project->subtabs = g_list_append(project->subtabs, subtab);
 
-    // Switch to this subtab first (so it's visible/realized)
-    on_subtab_button_clicked(GTK_BUTTON(subtab->tab_button), subtab);
+    // Switch to this subtab first (so it's visible/realized). Bulk
+    // operations only flip the stack; the tab strip is restyled on commit.
+    if (project->app->bulk_depth > 0) {
+        gtk_stack_set_visible_child(GTK_STACK(project->terminal_stack), subtab->container);
+        project->active_subtab = subtab;
+        project->tabs_dirty = TRUE;
+    } else {
+        on_subtab_button_clicked(GTK_BUTTON(subtab->tab_button), subtab);
+    }
 
     // Apply theme + settings AFTER terminal is in widget tree, visible, and realized
     if (project->app->theme.loaded) {
         apply_theme(subtab->terminal, &project->app->theme);
+        count_hud_work(project->app, HUD_WORK_THEME_APPLY);
     }
     {
         TerminalSettings *s = &project->app->settings;
@@ -2707,80 +4870,12 @@ static SubTab* create_subtab(Project *project, const char *name, const char *wor
 // Project Management
 //=============================================================================
 
-static void on_project_selected(GtkListBox *box, GtkListBoxRow *row, gpointer user_data) {
-    AppState *app = (AppState *)user_data;
-    (void)box;
-
-    if (!row) return;
-
-    Project *project = (Project *)g_object_get_data(G_OBJECT(row), "project");
-    if (project) {
-        int page_num = g_list_index(app->projects, project);
-        if (page_num >= 0) {
-            gtk_notebook_set_current_page(GTK_NOTEBOOK(app->notebook), page_num);
-            app->active_project = project;
-
-            // Update MRU timestamp (sort only triggered by sort button)
-            project->last_used = g_get_real_time();
-
-            // Lazy initialization: create terminal on first click
-            if (!project->initialized) {
-                if (project->saved_subtabs) {
-                    // Restore saved subtabs from session
-                    for (GList *sl = project->saved_subtabs; sl != NULL; sl = sl->next) {
-                        SavedSubTab *saved = (SavedSubTab *)sl->data;
-                        create_subtab(project, saved->name, saved->working_dir);
-                    }
-                    project->subtab_counter = (int)g_list_length(project->saved_subtabs);
-
-                    // Activate the saved active subtab
-                    GList *active_link = g_list_nth(project->subtabs, project->saved_active_subtab);
-                    if (active_link) {
-                        SubTab *active_sub = (SubTab *)active_link->data;
-                        on_subtab_button_clicked(GTK_BUTTON(active_sub->tab_button), active_sub);
-                    }
-
-                    // Free saved subtab data
-                    free_saved_subtabs(project);
-                } else {
-                    create_subtab(project, "Tab 1", project->path);
-                    project->subtab_counter = 1;
-                }
-                project->initialized = TRUE;
-            }
-
-            if (project->active_subtab) {
-                gtk_widget_grab_focus(GTK_WIDGET(project->active_subtab->terminal));
-            }
-        }
-    }
-}
-
-static void on_sidebar_add_subtab_clicked(GtkButton *button, gpointer user_data) {
-    Project *project = (Project *)user_data;
-    (void)button;
-
-    if (!project->initialized) {
-        free_saved_subtabs(project);
-        create_subtab(project, "Tab 1", project->path);
-        project->subtab_counter = 1;
-        project->initialized = TRUE;
-        return;
-    }
-
-    project->subtab_counter++;
-    char name[64];
-    snprintf(name, sizeof(name), "Tab %d", project->subtab_counter);
-
-    create_subtab(project, name, project->path);
-}
-
-static Project* create_project(AppState *app, const char *name, const char *path, gboolean init_terminal) {
-    Project *project = g_new0(Project, 1);
-    project->name = g_strdup(name);
-    project->path = g_strdup(path);
-    project->app = app;
-    project->subtab_counter = 0;
+// The notebook page (tab strip and terminal stack) is only built when the
+// project is first shown or gets a tab; until then only its sidebar row
+// exists. Notebook page order therefore doesn't follow app->projects.
+static void ensure_project_page(Project *project) {
+    if (project->tab_container) return;
+    gint64 start = g_get_monotonic_time();
 
     // Create main container (vertical box)
     project->tab_container = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
@@ -2831,6 +4926,7 @@ static Project* create_project(AppState *app, const char *name, const char *path
 
     // Enable gesture-based tab reordering
     setup_tabs_box_drag_reorder(project);
+    setup_tab_context_menu(project);
 
     project->tabs_overflow_indicator = gtk_image_new_from_icon_name("go-next-symbolic");
     gtk_widget_add_css_class(project->tabs_overflow_indicator, "gmux-tab-overflow-indicator");
@@ -2862,8 +4958,112 @@ static Project* create_project(AppState *app, const char *name, const char *path
     gtk_box_append(GTK_BOX(project->tab_container), project->terminal_stack);
 
     // Add to notebook
-    gtk_notebook_append_page(GTK_NOTEBOOK(app->notebook), project->tab_container, NULL);
-    gtk_notebook_set_show_tabs(GTK_NOTEBOOK(app->notebook), FALSE);
+    gtk_notebook_append_page(GTK_NOTEBOOK(project->win->notebook), project->tab_container, NULL);
+
+    debug_log("Built page for project '%s' in %.3f ms", project->name,
+              (g_get_monotonic_time() - start) / 1000.0);
+}
+
+// Switches the notebook to the project's page, building it if needed.
+static void show_project_page(Project *project) {
+    ensure_project_page(project);
+    int page_num = gtk_notebook_page_num(GTK_NOTEBOOK(project->win->notebook),
+                                         project->tab_container);
+    if (page_num >= 0) {
+        gtk_notebook_set_current_page(GTK_NOTEBOOK(project->win->notebook), page_num);
+    }
+}
+
+// Create a project's terminals on first use, restoring saved subtabs if the
+// session had any.
+static void ensure_project_initialized(Project *project) {
+    if (project->initialized) return;
+
+    if (project->saved_subtabs) {
+        // Restore saved subtabs from session
+        for (GList *sl = project->saved_subtabs; sl != NULL; sl = sl->next) {
+            SavedSubTab *saved = (SavedSubTab *)sl->data;
+            SubTab *subtab = create_subtab(project, saved->name, saved->working_dir,
+                                           saved->scrollback_id);
+            if (saved->command) {
+                char *line = g_strconcat(saved->command, "\n", NULL);
+                send_text_to_subtab(subtab, line);
+                g_free(line);
+            }
+        }
+        project->subtab_counter = (int)g_list_length(project->saved_subtabs);
+
+        // Activate the saved active subtab
+        GList *active_link = g_list_nth(project->subtabs, project->saved_active_subtab);
+        if (active_link) {
+            SubTab *active_sub = (SubTab *)active_link->data;
+            on_subtab_button_clicked(GTK_BUTTON(active_sub->tab_button), active_sub);
+        }
+
+        // Free saved subtab data
+        free_saved_subtabs(project);
+    } else if (!start_recipe_on_open(project)) {
+        create_subtab(project, "Tab 1", project->path, NULL);
+        project->subtab_counter = 1;
+    }
+    project->initialized = TRUE;
+}
+
+static void on_project_selected(GtkListBox *box, GtkListBoxRow *row, gpointer user_data) {
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
+    AppState *app = win->app;
+    (void)box;
+
+    if (!row) return;
+
+    Project *project = (Project *)g_object_get_data(G_OBJECT(row), "project");
+    if (project) {
+        if (g_list_find(app->projects, project)) {
+            show_project_page(project);
+            win->active_project = project;
+
+            // Update MRU timestamp (sort only triggered by sort button)
+            project->last_used = g_get_real_time();
+
+            // Bulk operations (session restore, layouts, scripted batches)
+            // select projects without the user visiting them
+            if (app->bulk_depth == 0) {
+                record_project_visit(project, project->last_used);
+
+                // Only this row's key changed: reposition it in O(log n)
+                if (app->sort_mode == SORT_FRECENCY) {
+                    gtk_list_box_row_changed(row);
+                }
+            }
+
+            // Lazy initialization: create terminal on first click
+            ensure_project_initialized(project);
+
+            // Working in a project is a good moment to pick up worktree edits
+            invalidate_git_status(app, project->path);
+
+            if (project->active_subtab) {
+                gtk_widget_grab_focus(GTK_WIDGET(project->active_subtab->terminal));
+            }
+        }
+    }
+}
+
+static void on_sidebar_add_subtab_clicked(GtkButton *button, gpointer user_data) {
+    Project *project = (Project *)user_data;
+    (void)button;
+    add_project_subtab(project, project->path);
+}
+
+static Project* create_project(WorkspaceWindow *win, const char *name, const char *path,
+                               gboolean init_terminal) {
+    AppState *app = win->app;
+    Project *project = g_new0(Project, 1);
+    project->name = g_strdup(name);
+    project->path = g_strdup(path);
+    project->app = app;
+    project->win = win;
+    project->subtab_counter = 0;
 
     // Create sidebar row: project text, quiet tab count, and add button.
     GtkWidget *row_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
@@ -2893,8 +5093,21 @@ static Project* create_project(AppState *app, const char *name, const char *path
     gtk_widget_set_hexpand(meta_label, TRUE);
     g_free(path_display);
 
+    // Git badge shares the path line; filled in asynchronously once visible
+    project->git_label = gtk_label_new("");
+    gtk_widget_add_css_class(project->git_label, "gmux-project-meta");
+    gtk_widget_add_css_class(project->git_label, "gmux-project-git");
+    gtk_label_set_single_line_mode(GTK_LABEL(project->git_label), TRUE);
+    gtk_label_set_ellipsize(GTK_LABEL(project->git_label), PANGO_ELLIPSIZE_END);
+    gtk_label_set_max_width_chars(GTK_LABEL(project->git_label), 16);
+    gtk_widget_set_visible(project->git_label, FALSE);
+
+    GtkWidget *meta_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    gtk_box_append(GTK_BOX(meta_box), project->git_label);
+    gtk_box_append(GTK_BOX(meta_box), meta_label);
+
     gtk_box_append(GTK_BOX(text_box), label);
-    gtk_box_append(GTK_BOX(text_box), meta_label);
+    gtk_box_append(GTK_BOX(text_box), meta_box);
 
     // Tab count badge (hidden until terminals are created)
     project->tab_count_label = gtk_label_new("");
@@ -2917,15 +5130,16 @@ static Project* create_project(AppState *app, const char *name, const char *path
     project->list_row = gtk_list_box_row_new();
     gtk_list_box_row_set_child(GTK_LIST_BOX_ROW(project->list_row), row_box);
     g_object_set_data(G_OBJECT(project->list_row), "project", project);
-    gtk_list_box_append(GTK_LIST_BOX(app->sidebar), project->list_row);
+    gtk_list_box_append(GTK_LIST_BOX(win->sidebar), project->list_row);
 
     project->insert_order = (int)g_list_length(app->projects);
     app->projects = g_list_append(app->projects, project);
-    app->active_project = project;
+    win->active_project = project;
+    queue_git_badge_refresh(app);
 
     if (init_terminal) {
         // Create the first subtab
-        create_subtab(project, "Tab 1", project->path);
+        create_subtab(project, "Tab 1", project->path, NULL);
         project->subtab_counter = 1;
         project->initialized = TRUE;
     }
@@ -2933,16 +5147,43 @@ static Project* create_project(AppState *app, const char *name, const char *path
     // Select this project (only when actually initializing a terminal,
     // otherwise load_session handles selection after all projects are loaded)
     if (init_terminal) {
-        int page_num = g_list_length(app->projects) - 1;
-        gtk_notebook_set_current_page(GTK_NOTEBOOK(app->notebook), page_num);
-        gtk_list_box_select_row(GTK_LIST_BOX(app->sidebar), GTK_LIST_BOX_ROW(project->list_row));
+        show_project_page(project);
+        gtk_list_box_select_row(GTK_LIST_BOX(win->sidebar), GTK_LIST_BOX_ROW(project->list_row));
     }
 
     return project;
 }
 
+static Project* find_project_by_path(AppState *app, const char *path) {
+    for (GList *l = app->projects; l != NULL; l = l->next) {
+        Project *project = (Project *)l->data;
+        if (g_strcmp0(project->path, path) == 0) return project;
+    }
+    return NULL;
+}
+
+// First project shown in win, in workspace order
+static Project* first_window_project(WorkspaceWindow *win) {
+    for (GList *l = win->app->projects; l != NULL; l = l->next) {
+        Project *project = (Project *)l->data;
+        if (project->win == win) return project;
+    }
+    return NULL;
+}
+
+// Active project of the window that last had focus
+static Project* focused_project(AppState *app) {
+    return app->focus ? app->focus->active_project : NULL;
+}
+
+static void select_project(Project *project) {
+    // on_project_selected does the page switch and lazy initialization
+    gtk_list_box_select_row(GTK_LIST_BOX(project->win->sidebar),
+                            GTK_LIST_BOX_ROW(project->list_row));
+}
+
 static void on_folder_selected(GObject *source, GAsyncResult *result, gpointer user_data) {
-    AppState *app = (AppState *)user_data;
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
     GtkFileDialog *dialog = GTK_FILE_DIALOG(source);
 
     GFile *folder = gtk_file_dialog_select_folder_finish(dialog, result, NULL);
@@ -2951,8 +5192,8 @@ static void on_folder_selected(GObject *source, GAsyncResult *result, gpointer u
     char *path = g_file_get_path(folder);
     char *basename = g_file_get_basename(folder);
 
-    create_project(app, basename, path, TRUE);
-    save_session(app);
+    create_project(win, basename, path, TRUE);
+    save_session(win->app);
 
     g_free(path);
     g_free(basename);
@@ -2960,67 +5201,81 @@ static void on_folder_selected(GObject *source, GAsyncResult *result, gpointer u
 }
 
 static void on_add_project_clicked(GtkButton *button, gpointer user_data) {
-    AppState *app = (AppState *)user_data;
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
     (void)button;
 
     GtkFileDialog *dialog = gtk_file_dialog_new();
     gtk_file_dialog_set_title(dialog, "Select Project Folder");
 
-    gtk_file_dialog_select_folder(dialog, GTK_WINDOW(app->window), NULL,
-                                  on_folder_selected, app);
+    gtk_file_dialog_select_folder(dialog, GTK_WINDOW(win->window), NULL,
+                                  on_folder_selected, win);
     g_object_unref(dialog);
 }
 
-static void on_remove_project_clicked(GtkButton *button, gpointer user_data) {
-    AppState *app = (AppState *)user_data;
-    (void)button;
+// Closes the project's tabs, forgets their scrollback and drops it from
+// the workspace. The window shows its first remaining project instead.
+static void remove_project(Project *project) {
+    WorkspaceWindow *win = project->win;
+    AppState *app = project->app;
+    gboolean was_active = win->active_project == project;
 
-    if (!app->active_project) {
-        return;
+    for (GList *l = project->subtabs; l != NULL; l = l->next) {
+        detach_subtab_terminal((SubTab *)l->data);
     }
-
-    Project *project = (Project *)app->active_project;
+    g_clear_pointer(&project->tab_menu, gtk_widget_unparent);
 
     // Remove from notebook
-    int page_num = gtk_notebook_page_num(GTK_NOTEBOOK(app->notebook), project->tab_container);
+    int page_num = project->tab_container
+        ? gtk_notebook_page_num(GTK_NOTEBOOK(win->notebook), project->tab_container) : -1;
     if (page_num >= 0) {
-        gtk_notebook_remove_page(GTK_NOTEBOOK(app->notebook), page_num);
+        gtk_notebook_remove_page(GTK_NOTEBOOK(win->notebook), page_num);
     }
 
     // Remove from sidebar
-    gtk_list_box_remove(GTK_LIST_BOX(app->sidebar), project->list_row);
+    gtk_list_box_remove(GTK_LIST_BOX(win->sidebar), project->list_row);
 
-    // Free subtabs
+    // Free subtabs; a removed project's scrollback is not coming back
+    if (project->restore_idle_id > 0) {
+        g_source_remove(project->restore_idle_id);
+    }
+    free_project_recipe(project);
     for (GList *l = project->subtabs; l != NULL; l = l->next) {
         SubTab *subtab = (SubTab *)l->data;
-        g_free(subtab->name);
-        g_free(subtab);
+        delete_subtab_scrollback(subtab);
+        free_subtab(subtab);
     }
     g_list_free(project->subtabs);
     free_saved_subtabs(project);
 
     // Free resources
     app->projects = g_list_remove(app->projects, project);
+    forget_git_repo(app, project->path);
     g_free(project->name);
     g_free(project->path);
     g_free(project);
 
     save_session(app);
-
-    // Select another project
-    if (app->projects) {
-        app->active_project = (Project *)app->projects->data;
-        gtk_notebook_set_current_page(GTK_NOTEBOOK(app->notebook), 0);
-        gtk_list_box_select_row(GTK_LIST_BOX(app->sidebar),
-                               GTK_LIST_BOX_ROW(((Project *)app->active_project)->list_row));
-        if (((Project *)app->active_project)->active_subtab) {
-            gtk_widget_grab_focus(GTK_WIDGET(((Project *)app->active_project)->active_subtab->terminal));
+    if (!was_active) return;
+
+    // Select another project in this window
+    win->active_project = first_window_project(win);
+    if (win->active_project) {
+        show_project_page(win->active_project);
+        gtk_list_box_select_row(GTK_LIST_BOX(win->sidebar),
+                               GTK_LIST_BOX_ROW(win->active_project->list_row));
+        if (win->active_project->active_subtab) {
+            gtk_widget_grab_focus(GTK_WIDGET(win->active_project->active_subtab->terminal));
         }
-    } else {
-        app->active_project = NULL;
     }
 }
 
+static void on_remove_project_clicked(GtkButton *button, gpointer user_data) {
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
+    (void)button;
+
+    if (win->active_project) remove_project(win->active_project);
+}
+
 static void on_window_destroy(GtkWidget *widget, gpointer user_data) {
     AppState *app = (AppState *)user_data;
     (void)widget;
@@ -3033,7 +5288,25 @@ static void on_window_destroy(GtkWidget *widget, gpointer user_data) {
         g_source_remove(app->theme_refresh_idle_id);
         app->theme_refresh_idle_id = 0;
     }
+    if (app->scrollback_timer_id > 0) {
+        g_source_remove(app->scrollback_timer_id);
+        app->scrollback_timer_id = 0;
+    }
 
+    config_store_unwatch();
+
+    app->shutting_down = TRUE;
+    control_socket_stop(app);
+    stop_project_discovery(app);
+    stop_git_badges(app);
+    stop_project_envs(app);
+    stop_triggers(app);
+    stop_job_poll(app);
+    stop_memory_monitor(app);
+    cancel_key_chord(app);
+    disable_latency_tracking(app);
+    hide_frame_hud(app);
+    save_scrollback_snapshots(app);
     save_window_geometry(app);
     save_session(app);
 
@@ -3041,11 +5314,16 @@ static void on_window_destroy(GtkWidget *widget, gpointer user_data) {
     for (GList *l = app->projects; l != NULL; l = l->next) {
         Project *project = (Project *)l->data;
 
+        if (project->restore_idle_id > 0) {
+            g_source_remove(project->restore_idle_id);
+        }
+        free_project_recipe(project);
+
         // Free subtabs
         for (GList *sl = project->subtabs; sl != NULL; sl = sl->next) {
             SubTab *subtab = (SubTab *)sl->data;
-            g_free(subtab->name);
-            g_free(subtab);
+            detach_subtab_terminal(subtab);
+            free_subtab(subtab);
         }
         g_list_free(project->subtabs);
         free_saved_subtabs(project);
@@ -3055,11 +5333,10 @@ static void on_window_destroy(GtkWidget *widget, gpointer user_data) {
         g_free(project);
     }
     g_list_free(app->projects);
+    stop_history(app);
 
     // Clean up settings resources
-    g_free(app->settings.font_family);
-    g_free(app->settings.day_theme_name);
-    g_free(app->settings.night_theme_name);
+    free_terminal_settings(&app->settings);
 
     // Clean up theme resources
     if (app->theme.font) {
@@ -3075,70 +5352,9741 @@ static void on_window_destroy(GtkWidget *widget, gpointer user_data) {
 }
 
 //=============================================================================
-// Keyboard Shortcuts
+// Bulk Workspace Operations
 //=============================================================================
 
-static gboolean on_key_pressed(GtkEventControllerKey *controller,
-                               guint keyval, guint keycode,
-                               GdkModifierType modifiers, gpointer user_data) {
-    AppState *app = (AppState *)user_data;
-    (void)controller;
-    (void)keycode;
-
-    Project *project = (Project *)app->active_project;
-    if (!project || !project->active_subtab) return FALSE;
+// Between workspace_begin_bulk() and workspace_commit_bulk(), creating or
+// closing projects and tabs skips the per-item session save, sidebar sort
+// and tab strip relayout. Commit does each of those once. Calls nest.
 
-    VteTerminal *terminal = project->active_subtab->terminal;
-    gboolean ctrl_shift = (modifiers & (GDK_CONTROL_MASK | GDK_SHIFT_MASK)) ==
-                          (GDK_CONTROL_MASK | GDK_SHIFT_MASK);
+static char *startup_layout_path = NULL;  // --layout FILE
 
-    if (ctrl_shift && (keyval == GDK_KEY_C || keyval == GDK_KEY_c)) {
-        vte_terminal_copy_clipboard_format(terminal, VTE_FORMAT_TEXT);
-        return TRUE;
-    }
+static void workspace_begin_bulk(AppState *app) {
+    if (app->bulk_depth++ > 0) return;
 
-    if (ctrl_shift && (keyval == GDK_KEY_V || keyval == GDK_KEY_v)) {
-        vte_terminal_paste_clipboard(terminal);
-        return TRUE;
+    // With no sort func, new sidebar rows are plain appends
+    for (GList *w = app->windows; w != NULL; w = w->next) {
+        gtk_list_box_set_sort_func(GTK_LIST_BOX(((WorkspaceWindow *)w->data)->sidebar),
+                                   NULL, NULL, NULL);
     }
-
-    return FALSE;
 }
 
-//=============================================================================
-// Application Setup
-//=============================================================================
+static void workspace_commit_bulk(AppState *app) {
+    g_return_if_fail(app->bulk_depth > 0);
+    if (--app->bulk_depth > 0) return;
 
-static void activate(GtkApplication *app, gpointer user_data) {
-    (void)user_data;
+    gint64 start = g_get_monotonic_time();
+    int refreshed = 0;
 
-    AppState *state = g_new0(AppState, 1);
+    apply_sort(app);
 
-    // Create window
-    state->window = gtk_application_window_new(app);
-    gtk_window_set_title(GTK_WINDOW(state->window), "gmux");
-    gtk_window_set_icon_name(GTK_WINDOW(state->window), "utilities-terminal");
-    gtk_window_set_default_size(GTK_WINDOW(state->window), 1200, 800);
-    load_window_geometry(state);
+    for (GList *l = app->projects; l != NULL; l = l->next) {
+        Project *project = (Project *)l->data;
+        if (!project->tabs_dirty) continue;
+        project->tabs_dirty = FALSE;
+        refreshed++;
 
-    // Create explicit headerbar so we can style it (skip on KDE — it forces SSD)
-    const char *desktop = g_getenv("XDG_CURRENT_DESKTOP");
-    gboolean is_kde = desktop && g_strstr_len(desktop, -1, "KDE") != NULL;
-    if (!is_kde) {
-        GtkWidget *headerbar = gtk_header_bar_new();
-        gtk_widget_add_css_class(headerbar, "gmux-headerbar");
-        gtk_window_set_titlebar(GTK_WINDOW(state->window), headerbar);
+        if (project == project->win->active_project && project->active_subtab) {
+            on_subtab_button_clicked(GTK_BUTTON(project->active_subtab->tab_button),
+                                     project->active_subtab);
+        } else {
+            update_active_tab_style(project);
+        }
+        update_tab_count_badge(project);
+        update_tab_overflow_indicator(project);
     }
 
-    // Create horizontal paned
-    GtkWidget *paned = gtk_paned_new(GTK_ORIENTATION_HORIZONTAL);
-    gtk_window_set_child(GTK_WINDOW(state->window), paned);
+    if (app->bulk_save_pending) {
+        app->bulk_save_pending = FALSE;
+        save_session(app);
+    }
+
+    debug_log("bulk: commit took %.2f ms (%u projects, %d tab strips refreshed)",
+              (g_get_monotonic_time() - start) / 1000.0,
+              g_list_length(app->projects), refreshed);
+}
+
+static void close_other_subtabs(SubTab *keep) {
+    Project *project = keep->parent_tab;
+    AppState *app = project->app;
+
+    workspace_begin_bulk(app);
+    if (project->active_subtab != keep) {
+        on_subtab_button_clicked(GTK_BUTTON(keep->tab_button), keep);
+    }
+    GList *subtabs = g_list_copy(project->subtabs);
+    for (GList *l = subtabs; l != NULL; l = l->next) {
+        if (l->data != keep) close_subtab((SubTab *)l->data);
+    }
+    g_list_free(subtabs);
+    workspace_commit_bulk(app);
+}
+
+static void close_all_subtabs(Project *project) {
+    AppState *app = project->app;
+    SubTab *active = project->active_subtab;
+
+    // The active tab goes last so no neighbour gets activated along the way
+    workspace_begin_bulk(app);
+    GList *subtabs = g_list_copy(project->subtabs);
+    for (GList *l = subtabs; l != NULL; l = l->next) {
+        if (l->data != active) close_subtab((SubTab *)l->data);
+    }
+    g_list_free(subtabs);
+    if (active) close_subtab(active);
+    workspace_commit_bulk(app);
+}
+
+#define BULK_BENCH_MAX_COUNT 2000
+
+// Opens count projects and closes them again, either one by one as
+// `gmux ctl open-project` and the remove button do, or inside one bulk
+// operation. The projects get no terminal and their paths don't exist, so
+// what is timed is the workspace bookkeeping: sidebar rows, sorting and
+// session writes.
+static JsonObject* run_bulk_bench(AppState *app, int count, gboolean bulk) {
+    WorkspaceWindow *win = app->focus ? app->focus : app->windows->data;
+    Project *shown = win->active_project;
+    Project **projects = g_new0(Project *, count);
+    guint saves = app->session_saves;
+    guint passes = app->sort_passes;
+    guint compares = app->sort_compares;
+    gint64 start = g_get_monotonic_time();
+
+    if (bulk) workspace_begin_bulk(app);
+    for (int i = 0; i < count; i++) {
+        char *name = g_strdup_printf("bulk-bench-%04d", i);
+        char *path = g_strdup_printf("/nonexistent/gmux-bulk-bench/%04d", i);
+        projects[i] = create_project(win, name, path, FALSE);
+        // The bench projects are never shown
+        win->active_project = shown;
+        save_session(app);
+        g_free(path);
+        g_free(name);
+    }
+    for (int i = 0; i < count; i++) remove_project(projects[i]);
+    if (bulk) workspace_commit_bulk(app);
+
+    JsonObject *result = json_object_new();
+    json_object_set_string_member(result, "path", bulk ? "bulk" : "per-item");
+    json_object_set_double_member(result, "ms", (g_get_monotonic_time() - start) / 1000.0);
+    json_object_set_int_member(result, "session_saves", app->session_saves - saves);
+    json_object_set_int_member(result, "sort_passes", app->sort_passes - passes);
+    json_object_set_int_member(result, "sort_compares", app->sort_compares - compares);
+    g_free(projects);
+    return result;
+}
+
+static void on_tab_menu_close(GSimpleAction *action, GVariant *parameter, gpointer user_data) {
+    Project *project = (Project *)user_data;
+    (void)action;
+    (void)parameter;
+    if (project->menu_subtab) request_close_subtabs(project->menu_subtab, CLOSE_TAB);
+}
+
+static void on_tab_menu_close_others(GSimpleAction *action, GVariant *parameter, gpointer user_data) {
+    Project *project = (Project *)user_data;
+    (void)action;
+    (void)parameter;
+    if (project->menu_subtab) request_close_subtabs(project->menu_subtab, CLOSE_OTHER_TABS);
+}
+
+static void on_tab_menu_close_all(GSimpleAction *action, GVariant *parameter, gpointer user_data) {
+    Project *project = (Project *)user_data;
+    (void)action;
+    (void)parameter;
+    SubTab *subtab = project->menu_subtab ? project->menu_subtab : project->active_subtab;
+    if (subtab) {
+        request_close_subtabs(subtab, CLOSE_ALL_TABS);
+    } else {
+        close_all_subtabs(project);
+    }
+}
+
+static void on_tabs_box_secondary_pressed(GtkGestureClick *gesture, int n_press,
+                                          double x, double y, gpointer user_data) {
+    Project *project = (Project *)user_data;
+    (void)n_press;
+
+    GtkWidget *picked = gtk_widget_pick(project->tabs_box, x, y, GTK_PICK_DEFAULT);
+    GtkWidget *tab = find_tab_button_ancestor(picked, project->tabs_box);
+    if (!tab) return;
+
+    graphene_point_t point;
+    if (!gtk_widget_compute_point(project->tabs_box, project->tab_header,
+                                  &GRAPHENE_POINT_INIT((float)x, (float)y), &point)) {
+        return;
+    }
+
+    project->menu_subtab = (SubTab *)g_object_get_data(G_OBJECT(tab), "subtab");
+    GActionMap *actions = g_object_get_data(G_OBJECT(project->tab_header), "tab-actions");
+    GAction *to_window = g_action_map_lookup_action(actions, "move-to-window");
+    g_simple_action_set_enabled(G_SIMPLE_ACTION(to_window),
+                                project->menu_subtab &&
+                                subtab_can_move_to_new_window(project->menu_subtab));
+
+    // Targets are every other project, by index into app->projects
+    g_menu_remove_all(project->tab_move_menu);
+    int index = 0;
+    for (GList *l = project->app->projects; l != NULL; l = l->next, index++) {
+        Project *other = (Project *)l->data;
+        if (other == project) continue;
+        GMenuItem *item = g_menu_item_new(other->name, NULL);
+        g_menu_item_set_action_and_target_value(item, "tab.move-to", g_variant_new_int32(index));
+        g_menu_append_item(project->tab_move_menu, item);
+        g_object_unref(item);
+    }
+
+    GdkRectangle rect = { (int)point.x, (int)point.y, 1, 1 };
+    gtk_popover_set_pointing_to(GTK_POPOVER(project->tab_menu), &rect);
+    gtk_popover_popup(GTK_POPOVER(project->tab_menu));
+    gtk_gesture_set_state(GTK_GESTURE(gesture), GTK_EVENT_SEQUENCE_CLAIMED);
+}
+
+static void on_tab_menu_export(GSimpleAction *action, GVariant *parameter, gpointer user_data) {
+    Project *project = (Project *)user_data;
+    (void)action;
+    (void)parameter;
+    if (project->menu_subtab) choose_scrollback_export(project->menu_subtab);
+}
+
+static void on_tab_menu_copy_scrollback(GSimpleAction *action, GVariant *parameter,
+                                        gpointer user_data) {
+    Project *project = (Project *)user_data;
+    (void)action;
+    (void)parameter;
+    if (!project->menu_subtab) return;
+    char *error = start_scrollback_export(project->menu_subtab, EXPORT_TEXT, NULL);
+    if (error) {
+        g_warning("Scrollback export: %s", error);
+        g_free(error);
+    }
+}
+
+static void on_tab_menu_move_to(GSimpleAction *action, GVariant *parameter, gpointer user_data) {
+    Project *project = (Project *)user_data;
+    (void)action;
+    Project *target = g_list_nth_data(project->app->projects,
+                                      (guint)g_variant_get_int32(parameter));
+    if (project->menu_subtab && target) move_subtab_to_project(project->menu_subtab, target);
+}
+
+static void on_tab_menu_move_to_window(GSimpleAction *action, GVariant *parameter,
+                                       gpointer user_data) {
+    Project *project = (Project *)user_data;
+    (void)action;
+    (void)parameter;
+    if (project->menu_subtab) move_subtab_to_new_window(project->menu_subtab);
+}
+
+static void setup_tab_context_menu(Project *project) {
+    static const GActionEntry entries[] = {
+        { "export",       on_tab_menu_export,       NULL, NULL, NULL, { 0 } },
+        { "copy-scrollback", on_tab_menu_copy_scrollback, NULL, NULL, NULL, { 0 } },
+        { "move-to",      on_tab_menu_move_to,      "i",  NULL, NULL, { 0 } },
+        { "move-to-window", on_tab_menu_move_to_window, NULL, NULL, NULL, { 0 } },
+        { "close",        on_tab_menu_close,        NULL, NULL, NULL, { 0 } },
+        { "close-others", on_tab_menu_close_others, NULL, NULL, NULL, { 0 } },
+        { "close-all",    on_tab_menu_close_all,    NULL, NULL, NULL, { 0 } },
+    };
+    GSimpleActionGroup *group = g_simple_action_group_new();
+    g_action_map_add_action_entries(G_ACTION_MAP(group), entries,
+                                    G_N_ELEMENTS(entries), project);
+    gtk_widget_insert_action_group(project->tab_header, "tab", G_ACTION_GROUP(group));
+    g_object_set_data(G_OBJECT(project->tab_header), "tab-actions", group);
+    g_object_unref(group);
+
+    GMenu *menu = g_menu_new();
+    GMenu *scrollback_section = g_menu_new();
+    g_menu_append(scrollback_section, "Export Scrollback…", "tab.export");
+    g_menu_append(scrollback_section, "Copy Scrollback", "tab.copy-scrollback");
+    g_menu_append_section(menu, NULL, G_MENU_MODEL(scrollback_section));
+    g_object_unref(scrollback_section);
+    // The menu model keeps tab_move_menu alive for as long as the popover
+    GMenu *move_section = g_menu_new();
+    project->tab_move_menu = g_menu_new();
+    g_menu_append_submenu(move_section, "Move to Project", G_MENU_MODEL(project->tab_move_menu));
+    g_object_unref(project->tab_move_menu);
+    g_menu_append(move_section, "Move to New Window", "tab.move-to-window");
+    g_menu_append_section(menu, NULL, G_MENU_MODEL(move_section));
+    g_object_unref(move_section);
+    GMenu *close_section = g_menu_new();
+    g_menu_append(close_section, "Close Tab", "tab.close");
+    g_menu_append(close_section, "Close Other Tabs", "tab.close-others");
+    g_menu_append(close_section, "Close All Tabs", "tab.close-all");
+    g_menu_append_section(menu, NULL, G_MENU_MODEL(close_section));
+    g_object_unref(close_section);
+    project->tab_menu = gtk_popover_menu_new_from_model(G_MENU_MODEL(menu));
+    gtk_popover_set_has_arrow(GTK_POPOVER(project->tab_menu), FALSE);
+    gtk_widget_set_parent(project->tab_menu, project->tab_header);
+    g_object_unref(menu);
+
+    GtkGesture *click = gtk_gesture_click_new();
+    gtk_gesture_single_set_button(GTK_GESTURE_SINGLE(click), GDK_BUTTON_SECONDARY);
+    g_signal_connect(click, "pressed", G_CALLBACK(on_tabs_box_secondary_pressed), project);
+    gtk_widget_add_controller(project->tabs_box, GTK_EVENT_CONTROLLER(click));
+}
+
+// Resolves a layout path: "~/" is the home directory, other relative paths
+// are taken relative to base.
+static char* resolve_layout_path(const char *base, const char *path) {
+    if (g_str_has_prefix(path, "~/") || strcmp(path, "~") == 0) {
+        return g_build_filename(g_get_home_dir(), path + 1, NULL);
+    }
+    return g_canonicalize_filename(path, base);
+}
+
+// A layout file lists projects and the tabs to open in them:
+//   {"projects": [{"path": "~/src/app", "name": "app", "active": true,
+//                  "tabs": [{"name": "web", "cwd": "web", "command": "npm run dev"}]}]}
+// Project paths resolve against the layout file's directory, tab cwds
+// against the project. Projects already open are reused. Tabs of projects
+// that aren't loaded yet are created, as usual, on first selection.
+static gboolean apply_layout_file(AppState *app, const char *path, GError **error) {
+    JsonParser *parser = json_parser_new();
+    if (!json_parser_load_from_file(parser, path, error)) {
+        g_object_unref(parser);
+        return FALSE;
+    }
+
+    JsonNode *root = json_parser_get_root(parser);
+    JsonObject *root_obj = root && JSON_NODE_HOLDS_OBJECT(root) ? json_node_get_object(root) : NULL;
+    JsonArray *projects = root_obj && json_object_has_member(root_obj, "projects")
+                          ? json_object_get_array_member(root_obj, "projects") : NULL;
+    if (!projects) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "%s has no \"projects\" array", path);
+        g_object_unref(parser);
+        return FALSE;
+    }
+
+    gint64 start = g_get_monotonic_time();
+    char *layout_dir = g_path_get_dirname(path);
+    WorkspaceWindow *win = app->focus;
+    Project *previous = win->active_project;
+    Project *first = NULL;
+    Project *active = NULL;
+    guint n_projects = json_array_get_length(projects);
+
+    workspace_begin_bulk(app);
+    for (guint i = 0; i < n_projects; i++) {
+        JsonObject *proj_obj = json_array_get_object_element(projects, i);
+        const char *proj_path = proj_obj ? json_object_get_string_member_with_default(
+                                    proj_obj, "path", NULL) : NULL;
+        if (!proj_path) continue;
+
+        char *full_path = resolve_layout_path(layout_dir, proj_path);
+        Project *project = find_project_by_path(app, full_path);
+        if (!project) {
+            char *basename = g_path_get_basename(full_path);
+            const char *name = json_object_get_string_member_with_default(proj_obj, "name", basename);
+            project = create_project(win, name, full_path, FALSE);
+            project->last_used = g_get_real_time();
+            g_free(basename);
+        }
+        if (!first) first = project;
+        if (json_object_get_boolean_member_with_default(proj_obj, "active", FALSE)) {
+            active = project;
+        }
+
+        JsonArray *tabs = json_object_has_member(proj_obj, "tabs")
+                          ? json_object_get_array_member(proj_obj, "tabs") : NULL;
+        guint n_tabs = tabs ? json_array_get_length(tabs) : 0;
+        for (guint j = 0; j < n_tabs; j++) {
+            JsonObject *tab_obj = json_array_get_object_element(tabs, j);
+            if (!tab_obj) continue;
+
+            const char *cwd = json_object_get_string_member_with_default(tab_obj, "cwd", NULL);
+            const char *command = json_object_get_string_member_with_default(tab_obj, "command", NULL);
+            char *working_dir = cwd ? resolve_layout_path(project->path, cwd)
+                                    : g_strdup(project->path);
+            char default_name[32];
+            snprintf(default_name, sizeof(default_name), "Tab %d", ++project->subtab_counter);
+            const char *name = json_object_get_string_member_with_default(tab_obj, "name",
+                                                                          default_name);
+
+            if (project->initialized) {
+                SubTab *subtab = create_subtab(project, name, working_dir, NULL);
+                if (command) {
+                    char *line = g_strconcat(command, "\n", NULL);
+                    send_text_to_subtab(subtab, line);
+                    g_free(line);
+                }
+            } else {
+                SavedSubTab *saved = g_new0(SavedSubTab, 1);
+                saved->name = g_strdup(name);
+                saved->working_dir = g_strdup(working_dir);
+                saved->command = g_strdup(command);
+                project->saved_subtabs = g_list_append(project->saved_subtabs, saved);
+            }
+            g_free(working_dir);
+        }
+        g_free(full_path);
+    }
+
+    // create_project makes each new project active; put the selection back
+    win->active_project = previous;
+    if (!active && !previous) active = first;
+    if (active) {
+        select_project(active);
+    }
+    save_session(app);
+    workspace_commit_bulk(app);
+
+    debug_log("layout: applied %u projects from %s in %.2f ms", n_projects, path,
+              (g_get_monotonic_time() - start) / 1000.0);
+    g_free(layout_dir);
+    g_object_unref(parser);
+    return TRUE;
+}
+
+//=============================================================================
+// Startup Recipes
+//=============================================================================
+
+// A project can keep a recipe in .gmux.json at its root, listing the tabs
+// to start when it is opened cold (no saved tabs):
+//   {"tabs": [{"name": "db", "command": "docker compose up db",
+//              "ready": {"port": 5432}},
+//             {"name": "api", "cwd": "api", "command": "npm run dev",
+//              "after": ["db"], "ready": {"output": "listening on", "timeout": 60}}]}
+// Tabs use the same keys as layout files. Every tab and its shell is created
+// at once, in file order. A tab's command is typed once all the tabs it is
+// "after" are ready, so tabs without dependencies start together. A tab
+// is ready when its "output" regex matches what it prints after the
+// command, when "port" on localhost accepts connections (both, if both are
+// given), or as soon as its command is sent if it has neither. Missing the
+// timeout (default RECIPE_TIMEOUT_S) or closing the tab fails it, and
+// everything after it. The time from opening to all tabs ready is logged
+// and reported by `gmux ctl recipe`.
+//
+// A recipe runs commands from a file that came with the repo, which may be
+// one discovery or `gmux ctl open` just picked up, so like `direnv allow`
+// it only runs once its path and exact contents (SHA-256) are in the
+// RECIPE_ALLOW_FILE_NAME list. Otherwise the project opens a plain shell
+// and asks; any edit to the file asks again.
+
+#define RECIPE_FILE_NAME ".gmux.json"
+#define RECIPE_ALLOW_FILE_NAME "recipes-allowed"   // "<sha256> <path>" lines
+#define RECIPE_TIMEOUT_S 120
+#define RECIPE_PORT_POLL_MS 250
+
+typedef enum {
+    RECIPE_STEP_WAITING,        // On the tabs it is after
+    RECIPE_STEP_STARTED,        // Command sent, not ready yet
+    RECIPE_STEP_READY,
+    RECIPE_STEP_FAILED,
+} RecipeStepState;
+
+static const char *const recipe_step_state_names[] = {
+    [RECIPE_STEP_WAITING] = "waiting",
+    [RECIPE_STEP_STARTED] = "started",
+    [RECIPE_STEP_READY]   = "ready",
+    [RECIPE_STEP_FAILED]  = "failed",
+};
+
+struct _RecipeStep {
+    Recipe *recipe;
+    char *name;
+    char *working_dir;
+    char *command;
+    char **after;               // Names of steps that must be ready first
+    GRegex *ready_output;       // NULL = no output condition
+    int ready_port;             // 0 = no port condition
+    int timeout_s;
+
+    RecipeStepState state;
+    char *error;                // Why it failed
+    SubTab *subtab;             // NULL once the tab is closed
+    gboolean output_seen;
+    gboolean port_open;
+    long scan_row;              // Output above this row has been searched
+    guint timeout_id;
+    guint probe_timer_id;
+    GCancellable *probe;        // Connect attempt in flight
+    gint64 ready_time;          // Monotonic
+};
+
+struct _Recipe {
+    Project *project;
+    char *hash;                 // SHA-256 of the file it was parsed from
+    GPtrArray *steps;           // RecipeStep*, in file order
+    gint64 start_time;          // Monotonic
+    gint64 ready_time;          // Monotonic; 0 until every step is ready
+    gboolean finished;          // Ready or failed, and logged
+};
+
+static void recipe_step_free(RecipeStep *step) {
+    if (step->timeout_id) g_source_remove(step->timeout_id);
+    if (step->probe_timer_id) g_source_remove(step->probe_timer_id);
+    if (step->probe) {
+        // The callback sees the cancellation and leaves the step alone
+        g_cancellable_cancel(step->probe);
+        g_object_unref(step->probe);
+    }
+    if (step->subtab) step->subtab->recipe_step = NULL;
+    if (step->ready_output) g_regex_unref(step->ready_output);
+    g_strfreev(step->after);
+    g_free(step->name);
+    g_free(step->working_dir);
+    g_free(step->command);
+    g_free(step->error);
+    g_free(step);
+}
+
+static void free_project_recipe(Project *project) {
+    Recipe *recipe = project->recipe;
+    if (!recipe) return;
+    project->recipe = NULL;
+    g_ptr_array_unref(recipe->steps);
+    g_free(recipe->hash);
+    g_free(recipe);
+}
+
+// Allow lists in the data dir hold "<sha256> <path>" lines: repository
+// files that run code (recipes, project environments) only take effect
+// once the user has allowed their exact contents.
+static char* allow_list_path(const char *name) {
+    char *dir = get_data_dir();
+    char *path = g_build_filename(dir, name, NULL);
+    g_free(dir);
+    return path;
+}
+
+static gboolean allow_list_has(const char *name, const char *path, const char *hash) {
+    char *allow_path = allow_list_path(name);
+    char *contents = NULL;
+    gboolean allowed = FALSE;
+
+    if (g_file_get_contents(allow_path, &contents, NULL, NULL)) {
+        char *line = g_strdup_printf("%s %s", hash, path);
+        char **lines = g_strsplit(contents, "\n", -1);
+        for (char **l = lines; *l && !allowed; l++) allowed = strcmp(*l, line) == 0;
+        g_strfreev(lines);
+        g_free(line);
+    }
+    g_free(contents);
+    g_free(allow_path);
+    return allowed;
+}
+
+// Records hash as the allowed contents at path, replacing whatever was
+// allowed there before
+static void allow_list_add(const char *name, const char *path, const char *hash) {
+    char *allow_path = allow_list_path(name);
+    char *contents = NULL;
+    GString *out = g_string_new(NULL);
+
+    if (g_file_get_contents(allow_path, &contents, NULL, NULL)) {
+        char **lines = g_strsplit(contents, "\n", -1);
+        for (char **l = lines; *l; l++) {
+            const char *space = strchr(*l, ' ');
+            if (!space || strcmp(space + 1, path) == 0) continue;
+            g_string_append_printf(out, "%s\n", *l);
+        }
+        g_strfreev(lines);
+    }
+    g_string_append_printf(out, "%s %s\n", hash, path);
+
+    GError *error = NULL;
+    if (!g_file_set_contents(allow_path, out->str, -1, &error)) {
+        g_warning("Failed to write %s: %s", allow_path, error->message);
+        g_error_free(error);
+    }
+    g_string_free(out, TRUE);
+    g_free(contents);
+    g_free(allow_path);
+}
+
+static gboolean project_has_recipe(Project *project) {
+    char *path = g_build_filename(project->path, RECIPE_FILE_NAME, NULL);
+    gboolean exists = g_file_test(path, G_FILE_TEST_IS_REGULAR);
+    g_free(path);
+    return exists;
+}
+
+static RecipeStep* find_recipe_step(Recipe *recipe, const char *name) {
+    for (guint i = 0; i < recipe->steps->len; i++) {
+        RecipeStep *step = g_ptr_array_index(recipe->steps, i);
+        if (strcmp(step->name, name) == 0) return step;
+    }
+    return NULL;
+}
+
+static char* parse_recipe_step(Recipe *recipe, JsonObject *tab_obj, guint index) {
+    Project *project = recipe->project;
+    RecipeStep *step = g_new0(RecipeStep, 1);
+    step->recipe = recipe;
+    step->timeout_s = RECIPE_TIMEOUT_S;
+    g_ptr_array_add(recipe->steps, step);
+
+    char default_name[32];
+    snprintf(default_name, sizeof(default_name), "Tab %u", index + 1);
+    step->name = g_strdup(json_object_get_string_member_with_default(tab_obj, "name", default_name));
+    const char *cwd = json_object_get_string_member_with_default(tab_obj, "cwd", NULL);
+    step->working_dir = cwd ? resolve_layout_path(project->path, cwd) : g_strdup(project->path);
+    step->command = g_strdup(json_object_get_string_member_with_default(tab_obj, "command", NULL));
+
+    if (!g_file_test(step->working_dir, G_FILE_TEST_IS_DIR))
+        return g_strdup_printf("tab '%s': '%s' is not a directory", step->name, step->working_dir);
+
+    JsonArray *after = json_object_has_member(tab_obj, "after")
+                       ? json_object_get_array_member(tab_obj, "after") : NULL;
+    guint n_after = after ? json_array_get_length(after) : 0;
+    step->after = g_new0(char *, n_after + 1);
+    for (guint i = 0; i < n_after; i++) {
+        const char *dep = json_array_get_string_element(after, i);
+        if (!dep) return g_strdup_printf("tab '%s': \"after\" must list tab names", step->name);
+        step->after[i] = g_strdup(dep);
+    }
+
+    JsonObject *ready = json_object_has_member(tab_obj, "ready")
+                        ? json_object_get_object_member(tab_obj, "ready") : NULL;
+    if (ready) {
+        const char *output = json_object_get_string_member_with_default(ready, "output", NULL);
+        if (output) {
+            GError *error = NULL;
+            step->ready_output = g_regex_new(output, G_REGEX_OPTIMIZE | G_REGEX_MULTILINE,
+                                             0, &error);
+            if (!step->ready_output) {
+                char *message = g_strdup_printf("tab '%s': bad \"output\" regex: %s",
+                                                step->name, error->message);
+                g_error_free(error);
+                return message;
+            }
+        }
+        gint64 port = json_object_get_int_member_with_default(ready, "port", 0);
+        if (port < 0 || port > 65535)
+            return g_strdup_printf("tab '%s': port %" G_GINT64_FORMAT " is out of range",
+                                   step->name, port);
+        step->ready_port = (int)port;
+        gint64 timeout = json_object_get_int_member_with_default(ready, "timeout",
+                                                                 RECIPE_TIMEOUT_S);
+        step->timeout_s = (int)CLAMP(timeout, 1, 24 * 3600);
+    }
+    return NULL;
+}
+
+// NULL with error set if the file is missing or invalid. The hash is taken
+// from the same bytes that are parsed, so an allowed hash covers exactly
+// what runs.
+static Recipe* load_project_recipe(Project *project, char **error) {
+    char *path = g_build_filename(project->path, RECIPE_FILE_NAME, NULL);
+    JsonParser *parser = json_parser_new();
+    GError *load_error = NULL;
+    Recipe *recipe = NULL;
+    char *contents = NULL;
+    gsize length = 0;
+
+    if (!g_file_get_contents(path, &contents, &length, &load_error) ||
+        !json_parser_load_from_data(parser, contents, (gssize)length, &load_error)) {
+        *error = g_strdup_printf("cannot load %s: %s", path, load_error->message);
+        g_error_free(load_error);
+        goto out;
+    }
+
+    JsonNode *root = json_parser_get_root(parser);
+    JsonObject *root_obj = root && JSON_NODE_HOLDS_OBJECT(root) ? json_node_get_object(root) : NULL;
+    JsonArray *tabs = root_obj && json_object_has_member(root_obj, "tabs")
+                      ? json_object_get_array_member(root_obj, "tabs") : NULL;
+    if (!tabs || json_array_get_length(tabs) == 0) {
+        *error = g_strdup_printf("%s has no \"tabs\"", path);
+        goto out;
+    }
+
+    recipe = g_new0(Recipe, 1);
+    recipe->project = project;
+    recipe->hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256, (const guchar *)contents, length);
+    recipe->steps = g_ptr_array_new_with_free_func((GDestroyNotify)recipe_step_free);
+    for (guint i = 0; i < json_array_get_length(tabs) && !*error; i++) {
+        JsonObject *tab_obj = json_array_get_object_element(tabs, i);
+        if (!tab_obj) {
+            *error = g_strdup_printf("tab %u is not an object", i);
+        } else {
+            *error = parse_recipe_step(recipe, tab_obj, i);
+        }
+    }
+
+    // Every dependency must exist, and each pass must free at least one
+    // step, or there is a cycle
+    guint settled = 0;
+    gboolean *done = g_new0(gboolean, recipe->steps->len);
+    for (guint i = 0; i < recipe->steps->len && !*error; i++) {
+        RecipeStep *step = g_ptr_array_index(recipe->steps, i);
+        if (find_recipe_step(recipe, step->name) != step) {
+            *error = g_strdup_printf("two tabs are named '%s'", step->name);
+        }
+        for (char **dep = step->after; *dep && !*error; dep++) {
+            if (!find_recipe_step(recipe, *dep))
+                *error = g_strdup_printf("tab '%s' is after unknown tab '%s'", step->name, *dep);
+        }
+    }
+    for (gboolean progress = TRUE; progress && !*error; ) {
+        progress = FALSE;
+        for (guint i = 0; i < recipe->steps->len; i++) {
+            RecipeStep *step = g_ptr_array_index(recipe->steps, i);
+            gboolean ready = !done[i];
+            for (char **dep = step->after; *dep && ready; dep++) {
+                guint d = 0;
+                g_ptr_array_find(recipe->steps, find_recipe_step(recipe, *dep), &d);
+                ready = done[d];
+            }
+            if (ready) {
+                done[i] = TRUE;
+                settled++;
+                progress = TRUE;
+            }
+        }
+    }
+    if (!*error && settled < recipe->steps->len) {
+        *error = g_strdup("tabs depend on each other in a cycle");
+    }
+    g_free(done);
+
+out:
+    if (*error && recipe) {
+        g_ptr_array_unref(recipe->steps);
+        g_free(recipe->hash);
+        g_clear_pointer(&recipe, g_free);
+    }
+    g_object_unref(parser);
+    g_free(contents);
+    g_free(path);
+    return recipe;
+}
+
+static void recipe_advance(Recipe *recipe);
+
+static void recipe_step_ready(RecipeStep *step) {
+    if (step->state != RECIPE_STEP_STARTED) return;
+    step->state = RECIPE_STEP_READY;
+    step->ready_time = g_get_monotonic_time();
+    g_clear_handle_id(&step->timeout_id, g_source_remove);
+    g_clear_handle_id(&step->probe_timer_id, g_source_remove);
+    debug_log("recipe: %s ready after %.0f ms", step->name,
+              (step->ready_time - step->recipe->start_time) / 1000.0);
+    recipe_advance(step->recipe);
+}
+
+static void recipe_step_fail(RecipeStep *step, char *error) {
+    if (step->state == RECIPE_STEP_READY || step->state == RECIPE_STEP_FAILED) {
+        g_free(error);
+        return;
+    }
+    step->state = RECIPE_STEP_FAILED;
+    step->error = error;
+    g_clear_handle_id(&step->timeout_id, g_source_remove);
+    g_clear_handle_id(&step->probe_timer_id, g_source_remove);
+    if (step->subtab) gtk_widget_set_tooltip_text(step->subtab->tab_label, error);
+    debug_log("recipe: %s failed: %s", step->name, error);
+    recipe_advance(step->recipe);
+}
+
+static void recipe_check_ready(RecipeStep *step) {
+    if ((!step->ready_output || step->output_seen) && (!step->ready_port || step->port_open))
+        recipe_step_ready(step);
+}
+
+static void recipe_scan_output(SubTab *subtab) {
+    RecipeStep *step = subtab->recipe_step;
+    if (step->state != RECIPE_STEP_STARTED || !step->ready_output || step->output_seen) return;
+
+    long col = 0, row = 0;
+    vte_terminal_get_cursor_position(subtab->terminal, &col, &row);
+    // Cleared screen or scrollback
+    if (row < step->scan_row) step->scan_row = row;
+
+    char *text = vte_terminal_get_text_range_format(subtab->terminal, VTE_FORMAT_TEXT,
+                                                    step->scan_row, 0, row + 1, 0, NULL);
+    step->output_seen = text && g_regex_match(step->ready_output, text, 0, NULL);
+    g_free(text);
+    // The cursor row may still grow, so it is searched again next time
+    step->scan_row = row;
+    if (step->output_seen) recipe_check_ready(step);
+}
+
+static gboolean on_recipe_probe_timer(gpointer user_data);
+
+static void on_recipe_probe_done(GObject *source, GAsyncResult *result, gpointer user_data) {
+    GError *error = NULL;
+    GSocketConnection *connection =
+        g_socket_client_connect_to_host_finish(G_SOCKET_CLIENT(source), result, &error);
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        // The step is gone
+        g_error_free(error);
+        return;
+    }
+
+    RecipeStep *step = (RecipeStep *)user_data;
+    g_clear_object(&step->probe);
+    if (connection) {
+        g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+        g_object_unref(connection);
+        step->port_open = TRUE;
+        recipe_check_ready(step);
+        return;
+    }
+
+    g_error_free(error);
+    if (step->state == RECIPE_STEP_STARTED) {
+        step->probe_timer_id = g_timeout_add(RECIPE_PORT_POLL_MS, on_recipe_probe_timer, step);
+    }
+}
+
+static gboolean on_recipe_probe_timer(gpointer user_data) {
+    RecipeStep *step = (RecipeStep *)user_data;
+    step->probe_timer_id = 0;
+
+    GSocketClient *client = g_socket_client_new();
+    g_socket_client_set_timeout(client, 1);
+    step->probe = g_cancellable_new();
+    g_socket_client_connect_to_host_async(client, "localhost", (guint16)step->ready_port,
+                                          step->probe, on_recipe_probe_done, step);
+    g_object_unref(client);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean on_recipe_step_timeout(gpointer user_data) {
+    RecipeStep *step = (RecipeStep *)user_data;
+    step->timeout_id = 0;
+    recipe_step_fail(step, g_strdup_printf("not ready after %d s", step->timeout_s));
+    return G_SOURCE_REMOVE;
+}
+
+static void recipe_start_step(RecipeStep *step) {
+    SubTab *subtab = step->subtab;
+    step->state = RECIPE_STEP_STARTED;
+    gtk_widget_set_tooltip_text(subtab->tab_label, subtab->name);
+
+    // Only output after the command line counts
+    long col = 0, row = 0;
+    vte_terminal_get_cursor_position(subtab->terminal, &col, &row);
+    step->scan_row = row + 1;
+
+    if (step->command) {
+        char *line = g_strconcat(step->command, "\n", NULL);
+        send_text_to_subtab(subtab, line);
+        g_free(line);
+    }
+    if (step->ready_port) on_recipe_probe_timer(step);
+    if (step->ready_output || step->ready_port) {
+        step->timeout_id = g_timeout_add_seconds((guint)step->timeout_s, on_recipe_step_timeout, step);
+    }
+    recipe_check_ready(step);
+}
+
+// Starts steps whose dependencies are ready, fails those behind a failed
+// one, and logs the outcome once nothing is left to wait for
+static void recipe_advance(Recipe *recipe) {
+    for (gboolean changed = TRUE; changed; ) {
+        changed = FALSE;
+        for (guint i = 0; i < recipe->steps->len; i++) {
+            RecipeStep *step = g_ptr_array_index(recipe->steps, i);
+            if (step->state != RECIPE_STEP_WAITING) continue;
+
+            RecipeStep *failed = NULL;
+            gboolean ready = TRUE;
+            for (char **dep = step->after; *dep; dep++) {
+                RecipeStep *other = find_recipe_step(recipe, *dep);
+                if (other->state == RECIPE_STEP_FAILED) failed = other;
+                if (other->state != RECIPE_STEP_READY) ready = FALSE;
+            }
+            // Either may settle the step at once and re-enter; the state
+            // checks keep the nested pass and this one from clashing
+            if (failed) {
+                recipe_step_fail(step, g_strdup_printf("'%s' failed", failed->name));
+                changed = TRUE;
+            } else if (ready) {
+                recipe_start_step(step);
+                changed = TRUE;
+            }
+        }
+    }
+
+    if (recipe->finished) return;
+    guint n_ready = 0, n_failed = 0;
+    for (guint i = 0; i < recipe->steps->len; i++) {
+        RecipeStep *step = g_ptr_array_index(recipe->steps, i);
+        if (step->state == RECIPE_STEP_READY) n_ready++;
+        if (step->state == RECIPE_STEP_FAILED) n_failed++;
+    }
+    if (n_ready + n_failed < recipe->steps->len) return;
+
+    recipe->finished = TRUE;
+    if (n_failed == 0) recipe->ready_time = g_get_monotonic_time();
+    debug_log("recipe: %s %s in %.0f ms (%u tabs, %u failed)", recipe->project->name,
+              n_failed ? "failed" : "ready",
+              (g_get_monotonic_time() - recipe->start_time) / 1000.0,
+              recipe->steps->len, n_failed);
+}
+
+static void recipe_subtab_closed(SubTab *subtab) {
+    RecipeStep *step = subtab->recipe_step;
+    if (!step) return;
+    subtab->recipe_step = NULL;
+    step->subtab = NULL;
+    recipe_step_fail(step, g_strdup("tab was closed"));
+}
+
+// Creates the recipe's tabs in project and starts what can start now.
+// Replaces the record of any previous run.
+static void start_project_recipe(Project *project, Recipe *recipe) {
+    AppState *app = project->app;
+    free_project_recipe(project);
+    project->recipe = recipe;
+    recipe->start_time = g_get_monotonic_time();
+
+    workspace_begin_bulk(app);
+    for (guint i = 0; i < recipe->steps->len; i++) {
+        RecipeStep *step = g_ptr_array_index(recipe->steps, i);
+        step->subtab = create_subtab(project, step->name, step->working_dir, NULL);
+        step->subtab->recipe_step = step;
+        project->subtab_counter++;
+
+        if (step->after[0]) {
+            char *deps = g_strjoinv(", ", step->after);
+            char *tooltip = g_strdup_printf("Waiting for %s", deps);
+            gtk_widget_set_tooltip_text(step->subtab->tab_label, tooltip);
+            g_free(tooltip);
+            g_free(deps);
+        }
+    }
+    app->bulk_save_pending = TRUE;
+    workspace_commit_bulk(app);
+
+    debug_log("recipe: %s started %u tabs", project->name, recipe->steps->len);
+    recipe_advance(recipe);
+}
+
+static void discard_recipe(Recipe *recipe) {
+    g_ptr_array_unref(recipe->steps);
+    g_free(recipe->hash);
+    g_free(recipe);
+}
+
+// Runs the project's recipe again, if its current contents are allowed or
+// allow is set, in which case they become the allowed ones
+static char* run_project_recipe(Project *project, gboolean allow) {
+    char *error = NULL;
+    Recipe *recipe = load_project_recipe(project, &error);
+    if (!recipe) return error;
+
+    char *path = g_build_filename(project->path, RECIPE_FILE_NAME, NULL);
+    if (allow) {
+        allow_list_add(RECIPE_ALLOW_FILE_NAME, path, recipe->hash);
+    } else if (!allow_list_has(RECIPE_ALLOW_FILE_NAME, path, recipe->hash)) {
+        error = g_strdup_printf("%s is new or has changed since it was allowed; "
+                                "review it and use --allow", path);
+    }
+    g_free(path);
+    if (error) {
+        discard_recipe(recipe);
+        return error;
+    }
+    start_project_recipe(project, recipe);
+    return NULL;
+}
+
+typedef struct {
+    AppState *app;
+    char *project_path;
+    char *hash;
+} RecipeAsk;
+
+static void on_recipe_ask_done(GObject *source, GAsyncResult *result, gpointer user_data) {
+    RecipeAsk *ask = (RecipeAsk *)user_data;
+    int button = gtk_alert_dialog_choose_finish(GTK_ALERT_DIALOG(source), result, NULL);
+
+    // The project may have been closed while the dialog was up
+    Project *project = button == 1 ? find_project_by_path(ask->app, ask->project_path) : NULL;
+    if (project) {
+        char *error = NULL;
+        Recipe *recipe = load_project_recipe(project, &error);
+        if (recipe && strcmp(recipe->hash, ask->hash) != 0) {
+            // Edited since the dialog showed it; what was allowed is gone
+            discard_recipe(recipe);
+            recipe = NULL;
+            error = g_strdup("the file changed while asking");
+        }
+        if (recipe) {
+            char *path = g_build_filename(project->path, RECIPE_FILE_NAME, NULL);
+            allow_list_add(RECIPE_ALLOW_FILE_NAME, path, recipe->hash);
+            g_free(path);
+            start_project_recipe(project, recipe);
+        } else {
+            g_warning("Not running the recipe for %s: %s", ask->project_path, error);
+            g_free(error);
+        }
+    }
+    g_free(ask->project_path);
+    g_free(ask->hash);
+    g_free(ask);
+}
+
+// Shows what a recipe would run and asks whether to allow it
+static void ask_recipe_permission(Project *project, Recipe *recipe) {
+    GString *detail = g_string_new(NULL);
+    for (guint i = 0; i < recipe->steps->len; i++) {
+        RecipeStep *step = g_ptr_array_index(recipe->steps, i);
+        g_string_append_printf(detail, "%s%s: %s", i ? "\n" : "", step->name,
+                               step->command ? step->command : "(shell)");
+    }
+    char *message = g_strdup_printf("Run the startup recipe in “%s”?", project->name);
+    GtkAlertDialog *dialog = gtk_alert_dialog_new("%s", message);
+    gtk_alert_dialog_set_detail(dialog, detail->str);
+    g_free(message);
+    g_string_free(detail, TRUE);
+
+    static const char *buttons[] = { "Not Now", "Allow and Run", NULL };
+    gtk_alert_dialog_set_buttons(dialog, buttons);
+    gtk_alert_dialog_set_cancel_button(dialog, 0);
+    gtk_alert_dialog_set_default_button(dialog, 0);
+
+    RecipeAsk *ask = g_new0(RecipeAsk, 1);
+    ask->app = project->app;
+    ask->project_path = g_strdup(project->path);
+    ask->hash = g_strdup(recipe->hash);
+    gtk_alert_dialog_choose(dialog, GTK_WINDOW(project->win->window), NULL,
+                            on_recipe_ask_done, ask);
+    g_object_unref(dialog);
+}
+
+// Runs the recipe in place of a cold project's default tab; FALSE if there
+// is none, it is broken, or it still has to be allowed (the question is
+// asked and the recipe's tabs join the default one if it is)
+static gboolean start_recipe_on_open(Project *project) {
+    if (!project_has_recipe(project)) return FALSE;
+
+    char *error = NULL;
+    Recipe *recipe = load_project_recipe(project, &error);
+    if (!recipe) {
+        g_warning("Not running the recipe for %s: %s", project->path, error);
+        g_free(error);
+        return FALSE;
+    }
+
+    char *path = g_build_filename(project->path, RECIPE_FILE_NAME, NULL);
+    gboolean allowed = allow_list_has(RECIPE_ALLOW_FILE_NAME, path, recipe->hash);
+    g_free(path);
+    if (allowed) {
+        start_project_recipe(project, recipe);
+    } else {
+        ask_recipe_permission(project, recipe);
+        discard_recipe(recipe);
+    }
+    return allowed;
+}
+
+static JsonObject* recipe_to_json(Recipe *recipe) {
+    JsonObject *obj = json_object_new();
+    gint64 now = g_get_monotonic_time();
+    gboolean failed = FALSE;
+    JsonArray *tabs = json_array_new();
+
+    for (guint i = 0; i < recipe->steps->len; i++) {
+        RecipeStep *step = g_ptr_array_index(recipe->steps, i);
+        JsonObject *tab = json_object_new();
+        json_object_set_string_member(tab, "name", step->name);
+        json_object_set_string_member(tab, "state", recipe_step_state_names[step->state]);
+        if (step->state == RECIPE_STEP_READY) {
+            json_object_set_int_member(tab, "ready_ms",
+                                       (step->ready_time - recipe->start_time) / 1000);
+        }
+        if (step->error) json_object_set_string_member(tab, "error", step->error);
+        failed |= step->state == RECIPE_STEP_FAILED;
+        json_array_add_object_element(tabs, tab);
+    }
+
+    json_object_set_string_member(obj, "state", failed ? "failed"
+                                  : recipe->ready_time ? "ready" : "running");
+    json_object_set_int_member(obj, "elapsed_ms",
+                               ((recipe->ready_time ? recipe->ready_time : now) -
+                                recipe->start_time) / 1000);
+    json_object_set_array_member(obj, "tabs", tabs);
+    return obj;
+}
+
+//=============================================================================
+// Output Triggers
+//=============================================================================
+
+// A trigger watches every terminal for a piece of text and highlights the
+// tab, sends a notification, focuses the tab or runs trigger_command when
+// a line containing it is printed. settings.conf lines look like
+//   trigger=highlight,notify FAILED
+//   trigger=notify /error\[E[0-9]+\]/    (a regex between slashes)
+//   trigger=none panic:                  (removes a default)
+//
+// All triggers are compiled into one Aho-Corasick automaton, flattened to
+// a full 256-way transition table so each byte costs one lookup, with the
+// states that end a pattern numbered last so a match is one comparison.
+// While the automaton is at its root, bytes that cannot start a pattern are
+// skipped eight at a time without following transitions. A regex trigger is
+// keyed on the longest literal every match must contain and the regex only
+// runs on lines where that literal turned up; a regex without one runs on
+// every new line, which is slow and logged as such.
+//
+// Output marks its tab dirty; every TRIGGER_SCAN_MS the dirty tabs' lines
+// completed since their last scan are searched and the hits from all tabs
+// are acted on together. A line soft-wrapped onto the cursor's row isn't
+// complete yet and waits for the next scan, unless it has grown past
+// TRIGGER_MAX_WRAP_ROWS. trigger_command runs at most once per tab per
+// scan, for its first hit, and not again for that tab within
+// TRIGGER_RUN_INTERVAL_US. `gmux ctl trigger-bench` measures the scan rate,
+// and the copy out of VTE plus scan for a tab's recent rows.
+
+#define TRIGGER_SCAN_MS 100
+#define TRIGGER_MAX_WRAP_ROWS 256
+#define TRIGGER_RUN_INTERVAL_US (5 * G_USEC_PER_SEC)
+#define TRIGGER_NO_STATE G_MAXUINT32
+
+typedef enum {
+    TRIGGER_HIGHLIGHT = 1 << 0,  // Mark the tab until it is shown
+    TRIGGER_NOTIFY    = 1 << 1,  // Desktop notification
+    TRIGGER_FOCUS     = 1 << 2,  // Switch to the tab
+    TRIGGER_RUN       = 1 << 3,  // Run trigger_command
+} TriggerAction;
+
+static const struct {
+    const char *name;
+    TriggerAction action;
+} trigger_action_names[] = {
+    { "highlight", TRIGGER_HIGHLIGHT },
+    { "notify",    TRIGGER_NOTIFY },
+    { "focus",     TRIGGER_FOCUS },
+    { "run",       TRIGGER_RUN },
+};
+
+static const char *const default_triggers[] = {
+    "highlight FAILED",
+    "highlight panic:",
+    "highlight Segmentation fault",
+    NULL
+};
+
+typedef struct {
+    char *pattern;              // As written, slashes included
+    GRegex *regex;              // NULL when the pattern is plain text
+    guint actions;
+} Trigger;
+
+struct _TriggerSet {
+    GPtrArray *triggers;        // Trigger*
+    guint32 *delta;             // n_states x 256 transitions
+    guint32 n_states;
+    guint32 accept_min;         // States from here on end some literal
+    guint32 *out_start;         // Per accepting state, into out_list; one extra
+    guint32 *out_list;          // Trigger indices
+    guint8 start[256];          // Bytes that leave the root
+    GArray *unfiltered;         // guint trigger indices with no literal
+};
+
+typedef struct {
+    SubTab *subtab;
+    guint trigger;
+    char *line;
+} TriggerHit;
+
+// Calls back once per (trigger, line); line is not NUL-terminated
+typedef void (*TriggerHitFunc)(guint trigger, const char *line, gsize len, gpointer user_data);
+
+static void trigger_free(Trigger *trigger) {
+    if (trigger->regex) g_regex_unref(trigger->regex);
+    g_free(trigger->pattern);
+    g_free(trigger);
+}
+
+static void trigger_set_free(TriggerSet *set) {
+    if (!set) return;
+    g_ptr_array_unref(set->triggers);
+    g_free(set->delta);
+    g_free(set->out_start);
+    g_free(set->out_list);
+    g_array_unref(set->unfiltered);
+    g_free(set);
+}
+
+// The longest run of text every match of re must contain, or NULL if that
+// can't be told cheaply. Groups and classes are skipped, a quantifier
+// that allows zero repeats drops the character before it, and alternation,
+// inline flags and escapes with arguments give up.
+static char* trigger_regex_literal(const char *re) {
+    GString *run = g_string_new("");
+    GString *best = g_string_new("");
+    int depth = 0;
+    gboolean give_up = FALSE;
+
+#define END_RUN() do { \
+        if (run->len > best->len) g_string_assign(best, run->str); \
+        g_string_truncate(run, 0); \
+    } while (0)
+
+    for (const char *p = re; *p && !give_up; p++) {
+        char c = *p;
+        if (c == '|') {
+            give_up = TRUE;
+        } else if (c == '(') {
+            if (p[1] == '?') give_up = TRUE;
+            END_RUN();
+            depth++;
+        } else if (c == ')') {
+            depth = MAX(depth - 1, 0);
+        } else if (c == '[') {
+            END_RUN();
+            if (p[1] == '^') p++;
+            if (p[1] == ']') p++;
+            while (p[1] && p[1] != ']') {
+                if (p[1] == '\\' && p[2]) p++;
+                p++;
+            }
+            if (p[1]) p++;
+        } else if (c == '*' || c == '?' || c == '{') {
+            if (run->len > 0) {
+                const char *last = g_utf8_find_prev_char(run->str, run->str + run->len);
+                g_string_truncate(run, last ? (gsize)(last - run->str) : 0);
+            }
+            END_RUN();
+            if (c == '{') {
+                while (p[1] && p[1] != '}') p++;
+                if (p[1]) p++;
+            }
+        } else if (c == '+' || c == '.' || c == '^' || c == '$') {
+            END_RUN();
+        } else if (c == '\\') {
+            char n = p[1];
+            if (!n) break;
+            p++;
+            if (g_ascii_ispunct(n) || n == ' ') {
+                if (depth == 0) g_string_append_c(run, n);
+            } else if (strchr("bBdDsSwWAzZG", n)) {
+                END_RUN();
+            } else if (strchr("ntrfe", n)) {
+                if (depth == 0) g_string_append_c(run, n == 'n' ? '\n' : n == 't' ? '\t' :
+                                                       n == 'r' ? '\r' : n == 'f' ? '\f' : '\033');
+            } else {
+                give_up = TRUE;
+            }
+        } else if (depth == 0) {
+            g_string_append_c(run, c);
+        }
+    }
+    END_RUN();
+#undef END_RUN
+
+    g_string_free(run, TRUE);
+    if (give_up || best->len == 0) {
+        g_string_free(best, TRUE);
+        return NULL;
+    }
+    return g_string_free(best, FALSE);
+}
+
+// "ACTIONS PATTERN"; FALSE if malformed. actions is 0 for "none".
+static gboolean parse_trigger_line(const char *line, guint *actions, char **pattern) {
+    const char *space = strchr(line, ' ');
+    if (!space || !space[1]) return FALSE;
+
+    *actions = 0;
+    char *names = g_strndup(line, (gsize)(space - line));
+    char **list = g_strsplit(names, ",", -1);
+    gboolean ok = TRUE;
+    for (char **name = list; *name && ok; name++) {
+        if (strcmp(*name, "none") == 0) continue;
+        ok = FALSE;
+        for (gsize i = 0; i < G_N_ELEMENTS(trigger_action_names); i++) {
+            if (strcmp(*name, trigger_action_names[i].name) == 0) {
+                *actions |= trigger_action_names[i].action;
+                ok = TRUE;
+            }
+        }
+    }
+    g_strfreev(list);
+    g_free(names);
+    if (ok) *pattern = g_strdup(space + 1);
+    return ok;
+}
+
+// Builds the automaton over literals[i] for trigger i (NULL = unfiltered)
+static void trigger_set_build(TriggerSet *set, char **literals) {
+    guint n = set->triggers->len;
+    GArray *trie = g_array_new(FALSE, FALSE, sizeof(guint32));
+    GArray *ends = g_array_new(FALSE, FALSE, sizeof(gint));   // Per state, first trigger
+    gint *ends_next = g_new(gint, n);                        // Per trigger, next at its state
+    guint32 none[256];
+    gint no_end = -1;
+    for (int c = 0; c < 256; c++) none[c] = TRIGGER_NO_STATE;
+
+    g_array_append_vals(trie, none, 256);
+    g_array_append_val(ends, no_end);
+    for (guint i = 0; i < n; i++) {
+        ends_next[i] = -1;
+        if (!literals[i]) continue;
+        guint32 s = 0;
+        for (const guchar *p = (const guchar *)literals[i]; *p; p++) {
+            guint32 *next = &g_array_index(trie, guint32, s * 256 + *p);
+            if (*next == TRIGGER_NO_STATE) {
+                *next = ends->len;
+                g_array_append_vals(trie, none, 256);
+                g_array_append_val(ends, no_end);
+            }
+            s = g_array_index(trie, guint32, s * 256 + *p);
+        }
+        ends_next[i] = g_array_index(ends, gint, s);
+        g_array_index(ends, gint, s) = (gint)i;
+    }
+
+    // Breadth-first: fill missing transitions from the failure state, and
+    // find which states end a literal directly or through their failure
+    guint32 n_states = ends->len;
+    guint32 *delta = (guint32 *)(void *)trie->data;
+    guint32 *fail = g_new0(guint32, n_states);
+    guint32 *queue = g_new(guint32, n_states);
+    gboolean *accepts = g_new0(gboolean, n_states);
+    guint head = 0, tail = 0;
+    for (int c = 0; c < 256; c++) {
+        guint32 u = delta[c];
+        if (u == TRIGGER_NO_STATE) {
+            delta[c] = 0;
+        } else {
+            set->start[c] = 1;
+            queue[tail++] = u;
+        }
+    }
+    while (head < tail) {
+        guint32 r = queue[head++];
+        accepts[r] = g_array_index(ends, gint, r) >= 0 || accepts[fail[r]];
+        for (int c = 0; c < 256; c++) {
+            guint32 u = delta[r * 256 + c];
+            if (u == TRIGGER_NO_STATE) {
+                delta[r * 256 + c] = delta[fail[r] * 256 + c];
+            } else {
+                fail[u] = delta[fail[r] * 256 + c];
+                queue[tail++] = u;
+            }
+        }
+    }
+
+    // Renumber so accepting states come last; the root is never one
+    guint32 *renum = g_new(guint32, n_states);
+    guint32 next_id = 0;
+    for (guint32 s = 0; s < n_states; s++) if (!accepts[s]) renum[s] = next_id++;
+    set->accept_min = next_id;
+    for (guint32 s = 0; s < n_states; s++) if (accepts[s]) renum[s] = next_id++;
+
+    set->n_states = n_states;
+    set->delta = g_new(guint32, (gsize)n_states * 256);
+    for (guint32 s = 0; s < n_states; s++) {
+        for (int c = 0; c < 256; c++) {
+            set->delta[(gsize)renum[s] * 256 + c] = renum[delta[s * 256 + c]];
+        }
+    }
+
+    // Each accepting state lists the literals ending there, own and inherited
+    guint32 n_accept = n_states - set->accept_min;
+    GArray *outs = g_array_new(FALSE, FALSE, sizeof(guint32));
+    guint32 **by_state = g_new0(guint32 *, n_accept);
+    guint32 *by_state_len = g_new0(guint32, n_accept);
+    for (guint32 s = 0; s < n_states; s++) {
+        if (!accepts[s]) continue;
+        GArray *own = g_array_new(FALSE, FALSE, sizeof(guint32));
+        for (guint32 f = s; f != 0; f = fail[f]) {
+            for (gint t = g_array_index(ends, gint, f); t >= 0; t = ends_next[t]) {
+                guint32 index = (guint32)t;
+                g_array_append_val(own, index);
+            }
+        }
+        by_state_len[renum[s] - set->accept_min] = own->len;
+        by_state[renum[s] - set->accept_min] = (guint32 *)(void *)g_array_free(own, FALSE);
+    }
+    set->out_start = g_new(guint32, n_accept + 1);
+    for (guint32 a = 0; a < n_accept; a++) {
+        set->out_start[a] = outs->len;
+        g_array_append_vals(outs, by_state[a], by_state_len[a]);
+        g_free(by_state[a]);
+    }
+    set->out_start[n_accept] = outs->len;
+    set->out_list = (guint32 *)(void *)g_array_free(outs, FALSE);
+
+    g_free(by_state);
+    g_free(by_state_len);
+    g_free(renum);
+    g_free(accepts);
+    g_free(queue);
+    g_free(fail);
+    g_free(ends_next);
+    g_array_unref(ends);
+    g_array_unref(trie);
+}
+
+// Defaults first, then the user's lines; a later line for the same
+// pattern replaces an earlier one. NULL if nothing is left.
+static TriggerSet* trigger_set_compile(const char *user_triggers) {
+    GPtrArray *triggers = g_ptr_array_new_with_free_func((GDestroyNotify)trigger_free);
+    GHashTable *by_pattern = g_hash_table_new(g_str_hash, g_str_equal);
+    char **user = user_triggers ? g_strsplit(user_triggers, "\n", -1) : NULL;
+
+    for (int pass = 0; pass < 2; pass++) {
+        const char *const *lines = pass == 0 ? default_triggers : (const char *const *)user;
+        for (; lines && *lines; lines++) {
+            guint actions = 0;
+            char *pattern = NULL;
+            if (!parse_trigger_line(*lines, &actions, &pattern)) {
+                g_warning("Ignoring trigger '%s': expected ACTIONS PATTERN", *lines);
+                continue;
+            }
+
+            GRegex *regex = NULL;
+            gsize len = strlen(pattern);
+            if (len > 2 && pattern[0] == '/' && pattern[len - 1] == '/') {
+                char *source = g_strndup(pattern + 1, len - 2);
+                GError *error = NULL;
+                regex = g_regex_new(source, G_REGEX_OPTIMIZE, 0, &error);
+                g_free(source);
+                if (!regex) {
+                    g_warning("Ignoring trigger '%s': %s", *lines, error->message);
+                    g_error_free(error);
+                    g_free(pattern);
+                    continue;
+                }
+            }
+
+            Trigger *trigger = g_hash_table_lookup(by_pattern, pattern);
+            if (!trigger) {
+                trigger = g_new0(Trigger, 1);
+                trigger->pattern = pattern;
+                g_ptr_array_add(triggers, trigger);
+                g_hash_table_insert(by_pattern, trigger->pattern, trigger);
+            } else {
+                g_free(pattern);
+            }
+            if (trigger->regex) g_regex_unref(trigger->regex);
+            trigger->regex = regex;
+            trigger->actions = actions;
+        }
+    }
+    g_strfreev(user);
+    g_hash_table_unref(by_pattern);
+
+    // "none" entries only existed to cancel earlier ones
+    for (guint i = triggers->len; i-- > 0; ) {
+        if (((Trigger *)g_ptr_array_index(triggers, i))->actions == 0)
+            g_ptr_array_remove_index(triggers, i);
+    }
+    if (triggers->len == 0) {
+        g_ptr_array_unref(triggers);
+        return NULL;
+    }
+
+    TriggerSet *set = g_new0(TriggerSet, 1);
+    set->triggers = triggers;
+    set->unfiltered = g_array_new(FALSE, FALSE, sizeof(guint));
+    char **literals = g_new0(char *, triggers->len + 1);
+    for (guint i = 0; i < triggers->len; i++) {
+        Trigger *trigger = g_ptr_array_index(triggers, i);
+        literals[i] = trigger->regex ? trigger_regex_literal(g_regex_get_pattern(trigger->regex))
+                                     : g_strdup(trigger->pattern);
+        if (!literals[i]) {
+            g_array_append_val(set->unfiltered, i);
+            debug_log("triggers: %s has no literal to search for; it runs on every line",
+                      trigger->pattern);
+        }
+    }
+    trigger_set_build(set, literals);
+    for (guint i = 0; i < triggers->len; i++) g_free(literals[i]);
+    g_free(literals);
+    return set;
+}
+
+// Reports trigger on the line around offset unless it already fired there.
+// seen[trigger] holds 1 + the start of the last line it fired on.
+static void trigger_report(TriggerSet *set, guint trigger, const char *text, gsize len,
+                           gsize offset, gsize *seen, TriggerHitFunc func, gpointer user_data) {
+    const char *line = text + offset;
+    while (line > text && line[-1] != '\n') line--;
+    gsize line_start = (gsize)(line - text);
+    if (seen[trigger] == line_start + 1) return;
+
+    const char *eol = memchr(text + offset, '\n', len - offset);
+    gsize line_len = (eol ? (gsize)(eol - text) : len) - line_start;
+    Trigger *t = g_ptr_array_index(set->triggers, trigger);
+    seen[trigger] = line_start + 1;
+    if (t->regex && !g_regex_match_full(t->regex, line, (gssize)line_len, 0, 0, NULL, NULL))
+        return;
+
+    func(trigger, line, line_len, user_data);
+}
+
+static void trigger_scan(TriggerSet *set, const char *text, gsize len,
+                         TriggerHitFunc func, gpointer user_data) {
+    const guchar *bytes = (const guchar *)text;
+    const guint32 *delta = set->delta;
+    const guint8 *start = set->start;
+    guint32 accept_min = set->accept_min;
+    gsize *seen = g_new0(gsize, set->triggers->len);
+    guint32 s = 0;
+    gsize i = 0;
+
+    while (i < len) {
+        if (s == 0) {
+            while (i + 8 <= len &&
+                   !(start[bytes[i]] | start[bytes[i + 1]] | start[bytes[i + 2]] |
+                     start[bytes[i + 3]] | start[bytes[i + 4]] | start[bytes[i + 5]] |
+                     start[bytes[i + 6]] | start[bytes[i + 7]])) {
+                i += 8;
+            }
+            while (i < len && !start[bytes[i]]) i++;
+            if (i == len) break;
+        }
+        s = delta[(gsize)s * 256 + bytes[i]];
+        if (G_UNLIKELY(s >= accept_min)) {
+            guint32 a = s - accept_min;
+            for (guint32 o = set->out_start[a]; o < set->out_start[a + 1]; o++) {
+                trigger_report(set, set->out_list[o], text, len, i, seen, func, user_data);
+            }
+        }
+        i++;
+    }
+
+    for (guint u = 0; u < set->unfiltered->len; u++) {
+        guint trigger = g_array_index(set->unfiltered, guint, u);
+        Trigger *t = g_ptr_array_index(set->triggers, trigger);
+        for (const char *line = text; line < text + len; ) {
+            const char *eol = memchr(line, '\n', (gsize)(text + len - line));
+            gsize line_len = (gsize)((eol ? eol : text + len) - line);
+            if (g_regex_match_full(t->regex, line, (gssize)line_len, 0, 0, NULL, NULL))
+                func(trigger, line, line_len, user_data);
+            line += line_len + 1;
+        }
+    }
+    g_free(seen);
+}
+
+static void reload_triggers(AppState *app) {
+    gint64 start = g_get_monotonic_time();
+    trigger_set_free(app->triggers);
+    app->triggers = trigger_set_compile(app->settings.triggers);
+    debug_log("Compiled %u triggers into %u states in %.3f ms",
+              app->triggers ? app->triggers->triggers->len : 0,
+              app->triggers ? app->triggers->n_states : 0,
+              (g_get_monotonic_time() - start) / 1000.0);
+}
+
+static gboolean on_trigger_scan(gpointer user_data);
+
+static void queue_trigger_scan(SubTab *subtab) {
+    AppState *app = subtab->parent_tab->app;
+    subtab->trigger_dirty = TRUE;
+    if (app->trigger_scan_id == 0) {
+        app->trigger_scan_id = g_timeout_add(TRIGGER_SCAN_MS, on_trigger_scan, app);
+    }
+}
+
+// Restored scrollback is old output; start looking after it
+static void skip_trigger_rows(SubTab *subtab) {
+    long col = 0;
+    vte_terminal_get_cursor_position(subtab->terminal, &col, &subtab->trigger_row);
+    subtab->trigger_dirty = FALSE;
+}
+
+typedef struct {
+    SubTab *subtab;
+    GArray *hits;               // TriggerHit
+} TriggerScan;
+
+// Whether row is soft-wrapped into the next: VTE ends a row's text with a
+// newline only where the line really ended
+static gboolean trigger_row_wraps(VteTerminal *terminal, long row) {
+    gsize len = 0;
+    char *text = vte_terminal_get_text_range_format(terminal, VTE_FORMAT_TEXT,
+                                                    row, 0, row + 1, 0, &len);
+    gboolean wraps = text && len > 0 && text[len - 1] != '\n';
+    g_free(text);
+    return wraps;
+}
+
+static void on_trigger_hit(guint trigger, const char *line, gsize len, gpointer user_data) {
+    TriggerScan *scan = (TriggerScan *)user_data;
+    TriggerHit hit = { scan->subtab, trigger, g_strstrip(g_strndup(line, len)) };
+    g_array_append_val(scan->hits, hit);
+}
+
+static void run_trigger_command(AppState *app, const TriggerHit *hit) {
+    Trigger *trigger = g_ptr_array_index(app->triggers->triggers, hit->trigger);
+    char *argv[] = { "/bin/sh", "-c", app->settings.trigger_command, NULL };
+    char **envp = g_get_environ();
+    envp = g_environ_setenv(envp, "GMUX_TRIGGER", trigger->pattern, TRUE);
+    envp = g_environ_setenv(envp, "GMUX_TRIGGER_LINE", hit->line, TRUE);
+    envp = g_environ_setenv(envp, "GMUX_PROJECT", hit->subtab->parent_tab->path, TRUE);
+    envp = g_environ_setenv(envp, "GMUX_TAB", hit->subtab->name, TRUE);
+
+    GError *error = NULL;
+    if (!g_spawn_async(hit->subtab->working_dir, argv, envp, G_SPAWN_DEFAULT,
+                       NULL, NULL, NULL, &error)) {
+        g_warning("Failed to run trigger_command: %s", error->message);
+        g_error_free(error);
+    }
+    g_strfreev(envp);
+}
+
+static gboolean subtab_is_seen(SubTab *subtab) {
+    Project *project = subtab->parent_tab;
+    return project->active_subtab == subtab && project->win &&
+           gtk_window_is_active(GTK_WINDOW(project->win->window)) &&
+           project->win->active_project == project;
+}
+
+// Acts on one tab's hits from a scan: every action any of them asks for,
+// once, with one notification naming the first line and trigger_command
+// run for the first hit asking for it
+static void deliver_trigger_hits(AppState *app, const TriggerHit *hits, guint n) {
+    SubTab *subtab = hits[0].subtab;
+    guint actions = 0;
+    const TriggerHit *run = NULL;
+    for (guint i = 0; i < n; i++) {
+        Trigger *trigger = g_ptr_array_index(app->triggers->triggers, hits[i].trigger);
+        actions |= trigger->actions;
+        if ((trigger->actions & TRIGGER_RUN) && !run) run = &hits[i];
+    }
+    debug_log("triggers: %u hits in %s/%s, first: %s", n, subtab->parent_tab->name,
+              subtab->name, hits[0].line);
+
+    if (run && app->settings.trigger_command) {
+        gint64 now = g_get_monotonic_time();
+        if (subtab->trigger_run_time && now - subtab->trigger_run_time < TRIGGER_RUN_INTERVAL_US) {
+            debug_log("triggers: not running trigger_command for %s/%s again yet",
+                      subtab->parent_tab->name, subtab->name);
+        } else {
+            subtab->trigger_run_time = now;
+            run_trigger_command(app, run);
+        }
+    }
+
+    if (actions & TRIGGER_FOCUS) {
+        select_project(subtab->parent_tab);
+        on_subtab_button_clicked(GTK_BUTTON(subtab->tab_button), subtab);
+        gtk_window_present(GTK_WINDOW(subtab->parent_tab->win->window));
+    }
+    if ((actions & TRIGGER_HIGHLIGHT) && !subtab_is_seen(subtab)) {
+        gtk_widget_add_css_class(subtab->tab_widget, "gmux-tab-alert");
+    }
+    if (actions & TRIGGER_NOTIFY) {
+        char *title = g_strdup_printf("%s — %s", subtab->parent_tab->name, subtab->name);
+        char *body = n > 1 ? g_strdup_printf("%s\n(and %u more)", hits[0].line, n - 1)
+                           : g_strdup(hits[0].line);
+        // One notification per tab, replaced by the next
+        char *id = g_strdup_printf("gmux-trigger-%p", (void *)subtab);
+        GNotification *notification = g_notification_new(title);
+        g_notification_set_body(notification, body);
+        g_application_send_notification(G_APPLICATION(app->gtk_app), id, notification);
+        g_object_unref(notification);
+        g_free(id);
+        g_free(body);
+        g_free(title);
+    }
+}
+
+static gboolean on_trigger_scan(gpointer user_data) {
+    AppState *app = (AppState *)user_data;
+    app->trigger_scan_id = 0;
+
+    GArray *hits = g_array_new(FALSE, FALSE, sizeof(TriggerHit));
+    gsize scanned = 0;
+    gint64 start = g_get_monotonic_time();
+
+    for (GList *l = app->projects; l; l = l->next) {
+        Project *project = (Project *)l->data;
+        for (GList *sl = project->subtabs; sl; sl = sl->next) {
+            SubTab *subtab = (SubTab *)sl->data;
+            if (!subtab->trigger_dirty || !app->triggers) continue;
+            subtab->trigger_dirty = FALSE;
+            if (subtab->restore_pending) continue;
+
+            // Only whole lines: the cursor's row may still be written to,
+            // and so may a line wrapped onto it
+            long col = 0, row = 0;
+            vte_terminal_get_cursor_position(subtab->terminal, &col, &row);
+            if (row < subtab->trigger_row) subtab->trigger_row = row;  // Cleared
+            long end = row;
+            while (end > subtab->trigger_row && row - end < TRIGGER_MAX_WRAP_ROWS &&
+                   trigger_row_wraps(subtab->terminal, end - 1)) {
+                end--;
+            }
+            if (row - end < TRIGGER_MAX_WRAP_ROWS) row = end;
+            if (row == subtab->trigger_row) continue;
+
+            gsize len = 0;
+            char *text = vte_terminal_get_text_range_format(subtab->terminal, VTE_FORMAT_TEXT,
+                                                            subtab->trigger_row, 0, row, 0, &len);
+            subtab->trigger_row = row;
+            if (!text) continue;
+            TriggerScan scan = { subtab, hits };
+            trigger_scan(app->triggers, text, len, on_trigger_hit, &scan);
+            scanned += len;
+            g_free(text);
+        }
+    }
+
+    // Hits are grouped by tab, as scanned
+    for (guint i = 0; i < hits->len; ) {
+        guint j = i;
+        while (j < hits->len && g_array_index(hits, TriggerHit, j).subtab ==
+                                g_array_index(hits, TriggerHit, i).subtab) {
+            j++;
+        }
+        deliver_trigger_hits(app, &g_array_index(hits, TriggerHit, i), j - i);
+        i = j;
+    }
+    for (guint i = 0; i < hits->len; i++) g_free(g_array_index(hits, TriggerHit, i).line);
+    if (hits->len > 0) {
+        debug_log("triggers: scanned %" G_GSIZE_FORMAT " bytes in %.3f ms, %u hits",
+                  scanned, (g_get_monotonic_time() - start) / 1000.0, hits->len);
+    }
+    g_array_unref(hits);
+    return G_SOURCE_REMOVE;
+}
+
+static void clear_trigger_alert(SubTab *subtab) {
+    gtk_widget_remove_css_class(subtab->tab_widget, "gmux-tab-alert");
+}
+
+static void stop_triggers(AppState *app) {
+    if (app->trigger_scan_id > 0) {
+        g_source_remove(app->trigger_scan_id);
+        app->trigger_scan_id = 0;
+    }
+    g_clear_pointer(&app->triggers, trigger_set_free);
+}
+
+static void on_bench_hit(guint trigger, const char *line, gsize len, gpointer user_data) {
+    (void)trigger;
+    (void)line;
+    (void)len;
+    (*(guint *)user_data)++;
+}
+
+#define TRIGGER_BENCH_MAX_MB 256
+#define TRIGGER_BENCH_BLOCK_BYTES (1024 * 1024)   // Generated once, scanned mb times
+#define TRIGGER_BENCH_MAX_US (5 * G_USEC_PER_SEC)  // Longest it may block the UI
+#define TRIGGER_BENCH_MAX_ROWS 10000               // Read from a tab by the tab bench
+
+// Scans mb megabytes of build-log-like text with the current triggers;
+// one line in 1000 is a failure. A 1 MB block is scanned over and over,
+// so the text is in cache as a scan's few new lines would be; the run
+// stops early past TRIGGER_BENCH_MAX_US and "bytes" says how far it got.
+static JsonObject* run_trigger_bench(TriggerSet *set, int mb) {
+    static const char *const lines[] = {
+        "[ 42%] Building CXX object src/core/CMakeFiles/core.dir/scheduler.cpp.o\n",
+        "   Compiling serde_json v1.0.117\n",
+        "ok   github.com/example/service/internal/store  0.412s\n",
+        "  CC      drivers/gpu/drm/i915/display/intel_display_power.o\n",
+        "test result: ok. 128 passed; 0 failed; 0 ignored; 0 measured\n",
+    };
+    static const char failure[] = "--- FAILED: TestReconnect (2.01s)\n";
+
+    GString *text = g_string_sized_new(TRIGGER_BENCH_BLOCK_BYTES + 128);
+    for (guint n = 0; text->len < TRIGGER_BENCH_BLOCK_BYTES; n++) {
+        g_string_append(text, n % 1000 == 999 ? failure : lines[n % G_N_ELEMENTS(lines)]);
+    }
+
+    guint hits = 0;
+    gsize bytes = 0;
+    gint64 start = g_get_monotonic_time();
+    for (int i = 0; i < mb && g_get_monotonic_time() - start < TRIGGER_BENCH_MAX_US; i++) {
+        trigger_scan(set, text->str, text->len, on_bench_hit, &hits);
+        bytes += text->len;
+    }
+    gint64 elapsed = MAX(g_get_monotonic_time() - start, 1);
+
+    JsonObject *result = json_object_new();
+    json_object_set_int_member(result, "bytes", (gint64)bytes);
+    json_object_set_int_member(result, "elapsed_us", elapsed);
+    json_object_set_double_member(result, "mb_per_s",
+                                  bytes / (1024.0 * 1024.0) / (elapsed / 1e6));
+    json_object_set_int_member(result, "hits", hits);
+    json_object_set_int_member(result, "triggers", set->triggers->len);
+    json_object_set_int_member(result, "states", set->n_states);
+    json_object_set_int_member(result, "unfiltered", set->unfiltered->len);
+    g_string_free(text, TRUE);
+    return result;
+}
+
+// What on_trigger_scan does for a tab with that much new output: copy the
+// last TRIGGER_BENCH_MAX_ROWS rows up to the cursor out of VTE, then scan
+// them. The wrapped-line check before the copy is not included.
+static JsonObject* run_trigger_tab_bench(TriggerSet *set, SubTab *subtab) {
+    long col = 0, row = 0;
+    vte_terminal_get_cursor_position(subtab->terminal, &col, &row);
+    GtkAdjustment *vadj = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(subtab->terminal));
+    long first = MAX((long)gtk_adjustment_get_lower(vadj), row - TRIGGER_BENCH_MAX_ROWS);
+
+    gsize len = 0;
+    guint hits = 0;
+    gint64 start = g_get_monotonic_time();
+    char *text = vte_terminal_get_text_range_format(subtab->terminal, VTE_FORMAT_TEXT,
+                                                    first, 0, row, 0, &len);
+    gint64 copied = g_get_monotonic_time();
+    if (text) trigger_scan(set, text, len, on_bench_hit, &hits);
+    gint64 scanned = g_get_monotonic_time();
+    g_free(text);
+
+    JsonObject *result = json_object_new();
+    json_object_set_int_member(result, "rows", row - first);
+    json_object_set_int_member(result, "bytes", (gint64)len);
+    json_object_set_int_member(result, "copy_us", copied - start);
+    json_object_set_int_member(result, "scan_us", scanned - copied);
+    json_object_set_double_member(result, "mb_per_s",
+                                  len / (1024.0 * 1024.0) / (MAX(scanned - start, 1) / 1e6));
+    json_object_set_int_member(result, "hits", hits);
+    return result;
+}
+
+//=============================================================================
+// Command Timeline
+//=============================================================================
+
+// Shells that mark their prompts with OSC 133 (the FinalTerm sequences;
+// snippets for bash, zsh and fish are in shell-integration/) give each tab
+// a timeline of its commands. VTE reports the marks as its vte.shell.*
+// termprops: precmd before a prompt (133;A), preexec when a command starts
+// (133;C) and postexec with its exit status (133;D). VTE only signals those
+// once it has parsed a whole chunk of output, so for a quick command like
+// `ls` the marks arrive together with the cursor already on the next
+// prompt. The prompt and the end of output are placed at that cursor row,
+// which is the prompt's (last) line either way. The start of output is
+// placed instead by the Enter that ran the command: the row after the
+// cursor when the last Enter was typed at the prompt, before the shell saw
+// it. Commands started without a typed Enter fall back to the cursor row
+// at the C mark. Rows are absolute and keep
+// counting up as scrollback is trimmed, so entries never need adjusting;
+// entries that scroll out of the buffer are kept until the timeline grows
+// past COMMAND_TIMELINE_MAX and are skipped when jumping.
+//
+// prev-prompt and next-prompt step an index into the timeline, and
+// copy-output copies the output of the command jumped to, or of the last
+// finished one; finding either is an array lookup. A command that exits
+// non-zero marks its tab until a later one succeeds.
+
+#if VTE_CHECK_VERSION(0, 78, 0)
+#define HAVE_PROMPT_MARKS 1     // vte.shell.* termprops
+#endif
+
+#define SHELL_COMMAND_TERMPROP "vte.ext.gmux.command"
+#define COMMAND_TIMELINE_MAX 2048
+#define COMMAND_TIMELINE_TRIM 512   // Dropped at once from the front when full
+
+struct _CommandMark {
+    long prompt_row;            // Row the prompt was drawn on
+    long output_row;            // First output row; -1 while at the prompt
+    long end_row;               // Row after the output; -1 while running
+    long enter_row;             // Cursor at the last Enter typed at the prompt; -1 = none
+    int exit_status;            // -1 while running or if the shell never said
+    gint64 start_time;          // Monotonic, when the command started
+    gint64 duration;            // Microseconds; 0 until it finishes
+};
+
+static long subtab_cursor_row(SubTab *subtab) {
+    long col = 0, row = 0;
+    vte_terminal_get_cursor_position(subtab->terminal, &col, &row);
+    return row;
+}
+
+static CommandMark* last_command(SubTab *subtab, guint back) {
+    GArray *commands = subtab->commands;
+    if (!commands || commands->len <= back) return NULL;
+    return &g_array_index(commands, CommandMark, commands->len - 1 - back);
+}
+
+static void set_command_failure(SubTab *subtab, const CommandMark *mark) {
+    g_clear_pointer(&subtab->failure, g_free);
+    if (mark && mark->exit_status > 0) {
+        subtab->failure = g_strdup_printf("exited with %d after %.1f s", mark->exit_status,
+                                          mark->duration / (double)G_USEC_PER_SEC);
+        gtk_widget_add_css_class(subtab->tab_widget, "gmux-tab-failed");
+    } else {
+        gtk_widget_remove_css_class(subtab->tab_widget, "gmux-tab-failed");
+    }
+    update_subtab_label(subtab);
+}
+
+static void finish_command(CommandMark *mark, long row) {
+    mark->end_row = MAX(row, mark->output_row);
+    mark->duration = g_get_monotonic_time() - mark->start_time;
+}
+
+static void record_command_exit(SubTab *subtab, CommandMark *mark, int status) {
+    mark->exit_status = status;
+    debug_log("timeline: %s: command at row %ld exited %d after %.0f ms", subtab->name,
+              mark->prompt_row, status, mark->duration / 1000.0);
+    set_command_failure(subtab, mark);
+    history_command_finished(subtab, status);
+    // The command may have edited, staged or committed files
+    invalidate_git_status(subtab->parent_tab->app, subtab->parent_tab->path);
+}
+
+// 133;A. A prompt after a running command also ends it, in case the
+// shell's D mark is missing or comes after this one.
+static void on_prompt_mark(SubTab *subtab) {
+    long row = subtab_cursor_row(subtab);
+    CommandMark *last = last_command(subtab, 0);
+
+    if (last && last->output_row >= 0 && last->end_row < 0) {
+        finish_command(last, row);
+    } else if (last && last->output_row < 0) {
+        // Nothing ran since the last prompt (an empty line, or ^C)
+        last->prompt_row = row;
+        last->enter_row = -1;
+        return;
+    }
+
+    if (!subtab->commands) subtab->commands = g_array_new(FALSE, FALSE, sizeof(CommandMark));
+    if (subtab->commands->len >= COMMAND_TIMELINE_MAX) {
+        g_array_remove_range(subtab->commands, 0, COMMAND_TIMELINE_TRIM);
+    }
+    CommandMark mark = { row, -1, -1, -1, -1, 0, 0 };
+    g_array_append_val(subtab->commands, mark);
+    subtab->command_nav = -1;
+}
+
+// 133;C
+static void on_command_mark(SubTab *subtab) {
+    CommandMark *last = last_command(subtab, 0);
+    if (!last || last->output_row >= 0) return;
+    last->output_row = last->enter_row >= 0 ? last->enter_row + 1 : subtab_cursor_row(subtab);
+    last->start_time = g_get_monotonic_time();
+    history_command_started(subtab);
+}
+
+// Typed at a prompt; the last Enter shows where the output will start.
+// Multi-line commands and PS2 take several Enters; only the one before the
+// C mark counts.
+static void note_command_input(SubTab *subtab, const char *text, guint size) {
+    CommandMark *last = last_command(subtab, 0);
+    if (!last || last->output_row >= 0) return;
+    if (memchr(text, '\r', size) || memchr(text, '\n', size)) {
+        last->enter_row = subtab_cursor_row(subtab);
+    }
+}
+
+// 133;D
+static void on_command_done_mark(SubTab *subtab, int status) {
+    CommandMark *last = last_command(subtab, 0);
+    if (last && last->output_row >= 0 && last->end_row < 0) {
+        finish_command(last, subtab_cursor_row(subtab));
+        record_command_exit(subtab, last, status);
+        return;
+    }
+
+    // The next prompt got here first and already ended the command
+    CommandMark *previous = last && last->output_row < 0 ? last_command(subtab, 1) : NULL;
+    if (previous && previous->end_row >= 0 && previous->exit_status < 0) {
+        record_command_exit(subtab, previous, status);
+    }
+}
+
+#ifdef HAVE_PROMPT_MARKS
+static void on_terminal_shell_termprop(VteTerminal *terminal, const char *name,
+                                       gpointer user_data) {
+    SubTab *subtab = (SubTab *)user_data;
+
+    if (strcmp(name, "vte.shell.precmd") == 0) {
+        on_prompt_mark(subtab);
+    } else if (strcmp(name, "vte.shell.preexec") == 0) {
+        on_command_mark(subtab);
+    } else if (strcmp(name, "vte.shell.postexec") == 0) {
+        guint64 status = 0;
+        if (!vte_terminal_get_termprop_uint(terminal, name, &status)) status = 0;
+        on_command_done_mark(subtab, (int)MIN(status, 255));
+    } else if (strcmp(name, SHELL_COMMAND_TERMPROP) == 0) {
+        size_t size = 0;
+        const guint8 *data = vte_terminal_get_termprop_data(terminal, name, &size);
+        history_command_line(subtab, data, data ? size : 0);
+    }
+}
+#endif
+
+// Lets the snippets send the command line (see Command History); VTE only
+// passes on termprops installed before terminals are created
+static void install_shell_termprops(void) {
+#ifdef HAVE_PROMPT_MARKS
+    vte_install_termprop(SHELL_COMMAND_TERMPROP, VTE_PROPERTY_DATA, VTE_PROPERTY_FLAG_NONE);
+#endif
+}
+
+static void watch_prompt_marks(SubTab *subtab) {
+    subtab->command_nav = -1;
+#ifdef HAVE_PROMPT_MARKS
+    g_signal_connect(subtab->terminal, "termprop-changed::vte.shell.precmd",
+                     G_CALLBACK(on_terminal_shell_termprop), subtab);
+    g_signal_connect(subtab->terminal, "termprop-changed::vte.shell.preexec",
+                     G_CALLBACK(on_terminal_shell_termprop), subtab);
+    g_signal_connect(subtab->terminal, "termprop-changed::vte.shell.postexec",
+                     G_CALLBACK(on_terminal_shell_termprop), subtab);
+    g_signal_connect(subtab->terminal, "termprop-changed::" SHELL_COMMAND_TERMPROP,
+                     G_CALLBACK(on_terminal_shell_termprop), subtab);
+#endif
+}
+
+static void free_command_timeline(SubTab *subtab) {
+    history_command_finished(subtab, -1);
+    g_clear_pointer(&subtab->shell_command, g_free);
+    g_clear_pointer(&subtab->commands, g_array_unref);
+    g_clear_pointer(&subtab->failure, g_free);
+}
+
+static long first_buffer_row(SubTab *subtab) {
+    GtkAdjustment *vadj = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(subtab->terminal));
+    return (long)gtk_adjustment_get_lower(vadj);
+}
+
+// step is -1 or 1. Past the newest prompt, scrolls back to the bottom.
+static gboolean jump_to_prompt(SubTab *subtab, int step) {
+    GArray *commands = subtab->commands;
+    if (!commands || commands->len == 0) return FALSE;
+
+    int len = (int)commands->len;
+    int nav = subtab->command_nav;
+    if (nav < 0 && step < 0) {
+        // From the bottom, the newest entry is usually the prompt in view
+        nav = g_array_index(commands, CommandMark, len - 1).output_row < 0 ? len - 2 : len - 1;
+    } else if (nav >= 0) {
+        nav += step;
+    }
+    if (nav >= len || (nav < 0 && step > 0)) {
+        subtab->command_nav = -1;
+        GtkAdjustment *vadj = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(subtab->terminal));
+        gtk_adjustment_set_value(vadj, gtk_adjustment_get_upper(vadj));
+        return TRUE;
+    }
+    if (nav < 0) return TRUE;
+
+    long row = g_array_index(commands, CommandMark, nav).prompt_row;
+    if (row < first_buffer_row(subtab)) return TRUE;  // Scrolled out
+
+    subtab->command_nav = nav;
+    GtkAdjustment *vadj = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(subtab->terminal));
+    gtk_adjustment_set_value(vadj, (double)row);
+    return TRUE;
+}
+
+// The command jumped to, else the newest one that has finished
+static const CommandMark* output_command(SubTab *subtab) {
+    if (!subtab->commands) return NULL;
+    if (subtab->command_nav >= 0) {
+        const CommandMark *mark = &g_array_index(subtab->commands, CommandMark,
+                                                 subtab->command_nav);
+        return mark->end_row >= 0 ? mark : NULL;
+    }
+    for (guint back = 0; back < 2; back++) {
+        CommandMark *mark = last_command(subtab, back);
+        if (mark && mark->end_row >= 0) return mark;
+    }
+    return NULL;
+}
+
+// NULL if the command printed nothing or its output has scrolled out
+static char* command_output_text(SubTab *subtab, const CommandMark *mark) {
+    long start = MAX(mark->output_row, first_buffer_row(subtab));
+    if (start >= mark->end_row) return NULL;
+    char *text = vte_terminal_get_text_range_format(subtab->terminal, VTE_FORMAT_TEXT,
+                                                    start, 0, mark->end_row, 0, NULL);
+    if (text && !*text) g_clear_pointer(&text, g_free);
+    return text;
+}
+
+static gboolean copy_command_output(SubTab *subtab) {
+    const CommandMark *mark = output_command(subtab);
+    char *text = mark ? command_output_text(subtab, mark) : NULL;
+    if (!text) return FALSE;
+
+    gdk_clipboard_set_text(gtk_widget_get_clipboard(GTK_WIDGET(subtab->terminal)), text);
+    debug_log("timeline: copied %zu bytes of output from row %ld", strlen(text),
+              mark->output_row);
+    g_free(text);
+    return TRUE;
+}
+
+static JsonArray* command_timeline_to_json(SubTab *subtab) {
+    JsonArray *array = json_array_new();
+    if (!subtab->commands) return array;
+
+    long first_row = first_buffer_row(subtab);
+    for (guint i = 0; i < subtab->commands->len; i++) {
+        const CommandMark *mark = &g_array_index(subtab->commands, CommandMark, i);
+        JsonObject *obj = json_object_new();
+        if (mark->prompt_row >= first_row) {
+            // The prompt line, with the command as typed on it
+            char *line = vte_terminal_get_text_range_format(subtab->terminal, VTE_FORMAT_TEXT,
+                                                            mark->prompt_row, 0,
+                                                            mark->prompt_row + 1, 0, NULL);
+            if (line) json_object_set_string_member(obj, "line", g_strstrip(line));
+            g_free(line);
+        }
+        json_object_set_int_member(obj, "prompt_row", mark->prompt_row);
+        if (mark->output_row >= 0) json_object_set_int_member(obj, "output_row", mark->output_row);
+        if (mark->end_row >= 0) {
+            json_object_set_int_member(obj, "end_row", mark->end_row);
+            json_object_set_int_member(obj, "duration_ms", mark->duration / 1000);
+        }
+        if (mark->exit_status >= 0) json_object_set_int_member(obj, "exit_status", mark->exit_status);
+        json_object_set_string_member(obj, "state", mark->output_row < 0 ? "prompt"
+                                      : mark->end_row < 0 ? "running" : "done");
+        json_array_add_object_element(array, obj);
+    }
+    return array;
+}
+
+//=============================================================================
+// Command History
+//=============================================================================
+
+// Commands run in any tab go into one history, <data>/history.db, shared by
+// every shell and every gmux process. The shell snippets send each command
+// line just before its OSC 133;C mark (see Command Timeline), as the
+// base64 SHELL_COMMAND_TERMPROP set with OSC 666: zsh's preexec argument,
+// fish's fish_preexec argument, bash's `history 1` from PS0. Nothing is
+// read off the screen, so right prompts and output never end up in it. A
+// command is recorded when it ends, with the project, the directory it ran
+// in, its exit status and the time it started. Lines starting with a space
+// are left out, as with HISTCONTROL=ignorespace.
+//
+// The file is append-only: a header, then 8-byte aligned records. Strings
+// (commands, project paths, directories) are written once and referred to
+// by offset, so a command run a thousand times is stored once, plus one
+// small RUN record per run. An append is one write() under flock(), after
+// first indexing what other gmux processes appended. The file is mapped
+// with room to grow past its end, and the index in memory only holds
+// offsets into the mapping. A torn record at the end (a crash mid-write) is
+// cut off when it is found.
+//
+// Matches rank prefix, then substring, then fuzzy (the query's characters
+// in order), newest first within each; a query without capitals ignores
+// case. Commands are kept in recency order (slots), and every slot is
+// posted under the hashed, lower-cased character triples it contains, plus
+// a start mark followed by its first one and two characters; a triple with
+// capitals is also posted exactly. Posting lists are LEB128 slot deltas in
+// segments of HISTORY_INDEX_GROUP slots, or a bitmap once a segment is
+// dense, and are walked newest segment first. The prefix and substring
+// matches of a query of three or more characters are among the slots in
+// every list of its triples: the shortest list of deltas is decoded and
+// the others merged in or their bitmaps tested. Once a page of substrings
+// is in, only the start-mark keys are used, for prefixes that would still
+// outrank them. Shorter queries find their prefixes the same way.
+//
+// Each slot also has a signature holding how often (up to 7) each letter,
+// digit and capital occurs and a 128-bit mask of its character pairs, and
+// every HISTORY_BLOCK_SLOTS slots share one with the per-bucket maximum,
+// so most slots are ruled out without touching their text. Fuzzy matches,
+// and substrings of one or two characters, have no keys: the whole history
+// is scanned for them, newest first, with the signatures skipping blocks.
+// A search runs in HISTORY_SLICE_US slices and the picker shows what each
+// slice found, so such a scan over a million commands (tens of ms) never
+// holds up a frame. `gmux ctl history-bench` times searches over a
+// synthetic history and holds their first slice to HISTORY_TARGET_US.
+//
+// In memory a distinct command costs about 140 bytes: ~40 of posting lists,
+// 32 each of signature and HistoryCommand, the intern table and its slot.
+
+#define HISTORY_FILE_NAME "history.db"
+#define HISTORY_MAGIC "GMUXHST"
+#define HISTORY_VERSION 1
+#define HISTORY_MAP_RESERVE (16u << 20)     // Mapped past the end of the file
+#define HISTORY_MAX_COMMAND 8192            // Longer command lines are not kept
+#define HISTORY_MAX_RESULTS 50
+#define HISTORY_BLOCK_SLOTS 32
+#define HISTORY_INDEX_BITS 15               // Hashed gram keys
+#define HISTORY_INDEX_GROUP 65536           // Slots per posting list segment
+#define HISTORY_DENSE_COUNT (HISTORY_INDEX_GROUP / 16)  // Bitmap from here on
+#define HISTORY_GROUP_WORDS (HISTORY_INDEX_GROUP / 64)
+#define HISTORY_START_MARK 0x01             // Counted before the first character
+#define HISTORY_MAX_KEYS 32
+#define HISTORY_SLICE_US 1500
+#define HISTORY_TARGET_US 2000              // What history-bench holds first slices to
+#define HISTORY_MOVED G_MAXUINT32           // Slot of a command run again since
+#define HISTORY_COMPACT_MIN 4096           // Moved slots tolerated before compacting
+#define HISTORY_LANE_GUARDS G_GUINT64_CONSTANT(0x8888888888888888)
+
+typedef enum {
+    HISTORY_RECORD_STRING = 1,
+    HISTORY_RECORD_RUN = 2,
+} HistoryRecordType;
+
+typedef struct {
+    char magic[8];
+    guint32 version;
+    guint32 reserved[5];
+} HistoryFileHeader;
+
+typedef struct {
+    guint32 size;               // Whole record, a multiple of 8
+    guint16 type;               // HistoryRecordType; others are skipped
+    guint16 reserved;
+} HistoryRecord;
+
+// Followed by the text and a NUL
+typedef struct {
+    HistoryRecord header;
+    guint32 length;
+} HistoryStringRecord;
+
+typedef struct {
+    HistoryRecord header;
+    guint32 command;            // Offsets of string records
+    guint32 project;            // 0 = none
+    guint32 cwd;                // 0 = none
+    gint32 exit_status;         // -1 if the shell never said
+    gint64 time;                // Wall clock µs when the command started
+} HistoryRunRecord;
+
+G_STATIC_ASSERT(sizeof(HistoryFileHeader) == 32);
+G_STATIC_ASSERT(sizeof(HistoryRunRecord) == 32);
+
+typedef struct {
+    guint64 lanes[2];           // 32 buckets of 4 bits; see history_signature
+    guint64 pairs[2];           // Bit per hashed pair of adjacent characters
+} HistorySig;
+
+typedef struct {
+    guint32 text;               // Offset of the string record
+    guint32 slot;               // Index into order
+    guint32 runs;
+    gint32 exit_status;         // Of the last run, as are the fields below
+    guint32 project;
+    guint32 cwd;
+    gint64 time;
+} HistoryCommand;
+
+typedef struct {
+    guint32 offset;             // String record, 0 = empty
+    guint32 hash;
+    guint32 command;            // Index into commands + 1, 0 = never run
+} HistoryIntern;
+
+typedef struct {
+    guint32 group;              // Slot / HISTORY_INDEX_GROUP
+    guint32 start;              // Offset of its first delta or its bitmap in bytes
+    guint32 count;
+    gboolean dense;             // A bit per slot of the group instead of deltas
+} HistorySegment;
+
+// The slots posted under one key. The first delta of a segment counts from
+// the start of its group, so every segment decodes on its own, and one
+// holding HISTORY_DENSE_COUNT slots turns into a bitmap.
+typedef struct {
+    GByteArray *bytes;
+    GArray *segments;           // HistorySegment, oldest first
+    guint32 last;               // Newest slot posted
+} HistoryPostings;
+
+struct _HistoryStore {
+    char *path;
+    int fd;                     // -1 for the benchmark's store in memory
+    GByteArray *memory;         // Its records, instead of a file
+    const char *map;
+    gsize map_size;
+    gsize size;                 // Bytes indexed so far
+    HistoryIntern *interns;     // Open addressing, linear probing
+    guint32 intern_mask;
+    guint32 n_interns;
+    GArray *commands;           // HistoryCommand
+    GArray *order;              // Command index per slot, oldest first
+    GArray *sigs;               // HistorySig per slot
+    GArray *block_sigs;         // HistorySig per HISTORY_BLOCK_SLOTS slots
+    HistoryPostings *postings;  // 1 << HISTORY_INDEX_BITS; NULL while empty
+    guint32 moved;              // Slots set to HISTORY_MOVED
+    guint generation;           // Bumped when the slots are compacted
+    guint64 runs;
+};
+
+struct _HistorySearch {
+    HistoryStore *store;
+    char *query;
+    gsize length;
+    gboolean fold;              // No capitals in the query: ignore case
+    HistorySig sig;
+    guint32 substring_keys[HISTORY_MAX_KEYS];
+    guint n_substring_keys;     // 0 for queries under three characters
+    guint32 prefix_keys[HISTORY_MAX_KEYS];
+    guint n_prefix_keys;        // 0 for the empty query
+    guint generation;
+    guint32 limit;              // Slots added since the search began are left out
+    guint32 group;              // Segments below this are still to be walked
+    guint32 next;               // Slots below this are still to be scanned
+    GArray *candidates;         // Slots of the group holding every key
+    GArray *decoded;            // Scratch: a decoded segment
+    guint64 *bitmap;            // Scratch: HISTORY_GROUP_WORDS
+    GArray *tiers[3];           // Command indexes: prefix, substring, fuzzy
+    gint64 busy_us;             // Time spent scanning
+    gboolean done;
+};
+
+struct _HistoryRun {
+    char *command;
+    char *cwd;
+    gint64 time;
+};
+
+static const char* history_string(HistoryStore *store, guint32 offset, guint32 *length) {
+    const HistoryStringRecord *record = (const HistoryStringRecord *)(store->map + offset);
+    if (length) *length = record->length;
+    return (const char *)(record + 1);
+}
+
+static guint32 history_hash(const char *text, gsize length) {
+    guint32 hash = 2166136261u;     // FNV-1a
+    for (gsize i = 0; i < length; i++) hash = (hash ^ (guchar)text[i]) * 16777619u;
+    return hash;
+}
+
+// The intern slot holding text, or the empty one where it would go
+static HistoryIntern* history_intern_slot(HistoryStore *store, const char *text,
+                                          gsize length, guint32 hash) {
+    for (guint32 i = hash & store->intern_mask;; i = (i + 1) & store->intern_mask) {
+        HistoryIntern *slot = &store->interns[i];
+        if (slot->offset == 0) return slot;
+        if (slot->hash != hash) continue;
+
+        guint32 other_length;
+        const char *other = history_string(store, slot->offset, &other_length);
+        if (other_length == length && memcmp(other, text, length) == 0) return slot;
+    }
+}
+
+static void history_grow_interns(HistoryStore *store) {
+    HistoryIntern *old = store->interns;
+    guint32 old_size = old ? store->intern_mask + 1 : 0;
+    guint32 size = old ? old_size * 2 : 4096;
+
+    store->interns = g_new0(HistoryIntern, size);
+    store->intern_mask = size - 1;
+    for (guint32 i = 0; i < old_size; i++) {
+        if (old[i].offset == 0) continue;
+        guint32 j = old[i].hash & store->intern_mask;
+        while (store->interns[j].offset != 0) j = (j + 1) & store->intern_mask;
+        store->interns[j] = old[i];
+    }
+    g_free(old);
+}
+
+// Buckets: a-z ignoring case, digits folded onto five, everything else one
+#define HISTORY_CAPITALS 30               // Bucket counting capitals a second time
+
+static inline guint history_bucket(guchar c) {
+    c = g_ascii_tolower(c);
+    if (c >= 'a' && c <= 'z') return c - 'a';
+    if (c >= '0' && c <= '9') return 26 + (c - '0') % 4;
+    return 31;
+}
+
+static inline guint history_pair_bit(guchar a, guchar b) {
+    guint32 pair = (guint32)g_ascii_tolower(a) << 8 | g_ascii_tolower(b);
+    return (pair * 2654435761u) >> 25;
+}
+
+// How often each bucket occurs, up to 7, in 4-bit lanes whose top bit is
+// left clear as a guard, and which pairs of characters occur side by side.
+// A query with capitals matches case and so needs as many capitals.
+static HistorySig history_signature(const char *text, gsize length) {
+    guint8 counts[32] = { 0 };
+    HistorySig sig = { { 0, 0 }, { 0, 0 } };
+    for (gsize i = 0; i < length; i++) {
+        guint bucket = history_bucket((guchar)text[i]);
+        if (counts[bucket] < 7) counts[bucket]++;
+        if (g_ascii_isupper(text[i]) && counts[HISTORY_CAPITALS] < 7) counts[HISTORY_CAPITALS]++;
+        if (i > 0) {
+            guint bit = history_pair_bit(text[i - 1], text[i]);
+            sig.pairs[bit / 64] |= G_GUINT64_CONSTANT(1) << (bit % 64);
+        }
+    }
+
+    for (guint b = 0; b < 32; b++) sig.lanes[b / 16] |= (guint64)counts[b] << (b % 16 * 4);
+    return sig;
+}
+
+// Whether have has at least need's count in every bucket: with the guard
+// bits set, subtracting a larger count clears one. With pairs, also whether
+// it has every pair need has, as it must to contain need as a substring.
+static inline gboolean history_sig_covers(const HistorySig *have, const HistorySig *need,
+                                          gboolean pairs) {
+    guint64 low = (have->lanes[0] | HISTORY_LANE_GUARDS) - need->lanes[0];
+    guint64 high = (have->lanes[1] | HISTORY_LANE_GUARDS) - need->lanes[1];
+    return (low & high & HISTORY_LANE_GUARDS) == HISTORY_LANE_GUARDS &&
+           (!pairs || ((have->pairs[0] & need->pairs[0]) == need->pairs[0] &&
+                       (have->pairs[1] & need->pairs[1]) == need->pairs[1]));
+}
+
+static void history_sig_max(HistorySig *into, const HistorySig *sig) {
+    for (int w = 0; w < 2; w++) {
+        guint64 result = 0;
+        for (int shift = 0; shift < 64; shift += 4) {
+            guint64 a = (into->lanes[w] >> shift) & 0xf;
+            guint64 b = (sig->lanes[w] >> shift) & 0xf;
+            result |= MAX(a, b) << shift;
+        }
+        into->lanes[w] = result;
+    }
+    into->pairs[0] |= sig->pairs[0];
+    into->pairs[1] |= sig->pairs[1];
+}
+
+static inline guint32 history_gram_key(guint n, guchar a, guchar b, guchar c) {
+    guint32 gram = (guint32)n << 24 | (guint32)a << 16 | (guint32)b << 8 | c;
+    return (gram * 2654435761u) >> (32 - HISTORY_INDEX_BITS);
+}
+
+static void history_decode_segment(const HistoryPostings *postings, const HistorySegment *segment,
+                                   GArray *into) {
+    const guint8 *p = postings->bytes->data + segment->start;
+    guint32 slot = segment->group * HISTORY_INDEX_GROUP;
+    g_array_set_size(into, segment->count);
+    guint32 *slots = (guint32 *)into->data;
+    for (guint32 i = 0; i < segment->count; i++) {
+        guint32 delta = 0;
+        for (guint shift = 0; ; shift += 7) {
+            delta |= (guint32)(*p & 0x7f) << shift;
+            if (!(*p++ & 0x80)) break;
+        }
+        slot += delta;
+        slots[i] = slot;
+    }
+}
+
+// Rewrites the newest segment of a list, always the last in its bytes
+static void history_make_dense(HistoryPostings *postings, HistorySegment *segment) {
+    GArray *slots = g_array_sized_new(FALSE, FALSE, sizeof(guint32), segment->count);
+    history_decode_segment(postings, segment, slots);
+
+    guint32 start = (segment->start + 7) & ~7u;
+    g_byte_array_set_size(postings->bytes, start + HISTORY_GROUP_WORDS * sizeof(guint64));
+    memset(postings->bytes->data + segment->start, 0, postings->bytes->len - segment->start);
+    segment->start = start;
+    segment->dense = TRUE;
+
+    guint64 *bits = (guint64 *)(postings->bytes->data + start);
+    for (guint i = 0; i < slots->len; i++) {
+        guint32 bit = g_array_index(slots, guint32, i) % HISTORY_INDEX_GROUP;
+        bits[bit / 64] |= G_GUINT64_CONSTANT(1) << (bit % 64);
+    }
+    g_array_unref(slots);
+}
+
+static void history_post(HistoryStore *store, guint32 key, guint32 slot) {
+    HistoryPostings *postings = &store->postings[key];
+    if (!postings->bytes) {
+        postings->bytes = g_byte_array_new();
+        postings->segments = g_array_new(FALSE, FALSE, sizeof(HistorySegment));
+    } else if (postings->last == slot) {
+        return;     // The same key twice in one command
+    }
+
+    guint32 group = slot / HISTORY_INDEX_GROUP;
+    guint n_segments = postings->segments->len;
+    HistorySegment *segment = n_segments
+        ? &g_array_index(postings->segments, HistorySegment, n_segments - 1) : NULL;
+    guint32 delta = slot - postings->last;
+    if (!segment || segment->group != group) {
+        HistorySegment fresh = { group, postings->bytes->len, 0, FALSE };
+        g_array_append_val(postings->segments, fresh);
+        segment = &g_array_index(postings->segments, HistorySegment, n_segments);
+        delta = slot - group * HISTORY_INDEX_GROUP;
+    }
+    segment->count++;
+    postings->last = slot;
+
+    if (segment->dense) {
+        guint64 *bits = (guint64 *)(postings->bytes->data + segment->start);
+        guint32 bit = slot % HISTORY_INDEX_GROUP;
+        bits[bit / 64] |= G_GUINT64_CONSTANT(1) << (bit % 64);
+        return;
+    }
+
+    guint8 bytes[5];
+    guint n = 0;
+    do {
+        bytes[n++] = (delta & 0x7f) | (delta > 0x7f ? 0x80 : 0);
+        delta >>= 7;
+    } while (delta);
+    g_byte_array_append(postings->bytes, bytes, n);
+    if (segment->count == HISTORY_DENSE_COUNT) history_make_dense(postings, segment);
+}
+
+// The key of the gram ending at text[i]: the triple ending there, or from
+// the start mark before text[0] for the first two. Folded to lower case
+// unless exact, which only differs for a gram with capitals in it.
+static guint32 history_text_key(const char *text, gsize i, gboolean exact) {
+    guchar gram[3] = { 0, 0, 0 };
+    guint n = i == 0 ? 2 : 3;
+    for (guint k = 0; k < 3; k++) {
+        gssize at = (gssize)i - 2 + k;
+        guchar c = at >= 0 ? (guchar)text[at] : at == -1 ? HISTORY_START_MARK : 0;
+        gram[k] = exact ? c : g_ascii_tolower(c);
+    }
+    return history_gram_key(n | (exact ? 4 : 0), gram[0], gram[1], gram[2]);
+}
+
+static gboolean history_gram_has_capitals(const char *text, gsize i) {
+    for (gsize at = i >= 2 ? i - 2 : 0; at <= i; at++) {
+        if (g_ascii_isupper(text[at])) return TRUE;
+    }
+    return FALSE;
+}
+
+// Posts slot under the key of every gram of text, and under the exact key
+// of one with capitals, so that a query with capitals can use those
+static void history_index_grams(HistoryStore *store, guint32 slot,
+                                const char *text, guint32 length) {
+    if (!store->postings) store->postings = g_new0(HistoryPostings, 1u << HISTORY_INDEX_BITS);
+
+    for (guint32 i = 0; i < length; i++) {
+        history_post(store, history_text_key(text, i, FALSE), slot);
+        if (history_gram_has_capitals(text, i)) {
+            history_post(store, history_text_key(text, i, TRUE), slot);
+        }
+    }
+}
+
+static void history_free_postings(HistoryStore *store) {
+    if (!store->postings) return;
+    for (guint32 key = 0; key < 1u << HISTORY_INDEX_BITS; key++) {
+        if (!store->postings[key].bytes) continue;
+        g_byte_array_unref(store->postings[key].bytes);
+        g_array_unref(store->postings[key].segments);
+    }
+    g_clear_pointer(&store->postings, g_free);
+}
+
+static gsize history_index_bytes(HistoryStore *store) {
+    gsize bytes = 0;
+    for (guint32 key = 0; store->postings && key < 1u << HISTORY_INDEX_BITS; key++) {
+        if (!store->postings[key].bytes) continue;
+        bytes += store->postings[key].bytes->len +
+                 store->postings[key].segments->len * sizeof(HistorySegment);
+    }
+    return bytes;
+}
+
+static void history_push_slot(HistoryStore *store, guint32 index, const HistorySig *sig) {
+    guint32 slot = store->order->len;
+    g_array_index(store->commands, HistoryCommand, index).slot = slot;
+    g_array_append_val(store->order, index);
+    g_array_append_val(store->sigs, *sig);
+    guint32 length;
+    const char *text = history_string(store, g_array_index(store->commands, HistoryCommand,
+                                                           index).text, &length);
+    history_index_grams(store, slot, text, length);
+    if (slot % HISTORY_BLOCK_SLOTS == 0) {
+        g_array_append_val(store->block_sigs, *sig);
+    } else {
+        history_sig_max(&g_array_index(store->block_sigs, HistorySig,
+                                       store->block_sigs->len - 1), sig);
+    }
+}
+
+// Drops the slots left behind by commands that were run again
+static void history_compact(HistoryStore *store) {
+    GArray *order = store->order;
+    GArray *sigs = store->sigs;
+    guint32 live = order->len - store->moved;
+
+    store->order = g_array_sized_new(FALSE, FALSE, sizeof(guint32), live);
+    store->sigs = g_array_sized_new(FALSE, FALSE, sizeof(HistorySig), live);
+    g_array_set_size(store->block_sigs, 0);
+    history_free_postings(store);
+    for (guint32 slot = 0; slot < order->len; slot++) {
+        guint32 index = g_array_index(order, guint32, slot);
+        if (index != HISTORY_MOVED) {
+            history_push_slot(store, index, &g_array_index(sigs, HistorySig, slot));
+        }
+    }
+    g_array_unref(order);
+    g_array_unref(sigs);
+    store->moved = 0;
+    store->generation++;
+}
+
+static void history_index_string(HistoryStore *store, guint32 offset) {
+    if ((store->n_interns + 1) * 10 > (store->intern_mask + 1) * 7) {
+        history_grow_interns(store);
+    }
+
+    guint32 length;
+    const char *text = history_string(store, offset, &length);
+    guint32 hash = history_hash(text, length);
+    HistoryIntern *slot = history_intern_slot(store, text, length, hash);
+    if (slot->offset != 0) return;  // Written twice by racing writers; the first one wins
+
+    slot->offset = offset;
+    slot->hash = hash;
+    store->n_interns++;
+}
+
+// FALSE if the command isn't an indexed string
+static gboolean history_index_run(HistoryStore *store, const HistoryRunRecord *run) {
+    guint32 length;
+    const char *text = history_string(store, run->command, &length);
+    HistoryIntern *intern = history_intern_slot(store, text, length, history_hash(text, length));
+    if (intern->offset == 0) return FALSE;
+
+    if (intern->command == 0) {
+        HistoryCommand fresh = { intern->offset, 0, 0, 0, 0, 0, 0 };
+        g_array_append_val(store->commands, fresh);
+        intern->command = store->commands->len;
+    }
+    guint32 index = intern->command - 1;
+    HistoryCommand *command = &g_array_index(store->commands, HistoryCommand, index);
+    command->runs++;
+    command->exit_status = run->exit_status;
+    command->project = run->project;
+    command->cwd = run->cwd;
+    command->time = run->time;
+    store->runs++;
+
+    if (command->runs > 1) {
+        if (command->slot == store->order->len - 1) return TRUE;  // Already the newest
+        g_array_index(store->order, guint32, command->slot) = HISTORY_MOVED;
+        store->moved++;
+        HistorySig sig = g_array_index(store->sigs, HistorySig, command->slot);
+        history_push_slot(store, index, &sig);
+    } else {
+        HistorySig sig = history_signature(text, length);
+        history_push_slot(store, index, &sig);
+    }
+    return TRUE;
+}
+
+// A string record that starts at offset and ends before before
+static gboolean history_is_string(HistoryStore *store, guint32 offset, gsize before) {
+    if (offset < sizeof(HistoryFileHeader) || offset % 8 != 0 ||
+        offset + sizeof(HistoryStringRecord) > before) return FALSE;
+    const HistoryStringRecord *string = (const HistoryStringRecord *)(store->map + offset);
+    return string->header.type == HISTORY_RECORD_STRING &&
+           string->length < before - offset - sizeof(*string);
+}
+
+// Indexes the records between store->size and end. Returns the end of the
+// last whole record, which is short of end if the file ends in a torn one.
+static gsize history_index_records(HistoryStore *store, gsize end) {
+    gsize offset = store->size;
+    while (offset + sizeof(HistoryRecord) <= end) {
+        const HistoryRecord *record = (const HistoryRecord *)(store->map + offset);
+        if (record->size < sizeof(HistoryRecord) || record->size % 8 != 0 ||
+            record->size > end - offset) break;
+
+        if (record->type == HISTORY_RECORD_STRING) {
+            const HistoryStringRecord *string = (const HistoryStringRecord *)record;
+            if (record->size < sizeof(*string) + 1 ||
+                string->length > record->size - sizeof(*string) - 1 ||
+                ((const char *)(string + 1))[string->length] != '\0') break;
+            history_index_string(store, (guint32)offset);
+        } else if (record->type == HISTORY_RECORD_RUN) {
+            const HistoryRunRecord *run = (const HistoryRunRecord *)record;
+            if (record->size < sizeof(*run) ||
+                !history_is_string(store, run->command, offset) ||
+                (run->project && !history_is_string(store, run->project, offset)) ||
+                (run->cwd && !history_is_string(store, run->cwd, offset)) ||
+                !history_index_run(store, run)) break;
+        }
+        offset += record->size;
+    }
+
+    store->size = offset;
+    if (store->moved > HISTORY_COMPACT_MIN && store->moved > store->order->len / 2) {
+        history_compact(store);
+    }
+    return offset;
+}
+
+// Adds text to buffer as a string record unless the store has it already.
+// Returns its offset once buffer is appended to the store.
+static guint32 history_stage_string(HistoryStore *store, GByteArray *buffer, const char *text) {
+    static const guint8 padding[8] = { 0 };
+    gsize length = strlen(text);
+    HistoryIntern *slot = history_intern_slot(store, text, length, history_hash(text, length));
+    if (slot->offset != 0) return slot->offset;
+
+    guint32 offset = (guint32)(store->size + buffer->len);
+    HistoryStringRecord record = { { 0, HISTORY_RECORD_STRING, 0 }, (guint32)length };
+    record.header.size = (guint32)((sizeof(record) + length + 1 + 7) & ~(gsize)7);
+    g_byte_array_append(buffer, (const guint8 *)&record, sizeof(record));
+    g_byte_array_append(buffer, (const guint8 *)text, (guint)length);
+    g_byte_array_append(buffer, padding, record.header.size - sizeof(record) - (guint)length);
+    return offset;
+}
+
+static void history_encode_run(HistoryStore *store, GByteArray *buffer, const char *command,
+                               const char *project, const char *cwd, int exit_status,
+                               gint64 time) {
+    HistoryRunRecord run = { { sizeof(run), HISTORY_RECORD_RUN, 0 }, 0, 0, 0, exit_status, time };
+    run.command = history_stage_string(store, buffer, command);
+    if (project) run.project = history_stage_string(store, buffer, project);
+    if (cwd) {
+        run.cwd = project && strcmp(cwd, project) == 0
+            ? run.project : history_stage_string(store, buffer, cwd);
+    }
+    g_byte_array_append(buffer, (const guint8 *)&run, sizeof(run));
+}
+
+static HistoryStore* history_store_new(void) {
+    HistoryStore *store = g_new0(HistoryStore, 1);
+    store->fd = -1;
+    store->size = sizeof(HistoryFileHeader);
+    store->commands = g_array_new(FALSE, FALSE, sizeof(HistoryCommand));
+    store->order = g_array_new(FALSE, FALSE, sizeof(guint32));
+    store->sigs = g_array_new(FALSE, FALSE, sizeof(HistorySig));
+    store->block_sigs = g_array_new(FALSE, FALSE, sizeof(HistorySig));
+    history_grow_interns(store);
+    return store;
+}
+
+static void history_store_free(HistoryStore *store) {
+    if (store->memory) {
+        g_byte_array_unref(store->memory);
+    } else if (store->map) {
+        munmap((void *)store->map, store->map_size);
+    }
+    if (store->fd >= 0) close(store->fd);
+    g_free(store->path);
+    g_free(store->interns);
+    g_array_unref(store->commands);
+    g_array_unref(store->order);
+    g_array_unref(store->sigs);
+    g_array_unref(store->block_sigs);
+    history_free_postings(store);
+    g_free(store);
+}
+
+static void history_set_errno(GError **error, const char *what) {
+    int saved = errno;
+    g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved), "%s: %s",
+                what, g_strerror(saved));
+}
+
+// Maps size bytes plus HISTORY_MAP_RESERVE. GMappedFile can't map past the
+// end of the file, so appends would need a remap every time.
+static gboolean history_map(HistoryStore *store, gsize size, GError **error) {
+    gsize page = (gsize)sysconf(_SC_PAGESIZE);
+    gsize map_size = (size + HISTORY_MAP_RESERVE + page - 1) / page * page;
+    void *map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, store->fd, 0);
+    if (map == MAP_FAILED) {
+        history_set_errno(error, "mmap");
+        return FALSE;
+    }
+
+    if (store->map) munmap((void *)store->map, store->map_size);
+    store->map = map;
+    store->map_size = map_size;
+    return TRUE;
+}
+
+// Indexes whatever was appended since the last look. Call with the file
+// locked.
+static gboolean history_sync(HistoryStore *store, GError **error) {
+    struct stat st;
+    if (fstat(store->fd, &st) != 0) {
+        history_set_errno(error, "fstat");
+        return FALSE;
+    }
+
+    gsize end = (gsize)st.st_size;
+    if (end < store->size) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s was truncated", store->path);
+        return FALSE;
+    }
+    if (end > G_MAXUINT32) end = G_MAXUINT32;   // Offsets are 32-bit
+    if ((!store->map || end > store->map_size) && !history_map(store, end, error)) return FALSE;
+    if (end == store->size) return TRUE;
+
+    gsize good = history_index_records(store, end);
+    if (good < end) {
+        g_warning("%s: dropping %zu damaged bytes at offset %zu", store->path, end - good, good);
+        if (ftruncate(store->fd, (off_t)good) != 0) {
+            history_set_errno(error, "ftruncate");
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static gboolean history_check_header(HistoryStore *store, GError **error) {
+    HistoryFileHeader header;
+    ssize_t n = pread(store->fd, &header, sizeof(header), 0);
+    if (n == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, HISTORY_MAGIC, sizeof(header.magic));
+        header.version = HISTORY_VERSION;
+        if (write(store->fd, &header, sizeof(header)) == (ssize_t)sizeof(header)) return TRUE;
+        n = -1;
+    }
+    if (n < 0) {
+        history_set_errno(error, store->path);
+        return FALSE;
+    }
+    if (n != (ssize_t)sizeof(header) || memcmp(header.magic, HISTORY_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != HISTORY_VERSION) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                    "%s is not a version %d gmux history", store->path, HISTORY_VERSION);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static HistoryStore* history_store_open(const char *path, GError **error) {
+    int fd = g_open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        history_set_errno(error, path);
+        return NULL;
+    }
+
+    HistoryStore *store = history_store_new();
+    store->path = g_strdup(path);
+    store->fd = fd;
+    flock(fd, LOCK_EX);
+    gboolean ok = history_check_header(store, error) && history_sync(store, error);
+    flock(fd, LOCK_UN);
+    if (!ok) {
+        history_store_free(store);
+        return NULL;
+    }
+    return store;
+}
+
+// Picks up commands other gmux processes have added
+static void history_refresh(HistoryStore *store) {
+    if (store->fd < 0) return;
+    GError *error = NULL;
+    flock(store->fd, LOCK_EX);
+    if (!history_sync(store, &error)) {
+        g_warning("Cannot read command history: %s", error->message);
+        g_error_free(error);
+    }
+    flock(store->fd, LOCK_UN);
+}
+
+static gboolean history_append(HistoryStore *store, const char *command, const char *project,
+                               const char *cwd, int exit_status, gint64 time, GError **error) {
+    GByteArray *buffer = g_byte_array_new();
+    gboolean ok;
+
+    if (store->memory) {
+        history_encode_run(store, buffer, command, project, cwd, exit_status, time);
+        g_byte_array_append(store->memory, buffer->data, buffer->len);
+        store->map = (const char *)store->memory->data;
+        store->map_size = store->memory->len;
+        ok = history_index_records(store, store->memory->len) == store->memory->len;
+    } else {
+        flock(store->fd, LOCK_EX);
+        ok = history_sync(store, error);
+        if (ok) {
+            // Staged after the sync so the offsets match the end of the file
+            history_encode_run(store, buffer, command, project, cwd, exit_status, time);
+            if (store->size + buffer->len > G_MAXUINT32) {
+                g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOSPC, "%s is full", store->path);
+                ok = FALSE;
+            } else if (write(store->fd, buffer->data, buffer->len) != (ssize_t)buffer->len) {
+                history_set_errno(error, store->path);
+                ok = FALSE;
+            } else {
+                ok = history_sync(store, error);
+            }
+        }
+        flock(store->fd, LOCK_UN);
+    }
+    g_byte_array_unref(buffer);
+    return ok;
+}
+
+static void history_add_key(guint32 *keys, guint *n_keys, guint32 key) {
+    for (guint i = 0; i < *n_keys; i++) {
+        if (keys[i] == key) return;
+    }
+    if (*n_keys < HISTORY_MAX_KEYS) keys[(*n_keys)++] = key;
+}
+
+static void history_search_reset(HistorySearch *search) {
+    HistoryStore *store = search->store;
+    for (int t = 0; t < 3; t++) g_array_set_size(search->tiers[t], 0);
+    search->generation = store->generation;
+    search->limit = store->order->len;
+    search->group = (search->limit + HISTORY_INDEX_GROUP - 1) / HISTORY_INDEX_GROUP;
+    search->next = search->limit;
+}
+
+static HistorySearch* history_search_new(HistoryStore *store, const char *query) {
+    HistorySearch *search = g_new0(HistorySearch, 1);
+    search->store = store;
+    search->fold = TRUE;
+    for (const char *p = query; *p; p++) {
+        if (g_ascii_isupper(*p)) search->fold = FALSE;
+    }
+    search->query = g_strdup(query);
+    search->length = strlen(query);
+    search->sig = history_signature(query, search->length);
+
+    // The keys history_index_grams posts every command matching the query
+    // under: its triples for a substring, with the start mark for a prefix
+    for (gsize i = 0; i < search->length; i++) {
+        if (i == 0 && search->length > 1) continue;    // Implied by the next key
+        gboolean exact = !search->fold && history_gram_has_capitals(query, i);
+        guint32 key = history_text_key(query, i, exact);
+        history_add_key(search->prefix_keys, &search->n_prefix_keys, key);
+        if (i >= 2) history_add_key(search->substring_keys, &search->n_substring_keys, key);
+    }
+
+    for (int t = 0; t < 3; t++) search->tiers[t] = g_array_new(FALSE, FALSE, sizeof(guint32));
+    search->candidates = g_array_new(FALSE, FALSE, sizeof(guint32));
+    search->decoded = g_array_new(FALSE, FALSE, sizeof(guint32));
+    search->bitmap = g_new(guint64, HISTORY_GROUP_WORDS);
+    history_search_reset(search);
+    return search;
+}
+
+static void history_search_free(HistorySearch *search) {
+    for (int t = 0; t < 3; t++) g_array_unref(search->tiers[t]);
+    g_array_unref(search->candidates);
+    g_array_unref(search->decoded);
+    g_free(search->bitmap);
+    g_free(search->query);
+    g_free(search);
+}
+
+static inline gboolean history_char_matches(const HistorySearch *search, char c, char q) {
+    return (search->fold ? g_ascii_tolower(c) : c) == q;
+}
+
+static gboolean history_has_at(const HistorySearch *search, const char *text) {
+    for (gsize i = 0; i < search->length; i++) {
+        if (!history_char_matches(search, text[i], search->query[i])) return FALSE;
+    }
+    return TRUE;
+}
+
+// 0 if text starts with the query, 1 if it contains it, 2 if it has its
+// characters in order, -1 if none of those
+static int history_match(const HistorySearch *search, const char *text, guint32 length) {
+    gsize n = search->length;
+    if (n > length) return -1;
+    if (history_has_at(search, text)) return 0;
+
+    gsize matched = 0;
+    for (guint32 i = 0; i < length && matched < n; i++) {
+        if (history_char_matches(search, text[i], search->query[matched])) matched++;
+    }
+    if (matched < n) return -1;
+
+    for (guint32 i = 1; i + n <= length; i++) {
+        if (history_has_at(search, text + i)) return 1;
+    }
+    return 2;
+}
+
+static const HistorySegment* history_segment(const HistoryPostings *postings, guint32 group) {
+    if (!postings->segments) return NULL;
+    const HistorySegment *segments = (const HistorySegment *)postings->segments->data;
+    guint lo = 0, hi = postings->segments->len;
+    while (lo < hi) {
+        guint mid = (lo + hi) / 2;
+        if (segments[mid].group < group) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < postings->segments->len && segments[lo].group == group ? &segments[lo] : NULL;
+}
+
+// Files a match in its tier unless that one is full; TRUE if it was taken
+static gboolean history_take(HistorySearch *search, int tier, guint32 index) {
+    if (search->tiers[tier]->len >= HISTORY_MAX_RESULTS) return FALSE;
+    g_array_append_val(search->tiers[tier], index);
+    return TRUE;
+}
+
+// Intersects the segments of group in every key's list into candidates:
+// the shortest list of deltas decoded, the other lists of deltas merged
+// in, then the bitmaps tested. FALSE if some key has no such segment.
+static gboolean history_group_candidates(HistorySearch *search, const guint32 *keys, guint n_keys,
+                                         guint32 group) {
+    HistoryStore *store = search->store;
+    const HistoryPostings *postings[HISTORY_MAX_KEYS];
+    const HistorySegment *segments[HISTORY_MAX_KEYS];
+    int driver = -1;
+    for (guint k = 0; k < n_keys; k++) {
+        postings[k] = &store->postings[keys[k]];
+        segments[k] = history_segment(postings[k], group);
+        if (!segments[k]) return FALSE;
+        if (!segments[k]->dense && (driver < 0 || segments[k]->count < segments[driver]->count)) {
+            driver = (int)k;
+        }
+    }
+
+    GArray *candidates = search->candidates;
+    if (driver < 0) {
+        // All bitmaps: AND them and list the bits left
+        memcpy(search->bitmap, postings[0]->bytes->data + segments[0]->start,
+               HISTORY_GROUP_WORDS * sizeof(guint64));
+        for (guint k = 1; k < n_keys; k++) {
+            const guint64 *bits = (const guint64 *)(postings[k]->bytes->data + segments[k]->start);
+            for (guint w = 0; w < HISTORY_GROUP_WORDS; w++) search->bitmap[w] &= bits[w];
+        }
+        g_array_set_size(candidates, 0);
+        for (guint w = 0; w < HISTORY_GROUP_WORDS; w++) {
+            for (guint64 word = search->bitmap[w]; word; word &= word - 1) {
+                guint32 slot = group * HISTORY_INDEX_GROUP + w * 64 + __builtin_ctzll(word);
+                g_array_append_val(candidates, slot);
+            }
+        }
+        return candidates->len > 0;
+    }
+
+    history_decode_segment(postings[driver], segments[driver], candidates);
+    guint32 *slots = (guint32 *)candidates->data;
+    guint n = candidates->len;
+    for (guint k = 0; k < n_keys && n > 0; k++) {
+        if ((int)k == driver) continue;
+        guint kept = 0;
+        if (segments[k]->dense) {
+            const guint64 *bits = (const guint64 *)(postings[k]->bytes->data + segments[k]->start);
+            for (guint i = 0; i < n; i++) {
+                guint32 bit = slots[i] % HISTORY_INDEX_GROUP;
+                if (bits[bit / 64] >> (bit % 64) & 1) slots[kept++] = slots[i];
+            }
+        } else {
+            history_decode_segment(postings[k], segments[k], search->decoded);
+            const guint32 *other = (const guint32 *)search->decoded->data;
+            guint j = 0;
+            for (guint i = 0; i < n; i++) {
+                while (j < search->decoded->len && other[j] < slots[i]) j++;
+                if (j < search->decoded->len && other[j] == slots[i]) slots[kept++] = slots[i];
+            }
+        }
+        n = kept;
+    }
+    g_array_set_size(candidates, n);
+    return n > 0;
+}
+
+// Walks the posting lists one segment at a time, newest first, for the
+// tiers they can find; TRUE once every segment is done
+static gboolean history_search_index(HistorySearch *search, gint64 deadline) {
+    HistoryStore *store = search->store;
+    const guint32 *order = (const guint32 *)store->order->data;
+    const HistorySig *sigs = (const HistorySig *)store->sigs->data;
+    const HistoryCommand *commands = (const HistoryCommand *)store->commands->data;
+    GArray **tiers = search->tiers;
+    if (!store->postings) return TRUE;
+
+    while (search->group > 0 && tiers[0]->len < HISTORY_MAX_RESULTS) {
+        if (g_get_monotonic_time() >= deadline) return FALSE;
+        guint32 group = --search->group;
+
+        // Past a page of prefixes and substrings only prefixes still count
+        gboolean prefixes_only = search->n_substring_keys == 0 ||
+                                 tiers[0]->len + tiers[1]->len >= HISTORY_MAX_RESULTS;
+        const guint32 *keys = prefixes_only ? search->prefix_keys : search->substring_keys;
+        guint n_keys = prefixes_only ? search->n_prefix_keys : search->n_substring_keys;
+
+        if (!history_group_candidates(search, keys, n_keys, group)) continue;
+        const guint32 *slots = (const guint32 *)search->candidates->data;
+        for (guint i = search->candidates->len; i > 0; i--) {
+            guint32 s = slots[i - 1];
+            if (s >= search->limit) continue;
+            guint32 index = order[s];
+            if (index == HISTORY_MOVED || !history_sig_covers(&sigs[s], &search->sig, TRUE)) continue;
+
+            guint32 length;
+            const char *text = history_string(store, commands[index].text, &length);
+            int tier = history_match(search, text, length);
+            if (tier == 0) {
+                history_take(search, 0, index);
+                if (tiers[0]->len == HISTORY_MAX_RESULTS) break;   // Nothing later can outrank these
+            } else if (tier == 1 && !prefixes_only) {
+                history_take(search, 1, index);
+                prefixes_only = tiers[0]->len + tiers[1]->len >= HISTORY_MAX_RESULTS;
+            }
+        }
+    }
+    return TRUE;
+}
+
+// Scans every slot, newest first, for the tiers the index can't find
+static gboolean history_search_scan(HistorySearch *search, gint64 deadline) {
+    HistoryStore *store = search->store;
+    const guint32 *order = (const guint32 *)store->order->data;
+    const HistorySig *sigs = (const HistorySig *)store->sigs->data;
+    const HistorySig *blocks = (const HistorySig *)store->block_sigs->data;
+    const HistoryCommand *commands = (const HistoryCommand *)store->commands->data;
+    GArray **tiers = search->tiers;
+    // The tiers already complete from the index
+    int first = search->n_substring_keys ? 2 : search->n_prefix_keys ? 1 : 0;
+    guint32 slot = search->next;
+    guint32 block = G_MAXUINT32;
+    guint budget = 0;
+
+    while (slot > 0) {
+        guint found = tiers[0]->len + tiers[1]->len + tiers[2]->len;
+        // A page of matches ranking at least as high as anything still to find
+        guint ahead = first == 0 ? tiers[0]->len : first == 1 ? found - tiers[2]->len : found;
+        if (ahead >= HISTORY_MAX_RESULTS) break;
+        // With a full page of any kind only substrings can still make it
+        gboolean pairs = found >= HISTORY_MAX_RESULTS;
+
+        if (++budget % 1024 == 0 && g_get_monotonic_time() >= deadline) {
+            search->next = slot;
+            return FALSE;
+        }
+        guint32 s = slot - 1;
+        if (s / HISTORY_BLOCK_SLOTS != block) {
+            block = s / HISTORY_BLOCK_SLOTS;
+            if (!history_sig_covers(&blocks[block], &search->sig, pairs)) {
+                slot = block * HISTORY_BLOCK_SLOTS;
+                continue;
+            }
+        }
+        slot = s;
+        guint32 index = order[s];
+        if (index == HISTORY_MOVED || !history_sig_covers(&sigs[s], &search->sig, pairs)) continue;
+
+        guint32 length;
+        const char *text = history_string(store, commands[index].text, &length);
+        int tier = history_match(search, text, length);
+        if (tier >= first) history_take(search, tier, index);
+    }
+
+    search->next = slot;
+    return TRUE;
+}
+
+// Searches newest first until the deadline (monotonic µs); TRUE once done.
+// Commands added since the search began are not looked at.
+static gboolean history_search_step(HistorySearch *search, gint64 deadline) {
+    HistoryStore *store = search->store;
+    if (search->done) return TRUE;
+    if (search->generation != store->generation) {
+        history_search_reset(search);   // Compacted under us: the slots moved
+    }
+
+    gint64 start = g_get_monotonic_time();
+    if (search->n_prefix_keys && !history_search_index(search, deadline)) {
+        search->busy_us += g_get_monotonic_time() - start;
+        return FALSE;
+    }
+    search->done = search->tiers[0]->len >= HISTORY_MAX_RESULTS ||
+                   history_search_scan(search, deadline);
+    search->busy_us += g_get_monotonic_time() - start;
+    return search->done;
+}
+
+static guint history_search_found(const HistorySearch *search) {
+    return search->tiers[0]->len + search->tiers[1]->len + search->tiers[2]->len;
+}
+
+// The best matches found so far, as command indexes, best first
+static GArray* history_search_results(HistorySearch *search) {
+    GArray *results = g_array_new(FALSE, FALSE, sizeof(guint32));
+    for (int t = 0; t < 3 && results->len < HISTORY_MAX_RESULTS; t++) {
+        guint take = MIN(search->tiers[t]->len, HISTORY_MAX_RESULTS - results->len);
+        g_array_append_vals(results, search->tiers[t]->data, take);
+    }
+    return results;
+}
+
+static JsonObject* history_command_to_json(HistoryStore *store, guint32 index) {
+    const HistoryCommand *command = &g_array_index(store->commands, HistoryCommand, index);
+    JsonObject *obj = json_object_new();
+    json_object_set_string_member(obj, "command", history_string(store, command->text, NULL));
+    json_object_set_int_member(obj, "runs", command->runs);
+    if (command->exit_status >= 0) json_object_set_int_member(obj, "exit_status", command->exit_status);
+    json_object_set_int_member(obj, "time", command->time / G_USEC_PER_SEC);
+    if (command->project) {
+        json_object_set_string_member(obj, "project", history_string(store, command->project, NULL));
+    }
+    if (command->cwd) json_object_set_string_member(obj, "cwd", history_string(store, command->cwd, NULL));
+    return obj;
+}
+
+// Opened on first use; NULL if it can't be
+static HistoryStore* app_history(AppState *app) {
+    if (app->history || app->history_unavailable) return app->history;
+
+    char *dir = get_data_dir();
+    char *path = g_build_filename(dir, HISTORY_FILE_NAME, NULL);
+    GError *error = NULL;
+    gint64 start = g_get_monotonic_time();
+    app->history = history_store_open(path, &error);
+    if (app->history) {
+        debug_log("history: %u commands, %" G_GUINT64_FORMAT " runs from %s in %.1f ms",
+                  app->history->commands->len, app->history->runs, path,
+                  (g_get_monotonic_time() - start) / 1000.0);
+    } else {
+        g_warning("Command history is off: %s", error->message);
+        g_error_free(error);
+        app->history_unavailable = TRUE;
+    }
+    g_free(path);
+    g_free(dir);
+    return app->history;
+}
+
+// The shell's SHELL_COMMAND_TERMPROP: "<sequence> <command line>". The
+// sequence only makes each value differ from the last, so the same
+// command twice still changes the termprop. VTE may report it just before
+// or just after the 133;C it belongs to, so it fills in a run that started
+// without one, and otherwise waits for the next run.
+static void history_command_line(SubTab *subtab, const guint8 *data, gsize size) {
+    const guint8 *space = data ? memchr(data, ' ', size) : NULL;
+    char *text = space ? g_strndup((const char *)space + 1, size - (gsize)(space + 1 - data)) : NULL;
+    if (text) g_strchomp(text);
+    if (!text || text[0] == '\0' || text[0] == ' ' || strlen(text) > HISTORY_MAX_COMMAND ||
+        !g_utf8_validate(text, -1, NULL)) {
+        g_clear_pointer(&text, g_free);
+    }
+
+    g_free(subtab->shell_command);
+    subtab->shell_command = text;
+    if (text && subtab->history_run && !subtab->history_run->command) {
+        subtab->history_run->command = g_steal_pointer(&subtab->shell_command);
+    }
+}
+
+// 133;C, from the Command Timeline
+static void history_command_started(SubTab *subtab) {
+    history_command_finished(subtab, -1);   // The last one never said how it ended
+
+    HistoryRun *run = g_new0(HistoryRun, 1);
+    run->command = g_steal_pointer(&subtab->shell_command);
+    run->cwd = subtab_current_dir(subtab);
+    run->time = g_get_real_time();
+    subtab->history_run = run;
+}
+
+// 133;D, or -1 when the command's tab goes away first
+static void history_command_finished(SubTab *subtab, int exit_status) {
+    HistoryRun *run = g_steal_pointer(&subtab->history_run);
+    if (!run) return;
+
+    // Without a command line (a shell without the snippet, or one it left
+    // out) there is nothing to keep
+    HistoryStore *store = run->command ? app_history(subtab->parent_tab->app) : NULL;
+    GError *error = NULL;
+    if (store && !history_append(store, run->command, subtab->parent_tab->path, run->cwd,
+                                 exit_status, run->time, &error)) {
+        g_warning("Cannot add to the command history: %s", error->message);
+        g_error_free(error);
+    }
+    g_free(run->command);
+    g_free(run->cwd);
+    g_free(run);
+}
+
+// Picker: a popover over the terminals that types the chosen command into
+// the active tab, without running it
+
+static char* history_age(gint64 time) {
+    gint64 seconds = MAX(g_get_real_time() - time, 0) / G_USEC_PER_SEC;
+    if (seconds < 60) return g_strdup("just now");
+    if (seconds < 3600) return g_strdup_printf("%" G_GINT64_FORMAT " min ago", seconds / 60);
+    if (seconds < 86400) return g_strdup_printf("%" G_GINT64_FORMAT " h ago", seconds / 3600);
+    return g_strdup_printf("%" G_GINT64_FORMAT " d ago", seconds / 86400);
+}
+
+static GtkWidget* history_row_new(HistoryStore *store, guint32 index) {
+    const HistoryCommand *command = &g_array_index(store->commands, HistoryCommand, index);
+    const char *text = history_string(store, command->text, NULL);
+
+    GString *meta = g_string_new(NULL);
+    if (command->cwd) {
+        char *dir = compact_project_path(history_string(store, command->cwd, NULL));
+        g_string_append(meta, dir);
+        g_free(dir);
+    }
+    char *age = history_age(command->time);
+    g_string_append_printf(meta, "%s%s", meta->len ? " · " : "", age);
+    g_free(age);
+    if (command->runs > 1) g_string_append_printf(meta, " · %u runs", command->runs);
+    if (command->exit_status > 0) g_string_append_printf(meta, " · exit %d", command->exit_status);
+
+    GtkWidget *label = gtk_label_new(text);
+    gtk_label_set_xalign(GTK_LABEL(label), 0.0);
+    gtk_label_set_ellipsize(GTK_LABEL(label), PANGO_ELLIPSIZE_END);
+    gtk_label_set_single_line_mode(GTK_LABEL(label), TRUE);
+    gtk_widget_set_tooltip_text(label, text);
+
+    GtkWidget *meta_label = gtk_label_new(meta->str);
+    gtk_widget_add_css_class(meta_label, "dim-label");
+    gtk_label_set_xalign(GTK_LABEL(meta_label), 0.0);
+    gtk_label_set_ellipsize(GTK_LABEL(meta_label), PANGO_ELLIPSIZE_MIDDLE);
+    g_string_free(meta, TRUE);
+
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 2);
+    gtk_box_append(GTK_BOX(box), label);
+    gtk_box_append(GTK_BOX(box), meta_label);
+
+    GtkWidget *row = gtk_list_box_row_new();
+    gtk_list_box_row_set_child(GTK_LIST_BOX_ROW(row), box);
+    g_object_set_data_full(G_OBJECT(row), "command", g_strdup(text), g_free);
+    return row;
+}
+
+// Refilled as later slices find more; the selected position is kept
+static void fill_history_list(WorkspaceWindow *win) {
+    GtkListBox *list = GTK_LIST_BOX(win->history_list);
+    GtkListBoxRow *selected = gtk_list_box_get_selected_row(list);
+    int position = selected ? gtk_list_box_row_get_index(selected) : 0;
+    GtkWidget *child;
+    while ((child = gtk_widget_get_first_child(win->history_list)) != NULL) {
+        gtk_list_box_remove(list, child);
+    }
+
+    GArray *results = history_search_results(win->history_search);
+    for (guint i = 0; i < results->len; i++) {
+        gtk_list_box_append(list, history_row_new(win->app->history,
+                                                  g_array_index(results, guint32, i)));
+    }
+    position = MIN(position, (int)results->len - 1);
+    gtk_list_box_select_row(list, gtk_list_box_get_row_at_index(list, MAX(position, 0)));
+    win->history_shown = history_search_found(win->history_search);
+    g_array_unref(results);
+}
+
+static void cancel_history_search(WorkspaceWindow *win) {
+    g_clear_handle_id(&win->history_idle_id, g_source_remove);
+    g_clear_pointer(&win->history_search, history_search_free);
+}
+
+static gboolean on_history_search_idle(gpointer user_data) {
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
+    if (!history_search_step(win->history_search, g_get_monotonic_time() + HISTORY_SLICE_US)) {
+        if (history_search_found(win->history_search) != win->history_shown) {
+            fill_history_list(win);
+        }
+        return G_SOURCE_CONTINUE;
+    }
+
+    win->history_idle_id = 0;
+    debug_log("history: \"%s\" took %.1f ms", win->history_search->query,
+              win->history_search->busy_us / 1000.0);
+    fill_history_list(win);
+    return G_SOURCE_REMOVE;
+}
+
+// Every keystroke searches afresh; the first slice is shown right away
+static void on_history_query_changed(GtkEditable *editable, gpointer user_data) {
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
+    cancel_history_search(win);
+    if (!win->app->history) return;
+
+    win->history_search = history_search_new(win->app->history, gtk_editable_get_text(editable));
+    gboolean done = history_search_step(win->history_search,
+                                        g_get_monotonic_time() + HISTORY_SLICE_US);
+    gtk_list_box_unselect_all(GTK_LIST_BOX(win->history_list));   // A new query starts at the top
+    fill_history_list(win);
+    if (!done) win->history_idle_id = g_idle_add(on_history_search_idle, win);
+}
+
+static void insert_history_row(WorkspaceWindow *win, GtkListBoxRow *row) {
+    const char *text = row ? g_object_get_data(G_OBJECT(row), "command") : NULL;
+    SubTab *subtab = win->active_project ? win->active_project->active_subtab : NULL;
+
+    gtk_popover_popdown(GTK_POPOVER(win->history_popover));
+    if (!text || !subtab || !subtab->spawned) return;
+    // As a paste, so a command spanning lines is not run line by line
+    vte_terminal_paste_text(subtab->terminal, text);
+    gtk_widget_grab_focus(GTK_WIDGET(subtab->terminal));
+}
+
+static void on_history_row_activated(GtkListBox *box, GtkListBoxRow *row, gpointer user_data) {
+    (void)box;
+    insert_history_row((WorkspaceWindow *)user_data, row);
+}
+
+static void on_history_entry_activate(GtkSearchEntry *entry, gpointer user_data) {
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
+    (void)entry;
+    insert_history_row(win, gtk_list_box_get_selected_row(GTK_LIST_BOX(win->history_list)));
+}
+
+static void on_history_entry_stop(GtkSearchEntry *entry, gpointer user_data) {
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
+    (void)entry;
+    gtk_popover_popdown(GTK_POPOVER(win->history_popover));
+}
+
+// Down moves into the list; typing there goes back to the entry
+static gboolean on_history_entry_key(GtkEventControllerKey *controller, guint keyval,
+                                     guint keycode, GdkModifierType state, gpointer user_data) {
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
+    (void)controller;
+    (void)keycode;
+    (void)state;
+    if (keyval != GDK_KEY_Down && keyval != GDK_KEY_KP_Down) return FALSE;
+
+    GtkListBox *list = GTK_LIST_BOX(win->history_list);
+    GtkListBoxRow *row = gtk_list_box_get_selected_row(list);
+    if (row) row = gtk_list_box_get_row_at_index(list, gtk_list_box_row_get_index(row) + 1);
+    if (!row) row = gtk_list_box_get_row_at_index(list, 0);
+    if (row) {
+        gtk_list_box_select_row(list, row);
+        gtk_widget_grab_focus(GTK_WIDGET(row));
+    }
+    return TRUE;
+}
+
+static void on_history_popover_closed(GtkPopover *popover, gpointer user_data) {
+    (void)popover;
+    cancel_history_search((WorkspaceWindow *)user_data);
+}
+
+static void build_history_picker(WorkspaceWindow *win) {
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 6);
+
+    win->history_entry = gtk_search_entry_new();
+    g_object_set(win->history_entry, "placeholder-text", "Search command history", NULL);
+    g_signal_connect(win->history_entry, "changed", G_CALLBACK(on_history_query_changed), win);
+    g_signal_connect(win->history_entry, "activate", G_CALLBACK(on_history_entry_activate), win);
+    g_signal_connect(win->history_entry, "stop-search", G_CALLBACK(on_history_entry_stop), win);
+    GtkEventController *keys = gtk_event_controller_key_new();
+    g_signal_connect(keys, "key-pressed", G_CALLBACK(on_history_entry_key), win);
+    gtk_widget_add_controller(win->history_entry, keys);
+    gtk_box_append(GTK_BOX(box), win->history_entry);
+
+    win->history_list = gtk_list_box_new();
+    gtk_list_box_set_activate_on_single_click(GTK_LIST_BOX(win->history_list), TRUE);
+    gtk_list_box_set_placeholder(GTK_LIST_BOX(win->history_list),
+                                 gtk_label_new("No matching commands"));
+    g_signal_connect(win->history_list, "row-activated",
+                     G_CALLBACK(on_history_row_activated), win);
+    gtk_search_entry_set_key_capture_widget(GTK_SEARCH_ENTRY(win->history_entry),
+                                            win->history_list);
+
+    GtkWidget *scrolled = gtk_scrolled_window_new();
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled),
+                                   GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+    gtk_scrolled_window_set_min_content_height(GTK_SCROLLED_WINDOW(scrolled), 360);
+    gtk_scrolled_window_set_min_content_width(GTK_SCROLLED_WINDOW(scrolled), 560);
+    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scrolled), win->history_list);
+    gtk_box_append(GTK_BOX(box), scrolled);
+
+    win->history_popover = gtk_popover_new();
+    gtk_popover_set_child(GTK_POPOVER(win->history_popover), box);
+    gtk_popover_set_has_arrow(GTK_POPOVER(win->history_popover), FALSE);
+    gtk_popover_set_position(GTK_POPOVER(win->history_popover), GTK_POS_BOTTOM);
+    g_signal_connect(win->history_popover, "closed", G_CALLBACK(on_history_popover_closed), win);
+    gtk_widget_set_parent(win->history_popover, win->notebook);
+}
+
+static gboolean show_history_picker(WorkspaceWindow *win) {
+    HistoryStore *store = app_history(win->app);
+    if (!store) return FALSE;
+    history_refresh(store);
+
+    if (!win->history_popover) build_history_picker(win);
+    GdkRectangle top = { gtk_widget_get_width(win->notebook) / 2, 0, 1, 1 };
+    gtk_popover_set_pointing_to(GTK_POPOVER(win->history_popover), &top);
+    gtk_popover_popup(GTK_POPOVER(win->history_popover));
+
+    // Setting "" when it already is doesn't emit "changed"
+    gtk_editable_set_text(GTK_EDITABLE(win->history_entry), "");
+    on_history_query_changed(GTK_EDITABLE(win->history_entry), win);
+    gtk_widget_grab_focus(win->history_entry);
+    return TRUE;
+}
+
+static void free_history_picker(WorkspaceWindow *win) {
+    cancel_history_search(win);
+    g_clear_pointer(&win->history_popover, gtk_widget_unparent);
+}
+
+static void stop_history(AppState *app) {
+    for (GList *l = app->windows; l; l = l->next) {
+        cancel_history_search((WorkspaceWindow *)l->data);
+    }
+    g_clear_pointer(&app->history, history_store_free);
+    app->history_unavailable = TRUE;    // Tabs freed later must not reopen it
+}
+
+// Builds a history of count synthetic runs in memory and times searches
+// over it: the first slice, as the picker shows it, and the whole scan
+static JsonObject* run_history_bench(guint count) {
+    static const char *const words[] = {
+        "api", "auth", "build", "cache", "config", "core", "db", "deploy", "docs", "gateway",
+        "infra", "jobs", "kafka", "metrics", "parser", "payments", "proxy", "queue", "render",
+        "search", "server", "storage", "sync", "tests", "users", "utils", "web", "worker",
+    };
+    static const char *const queries[] = {
+        "", "g", "git", "git commit", "make -j", "kubectl logs", "host42", "deploy/worker-9",
+        "Docker", "dkr", "gcmf", "zzqx",
+    };
+
+    HistoryStore *store = history_store_new();
+    HistoryFileHeader header = { HISTORY_MAGIC, HISTORY_VERSION, { 0 } };
+    store->memory = g_byte_array_new();
+    g_byte_array_append(store->memory, (const guint8 *)&header, sizeof(header));
+
+    GRand *rand = g_rand_new_with_seed(1);
+    char *projects[4];
+    for (int p = 0; p < 4; p++) projects[p] = g_strdup_printf("/home/user/src/%s", words[p * 5]);
+    gint64 start = g_get_monotonic_time();
+    for (guint i = 0; i < count; i++) {
+        const char *a = words[g_rand_int_range(rand, 0, G_N_ELEMENTS(words))];
+        const char *b = words[g_rand_int_range(rand, 0, G_N_ELEMENTS(words))];
+        guint n = (guint)g_rand_int_range(rand, 0, 100000);
+        char *command;
+        switch (i % 6) {
+        case 0: command = g_strdup_printf("git commit -m \"fix %s in %s %u\"", a, b, n); break;
+        case 1: command = g_strdup_printf("make -j%u %s-%s", n % 32 + 1, a, b); break;
+        case 2: command = g_strdup_printf("ssh %s@host%u.%s.example.com", a, n, b); break;
+        case 3: command = g_strdup_printf("kubectl logs -n %s deploy/%s-%u --tail=100", a, b, n); break;
+        case 4: command = g_strdup_printf("grep -rn %s_%u src/%s", a, n, b); break;
+        default: command = g_strdup_printf("docker run --rm -it %s/%s:%u", a, b, n); break;
+        }
+        history_append(store, command, projects[i % 4], projects[i % 4], i % 17 ? 0 : 1,
+                       (gint64)i * G_USEC_PER_SEC, NULL);
+        g_free(command);
+    }
+
+    JsonObject *result = json_object_new();
+    json_object_set_int_member(result, "runs", (gint64)store->runs);
+    json_object_set_int_member(result, "commands", store->commands->len);
+    json_object_set_int_member(result, "bytes", (gint64)store->size);
+    json_object_set_int_member(result, "build_ms", (g_get_monotonic_time() - start) / 1000);
+    json_object_set_int_member(result, "index_bytes", (gint64)history_index_bytes(store));
+    gsize memory = history_index_bytes(store) +
+                   (store->sigs->len + store->block_sigs->len) * sizeof(HistorySig) +
+                   store->commands->len * sizeof(HistoryCommand) +
+                   store->order->len * sizeof(guint32) +
+                   (store->intern_mask + 1) * sizeof(HistoryIntern);
+    json_object_set_int_member(result, "memory_bytes", (gint64)memory);
+    json_object_set_int_member(result, "bound_us", HISTORY_TARGET_US);
+
+    JsonArray *searches = json_array_new();
+    gboolean pass = TRUE;
+    for (gsize q = 0; q < G_N_ELEMENTS(queries); q++) {
+        HistorySearch *search = history_search_new(store, queries[q]);
+        gboolean done = history_search_step(search, g_get_monotonic_time() + HISTORY_SLICE_US);
+        gint64 first = search->busy_us;
+        while (!done) done = history_search_step(search, G_MAXINT64);
+        GArray *results = history_search_results(search);
+
+        JsonObject *obj = json_object_new();
+        json_object_set_string_member(obj, "query", queries[q]);
+        json_object_set_int_member(obj, "first_slice_us", first);
+        json_object_set_int_member(obj, "elapsed_us", search->busy_us);
+        json_object_set_int_member(obj, "results", results->len);
+        // Later slices run between frames, so only the first one is bound
+        json_object_set_boolean_member(obj, "pass", first < HISTORY_TARGET_US);
+        json_array_add_object_element(searches, obj);
+        pass = pass && first < HISTORY_TARGET_US;
+        g_array_unref(results);
+        history_search_free(search);
+    }
+    json_object_set_array_member(result, "searches", searches);
+    json_object_set_boolean_member(result, "pass", pass);
+
+    for (int p = 0; p < 4; p++) g_free(projects[p]);
+    g_rand_free(rand);
+    history_store_free(store);
+    return result;
+}
+
+//=============================================================================
+// Project Discovery
+//=============================================================================
+
+// With discovery_roots set in settings.conf, gmux looks for git
+// repositories (a ".git" directory, or a ".git" file for worktrees) below
+// those roots and offers them as candidate projects. A background thread
+// owns the index. It loads <data>/discovery.idx, and recrawls with a worker
+// pool if the index is missing, stale or was built for other settings.
+// After that it keeps the index current with inotify watches on every
+// crawled directory. Repository roots get a narrower watch that only
+// reports removals, so deleting or moving away a ".git" turns the
+// directory back into one that is crawled. The main thread only receives
+// finished, sorted snapshots of the repository list.
+
+#define DISCOVERY_INDEX_NAME "discovery.idx"
+#define DISCOVERY_INDEX_MAGIC "gmux-discovery 1"
+#define DISCOVERY_RESCAN_SECONDS (24 * 3600)
+#define DISCOVERY_MAX_WORKERS 8
+#define DISCOVERY_SETTLE_MS 500  // Quiet time before publishing inotify changes
+#define DISCOVERY_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#define DISCOVERY_REPO_MASK (IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR)
+
+// Never descended into, along with every hidden directory
+static const char *discovery_default_ignore[] = {
+    "node_modules", "target", "build", "dist", "vendor", "__pycache__", "venv", NULL
+};
+
+struct _Discovery {
+    gint refcount;
+    gint cancelled;
+    AppState *app;              // Main thread only
+
+    // Settings, fixed for the lifetime of the object
+    char **roots;
+    int max_depth;
+    GPtrArray *ignore;          // GPatternSpec*
+    char *config_key;           // Stored in the index; a mismatch forces a rescan
+    char *index_path;
+
+    // Crawl
+    GThreadPool *pool;
+    gint pending;               // Directories queued or being read
+    gint entries;               // Directory entries seen, for logging
+    GMutex crawl_lock;
+    GCond crawl_done;
+
+    // Results, under lock
+    GMutex lock;
+    GHashTable *repos;          // path -> NULL
+    GHashTable *dirs;           // crawled non-repo directory -> GINT_TO_POINTER(depth + 1)
+
+    // Incremental updates, discovery thread only
+    int inotify_fd;
+    int wake_fd;
+    GHashTable *watches;        // wd -> directory path
+    gboolean overflowed;
+    gboolean watch_limit_hit;
+};
+
+typedef struct {
+    char *path;
+    int depth;
+} DiscoveryDir;
+
+typedef struct {
+    Discovery *discovery;
+    GPtrArray *paths;
+} DiscoverySnapshot;
+
+static Discovery* discovery_ref(Discovery *d) {
+    g_atomic_int_inc(&d->refcount);
+    return d;
+}
+
+static void discovery_unref(Discovery *d) {
+    if (!g_atomic_int_dec_and_test(&d->refcount)) return;
+
+    g_strfreev(d->roots);
+    g_ptr_array_unref(d->ignore);
+    g_free(d->config_key);
+    g_free(d->index_path);
+    g_mutex_clear(&d->crawl_lock);
+    g_cond_clear(&d->crawl_done);
+    g_mutex_clear(&d->lock);
+    g_hash_table_destroy(d->repos);
+    g_hash_table_destroy(d->dirs);
+    g_hash_table_destroy(d->watches);
+    if (d->wake_fd >= 0) close(d->wake_fd);
+    g_free(d);
+}
+
+static char* expand_home_path(const char *path) {
+    if (g_str_has_prefix(path, "~/") || strcmp(path, "~") == 0) {
+        return g_build_filename(g_get_home_dir(), path + 1, NULL);
+    }
+    return g_canonicalize_filename(path, g_get_home_dir());
+}
+
+// Returns NULL when no configured root is usable.
+static Discovery* discovery_new(AppState *app) {
+    TerminalSettings *s = &app->settings;
+    GPtrArray *roots = g_ptr_array_new();
+    char **parts = g_strsplit(s->discovery_roots, ":", -1);
+    for (int i = 0; parts[i] != NULL; i++) {
+        g_strstrip(parts[i]);
+        if (parts[i][0] == '\0') continue;
+        char *root = expand_home_path(parts[i]);
+        if (g_file_test(root, G_FILE_TEST_IS_DIR)) {
+            g_ptr_array_add(roots, root);
+        } else {
+            g_warning("Ignoring discovery root %s: not a directory", root);
+            g_free(root);
+        }
+    }
+    g_strfreev(parts);
+    if (roots->len == 0) {
+        g_ptr_array_free(roots, TRUE);
+        return NULL;
+    }
+    g_ptr_array_add(roots, NULL);
+
+    Discovery *d = g_new0(Discovery, 1);
+    d->refcount = 1;
+    d->app = app;
+    d->roots = (char **)g_ptr_array_free(roots, FALSE);
+    d->max_depth = s->discovery_depth;
+
+    d->ignore = g_ptr_array_new_with_free_func((GDestroyNotify)g_pattern_spec_free);
+    for (int i = 0; discovery_default_ignore[i] != NULL; i++) {
+        g_ptr_array_add(d->ignore, g_pattern_spec_new(discovery_default_ignore[i]));
+    }
+    if (s->discovery_ignore) {
+        char **patterns = g_strsplit(s->discovery_ignore, ",", -1);
+        for (int i = 0; patterns[i] != NULL; i++) {
+            g_strstrip(patterns[i]);
+            if (patterns[i][0] != '\0')
+                g_ptr_array_add(d->ignore, g_pattern_spec_new(patterns[i]));
+        }
+        g_strfreev(patterns);
+    }
+
+    char *joined = g_strjoinv(":", d->roots);
+    d->config_key = g_strdup_printf("%s|%d|%s", joined, d->max_depth,
+                                    s->discovery_ignore ? s->discovery_ignore : "");
+    g_free(joined);
+    d->index_path = g_build_filename(config_store.data_dir, DISCOVERY_INDEX_NAME, NULL);
+
+    g_mutex_init(&d->crawl_lock);
+    g_cond_init(&d->crawl_done);
+    g_mutex_init(&d->lock);
+    d->repos = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    d->dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    d->watches = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    d->inotify_fd = -1;
+    d->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    return d;
+}
+
+static gboolean discovery_is_ignored(Discovery *d, const char *name) {
+    if (name[0] == '.') return TRUE;
+    for (guint i = 0; i < d->ignore->len; i++) {
+        if (g_pattern_spec_match_string(d->ignore->pdata[i], name)) return TRUE;
+    }
+    return FALSE;
+}
+
+static gboolean has_path_prefix(const char *path, const char *prefix) {
+    size_t len = strlen(prefix);
+    return strncmp(path, prefix, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// Reads one directory and records it as a repo or a crawled directory.
+// Returns the subdirectories to descend into, or NULL if it can't be read.
+static GPtrArray* discovery_read_dir(Discovery *d, const char *path, int depth,
+                                     gboolean *is_repo) {
+    DIR *dir = opendir(path);
+    if (!dir) return NULL;
+
+    GPtrArray *subdirs = g_ptr_array_new_with_free_func(g_free);
+    int entries = 0;
+    *is_repo = FALSE;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        entries++;
+        if (strcmp(name, ".git") == 0) {
+            *is_repo = TRUE;
+            break;
+        }
+        if (depth >= d->max_depth || discovery_is_ignored(d, name)) continue;
+
+        gboolean is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                     S_ISDIR(st.st_mode);
+        }
+        if (is_dir && !strchr(name, '\n')) {
+            g_ptr_array_add(subdirs, g_build_filename(path, name, NULL));
+        }
+    }
+    closedir(dir);
+    g_atomic_int_add(&d->entries, entries);
+
+    g_mutex_lock(&d->lock);
+    if (*is_repo) {
+        g_hash_table_add(d->repos, g_strdup(path));
+        g_ptr_array_set_size(subdirs, 0);
+    } else {
+        g_hash_table_insert(d->dirs, g_strdup(path), GINT_TO_POINTER(depth + 1));
+    }
+    g_mutex_unlock(&d->lock);
+    return subdirs;
+}
+
+static void discovery_crawl_worker(gpointer data, gpointer user_data);
+
+static void discovery_queue_dir(Discovery *d, const char *path, int depth) {
+    DiscoveryDir *dir = g_new(DiscoveryDir, 1);
+    dir->path = g_strdup(path);
+    dir->depth = depth;
+    g_atomic_int_inc(&d->pending);
+    g_thread_pool_push(d->pool, dir, NULL);
+}
+
+static void discovery_crawl_worker(gpointer data, gpointer user_data) {
+    DiscoveryDir *dir = (DiscoveryDir *)data;
+    Discovery *d = (Discovery *)user_data;
+
+    if (!g_atomic_int_get(&d->cancelled)) {
+        gboolean is_repo;
+        GPtrArray *subdirs = discovery_read_dir(d, dir->path, dir->depth, &is_repo);
+        if (subdirs) {
+            for (guint i = 0; i < subdirs->len; i++) {
+                discovery_queue_dir(d, subdirs->pdata[i], dir->depth + 1);
+            }
+            g_ptr_array_unref(subdirs);
+        }
+    }
+
+    g_free(dir->path);
+    g_free(dir);
+
+    if (g_atomic_int_dec_and_test(&d->pending)) {
+        g_mutex_lock(&d->crawl_lock);
+        g_cond_signal(&d->crawl_done);
+        g_mutex_unlock(&d->crawl_lock);
+    }
+}
+
+// Full parallel crawl of every root; returns once all workers are idle.
+static void discovery_crawl(Discovery *d) {
+    gint64 start = g_get_monotonic_time();
+    int workers = CLAMP((int)g_get_num_processors(), 1, DISCOVERY_MAX_WORKERS);
+
+    g_mutex_lock(&d->lock);
+    g_hash_table_remove_all(d->repos);
+    g_hash_table_remove_all(d->dirs);
+    g_mutex_unlock(&d->lock);
+    g_atomic_int_set(&d->entries, 0);
+
+    d->pool = g_thread_pool_new(discovery_crawl_worker, d, workers, FALSE, NULL);
+    for (int i = 0; d->roots[i] != NULL; i++) {
+        discovery_queue_dir(d, d->roots[i], 0);
+    }
+
+    g_mutex_lock(&d->crawl_lock);
+    while (g_atomic_int_get(&d->pending) > 0) {
+        g_cond_wait(&d->crawl_done, &d->crawl_lock);
+    }
+    g_mutex_unlock(&d->crawl_lock);
+    g_thread_pool_free(d->pool, FALSE, TRUE);
+    d->pool = NULL;
+
+    debug_log("discovery: crawled %d entries with %d workers in %.1f ms, %u repos",
+              g_atomic_int_get(&d->entries), workers,
+              (g_get_monotonic_time() - start) / 1000.0, g_hash_table_size(d->repos));
+}
+
+// Watches path with DISCOVERY_WATCH_MASK, or DISCOVERY_REPO_MASK for a repo
+// root. Re-adding a path replaces the mask on its existing watch.
+static void discovery_watch_dir(Discovery *d, const char *path, uint32_t mask) {
+    int wd = inotify_add_watch(d->inotify_fd, path, mask);
+    if (wd < 0) {
+        if (errno == ENOSPC && !d->watch_limit_hit) {
+            d->watch_limit_hit = TRUE;
+            g_warning("Out of inotify watches; new repositories under %s will only "
+                      "show up after the next rescan (raise fs.inotify.max_user_watches)",
+                      path);
+        }
+        return;
+    }
+    g_hash_table_replace(d->watches, GINT_TO_POINTER(wd), g_strdup(path));
+}
+
+// Crawls a subtree on the calling thread (used for inotify updates) and
+// watches the directories it finds.
+static void discovery_crawl_subtree(Discovery *d, const char *path, int depth) {
+    GQueue queue = G_QUEUE_INIT;
+    DiscoveryDir *first = g_new(DiscoveryDir, 1);
+    first->path = g_strdup(path);
+    first->depth = depth;
+    g_queue_push_tail(&queue, first);
+
+    DiscoveryDir *dir;
+    while ((dir = g_queue_pop_head(&queue)) != NULL) {
+        gboolean is_repo;
+        GPtrArray *subdirs = discovery_read_dir(d, dir->path, dir->depth, &is_repo);
+        if (subdirs) {
+            discovery_watch_dir(d, dir->path,
+                                is_repo ? DISCOVERY_REPO_MASK : DISCOVERY_WATCH_MASK);
+            for (guint i = 0; i < subdirs->len; i++) {
+                DiscoveryDir *sub = g_new(DiscoveryDir, 1);
+                sub->path = g_strdup(subdirs->pdata[i]);
+                sub->depth = dir->depth + 1;
+                g_queue_push_tail(&queue, sub);
+            }
+            g_ptr_array_unref(subdirs);
+        }
+        g_free(dir->path);
+        g_free(dir);
+    }
+}
+
+// Drops path and everything below it from the index and stops watching it.
+static gboolean discovery_forget_path(Discovery *d, const char *path) {
+    gboolean changed = FALSE;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_mutex_lock(&d->lock);
+    g_hash_table_iter_init(&iter, d->repos);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (has_path_prefix(key, path)) {
+            g_hash_table_iter_remove(&iter);
+            changed = TRUE;
+        }
+    }
+    g_hash_table_iter_init(&iter, d->dirs);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (has_path_prefix(key, path)) g_hash_table_iter_remove(&iter);
+    }
+    g_mutex_unlock(&d->lock);
+
+    // A moved directory keeps its watch, which would now report on the new
+    // location under the old name
+    g_hash_table_iter_init(&iter, d->watches);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (has_path_prefix(value, path)) {
+            inotify_rm_watch(d->inotify_fd, GPOINTER_TO_INT(key));
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+    return changed;
+}
+
+// Depth a repo root was crawled at, from its parent's entry in d->dirs;
+// -1 if it is neither a root nor below a crawled directory.
+static int discovery_repo_depth(Discovery *d, const char *path) {
+    for (int i = 0; d->roots[i] != NULL; i++) {
+        if (strcmp(d->roots[i], path) == 0) return 0;
+    }
+    char *parent = g_path_get_dirname(path);
+    g_mutex_lock(&d->lock);
+    int depth = GPOINTER_TO_INT(g_hash_table_lookup(d->dirs, parent));
+    g_mutex_unlock(&d->lock);
+    g_free(parent);
+    return depth > 0 ? depth : -1;
+}
+
+// Applies one inotify event; returns TRUE if the repo list changed.
+static gboolean discovery_handle_event(Discovery *d, const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        d->overflowed = TRUE;
+        return FALSE;
+    }
+    if (event->mask & IN_IGNORED) {
+        g_hash_table_remove(d->watches, GINT_TO_POINTER(event->wd));
+        return FALSE;
+    }
+    if (event->len == 0) return FALSE;
+
+    const char *watched = g_hash_table_lookup(d->watches, GINT_TO_POINTER(event->wd));
+    if (!watched) return FALSE;
+    char *parent = g_strdup(watched);
+    int depth = GPOINTER_TO_INT(g_hash_table_lookup(d->dirs, parent)) - 1;
+    gboolean added = (event->mask & (IN_CREATE | IN_MOVED_TO)) != 0;
+    gboolean changed = FALSE;
+
+    if (depth < 0) {
+        // A repo root's watch only reports removals; losing ".git" turns it
+        // back into a plain directory. Anything else raced with a forget.
+        if (strcmp(event->name, ".git") == 0) {
+            g_mutex_lock(&d->lock);
+            gboolean is_repo = g_hash_table_contains(d->repos, parent);
+            g_mutex_unlock(&d->lock);
+            depth = is_repo ? discovery_repo_depth(d, parent) : -1;
+            if (depth >= 0) {
+                discovery_forget_path(d, parent);
+                discovery_crawl_subtree(d, parent, depth);
+                changed = TRUE;
+            }
+        }
+    } else if (strcmp(event->name, ".git") == 0) {
+        // git init or worktree add made the directory a repo. A plain
+        // directory has no ".git" to lose, so removals here are ignored.
+        if (added) {
+            discovery_forget_path(d, parent);
+            g_mutex_lock(&d->lock);
+            g_hash_table_add(d->repos, g_strdup(parent));
+            g_mutex_unlock(&d->lock);
+            discovery_watch_dir(d, parent, DISCOVERY_REPO_MASK);
+            changed = TRUE;
+        }
+    } else if (event->mask & IN_ISDIR) {
+        char *child = g_build_filename(parent, event->name, NULL);
+        if (!added) {
+            changed = discovery_forget_path(d, child);
+        } else if (depth < d->max_depth && !discovery_is_ignored(d, event->name)) {
+            guint before = g_hash_table_size(d->repos);
+            discovery_crawl_subtree(d, child, depth + 1);
+            changed = g_hash_table_size(d->repos) != before;
+        }
+        g_free(child);
+    }
+
+    g_free(parent);
+    return changed;
+}
+
+static void discovery_write_index(Discovery *d) {
+    GString *text = g_string_new(DISCOVERY_INDEX_MAGIC "\n");
+    g_string_append_printf(text, "config %s\n", d->config_key);
+    g_string_append_printf(text, "time %" G_GINT64_FORMAT "\n",
+                           g_get_real_time() / G_USEC_PER_SEC);
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_mutex_lock(&d->lock);
+    g_hash_table_iter_init(&iter, d->dirs);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        g_string_append_printf(text, "dir %d %s\n", GPOINTER_TO_INT(value) - 1, (char *)key);
+    }
+    g_hash_table_iter_init(&iter, d->repos);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        g_string_append_printf(text, "repo %s\n", (char *)key);
+    }
+    g_mutex_unlock(&d->lock);
+
+    GError *error = NULL;
+    if (!g_file_set_contents(d->index_path, text->str, (gssize)text->len, &error)) {
+        g_warning("Failed to write %s: %s", d->index_path, error->message);
+        g_error_free(error);
+    }
+    g_string_free(text, TRUE);
+}
+
+// Fills the index from disk; FALSE means a crawl is needed.
+static gboolean discovery_load_index(Discovery *d) {
+    char *text = NULL;
+    if (!g_file_get_contents(d->index_path, &text, NULL, NULL)) return FALSE;
+
+    char **lines = g_strsplit(text, "\n", -1);
+    g_free(text);
+
+    gboolean valid = lines[0] && strcmp(lines[0], DISCOVERY_INDEX_MAGIC) == 0;
+    gint64 scanned = 0;
+    g_mutex_lock(&d->lock);
+    for (int i = 1; valid && lines[i] != NULL; i++) {
+        const char *line = lines[i];
+        if (g_str_has_prefix(line, "config ")) {
+            valid = strcmp(line + 7, d->config_key) == 0;
+        } else if (g_str_has_prefix(line, "time ")) {
+            scanned = g_ascii_strtoll(line + 5, NULL, 10);
+        } else if (g_str_has_prefix(line, "repo ")) {
+            g_hash_table_add(d->repos, g_strdup(line + 5));
+        } else if (g_str_has_prefix(line, "dir ")) {
+            char *path = NULL;
+            int depth = (int)g_ascii_strtoll(line + 4, &path, 10);
+            if (path && *path == ' ')
+                g_hash_table_insert(d->dirs, g_strdup(path + 1), GINT_TO_POINTER(depth + 1));
+        }
+    }
+    g_mutex_unlock(&d->lock);
+    g_strfreev(lines);
+
+    gint64 age = g_get_real_time() / G_USEC_PER_SEC - scanned;
+    if (!valid || age < 0 || age > DISCOVERY_RESCAN_SECONDS) {
+        debug_log("discovery: index %s, rescanning", valid ? "stale" : "invalid");
+        return FALSE;
+    }
+    debug_log("discovery: loaded %u repos from index", g_hash_table_size(d->repos));
+    return TRUE;
+}
+
+static gboolean on_discovery_published(gpointer user_data);
+
+static int compare_path_ptrs(gconstpointer a, gconstpointer b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void discovery_publish(Discovery *d) {
+    DiscoverySnapshot *snapshot = g_new0(DiscoverySnapshot, 1);
+    snapshot->discovery = discovery_ref(d);
+
+    g_mutex_lock(&d->lock);
+    snapshot->paths = g_ptr_array_new_full(g_hash_table_size(d->repos), g_free);
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, d->repos);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        g_ptr_array_add(snapshot->paths, g_strdup(key));
+    }
+    g_mutex_unlock(&d->lock);
+    g_ptr_array_sort(snapshot->paths, compare_path_ptrs);
+
+    g_main_context_invoke(NULL, on_discovery_published, snapshot);
+}
+
+// Watches every crawled directory and applies changes until cancelled.
+// Returns TRUE if the event queue overflowed and a full crawl is needed.
+static gboolean discovery_watch_loop(Discovery *d) {
+    d->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (d->inotify_fd < 0) {
+        g_warning("inotify unavailable; discovered projects won't update live");
+        return FALSE;
+    }
+
+    GPtrArray *dirs = g_ptr_array_new_with_free_func(g_free);
+    GPtrArray *repos = g_ptr_array_new_with_free_func(g_free);
+    g_mutex_lock(&d->lock);
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, d->dirs);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        g_ptr_array_add(dirs, g_strdup(key));
+    }
+    g_hash_table_iter_init(&iter, d->repos);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        g_ptr_array_add(repos, g_strdup(key));
+    }
+    g_mutex_unlock(&d->lock);
+    for (guint i = 0; i < dirs->len; i++) {
+        discovery_watch_dir(d, dirs->pdata[i], DISCOVERY_WATCH_MASK);
+    }
+    for (guint i = 0; i < repos->len; i++) {
+        discovery_watch_dir(d, repos->pdata[i], DISCOVERY_REPO_MASK);
+    }
+    debug_log("discovery: watching %u directories and %u repos", dirs->len, repos->len);
+    g_ptr_array_unref(dirs);
+    g_ptr_array_unref(repos);
+
+    // Aligned for struct inotify_event, as inotify(7) recommends
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    gboolean dirty = FALSE;
+    d->overflowed = FALSE;
+
+    while (!g_atomic_int_get(&d->cancelled) && !d->overflowed) {
+        struct pollfd fds[2] = {
+            { .fd = d->inotify_fd, .events = POLLIN },
+            { .fd = d->wake_fd, .events = POLLIN },
+        };
+        int ready = poll(fds, 2, dirty ? DISCOVERY_SETTLE_MS : -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (ready == 0) {
+            discovery_write_index(d);
+            discovery_publish(d);
+            dirty = FALSE;
+            continue;
+        }
+        if (fds[1].revents) break;
+
+        ssize_t len = read(d->inotify_fd, buffer, sizeof(buffer));
+        for (char *p = buffer; len > 0 && p < buffer + len; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            dirty |= discovery_handle_event(d, event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    close(d->inotify_fd);
+    d->inotify_fd = -1;
+    g_hash_table_remove_all(d->watches);
+    return d->overflowed && !g_atomic_int_get(&d->cancelled);
+}
+
+static gpointer discovery_thread(gpointer data) {
+    Discovery *d = (Discovery *)data;
+
+    gboolean need_crawl = !discovery_load_index(d);
+    if (!need_crawl) {
+        discovery_publish(d);
+    }
+
+    while (!g_atomic_int_get(&d->cancelled)) {
+        if (need_crawl) {
+            discovery_crawl(d);
+            if (g_atomic_int_get(&d->cancelled)) break;
+            discovery_write_index(d);
+            discovery_publish(d);
+        }
+        need_crawl = discovery_watch_loop(d);
+        if (!need_crawl) break;
+    }
+
+    discovery_unref(d);
+    return NULL;
+}
+
+static void stop_project_discovery(AppState *app) {
+    Discovery *d = app->discovery;
+    if (!d) return;
+    app->discovery = NULL;
+
+    // The thread notices at its next directory or poll wakeup and exits on
+    // its own; nothing here waits for it.
+    g_atomic_int_set(&d->cancelled, TRUE);
+    guint64 one = 1;
+    if (write(d->wake_fd, &one, sizeof(one)) < 0) {
+        debug_log("discovery: wakeup failed: %s", g_strerror(errno));
+    }
+    discovery_unref(d);
+}
+
+static void refresh_discovery_picker(AppState *app);
+
+static void start_project_discovery(AppState *app) {
+    stop_project_discovery(app);
+    g_clear_pointer(&app->discovered_projects, g_ptr_array_unref);
+
+    Discovery *d = app->settings.discovery_roots ? discovery_new(app) : NULL;
+    for (GList *l = app->windows; l; l = l->next) {
+        gtk_widget_set_visible(((WorkspaceWindow *)l->data)->discovery_button, d != NULL);
+    }
+    refresh_discovery_picker(app);
+    if (!d) return;
+
+    app->discovery = d;
+    g_thread_unref(g_thread_new("gmux-discovery", discovery_thread, discovery_ref(d)));
+}
+
+static gboolean on_discovery_published(gpointer user_data) {
+    DiscoverySnapshot *snapshot = (DiscoverySnapshot *)user_data;
+    AppState *app = snapshot->discovery->app;
+
+    if (app->discovery == snapshot->discovery && !app->shutting_down) {
+        if (app->discovered_projects) g_ptr_array_unref(app->discovered_projects);
+        app->discovered_projects = g_steal_pointer(&snapshot->paths);
+        refresh_discovery_picker(app);
+    }
+
+    if (snapshot->paths) g_ptr_array_unref(snapshot->paths);
+    discovery_unref(snapshot->discovery);
+    g_free(snapshot);
+    return G_SOURCE_REMOVE;
+}
+
+// Picker: a popover listing discovered repos that aren't projects yet
+
+static void on_discovery_row_activated(GtkListBox *box, GtkListBoxRow *row, gpointer user_data) {
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
+    (void)box;
+
+    const char *path = g_object_get_data(G_OBJECT(row), "path");
+    if (!path) return;
+
+    char *basename = g_path_get_basename(path);
+    gtk_popover_popdown(GTK_POPOVER(gtk_menu_button_get_popover(
+        GTK_MENU_BUTTON(win->discovery_button))));
+    create_project(win, basename, path, TRUE);
+    save_session(win->app);
+    g_free(basename);
+}
+
+static gboolean discovery_filter_func(GtkListBoxRow *row, gpointer user_data) {
+    AppState *app = ((WorkspaceWindow *)user_data)->app;
+    if (!app->discovery_query || app->discovery_query[0] == '\0') return TRUE;
+
+    const char *key = g_object_get_data(G_OBJECT(row), "search-key");
+    return key && strstr(key, app->discovery_query) != NULL;
+}
+
+static void on_discovery_search_changed(GtkSearchEntry *entry, gpointer user_data) {
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
+    AppState *app = win->app;
+    g_free(app->discovery_query);
+    app->discovery_query = g_utf8_strdown(gtk_editable_get_text(GTK_EDITABLE(entry)), -1);
+    gtk_list_box_invalidate_filter(GTK_LIST_BOX(win->discovery_list));
+}
+
+static void refresh_window_discovery_list(WorkspaceWindow *win) {
+    AppState *app = win->app;
+    if (!win->discovery_list || !gtk_widget_get_mapped(win->discovery_list)) return;
+
+    GtkWidget *child;
+    while ((child = gtk_widget_get_first_child(win->discovery_list)) != NULL) {
+        gtk_list_box_remove(GTK_LIST_BOX(win->discovery_list), child);
+    }
+
+    GPtrArray *paths = app->discovered_projects;
+    for (guint i = 0; paths && i < paths->len; i++) {
+        const char *path = paths->pdata[i];
+        if (find_project_by_path(app, path)) continue;
+
+        char *display = compact_project_path(path);
+        GtkWidget *label = gtk_label_new(display);
+        gtk_label_set_xalign(GTK_LABEL(label), 0.0);
+        gtk_label_set_ellipsize(GTK_LABEL(label), PANGO_ELLIPSIZE_MIDDLE);
+        gtk_widget_set_tooltip_text(label, path);
+
+        GtkWidget *row = gtk_list_box_row_new();
+        gtk_list_box_row_set_child(GTK_LIST_BOX_ROW(row), label);
+        g_object_set_data_full(G_OBJECT(row), "path", g_strdup(path), g_free);
+        g_object_set_data_full(G_OBJECT(row), "search-key", g_utf8_strdown(display, -1), g_free);
+        gtk_list_box_append(GTK_LIST_BOX(win->discovery_list), row);
+        g_free(display);
+    }
+}
+
+// Rebuilds open pickers in every window; a closed one is rebuilt on show.
+static void refresh_discovery_picker(AppState *app) {
+    for (GList *l = app->windows; l; l = l->next) {
+        refresh_window_discovery_list((WorkspaceWindow *)l->data);
+    }
+}
+
+static void on_discovery_popover_map(GtkWidget *popover, gpointer user_data) {
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
+    (void)popover;
+    gtk_editable_set_text(GTK_EDITABLE(win->discovery_search), "");
+    refresh_window_discovery_list(win);
+    gtk_widget_grab_focus(win->discovery_search);
+}
+
+static GtkWidget* build_discovery_button(WorkspaceWindow *win) {
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 6);
+
+    win->discovery_search = gtk_search_entry_new();
+    g_object_set(win->discovery_search, "placeholder-text", "Filter discovered projects", NULL);
+    g_signal_connect(win->discovery_search, "search-changed",
+                     G_CALLBACK(on_discovery_search_changed), win);
+    gtk_box_append(GTK_BOX(box), win->discovery_search);
+
+    win->discovery_list = gtk_list_box_new();
+    gtk_list_box_set_activate_on_single_click(GTK_LIST_BOX(win->discovery_list), TRUE);
+    gtk_list_box_set_filter_func(GTK_LIST_BOX(win->discovery_list),
+                                 discovery_filter_func, win, NULL);
+    gtk_list_box_set_placeholder(GTK_LIST_BOX(win->discovery_list),
+                                 gtk_label_new("No new repositories found"));
+    g_signal_connect(win->discovery_list, "row-activated",
+                     G_CALLBACK(on_discovery_row_activated), win);
+
+    GtkWidget *scrolled = gtk_scrolled_window_new();
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled),
+                                   GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+    gtk_scrolled_window_set_min_content_height(GTK_SCROLLED_WINDOW(scrolled), 320);
+    gtk_scrolled_window_set_min_content_width(GTK_SCROLLED_WINDOW(scrolled), 360);
+    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scrolled), win->discovery_list);
+    gtk_box_append(GTK_BOX(box), scrolled);
+
+    GtkWidget *popover = gtk_popover_new();
+    gtk_popover_set_child(GTK_POPOVER(popover), box);
+    g_signal_connect(popover, "map", G_CALLBACK(on_discovery_popover_map), win);
+
+    win->discovery_button = gtk_menu_button_new();
+    gtk_menu_button_set_icon_name(GTK_MENU_BUTTON(win->discovery_button), "edit-find-symbolic");
+    gtk_menu_button_set_popover(GTK_MENU_BUTTON(win->discovery_button), popover);
+    gtk_widget_set_tooltip_text(win->discovery_button, "Discovered Projects");
+    gtk_widget_set_visible(win->discovery_button, win->app->discovery != NULL);
+    return win->discovery_button;
+}
+
+//=============================================================================
+// Git Status Badges
+//=============================================================================
+
+// Project rows show branch, ahead/behind and dirty state. Status is
+// computed by a small worker pool. Branch and ref hashes come straight from
+// .git (HEAD, loose refs, packed-refs, config). Results are cached per
+// path, and only rows visible in the sidebar are refreshed. A directory
+// monitor on each repo's git dir marks the entry stale; for those refreshes
+// `git status` is only spawned when HEAD, the upstream ref or the index
+// changed, since nothing else there moves ahead/behind or the dirty marker.
+// Editing a tracked file touches none of them, so selecting the project or
+// a command finishing in one of its tabs marks the worktree stale as well,
+// and that always runs `git status`. Besides the git dir, the directories
+// holding the branch and upstream refs are watched, and for a linked
+// worktree the common dir too, where fetches and pushes land.
+
+#define GIT_STATUS_WORKERS 4
+#define GIT_REFRESH_DELAY_MS 150
+
+struct _GitRepo {
+    AppState *app;
+    char *path;
+    GPtrArray *monitors;        // GFileMonitor*, once the git dir is known
+    char *watched;              // Their directories, newline separated
+    gboolean stale;
+    gboolean worktree_stale;    // Files may have changed; run git status
+    gboolean in_flight;
+
+    // Last result
+    gboolean is_repo;
+    char *branch;
+    int ahead;
+    int behind;
+    gboolean dirty;
+
+    // What that result was computed from
+    char *head_sha;
+    char *upstream_sha;
+    gint64 index_stamp;
+};
+
+typedef struct {
+    AppState *app;
+    char *path;
+
+    // Previous fingerprint and result, reused only for git dir changes
+    gboolean check_worktree;
+    gboolean have_previous;
+    char *prev_head_sha;
+    char *prev_upstream_sha;
+    gint64 prev_index_stamp;
+    int prev_ahead;
+    int prev_behind;
+    gboolean prev_dirty;
+
+    // Result
+    char *git_dir;
+    char *common_dir;
+    char *branch_ref;           // NULL when HEAD is detached
+    char *upstream_ref;
+    char *branch;
+    char *head_sha;
+    char *upstream_sha;
+    gint64 index_stamp;
+    int ahead;
+    int behind;
+    gboolean dirty;
+    gboolean spawned;
+} GitStatusJob;
+
+static void git_repo_free(GitRepo *repo) {
+    if (repo->monitors) g_ptr_array_unref(repo->monitors);
+    g_free(repo->watched);
+    g_free(repo->path);
+    g_free(repo->branch);
+    g_free(repo->head_sha);
+    g_free(repo->upstream_sha);
+    g_free(repo);
+}
+
+static void git_status_job_free(GitStatusJob *job) {
+    g_free(job->path);
+    g_free(job->prev_head_sha);
+    g_free(job->prev_upstream_sha);
+    g_free(job->git_dir);
+    g_free(job->common_dir);
+    g_free(job->branch_ref);
+    g_free(job->upstream_ref);
+    g_free(job->branch);
+    g_free(job->head_sha);
+    g_free(job->upstream_sha);
+    g_free(job);
+}
+
+static char* read_trimmed_file(const char *path) {
+    char *contents = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) return NULL;
+    return g_strstrip(contents);
+}
+
+// .git is a directory, or for worktrees and submodules a "gitdir: " file.
+static char* git_resolve_dir(const char *path) {
+    char *dot_git = g_build_filename(path, ".git", NULL);
+    if (g_file_test(dot_git, G_FILE_TEST_IS_DIR)) return dot_git;
+
+    char *contents = read_trimmed_file(dot_git);
+    g_free(dot_git);
+    if (!contents) return NULL;
+
+    char *dir = g_str_has_prefix(contents, "gitdir: ")
+                ? g_canonicalize_filename(contents + 8, path) : NULL;
+    g_free(contents);
+    return dir;
+}
+
+// Worktrees keep refs and config in the main repo's git dir.
+static char* git_common_dir(const char *git_dir) {
+    char *file = g_build_filename(git_dir, "commondir", NULL);
+    char *contents = read_trimmed_file(file);
+    g_free(file);
+    if (!contents) return g_strdup(git_dir);
+
+    char *dir = g_canonicalize_filename(contents, git_dir);
+    g_free(contents);
+    return dir;
+}
+
+static char* git_read_packed_ref(const char *common_dir, const char *ref) {
+    char *file = g_build_filename(common_dir, "packed-refs", NULL);
+    char *contents = NULL;
+    g_file_get_contents(file, &contents, NULL, NULL);
+    g_free(file);
+    if (!contents) return NULL;
+
+    char *sha = NULL;
+    size_t ref_len = strlen(ref);
+    for (char *line = contents; line && *line; ) {
+        char *next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        char *space = strchr(line, ' ');
+        if (line[0] != '#' && line[0] != '^' && space &&
+            strncmp(space + 1, ref, ref_len) == 0 && space[1 + ref_len] == '\0') {
+            sha = g_strndup(line, (gsize)(space - line));
+            break;
+        }
+        line = next;
+    }
+    g_free(contents);
+    return sha;
+}
+
+// Resolves a ref ("HEAD", "refs/heads/main", ...) to a commit hash,
+// following symbolic refs a few levels deep.
+static char* git_read_ref(const char *git_dir, const char *common_dir, const char *ref) {
+    char *name = g_strdup(ref);
+    for (int depth = 0; depth < 5; depth++) {
+        // HEAD and other pseudo-refs are per worktree; refs/ are shared
+        const char *base = g_str_has_prefix(name, "refs/") ? common_dir : git_dir;
+        char *file = g_build_filename(base, name, NULL);
+        char *contents = read_trimmed_file(file);
+        g_free(file);
+
+        if (!contents) {
+            char *sha = git_read_packed_ref(common_dir, name);
+            g_free(name);
+            return sha;
+        }
+        if (!g_str_has_prefix(contents, "ref: ")) {
+            g_free(name);
+            return contents;
+        }
+        g_free(name);
+        name = g_strdup(contents + 5);
+        g_free(contents);
+    }
+    g_free(name);
+    return NULL;
+}
+
+// Upstream ref of a branch from [branch "name"] remote/merge in config.
+static char* git_upstream_ref(const char *common_dir, const char *branch) {
+    char *file = g_build_filename(common_dir, "config", NULL);
+    char *contents = NULL;
+    g_file_get_contents(file, &contents, NULL, NULL);
+    g_free(file);
+    if (!contents) return NULL;
+
+    char *section = g_strdup_printf("[branch \"%s\"]", branch);
+    char *remote = NULL;
+    char *merge = NULL;
+    gboolean in_section = FALSE;
+    char **lines = g_strsplit(contents, "\n", -1);
+    for (int i = 0; lines[i] != NULL; i++) {
+        char *line = g_strstrip(lines[i]);
+        if (line[0] == '[') {
+            in_section = strcmp(line, section) == 0;
+            continue;
+        }
+        char *eq = strchr(line, '=');
+        if (!in_section || !eq) continue;
+        *eq = '\0';
+        char *key = g_strstrip(line);
+        char *value = g_strstrip(eq + 1);
+        if (strcmp(key, "remote") == 0) {
+            g_free(remote);
+            remote = g_strdup(value);
+        } else if (strcmp(key, "merge") == 0) {
+            g_free(merge);
+            merge = g_strdup(value);
+        }
+    }
+    g_strfreev(lines);
+    g_free(section);
+    g_free(contents);
+
+    char *upstream = NULL;
+    if (remote && merge) {
+        if (strcmp(remote, ".") == 0) {
+            upstream = g_strdup(merge);
+        } else if (g_str_has_prefix(merge, "refs/heads/")) {
+            upstream = g_strdup_printf("refs/remotes/%s/%s", remote, merge + 11);
+        }
+    }
+    g_free(remote);
+    g_free(merge);
+    return upstream;
+}
+
+static void git_run_status(GitStatusJob *job) {
+    char *argv[] = {
+        "git", "--no-optional-locks", "-C", job->path, "status",
+        "--porcelain=v2", "--branch", "--untracked-files=no", NULL
+    };
+    char *output = NULL;
+    int wait_status = 0;
+    GError *error = NULL;
+
+    job->spawned = TRUE;
+    if (!g_spawn_sync(NULL, argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_STDERR_TO_DEV_NULL,
+                      NULL, NULL, &output, NULL, &wait_status, &error)) {
+        debug_log("git: status failed in %s: %s", job->path, error->message);
+        g_error_free(error);
+        return;
+    }
+
+    if (g_spawn_check_wait_status(wait_status, NULL)) {
+        char **lines = g_strsplit(output, "\n", -1);
+        for (int i = 0; lines[i] != NULL; i++) {
+            const char *line = lines[i];
+            if (g_str_has_prefix(line, "# branch.ab ")) {
+                sscanf(line + 12, "+%d -%d", &job->ahead, &job->behind);
+            } else if (line[0] != '\0' && line[0] != '#') {
+                job->dirty = TRUE;
+            }
+        }
+        g_strfreev(lines);
+    }
+    g_free(output);
+}
+
+static gboolean on_git_status_ready(gpointer user_data);
+
+static void git_status_worker(gpointer data, gpointer user_data) {
+    GitStatusJob *job = (GitStatusJob *)data;
+    (void)user_data;
+
+    job->git_dir = git_resolve_dir(job->path);
+    if (job->git_dir) {
+        char *common_dir = git_common_dir(job->git_dir);
+        char *head_file = g_build_filename(job->git_dir, "HEAD", NULL);
+        char *head = read_trimmed_file(head_file);
+        g_free(head_file);
+
+        char *upstream = NULL;
+        if (head && g_str_has_prefix(head, "ref: refs/heads/")) {
+            job->branch = g_strdup(head + 16);
+            job->branch_ref = g_strdup(head + 5);
+            upstream = git_upstream_ref(common_dir, job->branch);
+        }
+        job->head_sha = git_read_ref(job->git_dir, common_dir, "HEAD");
+        if (!job->branch) {
+            job->branch = job->head_sha ? g_strndup(job->head_sha, 7) : g_strdup("(no branch)");
+        }
+        job->upstream_sha = upstream ? git_read_ref(job->git_dir, common_dir, upstream) : NULL;
+
+        char *index_file = g_build_filename(job->git_dir, "index", NULL);
+        struct stat st;
+        if (stat(index_file, &st) == 0) {
+            job->index_stamp = (gint64)st.st_mtim.tv_sec * G_USEC_PER_SEC +
+                               st.st_mtim.tv_nsec / 1000 + st.st_size;
+        }
+        g_free(index_file);
+
+        if (job->have_previous && !job->check_worktree &&
+            g_strcmp0(job->head_sha, job->prev_head_sha) == 0 &&
+            g_strcmp0(job->upstream_sha, job->prev_upstream_sha) == 0 &&
+            job->index_stamp == job->prev_index_stamp) {
+            job->ahead = job->prev_ahead;
+            job->behind = job->prev_behind;
+            job->dirty = job->prev_dirty;
+        } else {
+            git_run_status(job);
+        }
+
+        job->upstream_ref = upstream;
+        job->common_dir = common_dir;
+        g_free(head);
+    }
+
+    g_main_context_invoke(NULL, on_git_status_ready, job);
+}
+
+static void update_project_git_label(Project *project, GitRepo *repo) {
+    if (!project->git_label) return;
+    if (!repo->is_repo || !repo->branch) {
+        gtk_widget_set_visible(project->git_label, FALSE);
+        return;
+    }
+
+    GString *text = g_string_new(repo->branch);
+    if (repo->ahead > 0) g_string_append_printf(text, " ↑%d", repo->ahead);
+    if (repo->behind > 0) g_string_append_printf(text, " ↓%d", repo->behind);
+    if (repo->dirty) g_string_append(text, " •");
+    gtk_label_set_text(GTK_LABEL(project->git_label), text->str);
+    g_string_free(text, TRUE);
+
+    char *tooltip = g_strdup_printf("Branch %s: %d ahead, %d behind upstream%s",
+                                    repo->branch, repo->ahead, repo->behind,
+                                    repo->dirty ? ", uncommitted changes" : "");
+    gtk_widget_set_tooltip_text(project->git_label, tooltip);
+    g_free(tooltip);
+
+    if (repo->dirty) {
+        gtk_widget_add_css_class(project->git_label, "gmux-project-git-dirty");
+    } else {
+        gtk_widget_remove_css_class(project->git_label, "gmux-project-git-dirty");
+    }
+    gtk_widget_set_visible(project->git_label, TRUE);
+}
+
+static gboolean on_git_refresh_timeout(gpointer user_data);
+
+static void queue_git_badge_refresh(AppState *app) {
+    if (app->git_refresh_timer_id != 0 || app->shutting_down) return;
+    app->git_refresh_timer_id = g_timeout_add(GIT_REFRESH_DELAY_MS, on_git_refresh_timeout, app);
+}
+
+static void invalidate_git_status(AppState *app, const char *path) {
+    GitRepo *repo = app->git_repos ? g_hash_table_lookup(app->git_repos, path) : NULL;
+    if (!repo) return;
+    repo->stale = TRUE;
+    repo->worktree_stale = TRUE;
+    queue_git_badge_refresh(app);
+}
+
+// Drops the status and file monitors for path once no project has it. A
+// job still running for it finds no entry and is ignored.
+static void forget_git_repo(AppState *app, const char *path) {
+    if (!app->git_repos) return;
+    for (GList *l = app->projects; l != NULL; l = l->next) {
+        if (g_strcmp0(((Project *)l->data)->path, path) == 0) return;
+    }
+    g_hash_table_remove(app->git_repos, path);
+}
+
+static void on_git_dir_changed(GFileMonitor *monitor, GFile *file, GFile *other_file,
+                               GFileMonitorEvent event, gpointer user_data) {
+    GitRepo *repo = (GitRepo *)user_data;
+
+    // Git writes HEAD, refs and the index via a .lock file renamed into place
+    GFile *target = (event == G_FILE_MONITOR_EVENT_RENAMED) ? other_file : file;
+    if (!target) return;
+
+    char *name = g_file_get_basename(target);
+    gboolean relevant;
+    if (g_object_get_data(G_OBJECT(monitor), "refs")) {
+        relevant = !g_str_has_suffix(name, ".lock");
+    } else {
+        relevant = strcmp(name, "HEAD") == 0 || strcmp(name, "index") == 0 ||
+                   strcmp(name, "FETCH_HEAD") == 0 || strcmp(name, "ORIG_HEAD") == 0 ||
+                   strcmp(name, "packed-refs") == 0;
+    }
+    g_free(name);
+    if (!relevant || repo->stale) return;
+
+    repo->stale = TRUE;
+    queue_git_badge_refresh(repo->app);
+}
+
+static void git_monitor_free(GFileMonitor *monitor) {
+    g_file_monitor_cancel(monitor);
+    g_object_unref(monitor);
+}
+
+static void git_watch_dir(GitRepo *repo, const char *path, gboolean refs) {
+    GFile *dir = g_file_new_for_path(path);
+    GFileMonitor *monitor = g_file_monitor_directory(dir, G_FILE_MONITOR_WATCH_MOVES, NULL, NULL);
+    g_object_unref(dir);
+    if (!monitor) return;
+    if (refs) g_object_set_data(G_OBJECT(monitor), "refs", GINT_TO_POINTER(1));
+    g_signal_connect(monitor, "changed", G_CALLBACK(on_git_dir_changed), repo);
+    g_ptr_array_add(repo->monitors, monitor);
+}
+
+// Watches what the job's result was read from, again whenever the branch,
+// upstream or git dir moved
+static void update_git_monitors(GitRepo *repo, GitStatusJob *job) {
+    char *branch_dir = job->branch_ref
+        ? g_path_get_dirname(job->branch_ref) : NULL;
+    char *upstream_dir = job->upstream_ref
+        ? g_path_get_dirname(job->upstream_ref) : NULL;
+    char *watched = g_strdup_printf("%s\n%s\n%s\n%s", job->git_dir, job->common_dir,
+                                    branch_dir ? branch_dir : "", upstream_dir ? upstream_dir : "");
+
+    if (g_strcmp0(watched, repo->watched) != 0) {
+        if (repo->monitors) g_ptr_array_unref(repo->monitors);
+        repo->monitors = g_ptr_array_new_with_free_func((GDestroyNotify)git_monitor_free);
+        git_watch_dir(repo, job->git_dir, FALSE);
+        if (strcmp(job->common_dir, job->git_dir) != 0) git_watch_dir(repo, job->common_dir, FALSE);
+        if (branch_dir) {
+            char *path = g_build_filename(job->common_dir, branch_dir, NULL);
+            git_watch_dir(repo, path, TRUE);
+            g_free(path);
+        }
+        if (upstream_dir && g_strcmp0(upstream_dir, branch_dir) != 0) {
+            char *path = g_build_filename(job->common_dir, upstream_dir, NULL);
+            git_watch_dir(repo, path, TRUE);
+            g_free(path);
+        }
+        g_free(repo->watched);
+        repo->watched = g_steal_pointer(&watched);
+    }
+    g_free(watched);
+    g_free(upstream_dir);
+    g_free(branch_dir);
+}
+
+static gboolean on_git_status_ready(gpointer user_data) {
+    GitStatusJob *job = (GitStatusJob *)user_data;
+    AppState *app = job->app;
+    GitRepo *repo = app->git_repos ? g_hash_table_lookup(app->git_repos, job->path) : NULL;
+
+    if (repo && !app->shutting_down) {
+        repo->in_flight = FALSE;
+        repo->is_repo = job->git_dir != NULL;
+        g_free(repo->branch);
+        repo->branch = g_steal_pointer(&job->branch);
+        g_free(repo->head_sha);
+        repo->head_sha = g_steal_pointer(&job->head_sha);
+        g_free(repo->upstream_sha);
+        repo->upstream_sha = g_steal_pointer(&job->upstream_sha);
+        repo->index_stamp = job->index_stamp;
+        repo->ahead = job->ahead;
+        repo->behind = job->behind;
+        repo->dirty = job->dirty;
+
+        if (repo->is_repo) update_git_monitors(repo, job);
+
+        for (GList *l = app->projects; l != NULL; l = l->next) {
+            Project *project = (Project *)l->data;
+            if (g_strcmp0(project->path, repo->path) == 0) {
+                update_project_git_label(project, repo);
+            }
+        }
+
+        debug_log("git: %s %s%s", repo->path, repo->branch ? repo->branch : "(not a repo)",
+                  job->spawned ? " (ran git status)" : "");
+        if (repo->stale) queue_git_badge_refresh(app);
+    }
+
+    git_status_job_free(job);
+    return G_SOURCE_REMOVE;
+}
+
+static void submit_git_status_job(AppState *app, GitRepo *repo) {
+    if (!app->git_pool) {
+        app->git_pool = g_thread_pool_new(git_status_worker, NULL, GIT_STATUS_WORKERS,
+                                          FALSE, NULL);
+    }
+
+    GitStatusJob *job = g_new0(GitStatusJob, 1);
+    job->app = app;
+    job->path = g_strdup(repo->path);
+    job->check_worktree = repo->worktree_stale;
+    if (repo->is_repo) {
+        job->have_previous = TRUE;
+        job->prev_head_sha = g_strdup(repo->head_sha);
+        job->prev_upstream_sha = g_strdup(repo->upstream_sha);
+        job->prev_index_stamp = repo->index_stamp;
+        job->prev_ahead = repo->ahead;
+        job->prev_behind = repo->behind;
+        job->prev_dirty = repo->dirty;
+    }
+
+    repo->stale = FALSE;
+    repo->worktree_stale = FALSE;
+    repo->in_flight = TRUE;
+    g_thread_pool_push(app->git_pool, job, NULL);
+}
+
+static gboolean project_row_visible(Project *project) {
+    GtkWidget *scrolled = gtk_widget_get_ancestor(project->win->sidebar, GTK_TYPE_SCROLLED_WINDOW);
+    if (!scrolled || !gtk_widget_get_mapped(project->list_row)) return FALSE;
+
+    graphene_rect_t bounds;
+    if (!gtk_widget_compute_bounds(project->list_row, scrolled, &bounds)) return FALSE;
+    return bounds.origin.y + bounds.size.height > 0 &&
+           bounds.origin.y < gtk_widget_get_height(scrolled);
+}
+
+static gboolean on_git_refresh_timeout(gpointer user_data) {
+    AppState *app = (AppState *)user_data;
+    app->git_refresh_timer_id = 0;
+
+    if (!app->git_repos) {
+        app->git_repos = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                               (GDestroyNotify)git_repo_free);
+    }
+
+    int queued = 0;
+    for (GList *l = app->projects; l != NULL; l = l->next) {
+        Project *project = (Project *)l->data;
+        if (!project_row_visible(project)) continue;
+
+        GitRepo *repo = g_hash_table_lookup(app->git_repos, project->path);
+        if (!repo) {
+            repo = g_new0(GitRepo, 1);
+            repo->app = app;
+            repo->path = g_strdup(project->path);
+            repo->stale = TRUE;
+            g_hash_table_insert(app->git_repos, repo->path, repo);
+        }
+        if (repo->stale && !repo->in_flight) {
+            submit_git_status_job(app, repo);
+            queued++;
+        } else if (!repo->in_flight && repo->is_repo &&
+                   !gtk_widget_get_visible(project->git_label)) {
+            // Row created after the result arrived (e.g. a re-added project)
+            update_project_git_label(project, repo);
+        }
+    }
+    if (queued > 0) debug_log("git: queued %d status jobs", queued);
+    return G_SOURCE_REMOVE;
+}
+
+static void on_sidebar_scrolled(GtkAdjustment *adjustment, gpointer user_data) {
+    (void)adjustment;
+    queue_git_badge_refresh((AppState *)user_data);
+}
+
+static void stop_git_badges(AppState *app) {
+    if (app->git_refresh_timer_id != 0) {
+        g_source_remove(app->git_refresh_timer_id);
+        app->git_refresh_timer_id = 0;
+    }
+    if (app->git_pool) {
+        // Drop queued jobs; running ones finish and are ignored
+        g_thread_pool_free(app->git_pool, TRUE, FALSE);
+        app->git_pool = NULL;
+    }
+}
+
+//=============================================================================
+// Project Environments
+//=============================================================================
+
+// Projects set up with direnv, a nix flake, mise (.tool-versions) or a
+// Python venv would otherwise pay for that activation in every new shell.
+// It is evaluated once per project path on a worker thread, and the result
+// is passed to each new shell as its whole environment. A direnv result
+// carries DIRENV_DIFF and friends, so the shell's own hook finds nothing to
+// do. The cached environment is reused while the activation files keep
+// their size and mtime and, for direnv, while every file its
+// DIRENV_WATCHES lists (source_env, watch_file, dotenv...) keeps the mtime
+// direnv recorded. A tab opened during an evaluation waits for it, up
+// to PROJECT_ENV_WAIT_MS, then starts with gmux's own environment. Failed
+// evaluations aren't cached, so e.g. `direnv allow` takes effect on the
+// next tab.
+//
+// Only the activations listed in project_env= (settings.conf) run; the
+// default is direnv, which has its own `direnv allow`. nix, mise and venv
+// run code or put binaries from the repository on PATH, so they are also
+// gated like recipes: the SHA-256 of their files must be in
+// PROJECT_ENV_ALLOW_FILE_NAME, which `gmux ctl env --allow` adds to.
+// Until then the tab starts with gmux's environment and says why. An
+// activation that runs longer than PROJECT_ENV_TIMEOUT_S is killed, with
+// everything it started.
+
+#define PROJECT_ENV_WORKERS 2
+#define PROJECT_ENV_WAIT_MS 3000
+#define PROJECT_ENV_TIMEOUT_S 120
+#define PROJECT_ENV_ALLOW_FILE_NAME "envs-allowed"  // "<sha256> <path>" lines
+
+typedef enum {
+    PROJECT_ENV_NONE,
+    PROJECT_ENV_DIRENV,
+    PROJECT_ENV_NIX,
+    PROJECT_ENV_MISE,
+    PROJECT_ENV_VENV,
+} ProjectEnvKind;
+
+static const char *const project_env_kind_names[] = {
+    [PROJECT_ENV_NONE]   = "none",
+    [PROJECT_ENV_DIRENV] = "direnv",
+    [PROJECT_ENV_NIX]    = "nix",
+    [PROJECT_ENV_MISE]   = "mise",
+    [PROJECT_ENV_VENV]   = "venv",
+};
+
+// Relative to the project path; any change re-evaluates
+static const char *const project_env_files[] = {
+    ".envrc", "flake.nix", "flake.lock", ".tool-versions",
+    ".venv/pyvenv.cfg", "venv/pyvenv.cfg",
+};
+
+// What an allowed hash covers, per kind; direnv keeps its own allow list
+static const char *const project_env_nix_files[] = { "flake.nix", "flake.lock", NULL };
+static const char *const project_env_mise_files[] = { ".tool-versions", NULL };
+static const char *const project_env_venv_dirs[] = { ".venv", "venv", NULL };
+
+// A file direnv read while evaluating, as DIRENV_WATCHES lists it
+typedef struct {
+    char *path;
+    gint64 modtime;             // Seconds
+    gboolean exists;
+} ProjectEnvWatch;
+
+typedef struct {
+    char *path;
+    char *stamp;                // Activation files envv was computed from; NULL = none yet
+    char **envv;                // NULL = nothing to activate
+    GArray *watches;            // ProjectEnvWatch; NULL unless direnv
+    ProjectEnvKind kind;
+    gboolean blocked;           // kind's files are not allowed; envv is NULL
+    gboolean in_flight;
+    GPtrArray *waiting;         // VteTerminal*, ref'd, to spawn once ready
+    guint wait_timer_id;
+} ProjectEnv;
+
+typedef struct {
+    AppState *app;
+    char *path;
+    char *stamp;
+    char **base_env;            // gmux's environment when the job was queued
+    guint enabled;              // Bit per ProjectEnvKind, from project_env=
+
+    // Result
+    ProjectEnvKind kind;
+    char **envv;
+    GArray *watches;
+    gboolean blocked;
+    gboolean ok;
+    gint64 elapsed_us;
+} ProjectEnvJob;
+
+static void project_env_free(ProjectEnv *env) {
+    if (env->wait_timer_id) g_source_remove(env->wait_timer_id);
+    g_ptr_array_unref(env->waiting);
+    g_strfreev(env->envv);
+    if (env->watches) g_array_unref(env->watches);
+    g_free(env->stamp);
+    g_free(env->path);
+    g_free(env);
+}
+
+static void project_env_job_free(ProjectEnvJob *job) {
+    g_free(job->path);
+    g_free(job->stamp);
+    g_strfreev(job->base_env);
+    g_strfreev(job->envv);
+    if (job->watches) g_array_unref(job->watches);
+    g_free(job);
+}
+
+static void project_env_watch_clear(gpointer data) {
+    g_free(((ProjectEnvWatch *)data)->path);
+}
+
+// DIRENV_WATCHES is URL-safe base64 of zlib-compressed JSON:
+// [{"Path": ..., "Modtime": <seconds>, "Exists": <bool>}, ...]
+static GArray* project_env_parse_watches(const char *value) {
+    char *standard = g_strdup(value);
+    for (char *p = standard; *p; p++) {
+        if (*p == '-') *p = '+';
+        else if (*p == '_') *p = '/';
+    }
+    gsize len = 0;
+    guchar *compressed = g_base64_decode(standard, &len);
+    g_free(standard);
+
+    GInputStream *in = g_memory_input_stream_new_from_data(compressed, (gssize)len, g_free);
+    GZlibDecompressor *decompressor = g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB);
+    GInputStream *z = g_converter_input_stream_new(in, G_CONVERTER(decompressor));
+    g_object_unref(decompressor);
+    g_object_unref(in);
+
+    GString *json = g_string_new(NULL);
+    char buf[4096];
+    gssize n;
+    while ((n = g_input_stream_read(z, buf, sizeof(buf), NULL, NULL)) > 0) {
+        g_string_append_len(json, buf, n);
+    }
+    g_object_unref(z);
+
+    GArray *watches = NULL;
+    JsonParser *parser = json_parser_new();
+    if (n == 0 && json_parser_load_from_data(parser, json->str, (gssize)json->len, NULL) &&
+        JSON_NODE_HOLDS_ARRAY(json_parser_get_root(parser))) {
+        JsonArray *array = json_node_get_array(json_parser_get_root(parser));
+        watches = g_array_new(FALSE, FALSE, sizeof(ProjectEnvWatch));
+        g_array_set_clear_func(watches, project_env_watch_clear);
+        for (guint i = 0; i < json_array_get_length(array); i++) {
+            JsonObject *obj = json_array_get_object_element(array, i);
+            const char *path = obj ? json_object_get_string_member_with_default(obj, "Path", NULL)
+                                   : NULL;
+            if (!path) continue;
+            ProjectEnvWatch watch = {
+                g_strdup(path),
+                json_object_get_int_member_with_default(obj, "Modtime", 0),
+                json_object_get_boolean_member_with_default(obj, "Exists", FALSE),
+            };
+            g_array_append_val(watches, watch);
+        }
+    }
+    g_object_unref(parser);
+    g_string_free(json, TRUE);
+    return watches;
+}
+
+// Whether every watched file is as direnv found it, as its own hook checks
+static gboolean project_env_watches_current(GArray *watches) {
+    for (guint i = 0; watches && i < watches->len; i++) {
+        const ProjectEnvWatch *watch = &g_array_index(watches, ProjectEnvWatch, i);
+        struct stat st;
+        gboolean exists = stat(watch->path, &st) == 0;
+        if (exists != watch->exists || (exists && (gint64)st.st_mtime != watch->modtime)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Size and mtime of each activation file present; "" if there are none
+static char* project_env_stamp(const char *path) {
+    GString *stamp = g_string_new(NULL);
+    for (size_t i = 0; i < G_N_ELEMENTS(project_env_files); i++) {
+        char *file = g_build_filename(path, project_env_files[i], NULL);
+        struct stat st;
+        if (stat(file, &st) == 0) {
+            g_string_append_printf(stamp, "%s:%lld.%09ld:%lld;", project_env_files[i],
+                                   (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+                                   (long long)st.st_size);
+        }
+        g_free(file);
+    }
+    return g_string_free(stamp, FALSE);
+}
+
+static gboolean project_env_has_file(const char *path, const char *name) {
+    char *file = g_build_filename(path, name, NULL);
+    gboolean exists = g_file_test(file, G_FILE_TEST_EXISTS);
+    g_free(file);
+    return exists;
+}
+
+// The kinds named in a project_env= value
+static guint project_env_parse_enabled(const char *setting) {
+    guint enabled = 0;
+    char **names = g_strsplit(setting ? setting : "", ",", -1);
+    for (char **n = names; *n; n++) {
+        g_strstrip(*n);
+        for (int kind = PROJECT_ENV_DIRENV; kind <= PROJECT_ENV_VENV; kind++) {
+            if (strcmp(*n, project_env_kind_names[kind]) == 0) enabled |= 1u << kind;
+        }
+    }
+    g_strfreev(names);
+    return enabled;
+}
+
+// First of project_env_venv_dirs with a pyvenv.cfg, or NULL
+static const char* project_env_venv_dir(const char *path) {
+    for (int i = 0; project_env_venv_dirs[i] != NULL; i++) {
+        char *cfg = g_build_filename(project_env_venv_dirs[i], "pyvenv.cfg", NULL);
+        gboolean found = project_env_has_file(path, cfg);
+        g_free(cfg);
+        if (found) return project_env_venv_dirs[i];
+    }
+    return NULL;
+}
+
+// SHA-256 over the kind and the name and contents of each of its files, so
+// allowing a flake doesn't also allow a later .tool-versions
+static char* project_env_hash(const char *path, ProjectEnvKind kind) {
+    const char *const *files = kind == PROJECT_ENV_NIX ? project_env_nix_files
+                             : kind == PROJECT_ENV_MISE ? project_env_mise_files : NULL;
+    const char *venv_files[2] = { NULL, NULL };
+    char *venv_cfg = NULL;
+    if (kind == PROJECT_ENV_VENV) {
+        const char *dir = project_env_venv_dir(path);
+        if (!dir) return NULL;
+        venv_cfg = g_build_filename(dir, "pyvenv.cfg", NULL);
+        venv_files[0] = venv_cfg;
+        files = venv_files;
+    }
+    if (!files) return NULL;
+
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_checksum_update(checksum, (const guchar *)project_env_kind_names[kind], -1);
+    for (int i = 0; files[i] != NULL; i++) {
+        char *file = g_build_filename(path, files[i], NULL);
+        char *contents = NULL;
+        gsize len = 0;
+        if (g_file_get_contents(file, &contents, &len, NULL)) {
+            g_checksum_update(checksum, (const guchar *)files[i], (gssize)strlen(files[i]) + 1);
+            g_checksum_update(checksum, (const guchar *)contents, (gssize)len);
+        }
+        g_free(contents);
+        g_free(file);
+    }
+    char *hash = g_strdup(g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+    g_free(venv_cfg);
+    return hash;
+}
+
+// Which enabled activation applies to path, in the order a shell hook
+// would win. program is the tool to run, if the kind needs one.
+static ProjectEnvKind project_env_detect(const char *path, guint enabled, char **program) {
+    static const struct {
+        ProjectEnvKind kind;
+        const char *file;
+        const char *program;
+    } kinds[] = {
+        { PROJECT_ENV_DIRENV, ".envrc", "direnv" },
+        { PROJECT_ENV_NIX, "flake.nix", "nix" },
+        { PROJECT_ENV_MISE, ".tool-versions", "mise" },
+    };
+    *program = NULL;
+    for (size_t i = 0; i < G_N_ELEMENTS(kinds); i++) {
+        if (!(enabled & (1u << kinds[i].kind)) || !project_env_has_file(path, kinds[i].file))
+            continue;
+        *program = g_find_program_in_path(kinds[i].program);
+        if (*program) return kinds[i].kind;
+    }
+    if ((enabled & (1u << PROJECT_ENV_VENV)) && project_env_venv_dir(path)) return PROJECT_ENV_VENV;
+    return PROJECT_ENV_NONE;
+}
+
+static gboolean project_env_needs_allow(ProjectEnvKind kind) {
+    return kind == PROJECT_ENV_NIX || kind == PROJECT_ENV_MISE || kind == PROJECT_ENV_VENV;
+}
+
+static void project_env_child_setup(gpointer user_data) {
+    (void)user_data;
+    setpgid(0, 0);  // So a timeout can kill everything the activation started
+}
+
+static gboolean on_project_env_timeout(gpointer user_data) {
+    g_cancellable_cancel(G_CANCELLABLE(user_data));
+    return G_SOURCE_REMOVE;
+}
+
+// Runs argv in the project directory and returns its stdout, or NULL if it
+// couldn't run or exited non-zero
+static GBytes* project_env_run(ProjectEnvJob *job, const char *const *argv) {
+    GSubprocessLauncher *launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE |
+                                                              G_SUBPROCESS_FLAGS_STDERR_SILENCE);
+    g_subprocess_launcher_set_cwd(launcher, job->path);
+    g_subprocess_launcher_set_environ(launcher, job->base_env);
+    g_subprocess_launcher_set_child_setup(launcher, project_env_child_setup, NULL, NULL);
+
+    // The timer runs on the main loop; cancelling makes communicate return
+    GCancellable *cancellable = g_cancellable_new();
+    GSource *timeout = g_timeout_source_new_seconds(PROJECT_ENV_TIMEOUT_S);
+    g_source_set_callback(timeout, on_project_env_timeout, g_object_ref(cancellable),
+                          g_object_unref);
+    g_source_attach(timeout, NULL);
+
+    GError *error = NULL;
+    GBytes *output = NULL;
+    GSubprocess *proc = g_subprocess_launcher_spawnv(launcher, argv, &error);
+    if (proc && g_subprocess_communicate(proc, NULL, cancellable, &output, NULL, &error) &&
+        !g_subprocess_get_successful(proc)) {
+        debug_log("env: %s exited with %d in %s", argv[0],
+                  g_subprocess_get_exit_status(proc), job->path);
+        g_clear_pointer(&output, g_bytes_unref);
+    }
+    g_source_destroy(timeout);
+    g_source_unref(timeout);
+
+    const char *pid = proc ? g_subprocess_get_identifier(proc) : NULL;
+    if (pid && g_cancellable_is_cancelled(cancellable)) {
+        g_warning("%s in %s took over %d s; killed it", argv[0], job->path, PROJECT_ENV_TIMEOUT_S);
+        kill(-(pid_t)atoi(pid), SIGKILL);
+        g_subprocess_wait(proc, NULL, NULL);
+        g_clear_pointer(&output, g_bytes_unref);
+    }
+    g_object_unref(cancellable);
+    if (error) {
+        debug_log("env: %s failed in %s: %s", argv[0], job->path, error->message);
+        g_error_free(error);
+    }
+    g_clear_object(&proc);
+    g_object_unref(launcher);
+    return output;
+}
+
+// `env -0` output from inside the activation, minus what belongs to the
+// shell that printed it. nix develop points the temp variables at a build
+// directory it deletes on exit, so every tab would inherit a dead TMPDIR.
+static char** project_env_parse_env0(GBytes *output) {
+    static const char *const skip[] = {
+        "PWD", "OLDPWD", "SHLVL", "_", "TMPDIR", "TMP", "TEMP", "TEMPDIR", "NIX_BUILD_TOP",
+    };
+    gsize len = 0;
+    const char *data = g_bytes_get_data(output, &len);
+    GPtrArray *envv = g_ptr_array_new();
+
+    for (const char *p = data; p < data + len; ) {
+        const char *end = memchr(p, '\0', (gsize)(data + len - p));
+        if (!end) end = data + len;
+        const char *eq = memchr(p, '=', (gsize)(end - p));
+        gboolean keep = eq != NULL && eq != p;
+        for (size_t i = 0; keep && i < G_N_ELEMENTS(skip); i++) {
+            if ((gsize)(eq - p) == strlen(skip[i]) && strncmp(p, skip[i], (gsize)(eq - p)) == 0)
+                keep = FALSE;
+        }
+        if (keep) g_ptr_array_add(envv, g_strndup(p, (gsize)(end - p)));
+        p = end + 1;
+    }
+    g_ptr_array_add(envv, NULL);
+    return (char **)g_ptr_array_free(envv, FALSE);
+}
+
+// `direnv export json` is a diff: a string sets a variable, null unsets it
+static gboolean project_env_apply_direnv(ProjectEnvJob *job, GBytes *output) {
+    gsize len = 0;
+    const char *data = g_bytes_get_data(output, &len);
+    char **envv = g_strdupv(job->base_env);
+
+    // No output means .envrc changed nothing
+    if (len > 0) {
+        JsonParser *parser = json_parser_new();
+        if (!json_parser_load_from_data(parser, data, (gssize)len, NULL) ||
+            !JSON_NODE_HOLDS_OBJECT(json_parser_get_root(parser))) {
+            g_object_unref(parser);
+            g_strfreev(envv);
+            return FALSE;
+        }
+        JsonObject *diff = json_node_get_object(json_parser_get_root(parser));
+        GList *names = json_object_get_members(diff);
+        for (GList *l = names; l != NULL; l = l->next) {
+            const char *name = (const char *)l->data;
+            JsonNode *value = json_object_get_member(diff, name);
+            if (JSON_NODE_HOLDS_NULL(value)) {
+                envv = g_environ_unsetenv(envv, name);
+            } else if (JSON_NODE_HOLDS_VALUE(value)) {
+                envv = g_environ_setenv(envv, name, json_node_get_string(value), TRUE);
+            }
+        }
+        g_list_free(names);
+        g_object_unref(parser);
+    }
+
+    job->envv = envv;
+    return TRUE;
+}
+
+// What bin/activate does
+static gboolean project_env_apply_venv(ProjectEnvJob *job) {
+    const char *dir = project_env_venv_dir(job->path);
+    if (!dir) return FALSE;
+
+    char *venv = g_build_filename(job->path, dir, NULL);
+    char *bin = g_build_filename(venv, "bin", NULL);
+    const char *old_path = g_environ_getenv(job->base_env, "PATH");
+    char *path = old_path ? g_strconcat(bin, ":", old_path, NULL) : g_strdup(bin);
+    job->envv = g_strdupv(job->base_env);
+    job->envv = g_environ_setenv(job->envv, "VIRTUAL_ENV", venv, TRUE);
+    job->envv = g_environ_setenv(job->envv, "PATH", path, TRUE);
+    job->envv = g_environ_unsetenv(job->envv, "PYTHONHOME");
+    g_free(path);
+    g_free(bin);
+    g_free(venv);
+    return TRUE;
+}
+
+static gboolean on_project_env_ready(gpointer user_data);
+
+static void project_env_worker(gpointer data, gpointer user_data) {
+    ProjectEnvJob *job = (ProjectEnvJob *)data;
+    (void)user_data;
+    gint64 start = g_get_monotonic_time();
+    char *program = NULL;
+    GBytes *output = NULL;
+
+    job->kind = project_env_detect(job->path, job->enabled, &program);
+    if (project_env_needs_allow(job->kind)) {
+        char *hash = project_env_hash(job->path, job->kind);
+        job->blocked = !hash || !allow_list_has(PROJECT_ENV_ALLOW_FILE_NAME, job->path, hash);
+        g_free(hash);
+    }
+
+    if (job->blocked) {
+        job->ok = TRUE;
+    } else if (job->kind == PROJECT_ENV_DIRENV) {
+        const char *const argv[] = { program, "export", "json", NULL };
+        output = project_env_run(job, argv);
+        job->ok = output && project_env_apply_direnv(job, output);
+        const char *watches = job->ok ? g_environ_getenv(job->envv, "DIRENV_WATCHES") : NULL;
+        if (watches) job->watches = project_env_parse_watches(watches);
+    } else if (job->kind == PROJECT_ENV_NIX) {
+        const char *const argv[] = { program, "develop", "--command", "env", "-0", NULL };
+        output = project_env_run(job, argv);
+        if (output) job->envv = project_env_parse_env0(output);
+        job->ok = output != NULL;
+    } else if (job->kind == PROJECT_ENV_MISE) {
+        const char *const argv[] = { program, "exec", "--", "env", "-0", NULL };
+        output = project_env_run(job, argv);
+        if (output) job->envv = project_env_parse_env0(output);
+        job->ok = output != NULL;
+    } else if (job->kind == PROJECT_ENV_VENV) {
+        job->ok = project_env_apply_venv(job);
+    } else {
+        // asdf resolves .tool-versions in its shims, so there is nothing to cache
+        job->ok = TRUE;
+    }
+
+    if (output) g_bytes_unref(output);
+    g_free(program);
+    job->elapsed_us = g_get_monotonic_time() - start;
+    g_main_context_invoke(NULL, on_project_env_ready, job);
+}
+
+// Tells a tab starting without its project's activation why
+static void project_env_show_blocked(SubTab *subtab, ProjectEnv *env) {
+    char *notice = g_strdup_printf("\033[2mgmux: %s activation not allowed yet; "
+                                   "`gmux ctl env --allow` runs it\033[0m\r\n",
+                                   project_env_kind_names[env->kind]);
+    vte_terminal_feed(subtab->terminal, notice, -1);
+    g_free(notice);
+}
+
+static void release_project_env_waiters(ProjectEnv *env, char **envv) {
+    if (env->wait_timer_id) {
+        g_source_remove(env->wait_timer_id);
+        env->wait_timer_id = 0;
+    }
+    for (guint i = 0; i < env->waiting->len; i++) {
+        // Tabs closed while waiting have let go of their terminal
+        VteTerminal *terminal = g_ptr_array_index(env->waiting, i);
+        SubTab *subtab = g_object_get_data(G_OBJECT(terminal), "subtab");
+        if (!subtab) continue;
+        if (env->blocked && !env->in_flight) project_env_show_blocked(subtab, env);
+        start_subtab_shell(subtab, envv);
+    }
+    g_ptr_array_set_size(env->waiting, 0);
+}
+
+static gboolean on_project_env_wait_timeout(gpointer user_data) {
+    ProjectEnv *env = (ProjectEnv *)user_data;
+    env->wait_timer_id = 0;
+    debug_log("env: %s still evaluating, starting %u tab(s) without it",
+              env->path, env->waiting->len);
+    release_project_env_waiters(env, NULL);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean on_project_env_ready(gpointer user_data) {
+    ProjectEnvJob *job = (ProjectEnvJob *)user_data;
+    AppState *app = job->app;
+    ProjectEnv *env = app->project_envs ? g_hash_table_lookup(app->project_envs, job->path) : NULL;
+
+    if (env && !app->shutting_down) {
+        env->in_flight = FALSE;
+        env->kind = job->kind;
+        env->blocked = job->blocked;
+        g_strfreev(env->envv);
+        env->envv = g_steal_pointer(&job->envv);
+        if (env->watches) g_array_unref(env->watches);
+        env->watches = g_steal_pointer(&job->watches);
+        g_free(env->stamp);
+        // Settings that changed meanwhile make the next tab evaluate again
+        gboolean current = job->enabled == project_env_parse_enabled(app->settings.project_env);
+        env->stamp = job->ok && current ? g_steal_pointer(&job->stamp) : NULL;
+
+        debug_log("env: %s %s%s in %.1fms, %u tab(s) waiting", env->path,
+                  project_env_kind_names[env->kind],
+                  job->blocked ? " (not allowed)" : job->ok ? "" : " (failed)",
+                  job->elapsed_us / 1000.0, env->waiting->len);
+        release_project_env_waiters(env, env->envv);
+    }
+
+    project_env_job_free(job);
+    return G_SOURCE_REMOVE;
+}
+
+static void submit_project_env_job(AppState *app, ProjectEnv *env, const char *stamp) {
+    if (!app->env_pool) {
+        app->env_pool = g_thread_pool_new(project_env_worker, NULL, PROJECT_ENV_WORKERS,
+                                          FALSE, NULL);
+    }
+
+    ProjectEnvJob *job = g_new0(ProjectEnvJob, 1);
+    job->app = app;
+    job->path = g_strdup(env->path);
+    job->stamp = g_strdup(stamp);
+    job->base_env = g_get_environ();
+    job->enabled = project_env_parse_enabled(app->settings.project_env);
+
+    env->in_flight = TRUE;
+    g_thread_pool_push(app->env_pool, job, NULL);
+}
+
+static void spawn_with_project_env(SubTab *subtab) {
+    Project *project = subtab->parent_tab;
+    AppState *app = project->app;
+    char *stamp = project_env_stamp(project->path);
+
+    // Nothing to activate: start right away, as before
+    if (stamp[0] == '\0' || app->shutting_down) {
+        g_free(stamp);
+        start_subtab_shell(subtab, NULL);
+        return;
+    }
+
+    if (!app->project_envs) {
+        app->project_envs = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                                  (GDestroyNotify)project_env_free);
+    }
+    ProjectEnv *env = g_hash_table_lookup(app->project_envs, project->path);
+    if (!env) {
+        env = g_new0(ProjectEnv, 1);
+        env->path = g_strdup(project->path);
+        env->waiting = g_ptr_array_new_with_free_func(g_object_unref);
+        g_hash_table_insert(app->project_envs, env->path, env);
+    }
+
+    if (!env->in_flight && g_strcmp0(env->stamp, stamp) == 0 &&
+        project_env_watches_current(env->watches)) {
+        g_free(stamp);
+        if (env->blocked) project_env_show_blocked(subtab, env);
+        start_subtab_shell(subtab, env->envv);
+        return;
+    }
+
+    if (!env->in_flight) submit_project_env_job(app, env, stamp);
+    g_ptr_array_add(env->waiting, g_object_ref(subtab->terminal));
+    if (!env->wait_timer_id) {
+        env->wait_timer_id = g_timeout_add(PROJECT_ENV_WAIT_MS, on_project_env_wait_timeout, env);
+    }
+    g_free(stamp);
+}
+
+// Makes every project evaluate again on its next tab, e.g. after
+// project_env= or an allow list changed
+static void forget_project_envs(AppState *app) {
+    if (!app->project_envs) return;
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, app->project_envs);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_clear_pointer(&((ProjectEnv *)value)->stamp, g_free);
+    }
+}
+
+static void stop_project_envs(AppState *app) {
+    if (app->env_pool) {
+        // Drop queued jobs; running ones finish and are ignored
+        g_thread_pool_free(app->env_pool, TRUE, FALSE);
+        app->env_pool = NULL;
+    }
+    g_clear_pointer(&app->project_envs, g_hash_table_unref);
+}
+
+//=============================================================================
+// Lightweight Spawn
+//=============================================================================
+
+// vte_terminal_spawn_async forks gmux before exec'ing the shell, and the
+// fork copies gmux's page tables: with hundreds of MB of scrollback, every
+// new tab pays for it. Here the PTY comes from vte_pty_new_sync and the
+// shell from posix_spawn, which glibc implements with
+// clone(CLONE_VM | CLONE_VFORK), so nothing is copied whatever gmux's size.
+// POSIX_SPAWN_SETSID followed by opening the PTY's peer as fd 0 makes it
+// the shell's controlling terminal, as VTE's child setup does.
+// `spawn_backend=vte` in settings.conf goes back to VTE's path, which is
+// also the fallback when this one fails. `gmux ctl spawn-bench` compares
+// the two against the process's RSS.
+
+// Nested: without glibc, __GLIBC_PREREQ isn't defined and can't be parsed
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 34)
+#define HAVE_LIGHT_SPAWN 1      // posix_spawn_file_actions_addclosefrom_np
+#endif
+#endif
+
+#define SPAWN_BENCH_STEPS 4
+#define SPAWN_BENCH_MAX_COUNT 500       // Spawns per method and step
+#define SPAWN_BENCH_MAX_BALLAST_MB 256  // Per step, so at most 1 GiB in all
+#define SPAWN_BENCH_MAX_US (5 * G_USEC_PER_SEC)  // Longest it may block the UI
+
+#ifdef HAVE_LIGHT_SPAWN
+// What VTE puts in a child's environment
+static char** light_spawn_environ(char **envv) {
+    char **env = envv ? g_strdupv(envv) : g_get_environ();
+    char *version = g_strdup_printf("%d", VTE_MAJOR_VERSION * 10000 +
+                                          VTE_MINOR_VERSION * 100 + VTE_MICRO_VERSION);
+    env = g_environ_setenv(env, "TERM", "xterm-256color", TRUE);
+    env = g_environ_setenv(env, "COLORTERM", "truecolor", TRUE);
+    env = g_environ_setenv(env, "VTE_VERSION", version, TRUE);
+    env = g_environ_unsetenv(env, "COLUMNS");
+    env = g_environ_unsetenv(env, "LINES");
+    g_free(version);
+    return env;
+}
+
+// posix_spawnp with the attributes a terminal child needs. tty is opened
+// as the controlling terminal, or stdio is left alone when NULL.
+static int light_spawn_exec(pid_t *pid, const char *working_dir, const char *tty,
+                            char **argv, char **env) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t all, none;
+
+    posix_spawn_file_actions_init(&actions);
+    if (working_dir) posix_spawn_file_actions_addchdir_np(&actions, working_dir);
+    if (tty) {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, tty, O_RDWR, 0);
+        posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO);
+    }
+    posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+
+    sigfillset(&all);
+    sigemptyset(&none);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &all);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGDEF |
+                                    POSIX_SPAWN_SETSIGMASK);
+
+    int rc = posix_spawnp(pid, argv[0], &actions, &attr, argv, env);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return rc;
+}
+#endif
+
+// Starts argv on a new PTY attached to terminal and returns its pid, or -1
+// with error set. The caller still owns argv and envv.
+static GPid light_spawn(VteTerminal *terminal, const char *working_dir, char **argv,
+                        char **envv, GError **error) {
+#ifdef HAVE_LIGHT_SPAWN
+    VtePty *pty = vte_pty_new_sync(VTE_PTY_DEFAULT, NULL, error);
+    if (!pty) return -1;
+
+    char tty[PATH_MAX];
+    int rc = ptsname_r(vte_pty_get_fd(pty), tty, sizeof(tty));
+    if (rc != 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(rc), "ptsname: %s", g_strerror(rc));
+        g_object_unref(pty);
+        return -1;
+    }
+
+    // Attach first so the shell starts at the terminal's size
+    vte_terminal_set_pty(terminal, pty);
+    g_object_unref(pty);
+
+    char **env = light_spawn_environ(envv);
+    pid_t pid = -1;
+    rc = light_spawn_exec(&pid, working_dir, tty, argv, env);
+    g_strfreev(env);
+    if (rc != 0) {
+        vte_terminal_set_pty(terminal, NULL);
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(rc),
+                    "posix_spawn %s: %s", argv[0], g_strerror(rc));
+        return -1;
+    }
+
+    vte_terminal_watch_child(terminal, pid);
+    return pid;
+#else
+    (void)terminal; (void)working_dir; (void)argv; (void)envv;
+    g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        "posix_spawn backend needs glibc 2.34");
+    return -1;
+#endif
+}
+
+static int compare_gint64(gconstpointer a, gconstpointer b) {
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+    return (x > y) - (x < y);
+}
+
+// Median and worst time, in microseconds, for the parent to get control
+// back from starting /bin/true: fork() as VTE does, or posix_spawn. Stops
+// early at deadline and says so in "spawned".
+static JsonObject* spawn_bench_round(int count, gboolean use_fork, gint64 deadline) {
+    char *argv[] = { "/bin/true", NULL };
+    char *envp[] = { NULL };
+    GArray *times = g_array_sized_new(FALSE, FALSE, sizeof(gint64), (guint)count);
+    int failed = 0;
+
+    for (int i = 0; i < count; i++) {
+        gint64 start = g_get_monotonic_time();
+        if (start > deadline) break;
+        pid_t pid = -1;
+        if (use_fork) {
+            pid = fork();
+            if (pid == 0) {
+                execve(argv[0], argv, envp);
+                _exit(127);
+            }
+        } else {
+#ifdef HAVE_LIGHT_SPAWN
+            if (light_spawn_exec(&pid, NULL, NULL, argv, envp) != 0) pid = -1;
+#endif
+        }
+        gint64 elapsed = g_get_monotonic_time() - start;
+        if (pid < 0) {
+            failed++;
+            continue;
+        }
+        g_array_append_val(times, elapsed);
+        waitpid(pid, NULL, 0);
+    }
+
+    JsonObject *result = json_object_new();
+    if (times->len > 0) {
+        g_array_sort(times, compare_gint64);
+        json_object_set_int_member(result, "p50_us", g_array_index(times, gint64, times->len / 2));
+        json_object_set_int_member(result, "max_us", g_array_index(times, gint64, times->len - 1));
+    }
+    json_object_set_int_member(result, "spawned", times->len);
+    json_object_set_int_member(result, "failed", failed);
+    g_array_free(times, TRUE);
+    return result;
+}
+
+// Runs both spawn methods at gmux's current RSS, then again after each of
+// SPAWN_BENCH_STEPS allocations of ballast_mb touched memory, so the reply
+// shows how spawn latency grows with RSS. This blocks the main loop, so
+// the callers' limits and SPAWN_BENCH_MAX_US keep it short; rounds past
+// the deadline are left out.
+static JsonArray* run_spawn_bench(int count, int ballast_mb) {
+    JsonArray *rounds = json_array_new();
+    GPtrArray *ballast = g_ptr_array_new_with_free_func(g_free);
+    int steps = ballast_mb > 0 ? SPAWN_BENCH_STEPS : 0;
+    gint64 deadline = g_get_monotonic_time() + SPAWN_BENCH_MAX_US;
+
+    for (int step = 0; step <= steps && g_get_monotonic_time() < deadline; step++) {
+        if (step > 0) {
+            gsize size = (gsize)ballast_mb * 1024 * 1024;
+            char *block = g_malloc(size);
+            memset(block, step, size);
+            g_ptr_array_add(ballast, block);
+        }
+
+        JsonObject *round = json_object_new();
+        json_object_set_int_member(round, "rss_mb", read_rss_bytes() / (1024 * 1024));
+        json_object_set_object_member(round, "fork", spawn_bench_round(count, TRUE, deadline));
+#ifdef HAVE_LIGHT_SPAWN
+        json_object_set_object_member(round, "posix_spawn", spawn_bench_round(count, FALSE, deadline));
+#endif
+        json_array_add_object_element(rounds, round);
+    }
+
+    g_ptr_array_unref(ballast);
+    return rounds;
+}
+
+//=============================================================================
+// Foreground Job Tracking
+//=============================================================================
+
+// One timer polls every tab's PTY in a single pass: tcgetpgrp() gives the
+// foreground process group and /proc supplies its command line and the
+// shell's cwd (skipped when the shell reports OSC 7, or while a job it
+// started is still in the foreground). Each tab backs off on its own,
+// doubling its interval while nothing changes. Typing into a tab or a
+// change seen in it resets that tab to the fastest rate. The timer only
+// fires when the earliest tab is due, and tabs due shortly after it are
+// folded into the same pass. Changes are published to job listeners.
+
+#define JOB_POLL_MIN_MS 250
+#define JOB_POLL_MAX_MS 4000
+#define JOB_LABEL_MAX 48
+
+typedef enum {
+    JOB_CHANGED_COMMAND = 1 << 0,
+    JOB_CHANGED_CWD     = 1 << 1
+} JobChange;
+
+typedef void (*JobListenerFunc)(SubTab *subtab, guint changes, gpointer user_data);
+
+typedef struct {
+    JobListenerFunc func;
+    gpointer user_data;
+} JobListener;
+
+static gboolean on_job_poll_tick(gpointer user_data);
+
+static void add_job_listener(AppState *app, JobListenerFunc func, gpointer user_data) {
+    if (!app->job_listeners) {
+        app->job_listeners = g_array_new(FALSE, FALSE, sizeof(JobListener));
+    }
+    JobListener listener = { func, user_data };
+    g_array_append_val(app->job_listeners, listener);
+}
+
+static void notify_job_listeners(AppState *app, SubTab *subtab, guint changes) {
+    if (!app->job_listeners) return;
+    for (guint i = 0; i < app->job_listeners->len; i++) {
+        JobListener *listener = &g_array_index(app->job_listeners, JobListener, i);
+        listener->func(subtab, changes, listener->user_data);
+    }
+}
+
+// "cargo build" from /proc/<pid>/cmdline: the program's basename plus its
+// first argument when that isn't an option. NULL if the process is gone.
+static char* read_job_label(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/cmdline", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    char buf[512];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return NULL;
+    buf[n] = '\0';
+
+    const char *argv0 = buf;
+    const char *slash = strrchr(argv0, '/');
+    if (slash) argv0 = slash + 1;
+
+    size_t len0 = strlen(buf);
+    const char *arg1 = (ssize_t)(len0 + 1) < n ? buf + len0 + 1 : NULL;
+    char *label;
+    if (arg1 && arg1[0] != '\0' && arg1[0] != '-') {
+        const char *base = strrchr(arg1, '/');
+        label = g_strdup_printf("%s %s", argv0, base && base[1] ? base + 1 : arg1);
+    } else {
+        label = g_strdup(argv0);
+    }
+
+    if (g_utf8_strlen(label, -1) > JOB_LABEL_MAX) {
+        char *end = g_utf8_offset_to_pointer(label, JOB_LABEL_MAX - 1);
+        *end = '\0';
+        char *shortened = g_strconcat(label, "…", NULL);
+        g_free(label);
+        label = shortened;
+    }
+    return label;
+}
+
+// Reads one tab's foreground job and cwd; returns the JobChange bits.
+static guint poll_subtab_job(SubTab *subtab) {
+    if (subtab->child_pid <= 0 || subtab->closing || !subtab->terminal) return 0;
+    VtePty *pty = vte_terminal_get_pty(subtab->terminal);
+    if (!pty) return 0;
+
+    guint changes = 0;
+    pid_t pgrp = tcgetpgrp(vte_pty_get_fd(pty));
+    gboolean same_job = pgrp > 0 && pgrp != subtab->child_pid && pgrp == subtab->fg_pgrp;
+    if (pgrp <= 0 || pgrp == subtab->child_pid) {
+        if (subtab->job) {
+            g_clear_pointer(&subtab->job, g_free);
+            changes |= JOB_CHANGED_COMMAND;
+        }
+    } else if (!same_job || subtab->job_poll_ms < JOB_POLL_MAX_MS) {
+        // Re-read the same group until the tab backs off: its leader may
+        // exec after the shell forks it. Typing resets the backoff.
+        char *job = read_job_label(pgrp);
+        if (!job) {
+            // Leader already exited (e.g. the left side of a pipeline)
+            job = g_strdup(pgrp == subtab->fg_pgrp && subtab->job ? subtab->job : "job");
+        }
+        if (g_strcmp0(job, subtab->job) != 0) {
+            g_free(subtab->job);
+            subtab->job = job;
+            changes |= JOB_CHANGED_COMMAND;
+        } else {
+            g_free(job);
+        }
+    }
+    subtab->fg_pgrp = pgrp;
+
+    // The shell can't change directory while a job it started holds the
+    // foreground, so one read when the job starts is enough
+    if (!same_job && !vte_terminal_get_current_directory_uri(subtab->terminal)) {
+        char link[64];
+        char target[PATH_MAX];
+        snprintf(link, sizeof(link), "/proc/%d/cwd", (int)subtab->child_pid);
+        ssize_t n = readlink(link, target, sizeof(target) - 1);
+        if (n > 0) {
+            target[n] = '\0';
+            if (g_strcmp0(target, subtab->cwd) != 0) {
+                g_free(subtab->cwd);
+                subtab->cwd = g_strdup(target);
+                changes |= JOB_CHANGED_CWD;
+            }
+        }
+    }
+
+    return changes;
+}
+
+static void schedule_job_poll(AppState *app, gint64 due) {
+    if (app->shutting_down) return;
+    if (app->job_poll_id > 0) {
+        if (app->job_poll_due <= due) return;
+        g_source_remove(app->job_poll_id);
+    }
+
+    gint64 delay_ms = MAX(0, (due - g_get_monotonic_time()) / 1000);
+    app->job_poll_due = due;
+    app->job_poll_id = g_timeout_add((guint)delay_ms, on_job_poll_tick, app);
+}
+
+static gboolean on_job_poll_tick(gpointer user_data) {
+    AppState *app = (AppState *)user_data;
+    app->job_poll_id = 0;
+
+    gint64 now = g_get_monotonic_time();
+    gint64 horizon = now + (JOB_POLL_MIN_MS / 2) * 1000;
+    gint64 next_due = G_MAXINT64;
+    int polled = 0;
+    int changed = 0;
+
+    for (GList *l = app->projects; l != NULL; l = l->next) {
+        Project *project = (Project *)l->data;
+        for (GList *sl = project->subtabs; sl != NULL; sl = sl->next) {
+            SubTab *subtab = (SubTab *)sl->data;
+            if (subtab->child_pid <= 0) continue;
+
+            if (subtab->job_poll_due <= horizon) {
+                guint changes = poll_subtab_job(subtab);
+                polled++;
+                if (changes) {
+                    changed++;
+                    subtab->job_poll_ms = JOB_POLL_MIN_MS;
+                    notify_job_listeners(app, subtab, changes);
+                } else {
+                    subtab->job_poll_ms = MIN(MAX(subtab->job_poll_ms, JOB_POLL_MIN_MS / 2) * 2,
+                                              JOB_POLL_MAX_MS);
+                }
+                subtab->job_poll_due = now + (gint64)subtab->job_poll_ms * 1000;
+            }
+            next_due = MIN(next_due, subtab->job_poll_due);
+        }
+    }
+
+    if (changed > 0) {
+        debug_log("Job poll: %d tabs polled, %d changed in %.3f ms", polled, changed,
+                  (g_get_monotonic_time() - now) / 1000.0);
+    }
+    if (next_due != G_MAXINT64) {
+        schedule_job_poll(app, next_due);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// Polls this tab at the fastest rate again, starting one interval from now.
+static void kick_job_poll(SubTab *subtab) {
+    if (subtab->child_pid <= 0) return;
+    gint64 due = g_get_monotonic_time() + JOB_POLL_MIN_MS * 1000;
+    subtab->job_poll_ms = JOB_POLL_MIN_MS;
+    if (subtab->job_poll_due > due || subtab->job_poll_due == 0) {
+        subtab->job_poll_due = due;
+    }
+    schedule_job_poll(subtab->parent_tab->app, subtab->job_poll_due);
+}
+
+static void stop_job_poll(AppState *app) {
+    if (app->job_poll_id > 0) {
+        g_source_remove(app->job_poll_id);
+        app->job_poll_id = 0;
+    }
+    if (app->job_listeners) {
+        g_array_free(app->job_listeners, TRUE);
+        app->job_listeners = NULL;
+    }
+}
+
+static void on_job_changed_update_label(SubTab *subtab, guint changes, gpointer user_data) {
+    (void)user_data;
+    if (changes & JOB_CHANGED_COMMAND) {
+        update_subtab_label(subtab);
+    }
+}
+
+static void start_job_poll(AppState *app) {
+    add_job_listener(app, on_job_changed_update_label, NULL);
+}
+
+typedef struct {
+    VteTerminal *terminal;      // Finds the SubTab again, if it still exists
+    CloseScope scope;
+} CloseRequest;
+
+static void close_subtabs_now(SubTab *subtab, CloseScope scope) {
+    switch (scope) {
+    case CLOSE_TAB:
+        close_subtab(subtab);
+        break;
+    case CLOSE_OTHER_TABS:
+        close_other_subtabs(subtab);
+        break;
+    case CLOSE_ALL_TABS:
+        close_all_subtabs(subtab->parent_tab);
+        break;
+    }
+}
+
+static void on_close_confirm_done(GObject *source, GAsyncResult *result, gpointer user_data) {
+    CloseRequest *request = (CloseRequest *)user_data;
+    int button = gtk_alert_dialog_choose_finish(GTK_ALERT_DIALOG(source), result, NULL);
+
+    SubTab *subtab = (SubTab *)g_object_get_data(G_OBJECT(request->terminal), "subtab");
+    if (button == 1 && subtab) {
+        close_subtabs_now(subtab, request->scope);
+    }
+    g_object_unref(request->terminal);
+    g_free(request);
+}
+
+// Closes the tabs in scope, asking first if any of them is running a job.
+// The jobs are re-polled so the answer isn't up to one backoff interval old.
+static void request_close_subtabs(SubTab *subtab, CloseScope scope) {
+    AppState *app = subtab->parent_tab->app;
+    GPtrArray *jobs = g_ptr_array_new();
+
+    for (GList *l = subtab->parent_tab->subtabs; l != NULL; l = l->next) {
+        SubTab *st = (SubTab *)l->data;
+        if ((scope == CLOSE_TAB && st != subtab) ||
+            (scope == CLOSE_OTHER_TABS && st == subtab)) {
+            continue;
+        }
+        guint changes = poll_subtab_job(st);
+        if (changes) notify_job_listeners(app, st, changes);
+        if (st->job) g_ptr_array_add(jobs, st->job);
+    }
+
+    if (jobs->len == 0) {
+        g_ptr_array_free(jobs, TRUE);
+        close_subtabs_now(subtab, scope);
+        return;
+    }
+
+    GtkAlertDialog *dialog;
+    if (jobs->len == 1) {
+        dialog = gtk_alert_dialog_new(scope == CLOSE_TAB ? "Close this tab?" : "Close tabs?");
+        char *detail = g_strdup_printf("“%s” is still running and will be terminated.",
+                                       (char *)jobs->pdata[0]);
+        gtk_alert_dialog_set_detail(dialog, detail);
+        g_free(detail);
+    } else {
+        g_ptr_array_add(jobs, NULL);
+        char *names = g_strjoinv(", ", (char **)jobs->pdata);
+        dialog = gtk_alert_dialog_new("Close tabs?");
+        char *detail = g_strdup_printf("%u tabs are running jobs that will be terminated: %s.",
+                                       jobs->len - 1, names);
+        gtk_alert_dialog_set_detail(dialog, detail);
+        g_free(detail);
+        g_free(names);
+    }
+    g_ptr_array_free(jobs, TRUE);
+
+    static const char *buttons[] = { "Cancel", "Close", NULL };
+    gtk_alert_dialog_set_buttons(dialog, buttons);
+    gtk_alert_dialog_set_cancel_button(dialog, 0);
+    gtk_alert_dialog_set_default_button(dialog, 0);
+
+    CloseRequest *request = g_new0(CloseRequest, 1);
+    request->terminal = g_object_ref(subtab->terminal);
+    request->scope = scope;
+    gtk_alert_dialog_choose(dialog, GTK_WINDOW(subtab->parent_tab->win->window), NULL,
+                            on_close_confirm_done, request);
+    g_object_unref(dialog);
+}
+
+//=============================================================================
+// Memory Pressure
+//=============================================================================
+
+// gmux listens for GMemoryMonitor warnings and, where the kernel has PSI,
+// for a /proc/pressure/memory trigger. Each warning maps to a tier, and the
+// response escalates through the tiers in order:
+//   1. drop caches that are rebuilt on demand (the theme catalog, the
+//      hidden settings window, git results for off-screen rows, discovery
+//      picker rows)
+//   2. trim scrollback in projects unused for MEMORY_IDLE_MINUTES
+//   3. trim scrollback in every project but each window's active one
+// The CSS provider is not a cache: it holds the styling in use, and GTK
+// has no call to drop the style data it derives from it.
+// A tier runs at most once per episode. An episode ends after
+// MEMORY_CALM_SECONDS with no warnings. A repeated warning still escalates
+// one step once the last step is MEMORY_ESCALATE_SECONDS old, because the
+// pressure outlasted it. `gmux ctl memory-pressure` injects warnings.
+
+#define MEMORY_TIER_MAX 3
+#define MEMORY_CALM_SECONDS 60
+#define MEMORY_ESCALATE_SECONDS 5
+#define MEMORY_IDLE_MINUTES 30
+#define MEMORY_TRIM_SCROLLBACK_LINES 1000
+#define PSI_TRIGGER "some 300000 2000000"  // 300ms stalled per 2s window
+
+static gint64 read_rss_bytes(void) {
+    char *contents = NULL;
+    if (!g_file_get_contents("/proc/self/statm", &contents, NULL, NULL)) return 0;
+    long long size = 0, resident = 0;
+    int fields = sscanf(contents, "%lld %lld", &size, &resident);
+    g_free(contents);
+    return fields == 2 ? resident * (gint64)sysconf(_SC_PAGESIZE) : 0;
+}
+
+// Hands freed heap back to the kernel and returns how much RSS went down
+// since rss_before; the RSS delta is the only honest "bytes reclaimed"
+// figure for widgets, VTE rings and GLib allocations alike.
+static gint64 memory_reclaimed_since(gint64 rss_before) {
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+    gint64 rss = read_rss_bytes();
+    return rss_before > rss ? rss_before - rss : 0;
+}
+
+static void log_memory_action(int tier, const char *action, int count, gint64 reclaimed) {
+    char *size = g_format_size((guint64)reclaimed);
+    printf("Memory pressure tier %d: %s (%d), reclaimed %s\n", tier, action, count, size);
+    fflush(stdout);
+    g_free(size);
+}
+
+static gint64 shed_caches(AppState *app) {
+    gint64 total = 0;
+    gint64 rss = read_rss_bytes();
+    int count = 0;
+
+    if (app->settings_dialog && !gtk_widget_get_visible(app->settings_dialog)) {
+        gtk_window_destroy(GTK_WINDOW(app->settings_dialog));
+        count++;
+    }
+    // The settings dropdowns index into the catalog, so it stays while
+    // they exist
+    if (!app->settings_dialog && theme_catalog_unload() > 0) count++;
+    if (app->git_repos) {
+        for (GList *l = app->projects; l != NULL; l = l->next) {
+            Project *project = (Project *)l->data;
+            GitRepo *repo = g_hash_table_lookup(app->git_repos, project->path);
+            // Rows keep their label; scrolling one into view recomputes it
+            if (repo && !repo->in_flight && !project_row_visible(project)) {
+                g_hash_table_remove(app->git_repos, project->path);
+                count++;
+            }
+        }
+    }
+    for (GList *l = app->windows; l != NULL; l = l->next) {
+        WorkspaceWindow *win = (WorkspaceWindow *)l->data;
+        if (!win->discovery_list || gtk_widget_get_mapped(win->discovery_list)) continue;
+
+        GtkWidget *child;
+        while ((child = gtk_widget_get_first_child(win->discovery_list)) != NULL) {
+            gtk_list_box_remove(GTK_LIST_BOX(win->discovery_list), child);
+            count++;
+        }
+    }
+
+    total = memory_reclaimed_since(rss);
+    log_memory_action(1, "dropped caches", count, total);
+    return total;
+}
+
+// Trims tabs of background projects last used before idle_before
+static int trim_background_scrollback(AppState *app, gint64 idle_before) {
+    int count = 0;
+
+    for (GList *l = app->projects; l != NULL; l = l->next) {
+        Project *project = (Project *)l->data;
+        if (project == project->win->active_project || project->last_used > idle_before) continue;
+
+        for (GList *sl = project->subtabs; sl != NULL; sl = sl->next) {
+            SubTab *subtab = (SubTab *)sl->data;
+            glong lines = vte_terminal_get_scrollback_lines(subtab->terminal);
+            if (lines >= 0 && lines <= MEMORY_TRIM_SCROLLBACK_LINES) continue;
+
+            // Shrinking the limit drops the oldest lines right away; putting
+            // it back only lets the tab grow again from what is left.
+            vte_terminal_set_scrollback_lines(subtab->terminal, MEMORY_TRIM_SCROLLBACK_LINES);
+            vte_terminal_set_scrollback_lines(subtab->terminal, lines);
+            count++;
+        }
+    }
+    return count;
+}
+
+static gint64 trim_idle_scrollback(AppState *app) {
+    gint64 rss = read_rss_bytes();
+    gint64 idle_before = g_get_real_time() - (gint64)MEMORY_IDLE_MINUTES * 60 * G_USEC_PER_SEC;
+    int count = trim_background_scrollback(app, idle_before);
+
+    gint64 reclaimed = memory_reclaimed_since(rss);
+    log_memory_action(2, "trimmed idle scrollback", count, reclaimed);
+    return reclaimed;
+}
+
+static gint64 trim_hidden_scrollback(AppState *app) {
+    gint64 rss = read_rss_bytes();
+    int count = trim_background_scrollback(app, G_MAXINT64);
+
+    gint64 reclaimed = memory_reclaimed_since(rss);
+    log_memory_action(3, "trimmed hidden projects' scrollback", count, reclaimed);
+    return reclaimed;
+}
+
+// Applies the tiers a warning of the given tier calls for; returns the
+// highest tier applied so far in this episode. reclaimed is incremented by
+// what the new steps freed.
+static int handle_memory_pressure(AppState *app, int tier, const char *source,
+                                  gint64 *reclaimed) {
+    gint64 now = g_get_monotonic_time();
+    tier = CLAMP(tier, 1, MEMORY_TIER_MAX);
+
+    if (now - app->memory_last_warning > (gint64)MEMORY_CALM_SECONDS * G_USEC_PER_SEC) {
+        app->memory_tier = 0;
+    }
+    app->memory_last_warning = now;
+
+    int target = tier;
+    if (target <= app->memory_tier &&
+        now - app->memory_last_step >= (gint64)MEMORY_ESCALATE_SECONDS * G_USEC_PER_SEC) {
+        target = MIN(app->memory_tier + 1, MEMORY_TIER_MAX);
+    }
+    debug_log("Memory pressure from %s: tier %d, episode at %d, applying up to %d",
+              source, tier, app->memory_tier, target);
+
+    for (int step = app->memory_tier + 1; step <= target; step++) {
+        gint64 freed = 0;
+        switch (step) {
+        case 1: freed = shed_caches(app); break;
+        case 2: freed = trim_idle_scrollback(app); break;
+        case 3: freed = trim_hidden_scrollback(app); break;
+        }
+        if (reclaimed) *reclaimed += freed;
+        app->memory_tier = step;
+        app->memory_last_step = now;
+    }
+    return app->memory_tier;
+}
+
+static void on_low_memory_warning(GMemoryMonitor *monitor, GMemoryMonitorWarningLevel level,
+                                  gpointer user_data) {
+    (void)monitor;
+    int tier = level >= G_MEMORY_MONITOR_WARNING_LEVEL_CRITICAL ? 3 :
+               level >= G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM ? 2 : 1;
+    handle_memory_pressure((AppState *)user_data, tier, "memory monitor", NULL);
+}
+
+// Grades a PSI trigger by the 10s averages: mostly "some" stalls is tier 1,
+// sustained or any "full" stalls (every task waiting on memory) go higher.
+static int psi_memory_tier(void) {
+    char *contents = NULL;
+    if (!g_file_get_contents("/proc/pressure/memory", &contents, NULL, NULL)) return 1;
+
+    double some = 0.0, full = 0.0;
+    char *line = strstr(contents, "some avg10=");
+    if (line) some = g_ascii_strtod(line + strlen("some avg10="), NULL);
+    line = strstr(contents, "full avg10=");
+    if (line) full = g_ascii_strtod(line + strlen("full avg10="), NULL);
+    g_free(contents);
+
+    if (full >= 10.0) return 3;
+    if (full >= 2.0 || some >= 30.0) return 2;
+    return 1;
+}
+
+static gboolean on_psi_trigger(gint fd, GIOCondition condition, gpointer user_data) {
+    AppState *app = (AppState *)user_data;
+    (void)fd;
+
+    if (condition & (G_IO_ERR | G_IO_NVAL)) {
+        g_warning("Memory pressure trigger stopped working");
+        close(app->psi_fd);
+        app->psi_fd = -1;
+        app->psi_source_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+    handle_memory_pressure(app, psi_memory_tier(), "PSI", NULL);
+    return G_SOURCE_CONTINUE;
+}
+
+static void start_memory_monitor(AppState *app) {
+    app->memory_monitor = g_memory_monitor_dup_default();
+    if (app->memory_monitor) {
+        g_signal_connect(app->memory_monitor, "low-memory-warning",
+                         G_CALLBACK(on_low_memory_warning), app);
+    }
+
+    // Missing on kernels without CONFIG_PSI; GMemoryMonitor still works
+    app->psi_fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (app->psi_fd < 0) return;
+    if (write(app->psi_fd, PSI_TRIGGER, strlen(PSI_TRIGGER) + 1) < 0) {
+        debug_log("PSI trigger unavailable: %s", g_strerror(errno));
+        close(app->psi_fd);
+        app->psi_fd = -1;
+        return;
+    }
+    app->psi_source_id = g_unix_fd_add(app->psi_fd, G_IO_PRI, on_psi_trigger, app);
+}
+
+static void stop_memory_monitor(AppState *app) {
+    if (app->memory_monitor) {
+        g_signal_handlers_disconnect_by_data(app->memory_monitor, app);
+        g_clear_object(&app->memory_monitor);
+    }
+    if (app->psi_source_id > 0) {
+        g_source_remove(app->psi_source_id);
+        app->psi_source_id = 0;
+    }
+    if (app->psi_fd >= 0) {
+        close(app->psi_fd);
+        app->psi_fd = -1;
+    }
+}
+
+//=============================================================================
+// Chunked Paste
+//=============================================================================
+
+// Pastes are streamed rather than handed to VTE in one piece, so a 20 MB
+// clipboard neither stalls the UI nor floods the child's input. The
+// clipboard is read asynchronously, at most PASTE_READAHEAD_BYTES ahead of
+// what has been pasted. VTE's paste queues everything it is given at once,
+// so it is given a chunk at a time: the next one only when the PTY has room
+// and VTE has nothing of its own left to write, which is as fast as the
+// child reads. VTE keeps the program's bracketed paste mode to itself and
+// adds the markers to each chunk, so a large paste reaches such a program
+// as several pastes in a row. Chunks are sanitized first (line breaks sent
+// as CR, control characters dropped), as newer VTEs do anyway. Pastes that
+// outgrow paste_confirm_kb or the read-ahead ask first, large ones show
+// progress on the tab, and Escape stops them.
+
+#define PASTE_READ_BYTES (64 * 1024)
+#define PASTE_READAHEAD_BYTES (256 * 1024)
+#define PASTE_CHUNK_BYTES (16 * 1024)
+#define PASTE_PROGRESS_BYTES (128 * 1024)   // Smaller pastes show no progress
+
+// Thin progress bar between a tab's label and close button, used by pastes
+// and scrollback exports. The caller owns the returned reference.
+static GtkWidget* add_tab_progress(SubTab *subtab) {
+    GtkWidget *progress = g_object_ref(gtk_progress_bar_new());
+    gtk_widget_add_css_class(progress, "gmux-tab-progress");
+    gtk_widget_set_valign(progress, GTK_ALIGN_CENTER);
+    gtk_widget_set_size_request(progress, 36, -1);
+    gtk_widget_insert_after(progress, subtab->tab_widget, subtab->tab_button);
+    return progress;
+}
+
+static void remove_tab_progress(GtkWidget **progress) {
+    if (!*progress) return;
+    // The tab strip may already be torn down; the ref keeps this valid
+    GtkWidget *parent = gtk_widget_get_parent(*progress);
+    if (parent) gtk_box_remove(GTK_BOX(parent), *progress);
+    g_clear_object(progress);
+}
+
+struct _PasteJob {
+    SubTab *subtab;             // NULL once the paste is finished or cancelled
+    GCancellable *cancellable;
+    int pending_ops;            // Clipboard reads and dialogs in flight
+    GInputStream *stream;
+    GByteArray *buffer;         // Read but not yet pasted
+    guint64 read_total;
+    guint64 written;            // Handed to VTE
+    gboolean eof;
+    gboolean confirmed;
+    guint write_source_id;
+    GtkWidget *progress;        // Owned ref, NULL for small pastes
+};
+
+static void paste_pump(PasteJob *job);
+
+static void maybe_free_paste_job(PasteJob *job) {
+    if (job->subtab || job->pending_ops > 0) return;
+    g_clear_object(&job->stream);
+    g_object_unref(job->cancellable);
+    g_byte_array_unref(job->buffer);
+    g_free(job);
+}
+
+// Detaches the job from its tab; it is freed once nothing is in flight.
+// Callers must not touch job afterwards.
+static void finish_paste(PasteJob *job, const char *reason) {
+    SubTab *subtab = job->subtab;
+    if (!subtab) return;
+
+    debug_log("Paste into %s %s: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " bytes",
+              subtab->name, reason, job->written, job->read_total);
+    if (job->write_source_id > 0) g_source_remove(job->write_source_id);
+    remove_tab_progress(&job->progress);
+    g_cancellable_cancel(job->cancellable);
+    subtab->paste = NULL;
+    job->subtab = NULL;
+    maybe_free_paste_job(job);
+}
+
+static void cancel_paste(SubTab *subtab) {
+    if (subtab->paste) finish_paste(subtab->paste, "cancelled");
+}
+
+static void update_paste_progress(PasteJob *job) {
+    if (!job->progress) {
+        if (job->eof && job->read_total < PASTE_PROGRESS_BYTES) return;
+        job->progress = add_tab_progress(job->subtab);
+    }
+
+    char *done = g_format_size(job->written);
+    char *total = g_format_size(job->read_total);
+    char *tooltip = g_strdup_printf("Pasting %s of %s%s (Esc to stop)", done,
+                                    job->eof ? "" : "at least ", total);
+    gtk_widget_set_tooltip_text(job->progress, tooltip);
+    if (job->eof && job->read_total > 0) {
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(job->progress),
+                                      (double)job->written / (double)job->read_total);
+    } else {
+        gtk_progress_bar_pulse(GTK_PROGRESS_BAR(job->progress));
+    }
+    g_free(tooltip);
+    g_free(total);
+    g_free(done);
+}
+
+// Longest prefix of at most PASTE_CHUNK_BYTES that ends on a character
+// boundary and doesn't split a CRLF pair
+static gsize paste_chunk_length(const GByteArray *buffer, gboolean eof) {
+    if (buffer->len <= PASTE_CHUNK_BYTES && eof) return buffer->len;
+
+    gsize n = MIN(buffer->len, PASTE_CHUNK_BYTES);
+    if (n < buffer->len) {
+        while (n > 0 && (buffer->data[n] & 0xC0) == 0x80) n--;
+    } else {
+        // More is coming: hold back a trailing multibyte character, which
+        // may be incomplete, until the next read
+        gsize lead = n;
+        while (lead > 0 && (buffer->data[lead - 1] & 0xC0) == 0x80) lead--;
+        if (lead > 0 && buffer->data[lead - 1] >= 0xC0) n = lead - 1;
+    }
+    if (n > 1 && buffer->data[n - 1] == '\r') n--;
+    return n;
+}
+
+// Appends valid UTF-8 text as VTE's paste would send it: LF and CRLF become
+// CR, and C0/C1 controls other than tab and CR are dropped so the text can
+// neither close the bracketed paste early nor drive the terminal
+static void paste_append_sanitized(GByteArray *out, const char *text, gsize len) {
+    for (gsize i = 0; i < len; i++) {
+        guint8 c = (guint8)text[i];
+        if (c == '\r' && i + 1 < len && text[i + 1] == '\n') continue;
+        if (c == '\n') c = '\r';
+        if ((c < 0x20 && c != '\t' && c != '\r') || c == 0x7F) continue;
+        if (c == 0xC2 && i + 1 < len && (guint8)text[i + 1] >= 0x80 && (guint8)text[i + 1] <= 0x9F) {
+            i++;
+            continue;
+        }
+        g_byte_array_append(out, &c, 1);
+    }
+}
+
+// Hands the next chunk of the clipboard to VTE's paste, which brackets it
+// when the program is in bracketed paste mode
+static void paste_next_chunk(PasteJob *job) {
+    gsize n = paste_chunk_length(job->buffer, job->eof);
+    if (n == 0) return;
+
+    char *chunk = g_utf8_make_valid((const char *)job->buffer->data, (gssize)n);
+    GByteArray *out = g_byte_array_sized_new((guint)n + 1);
+    paste_append_sanitized(out, chunk, strlen(chunk));
+    g_byte_array_append(out, (const guint8 *)"", 1);
+    if (out->len > 1) vte_terminal_paste_text(job->subtab->terminal, (const char *)out->data);
+    g_byte_array_unref(out);
+    g_free(chunk);
+
+    g_byte_array_remove_range(job->buffer, 0, (guint)n);
+    job->written += n;
+    update_paste_progress(job);
+}
+
+static gboolean on_paste_writable(gint fd, GIOCondition condition, gpointer user_data) {
+    PasteJob *job = (PasteJob *)user_data;
+    (void)fd;
+
+    job->write_source_id = 0;
+    if (condition & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+        finish_paste(job, "stopped, the PTY closed");
+        return G_SOURCE_REMOVE;
+    }
+
+    paste_next_chunk(job);
+    // Re-armed by paste_pump while there is more to paste
+    paste_pump(job);
+    return G_SOURCE_REMOVE;
+}
+
+static void on_paste_read(GObject *source, GAsyncResult *result, gpointer user_data) {
+    PasteJob *job = (PasteJob *)user_data;
+    GError *error = NULL;
+    GBytes *bytes = g_input_stream_read_bytes_finish(G_INPUT_STREAM(source), result, &error);
+
+    job->pending_ops--;
+    if (!job->subtab) {
+        maybe_free_paste_job(job);
+    } else if (!bytes) {
+        g_warning("Reading the clipboard failed: %s", error->message);
+        finish_paste(job, "failed");
+    } else {
+        gsize size = 0;
+        const guint8 *data = g_bytes_get_data(bytes, &size);
+        g_byte_array_append(job->buffer, data, (guint)size);
+        job->read_total += size;
+        job->eof = size == 0;
+        paste_pump(job);
+    }
+    g_clear_error(&error);
+    if (bytes) g_bytes_unref(bytes);
+}
+
+static void on_paste_confirm_done(GObject *source, GAsyncResult *result, gpointer user_data) {
+    PasteJob *job = (PasteJob *)user_data;
+    int button = gtk_alert_dialog_choose_finish(GTK_ALERT_DIALOG(source), result, NULL);
+
+    job->pending_ops--;
+    if (!job->subtab) {
+        maybe_free_paste_job(job);
+    } else if (button == 1) {
+        job->confirmed = TRUE;
+        paste_pump(job);
+    } else {
+        finish_paste(job, "declined");
+    }
+}
+
+static void ask_paste_confirmation(PasteJob *job) {
+    SubTab *subtab = job->subtab;
+    char *size = g_format_size(job->read_total);
+    char *message = job->eof
+        ? g_strdup_printf("Paste %s into “%s”?", size, subtab->name)
+        : g_strdup_printf("Paste more than %s into “%s”?", size, subtab->name);
+    GtkAlertDialog *dialog = gtk_alert_dialog_new("%s", message);
+    gtk_alert_dialog_set_detail(dialog, "The text is sent in chunks as the program reads it. "
+                                        "Press Escape in the tab to stop.");
+    g_free(message);
+    g_free(size);
+
+    static const char *buttons[] = { "Cancel", "Paste", NULL };
+    gtk_alert_dialog_set_buttons(dialog, buttons);
+    gtk_alert_dialog_set_cancel_button(dialog, 0);
+    gtk_alert_dialog_set_default_button(dialog, 0);
+
+    job->pending_ops++;
+    gtk_alert_dialog_choose(dialog, GTK_WINDOW(subtab->parent_tab->win->window),
+                            job->cancellable, on_paste_confirm_done, job);
+    g_object_unref(dialog);
+}
+
+// Moves the paste along: reads ahead, asks for confirmation once the size
+// calls for it, and waits for the PTY to accept the next chunk. It may
+// finish the paste, so callers must not touch job afterwards.
+static void paste_pump(PasteJob *job) {
+    if (job->pending_ops > 0 && !job->confirmed) return;   // Dialog or read pending
+
+    if (!job->confirmed) {
+        guint64 limit = (guint64)job->subtab->parent_tab->app->settings.paste_confirm_kb * 1024;
+        if (limit == 0 || (job->eof && job->read_total <= limit)) {
+            job->confirmed = TRUE;
+        } else if (job->read_total > limit ||
+                   (!job->eof && job->buffer->len >= PASTE_READAHEAD_BYTES)) {
+            // Nothing is written before the answer, so a full read-ahead
+            // can't wait for the limit
+            ask_paste_confirmation(job);
+            return;
+        }
+    }
+
+    if (!job->eof && job->pending_ops == 0 && job->buffer->len < PASTE_READAHEAD_BYTES) {
+        job->pending_ops++;
+        g_input_stream_read_bytes_async(job->stream, PASTE_READ_BYTES, G_PRIORITY_DEFAULT,
+                                        job->cancellable, on_paste_read, job);
+    }
+    if (!job->confirmed) return;
+
+    if (paste_chunk_length(job->buffer, job->eof) == 0) {
+        if (job->eof && job->buffer->len == 0) finish_paste(job, "done");
+        return;
+    }
+    if (job->write_source_id == 0) {
+        VtePty *pty = vte_terminal_get_pty(job->subtab->terminal);
+        if (!pty) {
+            finish_paste(job, "stopped, the shell is gone");
+            return;
+        }
+        // Below VTE's own PTY writer: while that still has queued input for
+        // the child and the PTY has room, it runs and this waits
+        job->write_source_id = g_unix_fd_add_full(G_PRIORITY_LOW, vte_pty_get_fd(pty),
+                                                  G_IO_OUT | G_IO_ERR | G_IO_HUP,
+                                                  on_paste_writable, job, NULL);
+    }
+}
+
+static void on_paste_clipboard_opened(GObject *source, GAsyncResult *result, gpointer user_data) {
+    PasteJob *job = (PasteJob *)user_data;
+    GError *error = NULL;
+    GInputStream *stream = gdk_clipboard_read_finish(GDK_CLIPBOARD(source), result, NULL, &error);
+
+    job->pending_ops--;
+    if (!job->subtab) {
+        g_clear_object(&stream);
+        maybe_free_paste_job(job);
+    } else if (!stream) {
+        // A clipboard without text is not worth a warning
+        debug_log("Clipboard has no text: %s", error->message);
+        finish_paste(job, "empty");
+    } else {
+        job->stream = stream;
+        paste_pump(job);
+    }
+    g_clear_error(&error);
+}
+
+static void start_paste(SubTab *subtab) {
+    if (subtab->paste || !subtab->spawned) return;
+
+    PasteJob *job = g_new0(PasteJob, 1);
+    job->subtab = subtab;
+    job->cancellable = g_cancellable_new();
+    job->buffer = g_byte_array_new();
+    subtab->paste = job;
+
+    static const char *mime_types[] = { "text/plain;charset=utf-8", "text/plain", NULL };
+    GdkClipboard *clipboard = gtk_widget_get_clipboard(GTK_WIDGET(subtab->terminal));
+    job->pending_ops++;
+    gdk_clipboard_read_async(clipboard, mime_types, G_PRIORITY_DEFAULT,
+                             job->cancellable, on_paste_clipboard_opened, job);
+}
+
+//=============================================================================
+// Scrollback Export
+//=============================================================================
+
+// Saves a tab's whole scrollback to a file or the clipboard as plain text,
+// text with ANSI colours, or HTML. VTE may only be read on the main thread,
+// so rows are copied out EXPORT_SLICE_ROWS at a time from an idle callback
+// and queued to a worker thread, which converts and writes them. The main
+// thread never holds more than EXPORT_QUEUE_MAX slices ahead of the writer.
+// VTE has no ANSI output, so that format is converted from its HTML.
+
+#define EXPORT_SLICE_ROWS 1000
+#define EXPORT_QUEUE_MAX 8
+#define EXPORT_BACKOFF_MS 10
+#define EXPORT_PROGRESS_ROWS 5000   // Smaller exports show no progress
+
+static const char *const export_format_names[] = {
+    [EXPORT_TEXT] = "text",
+    [EXPORT_ANSI] = "ansi",
+    [EXPORT_HTML] = "html",
+};
+
+struct _ScrollbackExport {
+    SubTab *subtab;             // NULL once finished or cancelled
+    VteTerminal *terminal;      // Ref held until the worker is done
+    ExportFormat format;
+    char *path;                 // NULL exports to the clipboard
+    char *title;
+    long start_row;
+    long next_row;
+    long end_row;
+    GAsyncQueue *slices;        // GBytes*; an empty one ends the export
+    GCancellable *cancellable;
+    guint source_id;
+    GtkWidget *progress;        // Owned ref, NULL for small exports
+    GBytes *result;             // Clipboard contents, set by the worker
+};
+
+static gboolean on_export_slice(gpointer user_data);
+
+static void scrollback_export_free(ScrollbackExport *ex) {
+    g_object_unref(ex->terminal);
+    g_free(ex->path);
+    g_free(ex->title);
+    g_async_queue_unref(ex->slices);
+    g_object_unref(ex->cancellable);
+    if (ex->result) g_bytes_unref(ex->result);
+    g_free(ex);
+}
+
+// Ends the producer side; the worker finishes once it reaches the marker
+static void end_export_slices(ScrollbackExport *ex) {
+    if (ex->source_id > 0) {
+        g_source_remove(ex->source_id);
+        ex->source_id = 0;
+    }
+    g_async_queue_push(ex->slices, g_bytes_new(NULL, 0));
+}
+
+static void detach_scrollback_export(ScrollbackExport *ex) {
+    if (!ex->subtab) return;
+    remove_tab_progress(&ex->progress);
+    ex->subtab->export = NULL;
+    ex->subtab = NULL;
+}
+
+static void cancel_scrollback_export(SubTab *subtab) {
+    ScrollbackExport *ex = subtab->export;
+    if (!ex) return;
+    g_cancellable_cancel(ex->cancellable);
+    if (ex->next_row < ex->end_row) end_export_slices(ex);
+    detach_scrollback_export(ex);
+}
+
+typedef struct {
+    int kind;                   // 'b', 'i', 'u', 's', 'k' (blink), 'f', 'g'
+    guint32 rgb;
+} AnsiTag;
+
+#define ANSI_TAG_MAX 16
+
+static void append_ansi_sgr(GString *out, const AnsiTag *tags, int n) {
+    g_string_append(out, "\033[0");
+    for (int i = 0; i < n; i++) {
+        guint32 c = tags[i].rgb;
+        switch (tags[i].kind) {
+        case 'b': g_string_append(out, ";1"); break;
+        case 'i': g_string_append(out, ";3"); break;
+        case 'u': g_string_append(out, ";4"); break;
+        case 'k': g_string_append(out, ";5"); break;
+        case 's': g_string_append(out, ";9"); break;
+        case 'f':
+        case 'g':
+            g_string_append_printf(out, ";%d;2;%u;%u;%u", tags[i].kind == 'f' ? 38 : 48,
+                                   (c >> 16) & 0xff, (c >> 8) & 0xff, c & 0xff);
+            break;
+        }
+    }
+    g_string_append_c(out, 'm');
+}
+
+static guint32 parse_html_color(const char *tag, const char *key) {
+    const char *p = strstr(tag, key);
+    if (!p) return 0;
+    p = strchr(p, '#');
+    return p ? (guint32)strtoul(p + 1, NULL, 16) : 0;
+}
+
+// Converts one slice of VTE's HTML (<b>, <i>, <u>, <strike>, <blink>,
+// <font color>, <span style="background-color">, entities) to text with
+// 24-bit SGR sequences. Every slice opens and closes its own tags.
+static void html_to_ansi(const char *html, gsize len, GString *out) {
+    AnsiTag tags[ANSI_TAG_MAX];
+    int depth = 0;
+    int pushed = 0;             // Tags beyond ANSI_TAG_MAX are dropped
+    const char *end = html + len;
+
+    for (const char *p = html; p < end; ) {
+        if (*p == '<') {
+            const char *close = memchr(p, '>', (gsize)(end - p));
+            if (!close) break;
+            char *tag = g_ascii_strdown(p + 1, close - p - 1);
+            p = close + 1;
+
+            if (strcmp(tag, "br") == 0 || strcmp(tag, "br/") == 0) {
+                g_string_append_c(out, '\n');
+            } else if (g_str_has_prefix(tag, "/pre") || g_str_has_prefix(tag, "pre")) {
+                // Slice wrapper
+            } else if (tag[0] == '/') {
+                if (pushed > 0 && --pushed < ANSI_TAG_MAX) {
+                    depth--;
+                    append_ansi_sgr(out, tags, depth);
+                }
+            } else {
+                int kind = 0;
+                guint32 rgb = 0;
+                if (strcmp(tag, "b") == 0) kind = 'b';
+                else if (strcmp(tag, "i") == 0) kind = 'i';
+                else if (strcmp(tag, "u") == 0) kind = 'u';
+                else if (strcmp(tag, "strike") == 0 || strcmp(tag, "s") == 0) kind = 's';
+                else if (strcmp(tag, "blink") == 0) kind = 'k';
+                else if (g_str_has_prefix(tag, "font")) {
+                    kind = 'f';
+                    rgb = parse_html_color(tag, "color");
+                } else if (g_str_has_prefix(tag, "span")) {
+                    kind = 'g';
+                    rgb = parse_html_color(tag, "background-color");
+                }
+                if (pushed++ < ANSI_TAG_MAX) {
+                    tags[depth].kind = kind;
+                    tags[depth].rgb = rgb;
+                    depth++;
+                    if (kind) append_ansi_sgr(out, tags, depth);
+                }
+            }
+            g_free(tag);
+        } else if (*p == '&') {
+            const char *semi = memchr(p, ';', (gsize)MIN(end - p, 10));
+            if (!semi) {
+                g_string_append_c(out, *p++);
+                continue;
+            }
+            if (strncmp(p, "&lt;", 4) == 0) g_string_append_c(out, '<');
+            else if (strncmp(p, "&gt;", 4) == 0) g_string_append_c(out, '>');
+            else if (strncmp(p, "&amp;", 5) == 0) g_string_append_c(out, '&');
+            else if (strncmp(p, "&quot;", 6) == 0) g_string_append_c(out, '"');
+            else if (p[1] == '#') {
+                gunichar c = p[2] == 'x' ? (gunichar)strtoul(p + 3, NULL, 16)
+                                         : (gunichar)strtoul(p + 2, NULL, 10);
+                if (g_unichar_validate(c)) g_string_append_unichar(out, c);
+            } else {
+                g_string_append_len(out, p, semi - p + 1);
+            }
+            p = semi + 1;
+        } else {
+            const char *next = p;
+            while (next < end && *next != '<' && *next != '&') next++;
+            g_string_append_len(out, p, next - p);
+            p = next;
+        }
+    }
+    if (depth > 0) g_string_append(out, "\033[0m");
+}
+
+// Drops the <pre> wrapper VTE puts around every slice
+static void append_html_slice(GString *out, const char *html, gsize len) {
+    if (len >= 5 && g_ascii_strncasecmp(html, "<pre>", 5) == 0) {
+        html += 5;
+        len -= 5;
+    }
+    if (len >= 6 && g_ascii_strncasecmp(html + len - 6, "</pre>", 6) == 0) len -= 6;
+    g_string_append_len(out, html, len);
+}
+
+static void scrollback_export_thread(GTask *task, gpointer source_object,
+                                     gpointer task_data, GCancellable *cancellable) {
+    ScrollbackExport *ex = (ScrollbackExport *)task_data;
+    (void)source_object;
+    GError *error = NULL;
+    GOutputStream *out = NULL;
+
+    if (ex->path) {
+        GFile *file = g_file_new_for_path(ex->path);
+        out = G_OUTPUT_STREAM(g_file_replace(file, NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                             cancellable, &error));
+        g_object_unref(file);
+    } else {
+        out = g_memory_output_stream_new_resizable();
+    }
+
+    GString *buf = g_string_new(NULL);
+    if (out && ex->format == EXPORT_HTML) {
+        char *title = g_markup_escape_text(ex->title, -1);
+        g_string_printf(buf, "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n"
+                        "<title>%s</title>\n</head>\n<body>\n<pre>", title);
+        g_free(title);
+    }
+
+    // Keep draining after an error so the main thread's slices are freed
+    gboolean ok = out != NULL;
+    for (;;) {
+        GBytes *slice = g_async_queue_pop(ex->slices);
+        gsize len = 0;
+        const char *data = g_bytes_get_data(slice, &len);
+        if (len == 0) {
+            g_bytes_unref(slice);
+            break;
+        }
+        if (ok) {
+            switch (ex->format) {
+            case EXPORT_TEXT: g_string_append_len(buf, data, len); break;
+            case EXPORT_ANSI: html_to_ansi(data, len, buf); break;
+            case EXPORT_HTML: append_html_slice(buf, data, len); break;
+            }
+            ok = g_output_stream_write_all(out, buf->str, buf->len, NULL, cancellable, &error);
+            g_string_truncate(buf, 0);
+        }
+        g_bytes_unref(slice);
+    }
+
+    if (ok && ex->format == EXPORT_HTML) {
+        g_string_append(buf, "</pre>\n</body>\n</html>\n");
+        ok = g_output_stream_write_all(out, buf->str, buf->len, NULL, cancellable, &error);
+    }
+    g_string_free(buf, TRUE);
+
+    // A cancelled close leaves any existing file untouched
+    if (ok) ok = g_output_stream_close(out, cancellable, &error);
+    if (ok && !ex->path) {
+        ex->result = g_memory_output_stream_steal_as_bytes(G_MEMORY_OUTPUT_STREAM(out));
+    }
+    g_clear_object(&out);
+
+    if (ok) g_task_return_boolean(task, TRUE);
+    else g_task_return_error(task, error);
+}
+
+static void on_scrollback_export_done(GObject *source, GAsyncResult *result, gpointer user_data) {
+    ScrollbackExport *ex = (ScrollbackExport *)user_data;
+    (void)source;
+    GError *error = NULL;
+    gboolean cancelled = g_cancellable_is_cancelled(ex->cancellable);
+
+    if (!g_task_propagate_boolean(G_TASK(result), &error)) {
+        if (!cancelled) {
+            g_warning("Scrollback export of '%s' failed: %s", ex->title, error->message);
+            GtkRoot *root = gtk_widget_get_root(GTK_WIDGET(ex->terminal));
+            GtkAlertDialog *dialog = gtk_alert_dialog_new("Could not export the scrollback");
+            gtk_alert_dialog_set_detail(dialog, error->message);
+            gtk_alert_dialog_show(dialog, GTK_IS_WINDOW(root) ? GTK_WINDOW(root) : NULL);
+            g_object_unref(dialog);
+        }
+        g_error_free(error);
+    } else if (!cancelled && ex->path) {
+        printf("Exported %ld lines of '%s' to %s\n", ex->end_row - ex->start_row,
+               ex->title, ex->path);
+    } else if (!cancelled) {
+        const char *mime = ex->format == EXPORT_HTML ? "text/html" : "text/plain;charset=utf-8";
+        GdkContentProvider *provider = gdk_content_provider_new_for_bytes(mime, ex->result);
+        gdk_clipboard_set_content(gtk_widget_get_clipboard(GTK_WIDGET(ex->terminal)), provider);
+        g_object_unref(provider);
+        printf("Copied %ld lines of '%s' to the clipboard\n", ex->end_row - ex->start_row,
+               ex->title);
+    }
+
+    detach_scrollback_export(ex);
+    scrollback_export_free(ex);
+}
+
+static void schedule_export_slice(ScrollbackExport *ex, guint delay_ms) {
+    ex->source_id = delay_ms > 0 ? g_timeout_add(delay_ms, on_export_slice, ex)
+                                 : g_idle_add(on_export_slice, ex);
+}
+
+static gboolean on_export_slice(gpointer user_data) {
+    ScrollbackExport *ex = (ScrollbackExport *)user_data;
+    ex->source_id = 0;
+
+    // The writer is behind; let it catch up instead of queueing more
+    if (g_async_queue_length(ex->slices) >= EXPORT_QUEUE_MAX) {
+        schedule_export_slice(ex, EXPORT_BACKOFF_MS);
+        return G_SOURCE_REMOVE;
+    }
+
+    // Rows that scrolled out of the ring meanwhile are gone
+    GtkAdjustment *vadj = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(ex->terminal));
+    long first = MAX(ex->next_row, (long)gtk_adjustment_get_lower(vadj));
+    long last = MIN(first + EXPORT_SLICE_ROWS, ex->end_row);
+    if (first < last) {
+        gsize length = 0;
+        char *text = vte_terminal_get_text_range_format(ex->terminal,
+                                                        ex->format == EXPORT_TEXT ? VTE_FORMAT_TEXT
+                                                                                  : VTE_FORMAT_HTML,
+                                                        first, 0, last, 0, &length);
+        if (text && length > 0) g_async_queue_push(ex->slices, g_bytes_new_take(text, length));
+        else g_free(text);
+    }
+    ex->next_row = MAX(last, first);
+
+    if (ex->progress) {
+        double fraction = (double)(ex->next_row - ex->start_row) /
+                          (double)MAX(ex->end_row - ex->start_row, 1);
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(ex->progress), fraction);
+        char *tooltip = g_strdup_printf("Exporting scrollback: %d%%", (int)(fraction * 100));
+        gtk_widget_set_tooltip_text(ex->progress, tooltip);
+        g_free(tooltip);
+    }
+
+    if (ex->next_row >= ex->end_row) {
+        end_export_slices(ex);
+    } else {
+        schedule_export_slice(ex, 0);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean parse_export_format(const char *name, ExportFormat *format) {
+    for (gsize i = 0; i < G_N_ELEMENTS(export_format_names); i++) {
+        if (g_ascii_strcasecmp(name, export_format_names[i]) == 0) {
+            *format = (ExportFormat)i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Picks the format from a file name: .html/.htm, .ans/.ansi, else text
+static ExportFormat export_format_for_path(const char *path) {
+    char *lower = g_ascii_strdown(path, -1);
+    ExportFormat format = EXPORT_TEXT;
+    if (g_str_has_suffix(lower, ".html") || g_str_has_suffix(lower, ".htm")) {
+        format = EXPORT_HTML;
+    } else if (g_str_has_suffix(lower, ".ans") || g_str_has_suffix(lower, ".ansi")) {
+        format = EXPORT_ANSI;
+    }
+    g_free(lower);
+    return format;
+}
+
+// Exports subtab's scrollback to path, or to the clipboard when path is
+// NULL. Returns an error message if it could not start.
+static char* start_scrollback_export(SubTab *subtab, ExportFormat format, const char *path) {
+    if (subtab->export) return g_strdup("an export of this tab is already running");
+    if (!subtab->terminal) return g_strdup("tab has no terminal");
+
+    GtkAdjustment *vadj = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(subtab->terminal));
+    ScrollbackExport *ex = g_new0(ScrollbackExport, 1);
+    ex->subtab = subtab;
+    ex->terminal = g_object_ref(subtab->terminal);
+    ex->format = format;
+    ex->path = g_strdup(path);
+    ex->title = g_strdup(subtab->name);
+    ex->start_row = (long)gtk_adjustment_get_lower(vadj);
+    ex->next_row = ex->start_row;
+    ex->end_row = (long)gtk_adjustment_get_upper(vadj);
+    ex->slices = g_async_queue_new_full((GDestroyNotify)g_bytes_unref);
+    ex->cancellable = g_cancellable_new();
+    subtab->export = ex;
+
+    if (ex->end_row - ex->start_row > EXPORT_PROGRESS_ROWS) {
+        ex->progress = add_tab_progress(subtab);
+    }
+    debug_log("Exporting rows %ld-%ld of '%s' as %s to %s", ex->start_row, ex->end_row,
+              ex->title, export_format_names[format], path ? path : "the clipboard");
+
+    GTask *task = g_task_new(NULL, ex->cancellable, on_scrollback_export_done, ex);
+    g_task_set_task_data(task, ex, NULL);
+    g_task_run_in_thread(task, scrollback_export_thread);
+    g_object_unref(task);
+
+    schedule_export_slice(ex, 0);
+    return NULL;
+}
+
+static void on_export_file_chosen(GObject *source, GAsyncResult *result, gpointer user_data) {
+    VteTerminal *terminal = VTE_TERMINAL(user_data);
+    GFile *file = gtk_file_dialog_save_finish(GTK_FILE_DIALOG(source), result, NULL);
+    SubTab *subtab = g_object_get_data(G_OBJECT(terminal), "subtab");
+
+    if (file && subtab) {
+        char *path = g_file_get_path(file);
+        char *error = start_scrollback_export(subtab, export_format_for_path(path), path);
+        if (error) {
+            g_warning("Scrollback export: %s", error);
+            g_free(error);
+        }
+        g_free(path);
+    }
+    g_clear_object(&file);
+    g_object_unref(terminal);
+}
+
+// Asks where to save; the extension chosen picks the format
+static void choose_scrollback_export(SubTab *subtab) {
+    GtkFileDialog *dialog = gtk_file_dialog_new();
+    gtk_file_dialog_set_title(dialog, "Export Scrollback");
+    char *name = g_strdup_printf("%s.txt", subtab->name);
+    g_strdelimit(name, G_DIR_SEPARATOR_S, '_');
+    gtk_file_dialog_set_initial_name(dialog, name);
+    g_free(name);
+
+    gtk_file_dialog_save(dialog, GTK_WINDOW(subtab->parent_tab->win->window), NULL,
+                         on_export_file_chosen, g_object_ref(subtab->terminal));
+    g_object_unref(dialog);
+}
+
+//=============================================================================
+// Keyboard Shortcuts
+//=============================================================================
+
+// Bindings are compiled once, when settings load, into one hash table per
+// layer. A layer is the context the focus is in. Each table already holds
+// the global bindings merged under that layer's own, so dispatching a key
+// costs one lookup. Keys pack the modifiers and the lowercased keyval into
+// a guint that is used directly as the hash key, so nothing is allocated.
+// A per-layer bitmask of the modifier combinations that have any binding
+// lets unbound keys, such as ordinary typing, go to VTE without a lookup.
+//
+// settings.conf lines look like
+//   bind=ctrl+shift+t new-tab
+//   bind=ctrl+a h prev-tab           (a chord: ctrl+a, then h)
+//   bind=terminal:ctrl+shift+c copy  (only while a terminal has focus)
+//   bind=ctrl+page_down none         (removes a default)
+
+#define KEY_CHORD_TIMEOUT_MS 1500
+#define KEY_CHORD_MAX 4
+
+typedef enum {
+    KEY_LAYER_GLOBAL,
+    KEY_LAYER_TERMINAL,
+    KEY_LAYER_SIDEBAR,
+    KEY_LAYER_COUNT
+} KeyLayer;
+
+static const char *const key_layer_names[KEY_LAYER_COUNT] = {
+    [KEY_LAYER_GLOBAL]   = "global",
+    [KEY_LAYER_TERMINAL] = "terminal",
+    [KEY_LAYER_SIDEBAR]  = "sidebar",
+};
+
+// Compact modifier bits; with keyvals below 2^25 a binding key fits a guint
+#define KEY_MOD_CTRL  (1u << 0)
+#define KEY_MOD_SHIFT (1u << 1)
+#define KEY_MOD_ALT   (1u << 2)
+#define KEY_MOD_SUPER (1u << 3)
+#define KEY_MOD_SHIFT_BITS 25
+#define KEY_HASH(mods, keyval) GUINT_TO_POINTER(((mods) << KEY_MOD_SHIFT_BITS) | (keyval))
+
+typedef gboolean (*KeyActionFunc)(AppState *app, int arg);
+
+typedef struct {
+    const char *name;
+    KeyActionFunc func;
+    gboolean takes_arg;
+} KeyAction;
+
+struct _KeyNode {
+    const KeyAction *action;    // NULL for a chord prefix
+    int arg;
+    GHashTable *next;           // Chord continuations, NULL for a leaf
+};
+
+struct _Keymap {
+    GHashTable *layers[KEY_LAYER_COUNT];
+    guint16 mod_sets[KEY_LAYER_COUNT];  // Bit n: some binding uses modifiers n
+    guint16 any_mod_set;
+};
+
+static const char *const default_keybindings[] = {
+    "ctrl+shift+c copy",
+    "ctrl+shift+v paste",
+    "ctrl+shift+t new-tab",
+    "ctrl+shift+w close-tab",
+    "ctrl+page_down next-tab",
+    "ctrl+page_up prev-tab",
+    "ctrl+shift+page_down next-project",
+    "ctrl+shift+page_up prev-project",
+    "ctrl+1 goto-tab 1",
+    "ctrl+2 goto-tab 2",
+    "ctrl+3 goto-tab 3",
+    "ctrl+4 goto-tab 4",
+    "ctrl+5 goto-tab 5",
+    "ctrl+6 goto-tab 6",
+    "ctrl+7 goto-tab 7",
+    "ctrl+8 goto-tab 8",
+    "ctrl+9 goto-tab last",
+    "ctrl+shift+s export-scrollback",
+    "ctrl+shift+f12 frame-hud",
+    "ctrl+shift+n new-window",
+    "ctrl+shift+z prev-prompt",
+    "ctrl+shift+x next-prompt",
+    "ctrl+shift+g copy-output",
+    "ctrl+shift+h history",
+    NULL
+};
+
+static SubTab* active_subtab(AppState *app) {
+    Project *project = focused_project(app);
+    return project ? project->active_subtab : NULL;
+}
+
+static gboolean key_action_copy(AppState *app, int arg) {
+    (void)arg;
+    SubTab *subtab = active_subtab(app);
+    if (!subtab) return FALSE;
+    vte_terminal_copy_clipboard_format(subtab->terminal, VTE_FORMAT_TEXT);
+    return TRUE;
+}
+
+static gboolean key_action_paste(AppState *app, int arg) {
+    (void)arg;
+    SubTab *subtab = active_subtab(app);
+    if (!subtab) return FALSE;
+    start_paste(subtab);
+    return TRUE;
+}
+
+static gboolean key_action_new_tab(AppState *app, int arg) {
+    (void)arg;
+    Project *project = focused_project(app);
+    if (!project) return FALSE;
+    add_project_subtab(project, project->path);
+    return TRUE;
+}
+
+static gboolean key_action_close_tab(AppState *app, int arg) {
+    (void)arg;
+    SubTab *subtab = active_subtab(app);
+    if (!subtab) return FALSE;
+    request_close_subtabs(subtab, CLOSE_TAB);
+    return TRUE;
+}
+
+static void activate_subtab(SubTab *subtab) {
+    on_subtab_button_clicked(GTK_BUTTON(subtab->tab_button), subtab);
+}
+
+// arg is the step for next/prev-tab
+static gboolean key_action_cycle_tab(AppState *app, int arg) {
+    Project *project = focused_project(app);
+    if (!project || !project->active_subtab) return FALSE;
+
+    int count = (int)g_list_length(project->subtabs);
+    int index = g_list_index(project->subtabs, project->active_subtab);
+    activate_subtab(g_list_nth_data(project->subtabs, (guint)((index + arg + count) % count)));
+    return TRUE;
+}
+
+// arg is 1-based; 0 means the last tab
+static gboolean key_action_goto_tab(AppState *app, int arg) {
+    Project *project = focused_project(app);
+    if (!project || !project->subtabs) return FALSE;
+
+    GList *link = arg > 0 ? g_list_nth(project->subtabs, (guint)(arg - 1))
+                          : g_list_last(project->subtabs);
+    if (link) activate_subtab((SubTab *)link->data);
+    return TRUE;
+}
+
+// Moves through projects in sidebar order, which follows the sort mode
+static gboolean key_action_cycle_project(AppState *app, int arg) {
+    Project *project = focused_project(app);
+    if (!project) return FALSE;
+
+    int index = gtk_list_box_row_get_index(GTK_LIST_BOX_ROW(project->list_row));
+    GtkListBox *sidebar = GTK_LIST_BOX(project->win->sidebar);
+    GtkListBoxRow *row = gtk_list_box_get_row_at_index(sidebar, index + arg);
+    if (row) gtk_list_box_select_row(sidebar, row);
+    return TRUE;
+}
+
+static gboolean key_action_export_scrollback(AppState *app, int arg) {
+    (void)arg;
+    SubTab *subtab = active_subtab(app);
+    if (!subtab) return FALSE;
+    choose_scrollback_export(subtab);
+    return TRUE;
+}
+
+static gboolean key_action_frame_hud(AppState *app, int arg) {
+    (void)arg;
+    toggle_frame_hud(app);
+    return TRUE;
+}
+
+static gboolean key_action_new_window(AppState *app, int arg) {
+    (void)arg;
+    open_workspace_window(app, NULL);
+    return TRUE;
+}
+
+// arg is the step for next/prev-prompt
+static gboolean key_action_jump_prompt(AppState *app, int arg) {
+    SubTab *subtab = active_subtab(app);
+    return subtab && jump_to_prompt(subtab, arg);
+}
+
+static gboolean key_action_copy_output(AppState *app, int arg) {
+    (void)arg;
+    SubTab *subtab = active_subtab(app);
+    return subtab && copy_command_output(subtab);
+}
+
+static gboolean key_action_history(AppState *app, int arg) {
+    (void)arg;
+    Project *project = focused_project(app);
+    return project && project->active_subtab && show_history_picker(project->win);
+}
+
+// Gives the active project a window of its own
+static gboolean key_action_detach_project(AppState *app, int arg) {
+    (void)arg;
+    Project *project = focused_project(app);
+    if (!project) return FALSE;
+    open_workspace_window(app, project);
+    return TRUE;
+}
+
+static const KeyAction key_actions[] = {
+    { "copy",         key_action_copy,          FALSE },
+    { "paste",        key_action_paste,         FALSE },
+    { "new-tab",      key_action_new_tab,       FALSE },
+    { "close-tab",    key_action_close_tab,     FALSE },
+    { "next-tab",     key_action_cycle_tab,     FALSE },
+    { "prev-tab",     key_action_cycle_tab,     FALSE },
+    { "goto-tab",     key_action_goto_tab,      TRUE },
+    { "next-project", key_action_cycle_project, FALSE },
+    { "prev-project", key_action_cycle_project, FALSE },
+    { "export-scrollback", key_action_export_scrollback, FALSE },
+    { "frame-hud",    key_action_frame_hud,     FALSE },
+    { "new-window",   key_action_new_window,    FALSE },
+    { "detach-project", key_action_detach_project, FALSE },
+    { "prev-prompt",  key_action_jump_prompt,   FALSE },
+    { "next-prompt",  key_action_jump_prompt,   FALSE },
+    { "copy-output",  key_action_copy_output,   FALSE },
+    { "history",      key_action_history,       FALSE },
+    { "none",         NULL,                     FALSE },
+};
+
+static const KeyAction* find_key_action(const char *name) {
+    for (gsize i = 0; i < G_N_ELEMENTS(key_actions); i++) {
+        if (strcmp(key_actions[i].name, name) == 0) return &key_actions[i];
+    }
+    return NULL;
+}
+
+static guint compact_modifiers(GdkModifierType modifiers) {
+    return ((modifiers & GDK_CONTROL_MASK) ? KEY_MOD_CTRL : 0) |
+           ((modifiers & GDK_SHIFT_MASK) ? KEY_MOD_SHIFT : 0) |
+           ((modifiers & GDK_ALT_MASK) ? KEY_MOD_ALT : 0) |
+           ((modifiers & GDK_SUPER_MASK) ? KEY_MOD_SUPER : 0);
+}
+
+static gboolean is_modifier_keyval(guint keyval) {
+    return (keyval >= GDK_KEY_Shift_L && keyval <= GDK_KEY_Hyper_R) ||
+           keyval == GDK_KEY_ISO_Level3_Shift;
+}
+
+// "ctrl+shift+page_down" -> mods and keyval; FALSE if it names no key
+static gboolean parse_key_spec(const char *spec, guint *mods, guint *keyval) {
+    char **parts = g_strsplit(spec, "+", -1);
+    guint n = g_strv_length(parts);
+    gboolean ok = n > 0 && parts[n - 1][0] != '\0';
+    *mods = 0;
+
+    for (guint i = 0; ok && i + 1 < n; i++) {
+        char *mod = g_ascii_strdown(parts[i], -1);
+        if (strcmp(mod, "ctrl") == 0 || strcmp(mod, "control") == 0) *mods |= KEY_MOD_CTRL;
+        else if (strcmp(mod, "shift") == 0) *mods |= KEY_MOD_SHIFT;
+        else if (strcmp(mod, "alt") == 0) *mods |= KEY_MOD_ALT;
+        else if (strcmp(mod, "super") == 0) *mods |= KEY_MOD_SUPER;
+        else ok = FALSE;
+        g_free(mod);
+    }
+
+    if (ok) {
+        // GDK names are case-sensitive ("Page_Down", "F5"); accept any case
+        const char *name = parts[n - 1];
+        guint kv = gdk_keyval_from_name(name);
+        if (kv == GDK_KEY_VoidSymbol) {
+            char *titled = g_ascii_strdown(name, -1);
+            for (char *c = titled; *c; c++) {
+                if (c == titled || c[-1] == '_') *c = g_ascii_toupper(*c);
+            }
+            kv = gdk_keyval_from_name(titled);
+            g_free(titled);
+        }
+        ok = kv != GDK_KEY_VoidSymbol && kv < (1u << KEY_MOD_SHIFT_BITS);
+        *keyval = gdk_keyval_to_lower(kv);
+    }
+
+    g_strfreev(parts);
+    return ok;
+}
+
+static void key_node_free(KeyNode *node) {
+    if (node->next) g_hash_table_unref(node->next);
+    g_free(node);
+}
+
+static GHashTable* key_table_new(void) {
+    return g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                 (GDestroyNotify)key_node_free);
+}
+
+typedef struct {
+    KeyLayer layer;
+    guint n_keys;
+    guint keys[KEY_CHORD_MAX];  // KEY_HASH values
+    const KeyAction *action;    // action->func is NULL for "none"
+    int arg;
+} KeyBinding;
+
+// Parses "[layer:]key [key...] action [arg]"
+static gboolean parse_key_binding(const char *line, KeyBinding *b, char **error) {
+    char **tokens = g_strsplit_set(line, " \t", -1);
+    const char *arg_text = NULL;
+    memset(b, 0, sizeof(*b));
+
+    for (char **t = tokens; *t && !*error; t++) {
+        char *token = *t;
+        if (token[0] == '\0') continue;
+
+        if (b->action) {
+            if (arg_text) *error = g_strdup("too many arguments");
+            arg_text = token;
+            continue;
+        }
+        if (b->n_keys > 0 && (b->action = find_key_action(token)) != NULL) continue;
+
+        char *colon = b->n_keys == 0 ? strchr(token, ':') : NULL;
+        if (colon) {
+            *colon = '\0';
+            int layer = -1;
+            for (int i = 0; i < KEY_LAYER_COUNT; i++) {
+                if (strcmp(token, key_layer_names[i]) == 0) layer = i;
+            }
+            if (layer < 0) {
+                *error = g_strdup_printf("unknown layer '%s'", token);
+                break;
+            }
+            b->layer = (KeyLayer)layer;
+            token = colon + 1;
+        }
+
+        guint mods = 0, keyval = 0;
+        if (b->n_keys == KEY_CHORD_MAX) {
+            *error = g_strdup_printf("chords are limited to %d keys", KEY_CHORD_MAX);
+        } else if (!parse_key_spec(token, &mods, &keyval)) {
+            *error = g_strdup_printf("unknown key '%s'", token);
+        } else {
+            b->keys[b->n_keys++] = GPOINTER_TO_UINT(KEY_HASH(mods, keyval));
+        }
+    }
+
+    if (!*error && !b->action) {
+        *error = g_strdup("no action");
+    } else if (!*error && b->action->takes_arg != (arg_text != NULL)) {
+        *error = g_strdup_printf("'%s' %s an argument", b->action->name,
+                                 b->action->takes_arg ? "needs" : "takes no");
+    } else if (!*error) {
+        const char *name = b->action->name;
+        if (strcmp(name, "next-tab") == 0 || strcmp(name, "next-project") == 0 ||
+            strcmp(name, "next-prompt") == 0) {
+            b->arg = 1;
+        } else if (strcmp(name, "prev-tab") == 0 || strcmp(name, "prev-project") == 0 ||
+                   strcmp(name, "prev-prompt") == 0) {
+            b->arg = -1;
+        } else if (arg_text && strcmp(arg_text, "last") != 0) {
+            b->arg = atoi(arg_text);
+            if (b->arg < 1) *error = g_strdup_printf("bad argument '%s'", arg_text);
+        }
+    }
+
+    g_strfreev(tokens);
+    return *error == NULL;
+}
+
+// Walks down the chord creating prefixes. A binding replaces whatever was
+// bound to the same sequence before it; "none" removes it.
+static void keymap_insert(Keymap *km, KeyLayer layer, const KeyBinding *b) {
+    GHashTable *table = km->layers[layer];
+    guint first_mods = b->keys[0] >> KEY_MOD_SHIFT_BITS;
+
+    for (guint i = 0; i < b->n_keys; i++) {
+        gpointer key = GUINT_TO_POINTER(b->keys[i]);
+        KeyNode *node = g_hash_table_lookup(table, key);
+
+        if (i + 1 < b->n_keys) {
+            if (!node || !node->next) {
+                node = g_new0(KeyNode, 1);
+                node->next = key_table_new();
+                g_hash_table_replace(table, key, node);
+            }
+            table = node->next;
+        } else if (b->action->func) {
+            node = g_new0(KeyNode, 1);
+            node->action = b->action;
+            node->arg = b->arg;
+            g_hash_table_replace(table, key, node);
+        } else {
+            g_hash_table_remove(table, key);
+        }
+    }
+    if (b->action->func) km->mod_sets[layer] |= (guint16)(1u << first_mods);
+}
+
+static void keymap_free(Keymap *km) {
+    if (!km) return;
+    for (int i = 0; i < KEY_LAYER_COUNT; i++) g_hash_table_unref(km->layers[i]);
+    g_free(km);
+}
+
+// Defaults first, then the user's bindings in file order. Each layer gets
+// the global bindings, then its own on top.
+static Keymap* keymap_compile(const char *user_bindings) {
+    GArray *bindings = g_array_new(FALSE, FALSE, sizeof(KeyBinding));
+    char **user = g_strsplit(user_bindings ? user_bindings : "", "\n", -1);
+
+    for (int pass = 0; pass < 2; pass++) {
+        const char *const *lines = pass == 0 ? default_keybindings : (const char *const *)user;
+        for (const char *const *l = lines; *l; l++) {
+            if ((*l)[0] == '\0') continue;
+            KeyBinding b;
+            char *error = NULL;
+            if (parse_key_binding(*l, &b, &error)) {
+                g_array_append_val(bindings, b);
+            } else {
+                g_warning("Ignoring key binding '%s': %s", *l, error);
+                g_free(error);
+            }
+        }
+    }
+    g_strfreev(user);
+
+    Keymap *km = g_new0(Keymap, 1);
+    for (int layer = 0; layer < KEY_LAYER_COUNT; layer++) {
+        km->layers[layer] = key_table_new();
+        for (guint i = 0; i < bindings->len; i++) {
+            KeyBinding *b = &g_array_index(bindings, KeyBinding, i);
+            if (b->layer == KEY_LAYER_GLOBAL) keymap_insert(km, (KeyLayer)layer, b);
+        }
+        for (guint i = 0; layer != KEY_LAYER_GLOBAL && i < bindings->len; i++) {
+            KeyBinding *b = &g_array_index(bindings, KeyBinding, i);
+            if ((int)b->layer == layer) keymap_insert(km, (KeyLayer)layer, b);
+        }
+        km->any_mod_set |= km->mod_sets[layer];
+    }
+
+    g_array_free(bindings, TRUE);
+    return km;
+}
+
+// The hot path: no allocation, and no lookup at all when nothing in the
+// layer uses these modifiers.
+static KeyNode* keymap_match(const Keymap *km, KeyLayer layer, guint keyval,
+                             GdkModifierType modifiers) {
+    guint mods = compact_modifiers(modifiers);
+    if (!(km->mod_sets[layer] & (1u << mods))) return NULL;
+    return g_hash_table_lookup(km->layers[layer],
+                               KEY_HASH(mods, gdk_keyval_to_lower(keyval)));
+}
+
+// Typing-latency microbenchmark for `gmux ctl keymap-bench`: dispatches a
+// stream of plain typing (the fall-through path) and of bound keys through
+// the terminal layer.
+static JsonObject* keymap_benchmark(const Keymap *km, int rounds) {
+    static const char text[] = "the quick brown fox jumps over the lazy dog 0123456789";
+    int hits = 0;
+
+    gint64 start = g_get_monotonic_time();
+    for (int r = 0; r < rounds; r++) {
+        for (const char *c = text; *c; c++) {
+            hits += keymap_match(km, KEY_LAYER_TERMINAL, (guchar)*c, 0) != NULL;
+        }
+    }
+    gint64 typed_us = g_get_monotonic_time() - start;
+
+    start = g_get_monotonic_time();
+    for (int r = 0; r < rounds; r++) {
+        for (const char *c = text; *c; c++) {
+            hits += keymap_match(km, KEY_LAYER_TERMINAL, (guchar)*c,
+                                 GDK_CONTROL_MASK | GDK_SHIFT_MASK) != NULL;
+        }
+    }
+    gint64 chorded_us = g_get_monotonic_time() - start;
+
+    double keys = (double)rounds * (sizeof(text) - 1);
+    JsonObject *result = json_object_new();
+    json_object_set_int_member(result, "keys", (gint64)keys);
+    json_object_set_double_member(result, "typing_ns", typed_us * 1000.0 / keys);
+    json_object_set_double_member(result, "ctrl_shift_ns", chorded_us * 1000.0 / keys);
+    json_object_set_int_member(result, "hits", hits);
+    return result;
+}
+
+static KeyLayer current_key_layer(AppState *app) {
+    if (!app->focus) return KEY_LAYER_GLOBAL;
+    GtkWidget *sidebar = app->focus->sidebar;
+    GtkWidget *focus = gtk_root_get_focus(GTK_ROOT(app->focus->window));
+    if (!focus) return KEY_LAYER_GLOBAL;
+    if (VTE_IS_TERMINAL(focus)) return KEY_LAYER_TERMINAL;
+    if (focus == sidebar || gtk_widget_is_ancestor(focus, sidebar)) {
+        return KEY_LAYER_SIDEBAR;
+    }
+    return KEY_LAYER_GLOBAL;
+}
+
+static void cancel_key_chord(AppState *app) {
+    app->key_chord = NULL;
+    if (app->key_chord_timer_id > 0) {
+        g_source_remove(app->key_chord_timer_id);
+        app->key_chord_timer_id = 0;
+    }
+}
+
+static gboolean on_key_chord_timeout(gpointer user_data) {
+    AppState *app = (AppState *)user_data;
+    app->key_chord_timer_id = 0;
+    app->key_chord = NULL;
+    debug_log("Key chord timed out");
+    return G_SOURCE_REMOVE;
+}
+
+static void reload_keymap(AppState *app) {
+    gint64 start = g_get_monotonic_time();
+    Keymap *km = keymap_compile(app->settings.keybindings);
+    keymap_free(app->keymap);
+    app->keymap = km;
+    cancel_key_chord(app);  // Points into the old keymap
+    debug_log("Compiled keymap in %.3f ms", (g_get_monotonic_time() - start) / 1000.0);
+}
+
+static gboolean run_key_node(AppState *app, KeyNode *node) {
+    if (node->next) {
+        cancel_key_chord(app);
+        app->key_chord = node;
+        app->key_chord_timer_id = g_timeout_add(KEY_CHORD_TIMEOUT_MS, on_key_chord_timeout, app);
+        return TRUE;
+    }
+    return node->action->func(app, node->arg);
+}
+
+static gboolean on_key_pressed(GtkEventControllerKey *controller,
+                               guint keyval, guint keycode,
+                               GdkModifierType modifiers, gpointer user_data) {
+    AppState *app = (AppState *)user_data;
+    (void)controller;
+    (void)keycode;
+
+    gint64 pressed = app->latency ? g_get_monotonic_time() : 0;
+
+    // Escape stops a paste that is still streaming into the active tab
+    if (keyval == GDK_KEY_Escape) {
+        SubTab *subtab = active_subtab(app);
+        if (subtab && subtab->paste) {
+            cancel_paste(subtab);
+            return TRUE;
+        }
+    }
+
+    if (app->key_chord) {
+        if (is_modifier_keyval(keyval)) return FALSE;
+        // Mid-chord every key is ours; one that continues nothing ends it
+        KeyNode *node = g_hash_table_lookup(app->key_chord->next,
+                                            KEY_HASH(compact_modifiers(modifiers),
+                                                     gdk_keyval_to_lower(keyval)));
+        cancel_key_chord(app);
+        if (node) run_key_node(app, node);
+        return TRUE;
+    }
+
+    Keymap *km = app->keymap;
+    if (km && (km->any_mod_set & (1u << compact_modifiers(modifiers)))) {
+        KeyNode *node = keymap_match(km, current_key_layer(app), keyval, modifiers);
+        if (node && run_key_node(app, node)) return TRUE;
+    }
+
+    // Only keys the terminal will turn into input start a latency sample
+    if (pressed && !is_modifier_keyval(keyval) && current_key_layer(app) == KEY_LAYER_TERMINAL)
+        latency_key_pressed(app, pressed);
+    return FALSE;
+}
+
+//=============================================================================
+// Latency Instrumentation
+//=============================================================================
+
+// Opt-in with GMUX_LATENCY=1 or `gmux ctl latency --enable`. Each keystroke
+// that goes on to the terminal (not modifiers, not shortcuts gmux handles)
+// is stamped when it reaches on_key_pressed, when VTE writes it to the PTY
+// ("commit"), when its echo changes the terminal ("contents-changed") and
+// after the next frame is painted. One sample is in flight at a time; a key
+// that arrives before the previous sample completes drops that sample.
+// Stage durations go into log-linear histograms with 8 sub-buckets per
+// power of two of microseconds (within 12.5%, like HDR histograms). They
+// are shown in the debug overlay and exported by `gmux ctl latency`.
+// `gmux ctl latency-self-test` types into a `cat` tab to reproduce them.
+
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_EXPONENT 26     // Values up to 2^27 us (~2 min)
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXPONENT - LATENCY_SUB_BUCKET_BITS + 2) * LATENCY_SUB_BUCKETS)
+#define LATENCY_OVERLAY_INTERVAL_MS 500
+#define LATENCY_SELFTEST_TICK_MS 10
+#define LATENCY_SELFTEST_LINE 64    // Chars typed before each Enter
+
+typedef enum {
+    LATENCY_KEY_TO_WRITE,
+    LATENCY_WRITE_TO_ECHO,
+    LATENCY_ECHO_TO_PAINT,
+    LATENCY_KEY_TO_PAINT,
+    LATENCY_STAGE_COUNT
+} LatencyStage;
+
+static const char *const latency_stage_names[LATENCY_STAGE_COUNT] = {
+    [LATENCY_KEY_TO_WRITE]  = "key_to_write",
+    [LATENCY_WRITE_TO_ECHO] = "write_to_echo",
+    [LATENCY_ECHO_TO_PAINT] = "echo_to_paint",
+    [LATENCY_KEY_TO_PAINT]  = "key_to_paint",
+};
+
+typedef struct {
+    guint64 counts[LATENCY_BUCKETS];
+    guint64 count;
+    gint64 min_us;
+    gint64 max_us;
+    gint64 sum_us;
+} LatencyHistogram;
+
+struct _LatencyTracker {
+    LatencyHistogram stages[LATENCY_STAGE_COUNT];
+    guint64 dropped;
+
+    // Sample in flight; key_time == 0 when there is none
+    VteTerminal *terminal;
+    gint64 key_time;
+    gint64 write_time;
+    gint64 echo_time;
+
+    GdkFrameClock *clock;           // Of the window the sampled terminal is in
+    WorkspaceWindow *win;           // Window showing the overlay
+    GtkWidget *overlay_label;
+    guint overlay_timer_id;
+
+    VteTerminal *selftest_terminal; // Ref held while the self-test runs
+    int selftest_remaining;
+    int selftest_typed;
+    gint64 selftest_deadline;       // Give up waiting for cat after this
+    gint64 selftest_pause_until;
+    guint selftest_timer_id;
+};
+
+static int latency_bucket_index(gint64 us) {
+    if (us < LATENCY_SUB_BUCKETS) return (int)MAX(us, 0);
+    us = MIN(us, ((gint64)1 << (LATENCY_MAX_EXPONENT + 1)) - 1);
+
+    int exponent = 63 - __builtin_clzll((unsigned long long)us);
+    int shift = exponent - LATENCY_SUB_BUCKET_BITS;
+    int sub = (int)(us >> shift) - LATENCY_SUB_BUCKETS;
+    return ((shift + 1) << LATENCY_SUB_BUCKET_BITS) + sub;
+}
+
+// Highest value that lands in the bucket
+static gint64 latency_bucket_upper(int index) {
+    if (index < LATENCY_SUB_BUCKETS) return index;
+    int shift = (index >> LATENCY_SUB_BUCKET_BITS) - 1;
+    int sub = index & (LATENCY_SUB_BUCKETS - 1);
+    return ((gint64)(LATENCY_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+static void latency_record(LatencyHistogram *h, gint64 us) {
+    us = MAX(us, 0);
+    h->counts[latency_bucket_index(us)]++;
+    h->min_us = h->count == 0 ? us : MIN(h->min_us, us);
+    h->max_us = MAX(h->max_us, us);
+    h->sum_us += us;
+    h->count++;
+}
+
+static gint64 latency_percentile(const LatencyHistogram *h, double percentile) {
+    if (h->count == 0) return 0;
+    guint64 rank = (guint64)ceil(h->count * percentile / 100.0);
+    guint64 seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= MAX(rank, 1)) return MIN(latency_bucket_upper(i), h->max_us);
+    }
+    return h->max_us;
+}
+
+static void on_latency_after_paint(GdkFrameClock *clock, gpointer user_data) {
+    LatencyTracker *lt = ((AppState *)user_data)->latency;
+    (void)clock;
+    if (!lt || lt->key_time == 0 || lt->echo_time == 0) return;
+
+    gint64 now = g_get_monotonic_time();
+    latency_record(&lt->stages[LATENCY_KEY_TO_WRITE], lt->write_time - lt->key_time);
+    latency_record(&lt->stages[LATENCY_WRITE_TO_ECHO], lt->echo_time - lt->write_time);
+    latency_record(&lt->stages[LATENCY_ECHO_TO_PAINT], now - lt->echo_time);
+    latency_record(&lt->stages[LATENCY_KEY_TO_PAINT], now - lt->key_time);
+    lt->key_time = 0;
+}
+
+// Starts a sample for input about to go to terminal
+static void latency_begin(AppState *app, VteTerminal *terminal, gint64 key_time) {
+    LatencyTracker *lt = app->latency;
+    if (lt->key_time != 0) lt->dropped++;
+
+    // Each window paints on its own clock; follow the one the key went to
+    GdkFrameClock *clock = gtk_widget_get_frame_clock(GTK_WIDGET(terminal));
+    if (clock != lt->clock) {
+        if (lt->clock) g_signal_handlers_disconnect_by_func(lt->clock, on_latency_after_paint, app);
+        lt->clock = clock;
+        if (lt->clock) {
+            g_signal_connect(lt->clock, "after-paint", G_CALLBACK(on_latency_after_paint), app);
+        }
+    }
+    lt->terminal = terminal;
+    lt->key_time = key_time;
+    lt->write_time = 0;
+    lt->echo_time = 0;
+}
+
+// pressed is when on_key_pressed saw the key, before the keymap lookup
+static void latency_key_pressed(AppState *app, gint64 pressed) {
+    SubTab *subtab = active_subtab(app);
+    if (subtab && subtab->child_pid > 0) latency_begin(app, subtab->terminal, pressed);
+}
+
+static void latency_mark_write(AppState *app, VteTerminal *terminal) {
+    LatencyTracker *lt = app->latency;
+    if (lt->key_time != 0 && lt->write_time == 0 && lt->terminal == terminal) {
+        lt->write_time = g_get_monotonic_time();
+    }
+}
+
+static void latency_mark_echo(AppState *app, VteTerminal *terminal) {
+    LatencyTracker *lt = app->latency;
+    if (lt->write_time != 0 && lt->echo_time == 0 && lt->terminal == terminal) {
+        lt->echo_time = g_get_monotonic_time();
+    }
+}
+
+static gboolean on_latency_overlay_tick(gpointer user_data) {
+    LatencyTracker *lt = ((AppState *)user_data)->latency;
+    GString *text = g_string_new("latency ms    p50    p99    max      n");
+    for (int i = 0; i < LATENCY_STAGE_COUNT; i++) {
+        const LatencyHistogram *h = &lt->stages[i];
+        g_string_append_printf(text, "\n%-13s %5.1f  %5.1f  %5.1f  %5" G_GUINT64_FORMAT,
+                               latency_stage_names[i],
+                               latency_percentile(h, 50.0) / 1000.0,
+                               latency_percentile(h, 99.0) / 1000.0,
+                               h->max_us / 1000.0, h->count);
+    }
+    if (lt->dropped > 0) {
+        g_string_append_printf(text, "\ndropped %" G_GUINT64_FORMAT, lt->dropped);
+    }
+    gtk_label_set_text(GTK_LABEL(lt->overlay_label), text->str);
+    g_string_free(text, TRUE);
+    return G_SOURCE_CONTINUE;
+}
+
+static void latency_reset(LatencyTracker *lt) {
+    memset(lt->stages, 0, sizeof(lt->stages));
+    lt->dropped = 0;
+    lt->key_time = 0;
+}
+
+static void enable_latency_tracking(AppState *app) {
+    if (app->latency || !app->focus) return;
+    LatencyTracker *lt = g_new0(LatencyTracker, 1);
+    app->latency = lt;
+    lt->win = app->focus;
+
+    lt->overlay_label = gtk_label_new("");
+    gtk_label_set_xalign(GTK_LABEL(lt->overlay_label), 0.0);
+    gtk_widget_add_css_class(lt->overlay_label, "gmux-debug-overlay");
+    gtk_box_append(GTK_BOX(lt->win->debug_overlay), lt->overlay_label);
+    gtk_widget_set_visible(lt->win->debug_overlay, TRUE);
+    on_latency_overlay_tick(app);
+    lt->overlay_timer_id = g_timeout_add(LATENCY_OVERLAY_INTERVAL_MS, on_latency_overlay_tick, app);
+}
+
+static void stop_latency_selftest(AppState *app) {
+    LatencyTracker *lt = app->latency;
+    if (!lt->selftest_terminal) return;
+
+    if (lt->selftest_timer_id > 0) {
+        g_source_remove(lt->selftest_timer_id);
+        lt->selftest_timer_id = 0;
+    }
+    SubTab *subtab = g_object_get_data(G_OBJECT(lt->selftest_terminal), "subtab");
+    if (subtab && !app->shutting_down) close_subtab(subtab);
+    g_clear_object(&lt->selftest_terminal);
+    debug_log("Latency self-test finished: %d keys typed", lt->selftest_typed);
+}
+
+static void disable_latency_tracking(AppState *app) {
+    LatencyTracker *lt = app->latency;
+    if (!lt) return;
+
+    stop_latency_selftest(app);
+    if (lt->clock) g_signal_handlers_disconnect_by_func(lt->clock, on_latency_after_paint, app);
+    if (lt->overlay_timer_id > 0) g_source_remove(lt->overlay_timer_id);
+    if (!app->shutting_down) {
+        gtk_box_remove(GTK_BOX(lt->win->debug_overlay), lt->overlay_label);
+        gtk_widget_set_visible(lt->win->debug_overlay,
+                               gtk_widget_get_first_child(lt->win->debug_overlay) != NULL);
+    }
+    g_free(lt);
+    app->latency = NULL;
+}
+
+static JsonObject* latency_to_json(LatencyTracker *lt) {
+    JsonObject *result = json_object_new();
+    json_object_set_int_member(result, "dropped", (gint64)lt->dropped);
+
+    JsonObject *stages = json_object_new();
+    for (int i = 0; i < LATENCY_STAGE_COUNT; i++) {
+        const LatencyHistogram *h = &lt->stages[i];
+        JsonObject *stage = json_object_new();
+        json_object_set_int_member(stage, "count", (gint64)h->count);
+        json_object_set_int_member(stage, "min_us", h->min_us);
+        json_object_set_int_member(stage, "p50_us", latency_percentile(h, 50.0));
+        json_object_set_int_member(stage, "p90_us", latency_percentile(h, 90.0));
+        json_object_set_int_member(stage, "p99_us", latency_percentile(h, 99.0));
+        json_object_set_int_member(stage, "max_us", h->max_us);
+        json_object_set_double_member(stage, "mean_us",
+                                      h->count ? (double)h->sum_us / (double)h->count : 0.0);
+
+        // Non-empty buckets as [highest value in bucket, count]
+        JsonArray *buckets = json_array_new();
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            if (h->counts[b] == 0) continue;
+            JsonArray *pair = json_array_new();
+            json_array_add_int_element(pair, latency_bucket_upper(b));
+            json_array_add_int_element(pair, (gint64)h->counts[b]);
+            json_array_add_array_element(buckets, pair);
+        }
+        json_object_set_array_member(stage, "buckets", buckets);
+        json_object_set_object_member(stages, latency_stage_names[i], stage);
+    }
+    json_object_set_object_member(result, "stages", stages);
+    return result;
+}
+
+// Types one key per tick into the cat tab, through the same stamps as a
+// real keystroke minus the key handler. The line discipline echoes each
+// key, so no shell or prompt is involved. Enter is sent every
+// LATENCY_SELFTEST_LINE keys, unmeasured, followed by a short pause so
+// cat's output doesn't count as an echo.
+static gboolean on_latency_selftest_tick(gpointer user_data) {
+    AppState *app = (AppState *)user_data;
+    LatencyTracker *lt = app->latency;
+    SubTab *subtab = g_object_get_data(G_OBJECT(lt->selftest_terminal), "subtab");
+    gint64 now = g_get_monotonic_time();
+
+    if (!subtab || lt->selftest_remaining <= 0) {
+        lt->selftest_timer_id = 0;
+        stop_latency_selftest(app);
+        return G_SOURCE_REMOVE;
+    }
+    if (g_strcmp0(subtab->job, "cat") != 0) {
+        // The job poller reports when cat is in the foreground
+        if (lt->selftest_typed == 0 && now < lt->selftest_deadline) return G_SOURCE_CONTINUE;
+        g_warning("Latency self-test: cat is not running in the test tab");
+        lt->selftest_timer_id = 0;
+        stop_latency_selftest(app);
+        return G_SOURCE_REMOVE;
+    }
+    if (lt->key_time != 0 || now < lt->selftest_pause_until) return G_SOURCE_CONTINUE;
+
+    if (lt->selftest_typed > 0 && lt->selftest_typed % LATENCY_SELFTEST_LINE == 0) {
+        vte_terminal_feed_child(subtab->terminal, "\r", 1);
+        lt->selftest_pause_until = now + 50 * 1000;
+        lt->selftest_typed++;
+        return G_SOURCE_CONTINUE;
+    }
+
+    latency_begin(app, subtab->terminal, g_get_monotonic_time());
+    vte_terminal_feed_child(subtab->terminal, "x", 1);
+    latency_mark_write(app, subtab->terminal);
+    lt->selftest_typed++;
+    lt->selftest_remaining--;
+    return G_SOURCE_CONTINUE;
+}
+
+static char* start_latency_selftest(AppState *app, int count) {
+    Project *project = focused_project(app);
+    if (!project) return g_strdup("no active project");
+
+    enable_latency_tracking(app);
+    LatencyTracker *lt = app->latency;
+    stop_latency_selftest(app);
+    latency_reset(lt);
+
+    SubTab *subtab = add_project_subtab(project, project->path);
+    g_free(subtab->name);
+    subtab->name = g_strdup("latency self-test");
+    update_subtab_label(subtab);
+    send_text_to_subtab(subtab, "exec cat\n");
+
+    lt->selftest_terminal = g_object_ref(subtab->terminal);
+    lt->selftest_remaining = count;
+    lt->selftest_typed = 0;
+    lt->selftest_deadline = g_get_monotonic_time() + 10 * G_USEC_PER_SEC;
+    lt->selftest_pause_until = 0;
+    lt->selftest_timer_id = g_timeout_add(LATENCY_SELFTEST_TICK_MS, on_latency_selftest_tick, app);
+    return NULL;
+}
+
+//=============================================================================
+// Frame Timing HUD
+//=============================================================================
+
+// Toggled with the frame-hud key action, `gmux ctl frame-hud` or
+// GMUX_FRAME_HUD=1. While it is shown, the window frame clock's phases are
+// timed per frame (layout, paint, whole frame), main-loop busy time is
+// measured from a source that is prepared before and checked after every
+// poll(), and count_hud_work() tallies our own work per frame. Frames are
+// kept in a ring covering roughly the last minute, which
+// `gmux ctl frame-hud --dump PATH` writes out as JSON. While hidden,
+// nothing is connected or allocated; count_hud_work() only tests a NULL
+// pointer.
+
+#define FRAME_HUD_HISTORY 4096      // ~68 s at 60 Hz
+#define FRAME_HUD_GRAPH_FRAMES 120
+#define FRAME_HUD_REFRESH_MS 250
+#define FRAME_HUD_DUMP_SECONDS 10
+
+static const char *const hud_work_names[HUD_WORK_COUNT] = {
+    [HUD_WORK_THEME_APPLY]  = "theme_applies",
+    [HUD_WORK_PTY_RESIZE]   = "pty_resizes",
+    [HUD_WORK_SESSION_SAVE] = "session_saves",
+};
+
+typedef struct {
+    gint64 time;                // Monotonic time of after-paint
+    gint32 frame_us;            // before-paint to after-paint
+    gint32 layout_us;
+    gint32 paint_us;
+    gint32 gap_us;              // Since the previous frame ended
+    gint32 busy_us;             // Main loop outside poll() during the gap
+    guint16 missed;             // Refresh intervals the frame overran
+    guint16 work[HUD_WORK_COUNT];
+} HudFrame;
+
+typedef struct {
+    GSource source;
+    FrameHud *hud;
+} HudLoopSource;
+
+struct _FrameHud {
+    HudFrame frames[FRAME_HUD_HISTORY];
+    guint head;                 // Next slot to write
+    guint count;
+
+    WorkspaceWindow *win;       // Window whose clock is measured
+    GdkFrameClock *clock;
+    gulong handlers[4];
+    gint64 before_paint_time;
+    gint64 layout_time;
+    gint64 paint_time;
+    gint64 last_frame_end;
+    gint64 refresh_interval;    // us, from the frame clock
+
+    GSource *loop_source;
+    gint64 poll_start;          // 0 while not inside poll()
+    gint64 idle_us;             // Spent in poll() since the last frame
+
+    guint work[HUD_WORK_COUNT]; // Since the last frame
+
+    GtkWidget *box;
+    GtkWidget *graph;
+    GtkWidget *label;
+    guint refresh_id;
+};
+
+static void frame_hud_count_work(FrameHud *hud, HudWork kind) {
+    hud->work[kind]++;
+}
+
+static gboolean hud_loop_prepare(GSource *source, gint *timeout) {
+    FrameHud *hud = ((HudLoopSource *)source)->hud;
+    *timeout = -1;
+    hud->poll_start = g_get_monotonic_time();
+    return FALSE;
+}
+
+static gboolean hud_loop_check(GSource *source) {
+    FrameHud *hud = ((HudLoopSource *)source)->hud;
+    if (hud->poll_start != 0) {
+        hud->idle_us += g_get_monotonic_time() - hud->poll_start;
+        hud->poll_start = 0;
+    }
+    return FALSE;
+}
+
+static GSourceFuncs hud_loop_funcs = {
+    .prepare = hud_loop_prepare,
+    .check = hud_loop_check,
+};
+
+static void on_hud_before_paint(GdkFrameClock *clock, gpointer user_data) {
+    (void)clock;
+    FrameHud *hud = (FrameHud *)user_data;
+    hud->before_paint_time = g_get_monotonic_time();
+    hud->layout_time = 0;
+    hud->paint_time = 0;
+}
+
+static void on_hud_layout(GdkFrameClock *clock, gpointer user_data) {
+    (void)clock;
+    ((FrameHud *)user_data)->layout_time = g_get_monotonic_time();
+}
+
+static void on_hud_paint(GdkFrameClock *clock, gpointer user_data) {
+    (void)clock;
+    ((FrameHud *)user_data)->paint_time = g_get_monotonic_time();
+}
+
+static void on_hud_after_paint(GdkFrameClock *clock, gpointer user_data) {
+    FrameHud *hud = (FrameHud *)user_data;
+    gint64 now = g_get_monotonic_time();
+    if (hud->before_paint_time == 0) return;
+
+    gint64 interval = 0;
+    gdk_frame_clock_get_refresh_info(clock, 0, &interval, NULL);
+    hud->refresh_interval = interval > 0 ? interval : 16667;
+
+    HudFrame *f = &hud->frames[hud->head];
+    memset(f, 0, sizeof(*f));
+    f->time = now;
+    f->frame_us = (gint32)(now - hud->before_paint_time);
+    if (hud->layout_time) {
+        f->layout_us = (gint32)((hud->paint_time ? hud->paint_time : now) - hud->layout_time);
+    }
+    if (hud->paint_time) f->paint_us = (gint32)(now - hud->paint_time);
+    f->missed = (guint16)MIN(f->frame_us / hud->refresh_interval, G_MAXUINT16);
+
+    if (hud->last_frame_end) {
+        gint64 gap = now - hud->last_frame_end;
+        f->gap_us = (gint32)MIN(gap, G_MAXINT32);
+        f->busy_us = (gint32)CLAMP(gap - hud->idle_us, 0, G_MAXINT32);
+    }
+    for (int i = 0; i < HUD_WORK_COUNT; i++) {
+        f->work[i] = (guint16)MIN(hud->work[i], G_MAXUINT16);
+        hud->work[i] = 0;
+    }
+    hud->last_frame_end = now;
+    hud->idle_us = 0;
+    hud->before_paint_time = 0;
+
+    hud->head = (hud->head + 1) % FRAME_HUD_HISTORY;
+    if (hud->count < FRAME_HUD_HISTORY) hud->count++;
+}
+
+// i = 0 is the newest frame
+static const HudFrame* hud_frame(FrameHud *hud, guint i) {
+    return &hud->frames[(hud->head + FRAME_HUD_HISTORY - 1 - i) % FRAME_HUD_HISTORY];
+}
+
+static void draw_frame_hud_graph(GtkDrawingArea *area, cairo_t *cr,
+                                 int width, int height, gpointer user_data) {
+    (void)area;
+    FrameHud *hud = ((AppState *)user_data)->frame_hud;
+    if (!hud || hud->count == 0) return;
+
+    // Bars are scaled so two refresh intervals fill the height
+    double scale = height / (2.0 * (double)hud->refresh_interval);
+    double bar = (double)width / FRAME_HUD_GRAPH_FRAMES;
+    guint n = MIN(hud->count, FRAME_HUD_GRAPH_FRAMES);
+
+    for (guint i = 0; i < n; i++) {
+        const HudFrame *f = hud_frame(hud, i);
+        double x = width - (i + 1) * bar;
+        double h = MIN(f->frame_us * scale, (double)height);
+        double layout_h = MIN(f->layout_us * scale, h);
+        double paint_h = MIN(f->paint_us * scale, h - layout_h);
+
+        if (f->missed) cairo_set_source_rgba(cr, 0.9, 0.3, 0.3, 0.9);
+        else cairo_set_source_rgba(cr, 0.6, 0.6, 0.6, 0.6);
+        cairo_rectangle(cr, x, height - h, MAX(bar - 1, 1), h);
+        cairo_fill(cr);
+
+        cairo_set_source_rgba(cr, 0.4, 0.6, 0.9, 0.9);
+        cairo_rectangle(cr, x, height - layout_h, MAX(bar - 1, 1), layout_h);
+        cairo_fill(cr);
+        cairo_set_source_rgba(cr, 0.4, 0.8, 0.5, 0.9);
+        cairo_rectangle(cr, x, height - layout_h - paint_h, MAX(bar - 1, 1), paint_h);
+        cairo_fill(cr);
+    }
+
+    // One refresh interval
+    cairo_set_source_rgba(cr, 1, 1, 1, 0.4);
+    cairo_rectangle(cr, 0, height / 2.0, width, 1);
+    cairo_fill(cr);
+}
+
+// Summarises the last second
+static gboolean on_frame_hud_refresh(gpointer user_data) {
+    AppState *app = (AppState *)user_data;
+    FrameHud *hud = app->frame_hud;
+    gint64 since = g_get_monotonic_time() - G_USEC_PER_SEC;
+
+    guint frames = 0, missed = 0;
+    gint64 frame_max = 0, layout_sum = 0, layout_max = 0, paint_sum = 0, paint_max = 0;
+    gint64 gap_sum = 0, busy_sum = 0;
+    guint work[HUD_WORK_COUNT] = { 0 };
+    for (guint i = 0; i < hud->count; i++) {
+        const HudFrame *f = hud_frame(hud, i);
+        if (f->time < since) break;
+        frames++;
+        missed += f->missed;
+        frame_max = MAX(frame_max, f->frame_us);
+        layout_sum += f->layout_us;
+        layout_max = MAX(layout_max, f->layout_us);
+        paint_sum += f->paint_us;
+        paint_max = MAX(paint_max, f->paint_us);
+        gap_sum += f->gap_us;
+        busy_sum += f->busy_us;
+        for (int w = 0; w < HUD_WORK_COUNT; w++) work[w] += f->work[w];
+    }
+    for (int w = 0; w < HUD_WORK_COUNT; w++) work[w] += hud->work[w];
+
+    char *text = g_strdup_printf(
+        "%u fps  missed %u  frame max %.1f ms\n"
+        "layout %.1f/%.1f  paint %.1f/%.1f ms avg/max\n"
+        "main loop busy %.0f%%\n"
+        "themes %u  resizes %u  saves %u /s",
+        frames, missed, frame_max / 1000.0,
+        frames ? layout_sum / 1000.0 / frames : 0.0, layout_max / 1000.0,
+        frames ? paint_sum / 1000.0 / frames : 0.0, paint_max / 1000.0,
+        gap_sum ? 100.0 * (double)busy_sum / (double)gap_sum : 0.0,
+        work[HUD_WORK_THEME_APPLY], work[HUD_WORK_PTY_RESIZE], work[HUD_WORK_SESSION_SAVE]);
+    gtk_label_set_text(GTK_LABEL(hud->label), text);
+    g_free(text);
+    gtk_widget_queue_draw(hud->graph);
+    return G_SOURCE_CONTINUE;
+}
+
+static void show_frame_hud(AppState *app) {
+    if (app->frame_hud || !app->focus) return;
+    GdkFrameClock *clock = gtk_widget_get_frame_clock(app->focus->window);
+    if (!clock) return;
+
+    FrameHud *hud = g_new0(FrameHud, 1);
+    app->frame_hud = hud;
+    hud->win = app->focus;
+    hud->refresh_interval = 16667;
+
+    hud->clock = g_object_ref(clock);
+    hud->handlers[0] = g_signal_connect(clock, "before-paint", G_CALLBACK(on_hud_before_paint), hud);
+    hud->handlers[1] = g_signal_connect(clock, "layout", G_CALLBACK(on_hud_layout), hud);
+    hud->handlers[2] = g_signal_connect(clock, "paint", G_CALLBACK(on_hud_paint), hud);
+    hud->handlers[3] = g_signal_connect(clock, "after-paint", G_CALLBACK(on_hud_after_paint), hud);
+
+    hud->loop_source = g_source_new(&hud_loop_funcs, sizeof(HudLoopSource));
+    ((HudLoopSource *)hud->loop_source)->hud = hud;
+    g_source_set_priority(hud->loop_source, G_PRIORITY_HIGH);
+    g_source_set_name(hud->loop_source, "gmux frame HUD");
+    g_source_attach(hud->loop_source, NULL);
+
+    hud->box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 4);
+    gtk_widget_add_css_class(hud->box, "gmux-debug-overlay");
+    hud->graph = gtk_drawing_area_new();
+    gtk_drawing_area_set_content_width(GTK_DRAWING_AREA(hud->graph), 2 * FRAME_HUD_GRAPH_FRAMES);
+    gtk_drawing_area_set_content_height(GTK_DRAWING_AREA(hud->graph), 48);
+    gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(hud->graph), draw_frame_hud_graph, app, NULL);
+    gtk_box_append(GTK_BOX(hud->box), hud->graph);
+    hud->label = gtk_label_new("");
+    gtk_label_set_xalign(GTK_LABEL(hud->label), 0.0);
+    gtk_box_append(GTK_BOX(hud->box), hud->label);
+    gtk_box_prepend(GTK_BOX(hud->win->debug_overlay), hud->box);
+    gtk_widget_set_visible(hud->win->debug_overlay, TRUE);
+
+    on_frame_hud_refresh(app);
+    hud->refresh_id = g_timeout_add(FRAME_HUD_REFRESH_MS, on_frame_hud_refresh, app);
+}
+
+static void hide_frame_hud(AppState *app) {
+    FrameHud *hud = app->frame_hud;
+    if (!hud) return;
+
+    for (gsize i = 0; i < G_N_ELEMENTS(hud->handlers); i++) {
+        g_signal_handler_disconnect(hud->clock, hud->handlers[i]);
+    }
+    g_object_unref(hud->clock);
+    g_source_destroy(hud->loop_source);
+    g_source_unref(hud->loop_source);
+    g_source_remove(hud->refresh_id);
+    if (!app->shutting_down) {
+        gtk_box_remove(GTK_BOX(hud->win->debug_overlay), hud->box);
+        gtk_widget_set_visible(hud->win->debug_overlay,
+                               gtk_widget_get_first_child(hud->win->debug_overlay) != NULL);
+    }
+    g_free(hud);
+    app->frame_hud = NULL;
+}
+
+static void toggle_frame_hud(AppState *app) {
+    if (app->frame_hud) hide_frame_hud(app);
+    else show_frame_hud(app);
+}
+
+// Writes frames that ended in the last `seconds` to path as JSON. Returns
+// the number written, or -1 with error set.
+static int dump_frame_hud(FrameHud *hud, const char *path, int seconds, GError **error) {
+    gint64 now = g_get_monotonic_time();
+    gint64 since = now - (gint64)seconds * G_USEC_PER_SEC;
+
+    JsonArray *frames = json_array_new();
+    int written = 0;
+    for (guint i = hud->count; i-- > 0; ) {
+        const HudFrame *f = hud_frame(hud, i);
+        if (f->time < since) continue;
+
+        JsonObject *frame = json_object_new();
+        json_object_set_int_member(frame, "t_ms", (f->time - now) / 1000);
+        json_object_set_int_member(frame, "frame_us", f->frame_us);
+        json_object_set_int_member(frame, "layout_us", f->layout_us);
+        json_object_set_int_member(frame, "paint_us", f->paint_us);
+        json_object_set_int_member(frame, "gap_us", f->gap_us);
+        json_object_set_int_member(frame, "busy_us", f->busy_us);
+        json_object_set_int_member(frame, "missed", f->missed);
+        for (int w = 0; w < HUD_WORK_COUNT; w++) {
+            json_object_set_int_member(frame, hud_work_names[w], f->work[w]);
+        }
+        json_array_add_object_element(frames, frame);
+        written++;
+    }
+
+    JsonObject *root = json_object_new();
+    json_object_set_int_member(root, "refresh_interval_us", hud->refresh_interval);
+    json_object_set_array_member(root, "frames", frames);
+    JsonNode *node = json_node_new(JSON_NODE_OBJECT);
+    json_node_take_object(node, root);
+
+    JsonGenerator *gen = json_generator_new();
+    json_generator_set_root(gen, node);
+    gboolean ok = json_generator_to_file(gen, path, error);
+    g_object_unref(gen);
+    json_node_unref(node);
+    return ok ? written : -1;
+}
+
+//=============================================================================
+// Control Socket
+//=============================================================================
+
+// gmux listens on $XDG_RUNTIME_DIR/gmux/control.sock for scripted control
+// (see `gmux ctl`). The protocol is newline-delimited JSON: each request line
+// is one command object, or an array of them to run as a batch, and gets
+// exactly one reply line (an object, or an array of objects for a batch).
+// Commands run on the main loop between reads, so the UI never blocks on a
+// client. Each request line is one bulk operation, so a batch touches
+// session.json once however many tabs it opens.
+//
+// The socket is created with umask 077 in a directory that must be ours
+// and mode 0700, and connections from other users are dropped, so only
+// the user running gmux can drive it. A line longer than
+// CONTROL_MAX_LINE_BYTES gets an error and the connection is closed.
+
+#define CONTROL_SOCKET_NAME "control.sock"
+#define CONTROL_READ_BYTES 65536
+#define CONTROL_MAX_LINE_BYTES (4 * 1024 * 1024)
+
+typedef struct {
+    AppState *app;
+    GSocketConnection *connection;
+    GInputStream *input;
+    GByteArray *pending;        // Read but not yet handled
+    gboolean eof;
+    gboolean closing;           // Close once the reply is written
+    GCancellable *cancellable;
+    char *reply;
+} ControlClient;
+
+// Returns an error message (caller frees) or NULL on success. Handlers add
+// any result members to reply and set *mutated when session state changed.
+typedef char* (*ControlHandler)(AppState *app, JsonObject *request,
+                                JsonObject *reply, gboolean *mutated);
+
+typedef struct {
+    const char *name;
+    ControlHandler handler;
+} ControlCommand;
+
+static char* get_control_socket_path(void) {
+    return g_build_filename(g_get_user_runtime_dir(), "gmux", CONTROL_SOCKET_NAME, NULL);
+}
+
+static const char* control_get_string(JsonObject *request, const char *member) {
+    JsonNode *node = json_object_get_member(request, member);
+    if (!node || JSON_NODE_HOLDS_NULL(node) || json_node_get_value_type(node) != G_TYPE_STRING)
+        return NULL;
+    return json_node_get_string(node);
+}
+
+// Looks up the project named by request[member]: an index (as reported by
+// list), a path or a name. NULL with error set if there is none.
+static Project* control_lookup_project(AppState *app, JsonObject *request,
+                                       const char *member, char **error) {
+    JsonNode *node = json_object_get_member(request, member);
+    if (JSON_NODE_HOLDS_VALUE(node) && json_node_get_value_type(node) == G_TYPE_INT64) {
+        gint64 index = json_node_get_int(node);
+        Project *project = index >= 0 ? g_list_nth_data(app->projects, (guint)index) : NULL;
+        if (!project)
+            *error = g_strdup_printf("no project at index %" G_GINT64_FORMAT, index);
+        return project;
+    }
+
+    const char *key = control_get_string(request, member);
+    if (key) {
+        Project *project = find_project_by_path(app, key);
+        for (GList *l = app->projects; !project && l != NULL; l = l->next) {
+            if (g_strcmp0(((Project *)l->data)->name, key) == 0) project = l->data;
+        }
+        if (!project) *error = g_strdup_printf("no project named '%s'", key);
+        return project;
+    }
+
+    *error = g_strdup_printf("'%s' must be an index, path or name", member);
+    return NULL;
+}
+
+// "project" names the project as for control_lookup_project; without it
+// the active project of the focused window is used.
+static Project* control_find_project(AppState *app, JsonObject *request, char **error) {
+    JsonNode *node = json_object_get_member(request, "project");
+    if (!node || JSON_NODE_HOLDS_NULL(node)) {
+        Project *project = focused_project(app);
+        if (!project) *error = g_strdup("no active project");
+        return project;
+    }
+    return control_lookup_project(app, request, "project", error);
+}
+
+// "tab" is an index into the project's tabs; without it the active tab is used.
+static SubTab* control_find_subtab(AppState *app, JsonObject *request, char **error) {
+    Project *project = control_find_project(app, request, error);
+    if (!project) return NULL;
+
+    if (!json_object_has_member(request, "tab")) {
+        if (!project->active_subtab)
+            *error = g_strdup_printf("project '%s' has no open tabs", project->name);
+        return project->active_subtab;
+    }
+
+    gint64 index = json_object_get_int_member(request, "tab");
+    SubTab *subtab = index >= 0 ? g_list_nth_data(project->subtabs, (guint)index) : NULL;
+    if (!subtab)
+        *error = g_strdup_printf("project '%s' has no tab %" G_GINT64_FORMAT,
+                                 project->name, index);
+    return subtab;
+}
+
+static char* control_open_project(AppState *app, JsonObject *request,
+                                  JsonObject *reply, gboolean *mutated) {
+    const char *path = control_get_string(request, "path");
+    if (!path || !g_path_is_absolute(path))
+        return g_strdup("'path' must be an absolute directory");
+    if (!g_file_test(path, G_FILE_TEST_IS_DIR))
+        return g_strdup_printf("'%s' is not a directory", path);
+
+    Project *project = find_project_by_path(app, path);
+    if (project) {
+        select_project(project);
+    } else {
+        const char *name = control_get_string(request, "name");
+        char *basename = g_path_get_basename(path);
+        project = create_project(app->focus, name ? name : basename, path, TRUE);
+        g_free(basename);
+        *mutated = TRUE;
+    }
+
+    json_object_set_int_member(reply, "project", g_list_index(app->projects, project));
+    return NULL;
+}
+
+// What `gmux --layout FILE` sends when gmux is already running
+static char* control_layout(AppState *app, JsonObject *request,
+                            JsonObject *reply, gboolean *mutated) {
+    (void)reply;
+    (void)mutated;  // apply_layout_file saves the session itself
+    const char *path = control_get_string(request, "path");
+    if (!path || !g_path_is_absolute(path)) return g_strdup("'path' must be an absolute file");
+
+    GError *error = NULL;
+    if (!apply_layout_file(app, path, &error)) {
+        char *message = g_strdup(error->message);
+        g_error_free(error);
+        return message;
+    }
+    if (app->focus) gtk_window_present(GTK_WINDOW(app->focus->window));
+    return NULL;
+}
+
+static char* control_new_tab(AppState *app, JsonObject *request,
+                             JsonObject *reply, gboolean *mutated) {
+    char *error = NULL;
+    Project *project = control_find_project(app, request, &error);
+    if (!project) return error;
+
+    const char *cwd = control_get_string(request, "cwd");
+    if (cwd && !g_file_test(cwd, G_FILE_TEST_IS_DIR))
+        return g_strdup_printf("'%s' is not a directory", cwd);
+
+    // Bring back the saved tabs first so the new one doesn't replace them
+    ensure_project_initialized(project);
+    SubTab *subtab = add_project_subtab(project, cwd ? cwd : project->path);
+
+    const char *name = control_get_string(request, "name");
+    if (name) {
+        g_free(subtab->name);
+        subtab->name = g_strdup(name);
+        gtk_label_set_text(GTK_LABEL(subtab->tab_label), name);
+        gtk_widget_set_tooltip_text(subtab->tab_label, name);
+    }
+
+    const char *command = control_get_string(request, "command");
+    if (command) {
+        char *line = g_strconcat(command, "\n", NULL);
+        send_text_to_subtab(subtab, line);
+        g_free(line);
+    }
+
+    *mutated = TRUE;
+    json_object_set_int_member(reply, "project", g_list_index(app->projects, project));
+    json_object_set_int_member(reply, "tab", g_list_index(project->subtabs, subtab));
+    return NULL;
+}
+
+// A tab's command timeline, oldest first; see Command Timeline
+static char* control_timeline(AppState *app, JsonObject *request,
+                              JsonObject *reply, gboolean *mutated) {
+    (void)mutated;
+    char *error = NULL;
+    SubTab *subtab = control_find_subtab(app, request, &error);
+    if (!subtab) return error;
+
+    json_object_set_array_member(reply, "commands", command_timeline_to_json(subtab));
+    if (subtab->failure) json_object_set_string_member(reply, "failure", subtab->failure);
+    return NULL;
+}
+
+static char* control_send_text(AppState *app, JsonObject *request,
+                               JsonObject *reply, gboolean *mutated) {
+    (void)reply;
+    (void)mutated;
+
+    const char *text = control_get_string(request, "text");
+    if (!text) return g_strdup("'text' is required");
+
+    char *error = NULL;
+    SubTab *subtab = control_find_subtab(app, request, &error);
+    if (!subtab) return error;
+
+    send_text_to_subtab(subtab, text);
+    return NULL;
+}
+
+// Exports a tab's scrollback to "output", or to the clipboard without it.
+// The reply comes right away; the export finishes in the background.
+static char* control_export(AppState *app, JsonObject *request,
+                            JsonObject *reply, gboolean *mutated) {
+    (void)mutated;
+
+    const char *output = control_get_string(request, "output");
+    const char *format_name = control_get_string(request, "format");
+    ExportFormat format = output ? export_format_for_path(output) : EXPORT_TEXT;
+    if (format_name && !parse_export_format(format_name, &format)) {
+        return g_strdup_printf("unknown format '%s' (text, ansi or html)", format_name);
+    }
+
+    char *error = NULL;
+    SubTab *subtab = control_find_subtab(app, request, &error);
+    if (!subtab) return error;
+
+    error = start_scrollback_export(subtab, format, output);
+    if (error) return error;
+    json_object_set_string_member(reply, "format", export_format_names[format]);
+    if (output) json_object_set_string_member(reply, "output", output);
+    return NULL;
+}
+
+static char* control_focus(AppState *app, JsonObject *request,
+                           JsonObject *reply, gboolean *mutated) {
+    (void)reply;
+    (void)mutated;
+
+    char *error = NULL;
+    Project *project = control_find_project(app, request, &error);
+    if (!project) return error;
+
+    select_project(project);
+    if (json_object_has_member(request, "tab")) {
+        SubTab *subtab = control_find_subtab(app, request, &error);
+        if (!subtab) return error;
+        on_subtab_button_clicked(GTK_BUTTON(subtab->tab_button), subtab);
+    }
+    gtk_window_present(GTK_WINDOW(project->win->window));
+    return NULL;
+}
+
+// With "project", the new window takes that project from its current one
+static char* control_new_window(AppState *app, JsonObject *request,
+                                JsonObject *reply, gboolean *mutated) {
+    Project *project = NULL;
+    if (json_object_has_member(request, "project")) {
+        char *error = NULL;
+        project = control_find_project(app, request, &error);
+        if (!project) return error;
+    }
+
+    WorkspaceWindow *win = open_workspace_window(app, project);
+    *mutated = TRUE;
+    json_object_set_int_member(reply, "window", g_list_index(app->windows, win));
+    return NULL;
+}
+
+// "window" is an index as reported by list
+static char* control_move_project(AppState *app, JsonObject *request,
+                                  JsonObject *reply, gboolean *mutated) {
+    (void)reply;
+
+    if (!json_object_has_member(request, "window")) return g_strdup("'window' is required");
+    gint64 index = json_object_get_int_member(request, "window");
+    WorkspaceWindow *win = index >= 0 ? g_list_nth_data(app->windows, (guint)index) : NULL;
+    if (!win) return g_strdup_printf("no window %" G_GINT64_FORMAT, index);
+
+    char *error = NULL;
+    Project *project = control_find_project(app, request, &error);
+    if (!project) return error;
+
+    move_project_to_window(project, win);
+    gtk_window_present(GTK_WINDOW(win->window));
+    *mutated = TRUE;
+    return NULL;
+}
+
+// Moves a tab, shell and scrollback included, to the project named by "to"
+// or, with "new_window", into a window of its own along with its project;
+// the latter only for a project's last tab.
+static char* control_move_tab(AppState *app, JsonObject *request,
+                              JsonObject *reply, gboolean *mutated) {
+    char *error = NULL;
+    SubTab *subtab = control_find_subtab(app, request, &error);
+    if (!subtab) return error;
+
+    gboolean new_window = json_object_has_member(request, "new_window") &&
+                          json_object_get_boolean_member(request, "new_window");
+    if (new_window) {
+        if (!move_subtab_to_new_window(subtab)) {
+            return g_strdup_printf("'%s' has other tabs; new-window --project moves the "
+                                   "whole project", subtab->parent_tab->name);
+        }
+    } else {
+        if (!json_object_has_member(request, "to")) {
+            return g_strdup("'to' or 'new_window' is required");
+        }
+        Project *target = control_lookup_project(app, request, "to", &error);
+        if (!target) return error;
+        move_subtab_to_project(subtab, target);
+    }
+
+    Project *project = subtab->parent_tab;
+    *mutated = TRUE;
+    json_object_set_int_member(reply, "project", g_list_index(app->projects, project));
+    json_object_set_int_member(reply, "tab", g_list_index(project->subtabs, subtab));
+    json_object_set_int_member(reply, "window", g_list_index(app->windows, project->win));
+    return NULL;
+}
+
+static int compare_project_frecency_data(gconstpointer a, gconstpointer b) {
+    return compare_project_frecency((Project *)a, (Project *)b);
+}
+
+// With "sort": "frecency" projects are listed best first, as a picker
+// would show them; "index" still addresses them in other commands.
+static char* control_list(AppState *app, JsonObject *request,
+                          JsonObject *reply, gboolean *mutated) {
+    (void)mutated;
+
+    GList *ordered = g_list_copy(app->projects);
+    const char *sort = control_get_string(request, "sort");
+    if (g_strcmp0(sort, "frecency") == 0) {
+        ordered = g_list_sort(ordered, compare_project_frecency_data);
+    } else if (sort) {
+        g_list_free(ordered);
+        return g_strdup_printf("unknown sort '%s'", sort);
+    }
+
+    JsonArray *projects = json_array_new();
+    for (GList *l = ordered; l != NULL; l = l->next) {
+        Project *project = (Project *)l->data;
+        JsonObject *entry = json_object_new();
+        json_object_set_int_member(entry, "index", g_list_index(app->projects, project));
+        json_object_set_string_member(entry, "name", project->name);
+        json_object_set_string_member(entry, "path", project->path);
+        json_object_set_int_member(entry, "window", g_list_index(app->windows, project->win));
+        json_object_set_boolean_member(entry, "active", project == project->win->active_project);
+        json_object_set_boolean_member(entry, "loaded", project->initialized);
+        json_object_set_double_member(entry, "frecency", project_frecency_score(project));
+
+        JsonArray *tabs = json_array_new();
+        int tab_index = 0;
+        for (GList *sl = project->subtabs; sl != NULL; sl = sl->next, tab_index++) {
+            SubTab *subtab = (SubTab *)sl->data;
+            JsonObject *tab = json_object_new();
+            json_object_set_int_member(tab, "index", tab_index);
+            json_object_set_string_member(tab, "name", subtab->name);
+            char *cwd = subtab_current_dir(subtab);
+            json_object_set_string_member(tab, "cwd", cwd);
+            g_free(cwd);
+            if (subtab->job) {
+                json_object_set_string_member(tab, "job", subtab->job);
+            } else {
+                json_object_set_null_member(tab, "job");
+            }
+            json_object_set_boolean_member(tab, "active", subtab == project->active_subtab);
+            json_array_add_object_element(tabs, tab);
+        }
+        json_object_set_array_member(entry, "tabs", tabs);
+        json_array_add_object_element(projects, entry);
+    }
+    g_list_free(ordered);
+    json_object_set_array_member(reply, "projects", projects);
+    return NULL;
+}
+
+static char* control_close(AppState *app, JsonObject *request,
+                           JsonObject *reply, gboolean *mutated) {
+    (void)reply;
+    (void)mutated;  // close_subtab saves the session itself
+
+    char *error = NULL;
+    SubTab *subtab = control_find_subtab(app, request, &error);
+    if (!subtab) return error;
+
+    close_subtab(subtab);
+    return NULL;
+}
+
+static char* control_close_others(AppState *app, JsonObject *request,
+                                  JsonObject *reply, gboolean *mutated) {
+    (void)reply;
+    (void)mutated;
+
+    char *error = NULL;
+    SubTab *subtab = control_find_subtab(app, request, &error);
+    if (!subtab) return error;
+
+    close_other_subtabs(subtab);
+    return NULL;
+}
+
+static char* control_close_all(AppState *app, JsonObject *request,
+                               JsonObject *reply, gboolean *mutated) {
+    (void)reply;
+    (void)mutated;
+
+    char *error = NULL;
+    Project *project = control_find_project(app, request, &error);
+    if (!project) return error;
+
+    close_all_subtabs(project);
+    return NULL;
+}
+
+// Synthetic warning for exercising the pressure policy; "reset" starts a
+// new episode first so every tier up to "tier" runs again.
+static char* control_memory_pressure(AppState *app, JsonObject *request,
+                                     JsonObject *reply, gboolean *mutated) {
+    (void)mutated;
+
+    gint64 tier = 1;
+    if (json_object_has_member(request, "tier")) {
+        JsonNode *node = json_object_get_member(request, "tier");
+        if (!JSON_NODE_HOLDS_VALUE(node) || json_node_get_value_type(node) != G_TYPE_INT64) {
+            return g_strdup("tier must be a number");
+        }
+        tier = json_node_get_int(node);
+        if (tier < 1 || tier > MEMORY_TIER_MAX) {
+            return g_strdup_printf("tier must be between 1 and %d", MEMORY_TIER_MAX);
+        }
+    }
+    if (json_object_has_member(request, "reset") &&
+        json_object_get_boolean_member(request, "reset")) {
+        app->memory_tier = 0;
+        app->memory_last_warning = 0;
+        app->memory_last_step = 0;
+    }
+
+    gint64 reclaimed = 0;
+    int applied = handle_memory_pressure(app, (int)tier, "control socket", &reclaimed);
+    json_object_set_int_member(reply, "tier", applied);
+    json_object_set_int_member(reply, "reclaimed", reclaimed);
+    return NULL;
+}
+
+// Reports the latency histograms; "enable", "disable" and "reset" act first.
+static char* control_latency(AppState *app, JsonObject *request,
+                             JsonObject *reply, gboolean *mutated) {
+    (void)mutated;
+    if (json_object_has_member(request, "enable") &&
+        json_object_get_boolean_member(request, "enable")) {
+        enable_latency_tracking(app);
+    }
+    if (json_object_has_member(request, "reset") &&
+        json_object_get_boolean_member(request, "reset") && app->latency) {
+        latency_reset(app->latency);
+    }
+
+    json_object_set_boolean_member(reply, "enabled", app->latency != NULL);
+    if (app->latency) {
+        json_object_set_object_member(reply, "latency", latency_to_json(app->latency));
+    }
+    if (json_object_has_member(request, "disable") &&
+        json_object_get_boolean_member(request, "disable")) {
+        disable_latency_tracking(app);
+    }
+    return NULL;
+}
+
+static char* control_latency_self_test(AppState *app, JsonObject *request,
+                                       JsonObject *reply, gboolean *mutated) {
+    (void)mutated;
+    gint64 count = json_object_has_member(request, "count")
+        ? json_object_get_int_member(request, "count") : 200;
+    if (count < 1 || count > 100000) return g_strdup("count must be between 1 and 100000");
+
+    char *error = start_latency_selftest(app, (int)count);
+    if (!error) json_object_set_int_member(reply, "count", count);
+    return error;
+}
+
+// Reports a project's startup recipe; "run" starts it again first (opening
+// a cold project with an allowed recipe runs it anyway) and "allow" allows
+// the file as it is now and runs it
+static char* control_recipe(AppState *app, JsonObject *request,
+                            JsonObject *reply, gboolean *mutated) {
+    char *error = NULL;
+    Project *project = control_find_project(app, request, &error);
+    if (!project) return error;
+
+    gboolean ran = FALSE;
+    if (!project->initialized) {
+        ensure_project_initialized(project);
+        ran = project->recipe != NULL;
+        *mutated = TRUE;
+    }
+    gboolean allow = json_object_get_boolean_member_with_default(request, "allow", FALSE);
+    if (!ran && (allow || json_object_get_boolean_member_with_default(request, "run", FALSE))) {
+        if (project->recipe && !project->recipe->finished)
+            return g_strdup("the recipe is still running");
+        error = run_project_recipe(project, allow);
+        if (error) return error;
+        *mutated = TRUE;
+    }
+    if (!project->recipe) {
+        return g_strdup_printf("no recipe has run in '%s' (see %s)", project->name,
+                               RECIPE_FILE_NAME);
+    }
+
+    json_object_set_int_member(reply, "project", g_list_index(app->projects, project));
+    json_object_set_object_member(reply, "recipe", recipe_to_json(project->recipe));
+    return NULL;
+}
+
+// Reports which environment activation applies to a project and whether it
+// is allowed; "allow" trusts its files as they are now
+static char* control_env(AppState *app, JsonObject *request,
+                         JsonObject *reply, gboolean *mutated) {
+    (void)mutated;
+    char *error = NULL;
+    Project *project = control_find_project(app, request, &error);
+    if (!project) return error;
+
+    char *program = NULL;
+    ProjectEnvKind kind = project_env_detect(project->path,
+                                             project_env_parse_enabled(app->settings.project_env),
+                                             &program);
+    g_free(program);
+    if (kind == PROJECT_ENV_NONE) {
+        return g_strdup_printf("nothing in '%s' to activate with project_env=%s",
+                               project->name, app->settings.project_env);
+    }
+
+    gboolean allowed = TRUE;
+    if (project_env_needs_allow(kind)) {
+        char *hash = project_env_hash(project->path, kind);
+        if (!hash) return g_strdup_printf("%s files in '%s' went away", project_env_kind_names[kind],
+                                          project->name);
+        allowed = allow_list_has(PROJECT_ENV_ALLOW_FILE_NAME, project->path, hash);
+        if (!allowed && json_object_get_boolean_member_with_default(request, "allow", FALSE)) {
+            allow_list_add(PROJECT_ENV_ALLOW_FILE_NAME, project->path, hash);
+            forget_project_envs(app);
+            allowed = TRUE;
+        }
+        g_free(hash);
+    }
+
+    json_object_set_int_member(reply, "project", g_list_index(app->projects, project));
+    json_object_set_string_member(reply, "kind", project_env_kind_names[kind]);
+    json_object_set_boolean_member(reply, "allowed", allowed);
+    return NULL;
+}
+
+// Searches the command history like the picker does, but to the end
+static char* control_history(AppState *app, JsonObject *request,
+                             JsonObject *reply, gboolean *mutated) {
+    (void)mutated;
+    HistoryStore *store = app_history(app);
+    if (!store) return g_strdup("the command history could not be opened");
+    history_refresh(store);
+
+    const char *query = control_get_string(request, "query");
+    HistorySearch *search = history_search_new(store, query ? query : "");
+    while (!history_search_step(search, G_MAXINT64)) {}
+    GArray *results = history_search_results(search);
+
+    JsonArray *array = json_array_new();
+    for (guint i = 0; i < results->len; i++) {
+        json_array_add_object_element(array, history_command_to_json(
+            store, g_array_index(results, guint32, i)));
+    }
+    json_object_set_array_member(reply, "results", array);
+    json_object_set_int_member(reply, "elapsed_us", search->busy_us);
+    json_object_set_int_member(reply, "commands", store->commands->len);
+    json_object_set_int_member(reply, "runs", (gint64)store->runs);
+    g_array_unref(results);
+    history_search_free(search);
+    return NULL;
+}
+
+// Times history searches over "count" synthetic runs
+static char* control_history_bench(AppState *app, JsonObject *request,
+                                   JsonObject *reply, gboolean *mutated) {
+    (void)app;
+    (void)mutated;
+    gint64 count = json_object_has_member(request, "count")
+        ? json_object_get_int_member(request, "count") : 1000000;
+    if (count < 1000 || count > 5000000) return g_strdup("count must be between 1000 and 5000000");
+
+    json_object_set_object_member(reply, "history", run_history_bench((guint)count));
+    return NULL;
+}
+
+// Times the trigger scan over "count" MB of synthetic build output, and
+// copying and scanning the rows of a tab ("project"/"tab", or the active one)
+static char* control_trigger_bench(AppState *app, JsonObject *request,
+                                   JsonObject *reply, gboolean *mutated) {
+    (void)mutated;
+    if (!app->triggers) return g_strdup("no triggers are set");
+    gint64 count = json_object_has_member(request, "count")
+        ? json_object_get_int_member(request, "count") : 64;
+    if (count < 1 || count > TRIGGER_BENCH_MAX_MB)
+        return g_strdup_printf("count must be between 1 and %d MB", TRIGGER_BENCH_MAX_MB);
+
+    char *error = NULL;
+    SubTab *subtab = control_find_subtab(app, request, &error);
+    if (!subtab && (json_object_has_member(request, "project") ||
+                    json_object_has_member(request, "tab"))) {
+        return error;
+    }
+    g_free(error);
+
+    json_object_set_object_member(reply, "scan", run_trigger_bench(app->triggers, (int)count));
+    if (subtab) {
+        json_object_set_object_member(reply, "tab", run_trigger_tab_bench(app->triggers, subtab));
+    }
+    return NULL;
+}
+
+// Times "count" rounds of typing through the current keymap
+static char* control_keymap_bench(AppState *app, JsonObject *request,
+                                  JsonObject *reply, gboolean *mutated) {
+    (void)mutated;
+    gint64 count = json_object_has_member(request, "count")
+        ? json_object_get_int_member(request, "count") : 20000;
+    if (count < 1 || count > 1000000) return g_strdup("count must be between 1 and 1000000");
+
+    json_object_set_object_member(reply, "keymap", keymap_benchmark(app->keymap, (int)count));
+    return NULL;
+}
+
+// Times fork() against posix_spawn, optionally with extra RSS ("ballast_mb")
+static char* control_spawn_bench(AppState *app, JsonObject *request,
+                                 JsonObject *reply, gboolean *mutated) {
+    (void)mutated;
+    gint64 count = json_object_has_member(request, "count")
+        ? json_object_get_int_member(request, "count") : 100;
+    if (count < 1 || count > SPAWN_BENCH_MAX_COUNT)
+        return g_strdup_printf("count must be between 1 and %d", SPAWN_BENCH_MAX_COUNT);
+    gint64 ballast = json_object_has_member(request, "ballast_mb")
+        ? json_object_get_int_member(request, "ballast_mb") : 0;
+    if (ballast < 0 || ballast > SPAWN_BENCH_MAX_BALLAST_MB)
+        return g_strdup_printf("ballast must be between 0 and %d MB", SPAWN_BENCH_MAX_BALLAST_MB);
+
+    json_object_set_string_member(reply, "backend",
+                                  app->settings.spawn_via_vte ? "vte" : "posix");
+    json_object_set_int_member(reply, "count", count);
+    json_object_set_array_member(reply, "rounds", run_spawn_bench((int)count, (int)ballast));
+    return NULL;
+}
+
+// Opens and closes "count" projects one by one, then the same inside one
+// bulk operation, and reports the work each path did
+static char* control_bulk_bench(AppState *app, JsonObject *request,
+                                JsonObject *reply, gboolean *mutated) {
+    (void)mutated;  // Both rounds leave the workspace as they found it
+    gint64 count = json_object_has_member(request, "count")
+        ? json_object_get_int_member(request, "count") : 500;
+    if (count < 1 || count > BULK_BENCH_MAX_COUNT)
+        return g_strdup_printf("count must be between 1 and %d", BULK_BENCH_MAX_COUNT);
+    if (app->bulk_depth > 0) return g_strdup("a bulk operation is already open");
+
+    JsonArray *rounds = json_array_new();
+    json_array_add_object_element(rounds, run_bulk_bench(app, (int)count, FALSE));
+    json_array_add_object_element(rounds, run_bulk_bench(app, (int)count, TRUE));
+    json_object_set_int_member(reply, "count", count);
+    json_object_set_array_member(reply, "rounds", rounds);
+    return NULL;
+}
+
+// Shows, hides or dumps the frame HUD and reports whether it is shown.
+// "dump" writes the last "seconds" of frames before "disable" hides it.
+static char* control_frame_hud(AppState *app, JsonObject *request,
+                               JsonObject *reply, gboolean *mutated) {
+    (void)mutated;
+    if (json_object_has_member(request, "enable") &&
+        json_object_get_boolean_member(request, "enable")) {
+        show_frame_hud(app);
+        if (!app->frame_hud) return g_strdup("window is not realized yet");
+    }
+
+    const char *path = json_object_has_member(request, "dump")
+        ? json_object_get_string_member(request, "dump") : NULL;
+    if (path) {
+        if (!app->frame_hud) return g_strdup("frame HUD is not shown");
+        gint64 seconds = json_object_has_member(request, "seconds")
+            ? json_object_get_int_member(request, "seconds") : FRAME_HUD_DUMP_SECONDS;
+        if (seconds < 1) return g_strdup("seconds must be positive");
+
+        GError *error = NULL;
+        int frames = dump_frame_hud(app->frame_hud, path, (int)MIN(seconds, G_MAXINT), &error);
+        if (frames < 0) {
+            char *message = g_strdup_printf("cannot write %s: %s", path, error->message);
+            g_error_free(error);
+            return message;
+        }
+        json_object_set_string_member(reply, "path", path);
+        json_object_set_int_member(reply, "frames", frames);
+    }
+
+    if (json_object_has_member(request, "disable") &&
+        json_object_get_boolean_member(request, "disable")) {
+        hide_frame_hud(app);
+    }
+    json_object_set_boolean_member(reply, "shown", app->frame_hud != NULL);
+    return NULL;
+}
+
+static const ControlCommand control_commands[] = {
+    { "open-project", control_open_project },
+    { "layout",       control_layout },
+    { "new-tab",      control_new_tab },
+    { "send-text",    control_send_text },
+    { "export",       control_export },
+    { "focus",        control_focus },
+    { "list",         control_list },
+    { "close",        control_close },
+    { "close-others", control_close_others },
+    { "close-all",    control_close_all },
+    { "memory-pressure", control_memory_pressure },
+    { "latency",      control_latency },
+    { "latency-self-test", control_latency_self_test },
+    { "frame-hud",    control_frame_hud },
+    { "spawn-bench",  control_spawn_bench },
+    { "bulk-bench",   control_bulk_bench },
+    { "recipe",       control_recipe },
+    { "env",          control_env },
+    { "trigger-bench", control_trigger_bench },
+    { "keymap-bench", control_keymap_bench },
+    { "commands",     control_timeline },
+    { "history",      control_history },
+    { "history-bench", control_history_bench },
+    { "new-window",   control_new_window },
+    { "move-project", control_move_project },
+    { "move-tab",     control_move_tab },
+};
+
+static JsonNode* control_run_command(AppState *app, JsonNode *node, gboolean *mutated) {
+    JsonObject *reply = json_object_new();
+    char *error = NULL;
+
+    JsonObject *request = JSON_NODE_HOLDS_OBJECT(node) ? json_node_get_object(node) : NULL;
+    const char *name = request ? control_get_string(request, "cmd") : NULL;
+    const ControlCommand *command = NULL;
+    for (gsize i = 0; name && i < G_N_ELEMENTS(control_commands); i++) {
+        if (strcmp(control_commands[i].name, name) == 0) command = &control_commands[i];
+    }
+
+    if (!request) {
+        error = g_strdup("request must be a JSON object");
+    } else if (!name) {
+        error = g_strdup("'cmd' is required");
+    } else if (!command) {
+        error = g_strdup_printf("unknown command '%s'", name);
+    } else {
+        error = command->handler(app, request, reply, mutated);
+    }
+
+    json_object_set_boolean_member(reply, "ok", error == NULL);
+    if (error) {
+        json_object_set_string_member(reply, "error", error);
+        debug_log("control: %s failed: %s", name ? name : "?", error);
+        g_free(error);
+    }
+
+    JsonNode *result = json_node_new(JSON_NODE_OBJECT);
+    json_node_take_object(result, reply);
+    return result;
+}
+
+// Runs one request line and returns the reply line (without newline).
+static char* control_handle_line(AppState *app, const char *line) {
+    gint64 start = g_get_monotonic_time();
+    gboolean mutated = FALSE;
+    GError *error = NULL;
+    JsonNode *reply = NULL;
+    JsonParser *parser = json_parser_new();
+
+    workspace_begin_bulk(app);
+    if (!json_parser_load_from_data(parser, line, -1, &error)) {
+        JsonObject *object = json_object_new();
+        json_object_set_boolean_member(object, "ok", FALSE);
+        char *message = g_strdup_printf("invalid JSON: %s", error->message);
+        json_object_set_string_member(object, "error", message);
+        g_free(message);
+        g_error_free(error);
+        reply = json_node_new(JSON_NODE_OBJECT);
+        json_node_take_object(reply, object);
+    } else {
+        JsonNode *root = json_parser_get_root(parser);
+        if (JSON_NODE_HOLDS_ARRAY(root)) {
+            JsonArray *requests = json_node_get_array(root);
+            JsonArray *replies = json_array_new();
+            guint count = json_array_get_length(requests);
+            for (guint i = 0; i < count; i++) {
+                json_array_add_element(replies, control_run_command(
+                    app, json_array_get_element(requests, i), &mutated));
+            }
+            reply = json_node_new(JSON_NODE_ARRAY);
+            json_node_take_array(reply, replies);
+        } else {
+            reply = control_run_command(app, root, &mutated);
+        }
+    }
+    g_object_unref(parser);
+
+    if (mutated) {
+        save_session(app);
+    }
+    workspace_commit_bulk(app);
+
+    char *text = json_to_string(reply, FALSE);
+    json_node_unref(reply);
+    debug_log("control: handled request in %.2f ms",
+              (g_get_monotonic_time() - start) / 1000.0);
+    return text;
+}
+
+static void control_read_next(ControlClient *client);
+
+static void control_client_free(ControlClient *client) {
+    client->app->control_clients = g_list_remove(client->app->control_clients, client);
+    g_io_stream_close(G_IO_STREAM(client->connection), NULL, NULL);
+    g_byte_array_unref(client->pending);
+    g_object_unref(client->connection);
+    g_object_unref(client->cancellable);
+    g_free(client->reply);
+    g_free(client);
+}
+
+static void on_control_reply_written(GObject *source, GAsyncResult *result, gpointer user_data) {
+    ControlClient *client = (ControlClient *)user_data;
+    GError *error = NULL;
+
+    if (!g_output_stream_write_all_finish(G_OUTPUT_STREAM(source), result, NULL, &error)) {
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            debug_log("control: write failed: %s", error->message);
+        g_error_free(error);
+        control_client_free(client);
+        return;
+    }
+
+    g_clear_pointer(&client->reply, g_free);
+    if (client->closing) {
+        control_client_free(client);
+        return;
+    }
+    control_read_next(client);
+}
+
+static void control_send_reply(ControlClient *client, char *reply) {
+    client->reply = g_strconcat(reply, "\n", NULL);
+    g_free(reply);
+
+    GOutputStream *output = g_io_stream_get_output_stream(G_IO_STREAM(client->connection));
+    g_output_stream_write_all_async(output, client->reply, strlen(client->reply),
+                                    G_PRIORITY_DEFAULT, client->cancellable,
+                                    on_control_reply_written, client);
+}
+
+static void on_control_read(GObject *source, GAsyncResult *result, gpointer user_data) {
+    ControlClient *client = (ControlClient *)user_data;
+    GError *error = NULL;
+
+    GBytes *bytes = g_input_stream_read_bytes_finish(G_INPUT_STREAM(source), result, &error);
+    if (!bytes || client->app->shutting_down) {
+        if (error && !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            debug_log("control: read failed: %s", error->message);
+        g_clear_error(&error);
+        if (bytes) g_bytes_unref(bytes);
+        control_client_free(client);
+        return;
+    }
+
+    gsize size = 0;
+    const guint8 *data = g_bytes_get_data(bytes, &size);
+    g_byte_array_append(client->pending, data, (guint)size);
+    client->eof = size == 0;
+    g_bytes_unref(bytes);
+    control_read_next(client);
+}
+
+// Handles the next whole line read, or reads more. At end of input a last
+// line without a newline still counts.
+static void control_read_next(ControlClient *client) {
+    GByteArray *pending = client->pending;
+    guint8 *newline = memchr(pending->data, '\n', pending->len);
+    gsize length = newline ? (gsize)(newline - pending->data)
+                           : client->eof ? pending->len : 0;
+
+    if (!newline && !client->eof) {
+        if (pending->len > CONTROL_MAX_LINE_BYTES) {
+            debug_log("control: dropping a client whose request passed %d bytes",
+                      CONTROL_MAX_LINE_BYTES);
+            client->closing = TRUE;
+            control_send_reply(client, g_strdup_printf(
+                "{\"ok\":false,\"error\":\"request longer than %d bytes\"}",
+                CONTROL_MAX_LINE_BYTES));
+            return;
+        }
+        g_input_stream_read_bytes_async(client->input, CONTROL_READ_BYTES, G_PRIORITY_DEFAULT,
+                                        client->cancellable, on_control_read, client);
+        return;
+    }
+    if (!newline && length == 0) {
+        control_client_free(client);    // End of input
+        return;
+    }
+
+    char *line = g_strndup((const char *)pending->data, length);
+    g_byte_array_remove_range(pending, 0, (guint)MIN(length + 1, pending->len));
+    if (strlen(line) != length || !g_utf8_validate(line, (gssize)length, NULL)) {
+        debug_log("control: dropping a client that sent a line that isn't UTF-8 text");
+        g_free(line);
+        control_client_free(client);
+        return;
+    }
+    if (length == 0) {
+        g_free(line);
+        control_read_next(client);
+        return;
+    }
+
+    char *reply = control_handle_line(client->app, line);
+    g_free(line);
+    control_send_reply(client, reply);
+}
+
+static gboolean on_control_incoming(GSocketService *service, GSocketConnection *connection,
+                                    GObject *source_object, gpointer user_data) {
+    AppState *app = (AppState *)user_data;
+    (void)service;
+    (void)source_object;
+
+    // The directory already keeps other users out; this holds even if it
+    // was loosened afterwards
+    GError *error = NULL;
+    GCredentials *credentials = g_socket_get_credentials(
+        g_socket_connection_get_socket(connection), &error);
+    uid_t uid = credentials ? g_credentials_get_unix_user(credentials, &error) : (uid_t)-1;
+    g_clear_object(&credentials);
+    if (uid != getuid()) {
+        g_warning("Control socket: refusing a connection from %s",
+                  error ? error->message : "another user");
+        g_clear_error(&error);
+        g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+        return TRUE;
+    }
+
+    ControlClient *client = g_new0(ControlClient, 1);
+    client->app = app;
+    client->connection = g_object_ref(connection);
+    client->input = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+    client->pending = g_byte_array_new();
+    client->cancellable = g_cancellable_new();
+    app->control_clients = g_list_prepend(app->control_clients, client);
+
+    control_read_next(client);
+    return TRUE;
+}
+
+// A socket file nobody accepts on is left over from a crash; one that
+// answers belongs to another running gmux, which keeps it.
+static gboolean control_socket_in_use(const char *path) {
+    GSocketClient *socket_client = g_socket_client_new();
+    GSocketAddress *address = g_unix_socket_address_new(path);
+    GSocketConnection *connection = g_socket_client_connect(
+        socket_client, G_SOCKET_CONNECTABLE(address), NULL, NULL);
+    gboolean in_use = connection != NULL;
+
+    if (connection) g_object_unref(connection);
+    g_object_unref(address);
+    g_object_unref(socket_client);
+    return in_use;
+}
+
+// The socket's directory must be a real directory of ours that nobody else
+// can enter; a loose mode on one we own is tightened
+static gboolean control_socket_dir_safe(const char *dir) {
+    g_mkdir_with_parents(dir, 0700);
+
+    struct stat st;
+    if (lstat(dir, &st) != 0) {
+        g_warning("Control socket directory %s: %s", dir, g_strerror(errno));
+        return FALSE;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid()) {
+        g_warning("Control socket directory %s is not a directory owned by this user", dir);
+        return FALSE;
+    }
+    if ((st.st_mode & 0077) != 0 && g_chmod(dir, 0700) != 0) {
+        g_warning("Cannot make %s private: %s", dir, g_strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void control_socket_start(AppState *app) {
+    char *path = get_control_socket_path();
+    char *dir = g_path_get_dirname(path);
+    gboolean safe = control_socket_dir_safe(dir);
+    g_free(dir);
+    if (!safe) {
+        g_warning("Not listening on %s", path);
+        g_free(path);
+        return;
+    }
+
+    if (g_file_test(path, G_FILE_TEST_EXISTS)) {
+        if (control_socket_in_use(path)) {
+            g_warning("Control socket %s is owned by another gmux; not listening", path);
+            g_free(path);
+            return;
+        }
+        g_unlink(path);
+    }
+
+    GError *error = NULL;
+    GSocketService *service = g_socket_service_new();
+    GSocketAddress *address = g_unix_socket_address_new(path);
+    // The socket file gets mode 0600 as bind() creates it
+    mode_t old_umask = umask(0077);
+    gboolean listening = g_socket_listener_add_address(G_SOCKET_LISTENER(service), address,
+                                                       G_SOCKET_TYPE_STREAM,
+                                                       G_SOCKET_PROTOCOL_DEFAULT,
+                                                       NULL, NULL, &error);
+    umask(old_umask);
+    if (!listening) {
+        g_warning("Failed to listen on %s: %s", path, error->message);
+        g_error_free(error);
+        g_object_unref(address);
+        g_object_unref(service);
+        g_free(path);
+        return;
+    }
+    g_object_unref(address);
+
+    g_signal_connect(service, "incoming", G_CALLBACK(on_control_incoming), app);
+    g_socket_service_start(service);
+    app->control_service = service;
+    app->control_socket_path = path;
+    debug_log("control: listening on %s", path);
+}
+
+static void control_socket_stop(AppState *app) {
+    if (!app->control_service) return;
+
+    g_socket_service_stop(app->control_service);
+    g_socket_listener_close(G_SOCKET_LISTENER(app->control_service));
+    g_clear_object(&app->control_service);
+    g_unlink(app->control_socket_path);
+    g_clear_pointer(&app->control_socket_path, g_free);
+
+    // Clients free themselves once their pending read or write is cancelled
+    for (GList *l = app->control_clients; l != NULL; l = l->next) {
+        g_cancellable_cancel(((ControlClient *)l->data)->cancellable);
+    }
+}
+
+//=============================================================================
+// Control Client (gmux ctl)
+//=============================================================================
+
+static void print_ctl_usage(void) {
+    fputs("Usage: gmux ctl COMMAND [ARGS]\n"
+          "\n"
+          "Commands:\n"
+          "  list [--frecency]                    Print projects and tabs as JSON,\n"
+          "                                       optionally most used first\n"
+          "  open-project PATH                    Add (or select) the project at PATH\n"
+          "  layout FILE                          Open the projects and tabs in a layout file\n"
+          "  new-tab [--project P] [--cwd DIR] [--name NAME] [COMMAND...]\n"
+          "                                       Open a tab, optionally running COMMAND\n"
+          "  send-text [--project P] [--tab N] TEXT\n"
+          "                                       Type TEXT into a tab\n"
+          "  export [--project P] [--tab N] [--format text|ansi|html] [--output FILE]\n"
+          "                                       Save a tab's scrollback (default: clipboard)\n"
+          "  focus [--project P] [--tab N]        Switch to a project or tab\n"
+          "  new-window [--project P]             Open a window, optionally moving P into it\n"
+          "  move-project [--project P] --window N\n"
+          "                                       Show a project in window N (see list)\n"
+          "  move-tab [--project P] [--tab N] --to P2 | --new-window\n"
+          "                                       Move a running tab to another project\n"
+          "                                       or, with its project, a new window\n"
+          "  close [--project P] [--tab N]        Close a tab\n"
+          "  close-others [--project P] [--tab N] Close every other tab in the project\n"
+          "  close-all [--project P]              Close every tab in the project\n"
+          "  memory-pressure [--tier N] [--reset] Act as if memory were low (tier 1-3)\n"
+          "  latency [--enable|--disable] [--reset]\n"
+          "                                       Print keypress-to-paint histograms\n"
+          "  latency-self-test [--count N]        Measure typing into a cat tab\n"
+          "  frame-hud [--enable|--disable] [--dump FILE [--seconds N]]\n"
+          "                                       Show frame timings, save them as JSON\n"
+          "  recipe [--project P] [--run|--allow] Show (or rerun) the project's startup\n"
+          "                                       recipe and how long it took to be ready;\n"
+          "                                       --allow trusts .gmux.json as it is now\n"
+          "  env [--project P] [--allow]          Show the project's environment activation;\n"
+          "                                       --allow trusts its files as they are now\n"
+          "  commands [--project P] [--tab N]     A tab's commands, from shell integration\n"
+          "  history [QUERY]                      Search the command history of all tabs\n"
+          "  history-bench [--count N]            Time history searches over N commands\n"
+          "  trigger-bench [--count MB] [--project P] [--tab N]\n"
+          "                                       Time the output trigger scan, and reading\n"
+          "                                       and scanning the tab's last 10000 rows\n"
+          "  keymap-bench [--count N]             Time key lookups over N rounds of typing\n"
+          "  spawn-bench [--count N] [--ballast MB]\n"
+          "                                       Time fork() against posix_spawn, growing\n"
+          "                                       RSS by MB between rounds\n"
+          "  bulk-bench [--count N]               Open and close N projects one by one,\n"
+          "                                       then in one bulk operation; report time,\n"
+          "                                       session writes and sorting for each\n"
+          "  batch                                Read JSON commands from stdin (one per\n"
+          "                                       line, or one array) and run them in a\n"
+          "                                       single round trip\n"
+          "\n"
+          "P is a project index (see list), path or name. Without --project or\n"
+          "--tab the active project and tab are used.\n",
+          stderr);
+}
+
+// Sets member from a --project (or --to) value: numbers are indexes, relative
+// paths are resolved against the caller's directory.
+static void ctl_set_project(JsonObject *request, const char *member, const char *value) {
+    char *end = NULL;
+    gint64 index = g_ascii_strtoll(value, &end, 10);
+    if (end != value && *end == '\0') {
+        json_object_set_int_member(request, member, index);
+    } else if (value[0] == '.' || strchr(value, '/')) {
+        char *path = g_canonicalize_filename(value, NULL);
+        json_object_set_string_member(request, member, path);
+        g_free(path);
+    } else {
+        json_object_set_string_member(request, member, value);
+    }
+}
+
+// Builds the request for a single ctl subcommand; NULL on a usage error.
+static JsonNode* build_ctl_request(int argc, char **argv) {
+    const char *cmd = argv[0];
+    JsonObject *request = json_object_new();
+    json_object_set_string_member(request, "cmd", cmd);
+
+    // Options come first; everything after them (or after "--") is positional
+    GPtrArray *rest = g_ptr_array_new();
+    gboolean options_done = FALSE;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        gboolean has_value = !options_done && i + 1 < argc;
+
+        if (!options_done && strcmp(arg, "--") == 0) {
+            options_done = TRUE;
+        } else if (has_value && strcmp(arg, "--project") == 0) {
+            ctl_set_project(request, "project", argv[++i]);
+        } else if (has_value && strcmp(arg, "--to") == 0) {
+            ctl_set_project(request, "to", argv[++i]);
+        } else if (!options_done && strcmp(arg, "--new-window") == 0) {
+            json_object_set_boolean_member(request, "new_window", TRUE);
+        } else if (has_value && strcmp(arg, "--tab") == 0) {
+            json_object_set_int_member(request, "tab", g_ascii_strtoll(argv[++i], NULL, 10));
+        } else if (has_value && strcmp(arg, "--cwd") == 0) {
+            char *path = g_canonicalize_filename(argv[++i], NULL);
+            json_object_set_string_member(request, "cwd", path);
+            g_free(path);
+        } else if (!options_done && strcmp(arg, "--frecency") == 0) {
+            json_object_set_string_member(request, "sort", "frecency");
+        } else if (has_value && strcmp(arg, "--name") == 0) {
+            json_object_set_string_member(request, "name", argv[++i]);
+        } else if (has_value && strcmp(arg, "--tier") == 0) {
+            json_object_set_int_member(request, "tier", g_ascii_strtoll(argv[++i], NULL, 10));
+        } else if (!options_done && strcmp(arg, "--run") == 0) {
+            json_object_set_boolean_member(request, "run", TRUE);
+        } else if (!options_done && strcmp(arg, "--allow") == 0) {
+            json_object_set_boolean_member(request, "allow", TRUE);
+        } else if (!options_done && strcmp(arg, "--reset") == 0) {
+            json_object_set_boolean_member(request, "reset", TRUE);
+        } else if (!options_done && strcmp(arg, "--enable") == 0) {
+            json_object_set_boolean_member(request, "enable", TRUE);
+        } else if (!options_done && strcmp(arg, "--disable") == 0) {
+            json_object_set_boolean_member(request, "disable", TRUE);
+        } else if (has_value && strcmp(arg, "--output") == 0) {
+            char *output = g_canonicalize_filename(argv[++i], NULL);
+            json_object_set_string_member(request, "output", output);
+            g_free(output);
+        } else if (has_value && strcmp(arg, "--format") == 0) {
+            json_object_set_string_member(request, "format", argv[++i]);
+        } else if (has_value && strcmp(arg, "--dump") == 0) {
+            char *dump = g_canonicalize_filename(argv[++i], NULL);
+            json_object_set_string_member(request, "dump", dump);
+            g_free(dump);
+        } else if (has_value && strcmp(arg, "--seconds") == 0) {
+            json_object_set_int_member(request, "seconds", g_ascii_strtoll(argv[++i], NULL, 10));
+        } else if (has_value && strcmp(arg, "--count") == 0) {
+            json_object_set_int_member(request, "count", g_ascii_strtoll(argv[++i], NULL, 10));
+        } else if (has_value && strcmp(arg, "--ballast") == 0) {
+            json_object_set_int_member(request, "ballast_mb", g_ascii_strtoll(argv[++i], NULL, 10));
+        } else if (has_value && strcmp(arg, "--window") == 0) {
+            json_object_set_int_member(request, "window", g_ascii_strtoll(argv[++i], NULL, 10));
+        } else {
+            options_done = TRUE;
+            g_ptr_array_add(rest, (gpointer)arg);
+        }
+    }
+
+    gboolean ok = TRUE;
+    if (strcmp(cmd, "open-project") == 0 || strcmp(cmd, "layout") == 0) {
+        ok = rest->len == 1;
+        if (ok) {
+            char *path = g_canonicalize_filename(rest->pdata[0], NULL);
+            json_object_set_string_member(request, "path", path);
+            g_free(path);
+        }
+    } else if (strcmp(cmd, "new-tab") == 0) {
+        if (rest->len > 0) {
+            g_ptr_array_add(rest, NULL);
+            char *command = g_strjoinv(" ", (char **)rest->pdata);
+            json_object_set_string_member(request, "command", command);
+            g_free(command);
+        }
+    } else if (strcmp(cmd, "send-text") == 0) {
+        ok = rest->len == 1;
+        if (ok) json_object_set_string_member(request, "text", rest->pdata[0]);
+    } else if (strcmp(cmd, "history") == 0) {
+        ok = rest->len <= 1;
+        if (ok && rest->len == 1) json_object_set_string_member(request, "query", rest->pdata[0]);
+    } else if (strcmp(cmd, "focus") == 0 || strcmp(cmd, "close") == 0 ||
+               strcmp(cmd, "close-others") == 0 || strcmp(cmd, "close-all") == 0 ||
+               strcmp(cmd, "list") == 0 || strcmp(cmd, "memory-pressure") == 0 ||
+               strcmp(cmd, "latency") == 0 || strcmp(cmd, "latency-self-test") == 0 ||
+               strcmp(cmd, "frame-hud") == 0 || strcmp(cmd, "export") == 0 ||
+               strcmp(cmd, "new-window") == 0 || strcmp(cmd, "move-project") == 0 ||
+               strcmp(cmd, "move-tab") == 0 || strcmp(cmd, "spawn-bench") == 0 ||
+               strcmp(cmd, "recipe") == 0 || strcmp(cmd, "trigger-bench") == 0 ||
+               strcmp(cmd, "env") == 0 || strcmp(cmd, "bulk-bench") == 0 ||
+               strcmp(cmd, "commands") == 0 || strcmp(cmd, "history-bench") == 0 ||
+               strcmp(cmd, "keymap-bench") == 0) {
+        ok = rest->len == 0;
+    } else {
+        ok = FALSE;
+    }
+    g_ptr_array_free(rest, TRUE);
+
+    if (!ok) {
+        json_object_unref(request);
+        return NULL;
+    }
+    JsonNode *node = json_node_new(JSON_NODE_OBJECT);
+    json_node_take_object(node, request);
+    return node;
+}
+
+// Reads batch commands from stdin: either one JSON array, or one command
+// object per line. Everything goes out as a single array request.
+static JsonNode* read_ctl_batch(GError **error) {
+    GString *input = g_string_new(NULL);
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
+        g_string_append_len(input, buffer, (gssize)n);
+    }
+
+    JsonParser *parser = json_parser_new();
+    JsonNode *batch = NULL;
+    if (json_parser_load_from_data(parser, input->str, (gssize)input->len, NULL) &&
+        JSON_NODE_HOLDS_ARRAY(json_parser_get_root(parser))) {
+        batch = json_node_copy(json_parser_get_root(parser));
+    } else {
+        JsonArray *requests = json_array_new();
+        char **lines = g_strsplit(input->str, "\n", -1);
+        for (int i = 0; lines[i] != NULL; i++) {
+            g_strstrip(lines[i]);
+            if (lines[i][0] == '\0') continue;
+            if (!json_parser_load_from_data(parser, lines[i], -1, error)) {
+                json_array_unref(requests);
+                requests = NULL;
+                break;
+            }
+            json_array_add_element(requests, json_node_copy(json_parser_get_root(parser)));
+        }
+        g_strfreev(lines);
+        if (requests) {
+            batch = json_node_new(JSON_NODE_ARRAY);
+            json_node_take_array(batch, requests);
+        }
+    }
+
+    g_object_unref(parser);
+    g_string_free(input, TRUE);
+    return batch;
+}
+
+static gboolean ctl_reply_ok(JsonNode *reply) {
+    if (JSON_NODE_HOLDS_ARRAY(reply)) {
+        JsonArray *replies = json_node_get_array(reply);
+        for (guint i = 0; i < json_array_get_length(replies); i++) {
+            if (!ctl_reply_ok(json_array_get_element(replies, i))) return FALSE;
+        }
+        return TRUE;
+    }
+    return JSON_NODE_HOLDS_OBJECT(reply) &&
+           json_object_get_boolean_member_with_default(json_node_get_object(reply), "ok", FALSE);
+}
+
+// Sends one request over the control socket and returns the reply line.
+// connected tells a failure to reach gmux from one after reaching it.
+static char* send_ctl_request(JsonNode *request, gboolean *connected, GError **error) {
+    char *path = get_control_socket_path();
+    GSocketClient *socket_client = g_socket_client_new();
+    GSocketAddress *address = g_unix_socket_address_new(path);
+    GSocketConnection *connection = g_socket_client_connect(
+        socket_client, G_SOCKET_CONNECTABLE(address), NULL, error);
+    g_object_unref(address);
+    g_object_unref(socket_client);
+
+    *connected = connection != NULL;
+    if (!connection) {
+        g_prefix_error(error, "cannot connect to %s: ", path);
+        g_free(path);
+        return NULL;
+    }
+    g_free(path);
+
+    char *text = json_to_string(request, FALSE);
+    char *line = g_strconcat(text, "\n", NULL);
+    g_free(text);
+
+    GOutputStream *output = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+    GDataInputStream *input = g_data_input_stream_new(
+        g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+    char *reply_line = NULL;
+    if (g_output_stream_write_all(output, line, strlen(line), NULL, NULL, error)) {
+        reply_line = g_data_input_stream_read_line_utf8(input, NULL, NULL, error);
+    }
+    g_free(line);
+    g_object_unref(input);
+    g_object_unref(connection);
+    return reply_line;
+}
+
+// Entry point for `gmux ctl ...`. Exits 0 on success, 1 when gmux reports
+// a failed command and 2 on usage or connection errors.
+static int run_ctl_client(int argc, char **argv) {
+    if (argc < 1 || strcmp(argv[0], "--help") == 0 || strcmp(argv[0], "-h") == 0) {
+        print_ctl_usage();
+        return argc < 1 ? 2 : 0;
+    }
+
+    GError *error = NULL;
+    JsonNode *request = NULL;
+    if (strcmp(argv[0], "batch") == 0) {
+        request = read_ctl_batch(&error);
+        if (!request) {
+            fprintf(stderr, "gmux ctl: invalid batch input: %s\n",
+                    error ? error->message : "unknown error");
+            g_clear_error(&error);
+            return 2;
+        }
+    } else {
+        request = build_ctl_request(argc, argv);
+        if (!request) {
+            print_ctl_usage();
+            return 2;
+        }
+    }
+
+    gboolean connected = FALSE;
+    char *reply_line = send_ctl_request(request, &connected, &error);
+    json_node_unref(request);
+    if (!reply_line) {
+        fprintf(stderr, connected ? "gmux ctl: no reply from gmux: %s\n" : "gmux ctl: %s\n",
+                error ? error->message : "connection closed");
+        g_clear_error(&error);
+        return 2;
+    }
+
+    puts(reply_line);
+
+    JsonParser *parser = json_parser_new();
+    gboolean ok = json_parser_load_from_data(parser, reply_line, -1, NULL) &&
+                  ctl_reply_ok(json_parser_get_root(parser));
+    g_object_unref(parser);
+    g_free(reply_line);
+    return ok ? 0 : 1;
+}
+
+//=============================================================================
+// Workspace Windows
+//=============================================================================
+
+// All windows show one workspace model (AppState): settings, themes,
+// discovery, git badges, the control socket and the session file exist
+// once. A window only owns widgets: its sidebar rows and notebook pages
+// belong to the projects shown in it. Projects move between windows by
+// reparenting those widgets, so their terminals keep running.
+
+static void move_project_to_window(Project *project, WorkspaceWindow *win) {
+    WorkspaceWindow *from = project->win;
+    if (from == win) {
+        select_project(project);
+        return;
+    }
+
+    // Hold the widgets while they have no parent
+    GtkWidget *row = g_object_ref(project->list_row);
+    gtk_list_box_remove(GTK_LIST_BOX(from->sidebar), row);
+    GtkWidget *page = project->tab_container ? g_object_ref(project->tab_container) : NULL;
+    if (page) {
+        gtk_notebook_remove_page(GTK_NOTEBOOK(from->notebook),
+                                 gtk_notebook_page_num(GTK_NOTEBOOK(from->notebook), page));
+    }
+
+    project->win = win;
+    gtk_list_box_append(GTK_LIST_BOX(win->sidebar), row);
+    g_object_unref(row);
+    if (page) {
+        gtk_notebook_append_page(GTK_NOTEBOOK(win->notebook), page, NULL);
+        g_object_unref(page);
+    }
+
+    if (from->active_project == project) {
+        from->active_project = first_window_project(from);
+        if (from->active_project) select_project(from->active_project);
+    }
+    select_project(project);
+    save_session(project->app);
+    debug_log("Moved project '%s' to window %d", project->name,
+              g_list_index(project->app->windows, win));
+}
+
+static void on_workspace_window_active(GtkWidget *widget, GParamSpec *pspec, gpointer user_data) {
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
+    (void)pspec;
+    if (gtk_window_is_active(GTK_WINDOW(widget))) win->app->focus = win;
+}
+
+// Closing one of several windows hands its projects to another window
+// instead of closing them; only the last window ends the session.
+static gboolean on_workspace_window_close_request(GtkWindow *window, gpointer user_data) {
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
+    AppState *app = win->app;
+    (void)window;
+    if (!app->windows || !app->windows->next) return FALSE;
+
+    app->windows = g_list_remove(app->windows, win);
+    WorkspaceWindow *target = app->focus && app->focus != win ? app->focus
+                                                             : app->windows->data;
+    app->focus = target;
+
+    if (app->latency && app->latency->win == win) disable_latency_tracking(app);
+    if (app->frame_hud && app->frame_hud->win == win) hide_frame_hud(app);
+
+    workspace_begin_bulk(app);
+    for (GList *l = app->projects; l != NULL; l = l->next) {
+        Project *project = (Project *)l->data;
+        if (project->win == win) move_project_to_window(project, target);
+    }
+    save_session(app);
+    workspace_commit_bulk(app);
+    return FALSE;
+}
+
+static void on_workspace_window_destroy(GtkWidget *widget, gpointer user_data) {
+    WorkspaceWindow *win = (WorkspaceWindow *)user_data;
+    AppState *app = win->app;
+
+    free_history_picker(win);
+
+    // Still listed when it is the last window, or when the application is
+    // going away without asking each window to close. Either way the first
+    // one ends the session, while every window's projects are still there.
+    if (g_list_find(app->windows, win) && !app->shutting_down) {
+        on_window_destroy(widget, app);
+    }
+}
+
+static WorkspaceWindow* create_workspace_window(AppState *app) {
+    WorkspaceWindow *win = g_new0(WorkspaceWindow, 1);
+    win->app = app;
+
+    win->window = gtk_application_window_new(app->gtk_app);
+    gtk_window_set_title(GTK_WINDOW(win->window), "gmux");
+    gtk_window_set_icon_name(GTK_WINDOW(win->window), "utilities-terminal");
+    gtk_window_set_default_size(GTK_WINDOW(win->window), 1200, 800);
+    // Freed with the window, after its widgets have let go of it
+    g_object_set_data_full(G_OBJECT(win->window), "gmux-workspace-window", win, g_free);
+
+    // Create explicit headerbar so we can style it (skip on KDE — it forces SSD)
+    const char *desktop = g_getenv("XDG_CURRENT_DESKTOP");
+    gboolean is_kde = desktop && g_strstr_len(desktop, -1, "KDE") != NULL;
+    if (!is_kde) {
+        GtkWidget *headerbar = gtk_header_bar_new();
+        gtk_widget_add_css_class(headerbar, "gmux-headerbar");
+        gtk_window_set_titlebar(GTK_WINDOW(win->window), headerbar);
+    }
+
+    // Create horizontal paned
+    GtkWidget *paned = gtk_paned_new(GTK_ORIENTATION_HORIZONTAL);
+    gtk_window_set_child(GTK_WINDOW(win->window), paned);
 
     // Create sidebar with toolbar
     GtkWidget *sidebar_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
     gtk_widget_set_size_request(sidebar_box, 200, -1);
     gtk_widget_add_css_class(sidebar_box, "gmux-sidebar");
-    state->sidebar_box = sidebar_box;
 
     // Toolbar
     GtkWidget *toolbar = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
@@ -3151,13 +15099,14 @@ static void activate(GtkApplication *app, gpointer user_data) {
     GtkWidget *settings_button = gtk_button_new_from_icon_name("preferences-system-symbolic");
     gtk_widget_set_tooltip_text(settings_button, "Settings");
 
-    state->sort_button = gtk_button_new_from_icon_name("view-list-symbolic");
-    gtk_widget_set_tooltip_text(state->sort_button, "Sort: Manual");
+    win->sort_button = gtk_button_new_from_icon_name("view-list-symbolic");
+    gtk_widget_set_tooltip_text(win->sort_button, "Sort: Manual");
 
     gtk_box_append(GTK_BOX(toolbar), add_button);
     gtk_box_append(GTK_BOX(toolbar), remove_button);
     gtk_box_append(GTK_BOX(toolbar), settings_button);
-    gtk_box_append(GTK_BOX(toolbar), state->sort_button);
+    gtk_box_append(GTK_BOX(toolbar), win->sort_button);
+    gtk_box_append(GTK_BOX(toolbar), build_discovery_button(win));
 
     // Sidebar list
     GtkWidget *scrolled = gtk_scrolled_window_new();
@@ -3166,23 +15115,40 @@ static void activate(GtkApplication *app, gpointer user_data) {
                                    GTK_POLICY_NEVER,
                                    GTK_POLICY_AUTOMATIC);
 
-    state->sidebar = gtk_list_box_new();
-    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scrolled), state->sidebar);
+    win->sidebar = gtk_list_box_new();
+    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scrolled), win->sidebar);
+
+    // Git badges are only computed for rows scrolled into view
+    GtkAdjustment *sidebar_vadjustment =
+        gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(scrolled));
+    g_signal_connect(sidebar_vadjustment, "value-changed", G_CALLBACK(on_sidebar_scrolled), app);
+    g_signal_connect(sidebar_vadjustment, "changed", G_CALLBACK(on_sidebar_scrolled), app);
 
     gtk_box_append(GTK_BOX(sidebar_box), toolbar);
     gtk_box_append(GTK_BOX(sidebar_box), scrolled);
 
     // Create notebook for content
-    state->notebook = gtk_notebook_new();
-    gtk_widget_set_hexpand(state->notebook, TRUE);
-    gtk_widget_set_vexpand(state->notebook, TRUE);
+    win->notebook = gtk_notebook_new();
+    gtk_notebook_set_show_tabs(GTK_NOTEBOOK(win->notebook), FALSE);
+    gtk_widget_set_hexpand(win->notebook, TRUE);
+    gtk_widget_set_vexpand(win->notebook, TRUE);
 
     // Add to paned
     gtk_paned_set_start_child(GTK_PANED(paned), sidebar_box);
     gtk_paned_set_resize_start_child(GTK_PANED(paned), FALSE);
     gtk_paned_set_shrink_start_child(GTK_PANED(paned), FALSE);
 
-    gtk_paned_set_end_child(GTK_PANED(paned), state->notebook);
+    // Debug readouts float over the top-right corner of the terminals
+    GtkWidget *content = gtk_overlay_new();
+    gtk_overlay_set_child(GTK_OVERLAY(content), win->notebook);
+    win->debug_overlay = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    gtk_widget_set_halign(win->debug_overlay, GTK_ALIGN_END);
+    gtk_widget_set_valign(win->debug_overlay, GTK_ALIGN_START);
+    gtk_widget_set_can_target(win->debug_overlay, FALSE);
+    gtk_widget_set_visible(win->debug_overlay, FALSE);
+    gtk_overlay_add_overlay(GTK_OVERLAY(content), win->debug_overlay);
+
+    gtk_paned_set_end_child(GTK_PANED(paned), content);
     gtk_paned_set_resize_end_child(GTK_PANED(paned), TRUE);
     gtk_paned_set_shrink_end_child(GTK_PANED(paned), TRUE);
 
@@ -3190,38 +15156,380 @@ static void activate(GtkApplication *app, gpointer user_data) {
     gtk_paned_set_wide_handle(GTK_PANED(paned), TRUE);
 
     // Connect signals
-    g_signal_connect(add_button, "clicked", G_CALLBACK(on_add_project_clicked), state);
-    g_signal_connect(remove_button, "clicked", G_CALLBACK(on_remove_project_clicked), state);
-    g_signal_connect(settings_button, "clicked", G_CALLBACK(on_settings_clicked), state);
-    g_signal_connect(state->sort_button, "clicked", G_CALLBACK(on_sort_clicked), state);
-    g_signal_connect(state->sidebar, "row-selected", G_CALLBACK(on_project_selected), state);
-    g_signal_connect(state->window, "destroy", G_CALLBACK(on_window_destroy), state);
-    g_signal_connect(state->window, "notify::default-width", G_CALLBACK(on_window_size_changed), state);
-    g_signal_connect(state->window, "notify::default-height", G_CALLBACK(on_window_size_changed), state);
-    g_signal_connect(state->window, "notify::maximized", G_CALLBACK(on_window_size_changed), state);
-
-    // Add keyboard shortcut controller for copy/paste
+    g_signal_connect(add_button, "clicked", G_CALLBACK(on_add_project_clicked), win);
+    g_signal_connect(remove_button, "clicked", G_CALLBACK(on_remove_project_clicked), win);
+    g_signal_connect(settings_button, "clicked", G_CALLBACK(on_settings_clicked), win);
+    g_signal_connect(win->sort_button, "clicked", G_CALLBACK(on_sort_clicked), app);
+    g_signal_connect(win->sidebar, "row-selected", G_CALLBACK(on_project_selected), win);
+    g_signal_connect(win->window, "close-request",
+                     G_CALLBACK(on_workspace_window_close_request), win);
+    g_signal_connect(win->window, "destroy", G_CALLBACK(on_workspace_window_destroy), win);
+    g_signal_connect(win->window, "notify::is-active", G_CALLBACK(on_workspace_window_active), win);
+    g_signal_connect(win->window, "notify::default-width", G_CALLBACK(on_window_size_changed), win);
+    g_signal_connect(win->window, "notify::default-height", G_CALLBACK(on_window_size_changed), win);
+    g_signal_connect(win->window, "notify::maximized", G_CALLBACK(on_window_size_changed), win);
+
+    // Key bindings are dispatched before the focused terminal sees the key
     GtkEventController *key_controller = gtk_event_controller_key_new();
     gtk_event_controller_set_propagation_phase(key_controller, GTK_PHASE_CAPTURE);
-    g_signal_connect(key_controller, "key-pressed", G_CALLBACK(on_key_pressed), state);
-    gtk_widget_add_controller(state->window, key_controller);
+    g_signal_connect(key_controller, "key-pressed", G_CALLBACK(on_key_pressed), app);
+    gtk_widget_add_controller(win->window, key_controller);
+
+    app->windows = g_list_append(app->windows, win);
+    if (!app->focus) app->focus = win;
+    apply_sort(app);
+    return win;
+}
+
+// A new window at runtime, optionally taking project from its current one.
+// An empty window isn't in the session, so only a project moving in saves.
+static WorkspaceWindow* open_workspace_window(AppState *app, Project *project) {
+    WorkspaceWindow *win = create_workspace_window(app);
+    app->focus = win;
+    if (project) move_project_to_window(project, win);
+    gtk_window_present(GTK_WINDOW(win->window));
+    return win;
+}
+
+//=============================================================================
+// Moving Tabs
+//=============================================================================
+
+// A tab moves by reparenting its strip button and terminal pane into the
+// target project's tabs_box and terminal_stack. The VteTerminal, its PTY
+// and child, its scrollback and any paste or export in progress go along
+// unchanged; only parent_tab and the two projects' lists are fixed up.
+
+static void move_subtab_to_project(SubTab *subtab, Project *target) {
+    Project *source = subtab->parent_tab;
+    AppState *app = source->app;
+    if (source == target || subtab->closing) return;
+
+    // Bring back the target's saved tabs first so this one doesn't replace them
+    if (target->saved_subtabs) ensure_project_initialized(target);
+    target->initialized = TRUE;
+    ensure_project_page(target);
+
+    // Hand the active role to a neighbour, as closing the tab would
+    if (source->active_subtab == subtab) {
+        GList *link = g_list_find(source->subtabs, subtab);
+        GList *next = link->next ? link->next : link->prev;
+        if (next) {
+            SubTab *new_active = (SubTab *)next->data;
+            on_subtab_button_clicked(GTK_BUTTON(new_active->tab_button), new_active);
+        } else {
+            source->active_subtab = NULL;
+        }
+    }
+    if (source->menu_subtab == subtab) source->menu_subtab = NULL;
+
+    // Hold the widgets while they have no parent
+    GtkWidget *tab_widget = g_object_ref(subtab->tab_widget);
+    GtkWidget *container = g_object_ref(subtab->container);
+    gtk_box_remove(GTK_BOX(source->tabs_box), tab_widget);
+    gtk_stack_remove(GTK_STACK(source->terminal_stack), container);
+    source->subtabs = g_list_remove(source->subtabs, subtab);
+    if (!source->subtabs) source->initialized = FALSE;
+
+    subtab->parent_tab = target;
+    gtk_box_append(GTK_BOX(target->tabs_box), tab_widget);
+    gtk_stack_add_child(GTK_STACK(target->terminal_stack), container);
+    target->subtabs = g_list_append(target->subtabs, subtab);
+    g_object_unref(tab_widget);
+    g_object_unref(container);
+
+    update_tab_count_badge(source);
+    update_tab_overflow_indicator(source);
+    update_tab_count_badge(target);
+
+    // Follow the tab to where it went
+    select_project(target);
+    if (app->bulk_depth > 0) {
+        gtk_stack_set_visible_child(GTK_STACK(target->terminal_stack), container);
+        target->active_subtab = subtab;
+        target->tabs_dirty = TRUE;
+    } else {
+        on_subtab_button_clicked(GTK_BUTTON(subtab->tab_button), subtab);
+    }
+    if (target->win != source->win) gtk_window_present(GTK_WINDOW(target->win->window));
+    save_session(app);
+    debug_log("Moved tab '%s' from '%s' to '%s'", subtab->name, source->name, target->name);
+}
+
+// A project is shown in one window and is the only entry for its path, so
+// only a project's last tab can be torn off: the project goes with it.
+// With other tabs left behind there is no project to put it in, and FALSE
+// is returned without moving anything.
+static gboolean subtab_can_move_to_new_window(SubTab *subtab) {
+    return !subtab->closing && g_list_length(subtab->parent_tab->subtabs) == 1;
+}
+
+static gboolean move_subtab_to_new_window(SubTab *subtab) {
+    Project *source = subtab->parent_tab;
+    if (!subtab_can_move_to_new_window(subtab)) return FALSE;
+
+    open_workspace_window(source->app, source);
+    return TRUE;
+}
+
+//=============================================================================
+// Application Setup
+//=============================================================================
+
+static int startup_bench_projects = 0;  // --startup-bench N
+
+// Write a session with n projects, each in its own empty directory, into a
+// fresh data directory. Returns the directory, or NULL with error set.
+static char* create_startup_bench_dir(int n, GError **error) {
+    char *dir = g_dir_make_tmp("gmux-startup-bench-XXXXXX", error);
+    if (!dir) return NULL;
+
+    JsonBuilder *builder = json_builder_new();
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "sort_mode");
+    json_builder_add_string_value(builder, "alpha");
+    json_builder_set_member_name(builder, "projects");
+    json_builder_begin_array(builder);
+    for (int i = 0; i < n; i++) {
+        char *name = g_strdup_printf("bench-%04d", i);
+        char *path = g_build_filename(dir, "projects", name, NULL);
+        g_mkdir_with_parents(path, 0700);
+        json_builder_begin_object(builder);
+        json_builder_set_member_name(builder, "name");
+        json_builder_add_string_value(builder, name);
+        json_builder_set_member_name(builder, "path");
+        json_builder_add_string_value(builder, path);
+        json_builder_end_object(builder);
+        g_free(path);
+        g_free(name);
+    }
+    json_builder_end_array(builder);
+    json_builder_end_object(builder);
+
+    JsonGenerator *gen = json_generator_new();
+    JsonNode *root = json_builder_get_root(builder);
+    json_generator_set_root(gen, root);
+    char *json = json_generator_to_data(gen, NULL);
+    char *session_path = g_build_filename(dir, config_file_names[CONFIG_FILE_SESSION], NULL);
+    gboolean ok = g_file_set_contents(session_path, json, -1, error);
+
+    g_free(session_path);
+    g_free(json);
+    json_node_unref(root);
+    g_object_unref(gen);
+    g_object_unref(builder);
+    if (!ok) g_clear_pointer(&dir, g_free);
+    return dir;
+}
+
+static void remove_tree(const char *path) {
+    GDir *dir = g_dir_open(path, 0, NULL);
+    if (dir) {
+        const char *entry;
+        while ((entry = g_dir_read_name(dir)) != NULL) {
+            char *child = g_build_filename(path, entry, NULL);
+            if (g_file_test(child, G_FILE_TEST_IS_DIR) &&
+                !g_file_test(child, G_FILE_TEST_IS_SYMLINK)) {
+                remove_tree(child);
+            } else {
+                g_remove(child);
+            }
+            g_free(child);
+        }
+        g_dir_close(dir);
+    }
+    g_rmdir(path);
+}
+
+// Startup cost, from activate() until the first frame has been painted
+static void on_first_frame_painted(GdkFrameClock *clock, gpointer user_data) {
+    AppState *app = (AppState *)user_data;
+    g_signal_handlers_disconnect_by_func(clock, on_first_frame_painted, app);
+    int pages = 0;
+    for (GList *w = app->windows; w != NULL; w = w->next) {
+        pages += gtk_notebook_get_n_pages(GTK_NOTEBOOK(((WorkspaceWindow *)w->data)->notebook));
+    }
+    double ms = (g_get_monotonic_time() - app->activate_time) / 1000.0;
+    debug_log("First frame %.1f ms after activate: %u projects in %u windows, %d pages built",
+              ms, g_list_length(app->projects), g_list_length(app->windows), pages);
+
+    if (startup_bench_projects > 0) {
+        printf("first frame %.1f ms after activate: %u projects in %u windows, %d pages built\n",
+               ms, g_list_length(app->projects), g_list_length(app->windows), pages);
+        fflush(stdout);
+        g_application_quit(G_APPLICATION(app->gtk_app));
+        return;
+    }
+
+    // The HUD needs the frame clock, which exists from here on
+    const char *hud = g_getenv("GMUX_FRAME_HUD");
+    if (hud && hud[0] && strcmp(hud, "0") != 0) show_frame_hud(app);
+}
+
+static gboolean on_first_frame_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer user_data) {
+    (void)widget;
+    g_signal_connect(clock, "after-paint", G_CALLBACK(on_first_frame_painted), user_data);
+    return G_SOURCE_REMOVE;
+}
+
+static void activate(GtkApplication *app, gpointer user_data) {
+    (void)user_data;
+
+    // Launching gmux again while it runs opens another window onto the
+    // same workspace; nothing is read from disk
+    AppState *running = g_object_get_data(G_OBJECT(app), "gmux-state");
+    if (running) {
+        if (!running->shutting_down) open_workspace_window(running, NULL);
+        return;
+    }
 
-    // Migrate old config data to XDG data dir
+    AppState *state = g_new0(AppState, 1);
+    state->activate_time = g_get_monotonic_time();
+    state->psi_fd = -1;
+    state->gtk_app = app;
+    g_object_set_data(G_OBJECT(app), "gmux-state", state);
+
+    // One pass over the data directory; everything below parses from memory
+    config_store_load();
     migrate_config_to_data();
 
+    // Create the first window; the session may add more
+    WorkspaceWindow *first = create_workspace_window(state);
+    load_window_geometry(first);
+
     load_terminal_settings(&state->settings);
+    reload_keymap(state);
+    reload_triggers(state);
     refresh_scheduled_theme(state);
     state->theme_schedule_timer_id = g_timeout_add_seconds(30, on_theme_schedule_tick, state);
 
-    // Restore session (projects, subtabs, sort mode)
+    // Restore session (projects, subtabs, sort mode), then any --layout,
+    // as one bulk operation: a single sort and at most one session write
+    workspace_begin_bulk(state);
     load_session(state);
-    apply_sort(state);
+    if (startup_layout_path) {
+        GError *error = NULL;
+        if (!apply_layout_file(state, startup_layout_path, &error)) {
+            g_warning("Failed to load layout %s: %s", startup_layout_path, error->message);
+            g_error_free(error);
+        }
+        g_clear_pointer(&startup_layout_path, g_free);
+    }
+    workspace_commit_bulk(state);
+
+    // Scrollback files are only read when a tab is first shown
+    prune_orphan_scrollback(state);
+    state->scrollback_timer_id = g_timeout_add_seconds(SCROLLBACK_AUTOSAVE_SECONDS,
+                                                       on_scrollback_autosave_tick, state);
 
     // Apply settings overrides after projects are loaded
     refresh_scheduled_theme(state);
     apply_settings_overrides(state);
 
-    gtk_window_present(GTK_WINDOW(state->window));
+    // Pick up settings.conf edits made outside gmux
+    config_store_watch(state);
+
+    // Accept `gmux ctl` commands; a startup bench must not take the
+    // socket from a gmux that is already running
+    if (startup_bench_projects == 0) control_socket_start(state);
+
+    // Crawling and index loading happen off the main thread
+    start_project_discovery(state);
+
+    // Tab labels follow the foreground job; tabs are polled once spawned
+    start_job_poll(state);
+
+    // Shed caches, scrollback and hidden pages when memory runs low
+    start_memory_monitor(state);
+
+    const char *latency = g_getenv("GMUX_LATENCY");
+    if (latency && latency[0] && strcmp(latency, "0") != 0) {
+        enable_latency_tracking(state);
+    }
+
+    gtk_widget_add_tick_callback(first->window, on_first_frame_tick, state, NULL);
+    for (GList *w = state->windows; w != NULL; w = w->next) {
+        gtk_window_present(GTK_WINDOW(((WorkspaceWindow *)w->data)->window));
+    }
+    // The first window has the keyboard; it was created before the others
+    gtk_window_present(GTK_WINDOW(first->window));
+}
+
+// With gmux already running, activate() would only open another window
+// there, so --layout goes over the control socket instead
+static int forward_layout(const char *path) {
+    JsonObject *request = json_object_new();
+    json_object_set_string_member(request, "cmd", "layout");
+    json_object_set_string_member(request, "path", path);
+    JsonNode *node = json_node_new(JSON_NODE_OBJECT);
+    json_node_take_object(node, request);
+
+    GError *error = NULL;
+    gboolean connected = FALSE;
+    char *reply_line = send_ctl_request(node, &connected, &error);
+    json_node_unref(node);
+    if (!reply_line) {
+        fprintf(stderr, "gmux: cannot hand --layout to the running gmux: %s\n",
+                error ? error->message : "connection closed");
+        g_clear_error(&error);
+        return 1;
+    }
+
+    JsonParser *parser = json_parser_new();
+    gboolean ok = json_parser_load_from_data(parser, reply_line, -1, NULL) &&
+                  ctl_reply_ok(json_parser_get_root(parser));
+    if (!ok) {
+        JsonNode *root = json_parser_get_root(parser);
+        const char *message = root && JSON_NODE_HOLDS_OBJECT(root)
+            ? json_object_get_string_member_with_default(json_node_get_object(root), "error", NULL)
+            : NULL;
+        fprintf(stderr, "gmux: --layout %s: %s\n", path, message ? message : reply_line);
+    }
+    g_object_unref(parser);
+    g_free(reply_line);
+    return ok ? 0 : 1;
+}
+
+static int on_handle_local_options(GApplication *application, GVariantDict *options,
+                                   gpointer user_data) {
+    (void)user_data;
+
+    const char *layout = NULL;
+    if (g_variant_dict_lookup(options, "layout", "^&ay", &layout)) {
+        startup_layout_path = g_canonicalize_filename(layout, NULL);
+
+        GError *error = NULL;
+        if (!g_application_register(application, NULL, &error)) {
+            fprintf(stderr, "gmux: %s\n", error->message);
+            g_error_free(error);
+            return 1;
+        }
+        if (g_application_get_is_remote(application)) {
+            int status = forward_layout(startup_layout_path);
+            g_clear_pointer(&startup_layout_path, g_free);
+            return status;
+        }
+    }
+
+    int bench = 0;
+    if (g_variant_dict_lookup(options, "startup-bench", "i", &bench)) {
+        if (bench < 1 || bench > 10000) {
+            fprintf(stderr, "gmux: --startup-bench takes 1 to 10000 projects\n");
+            return 1;
+        }
+        GError *error = NULL;
+        startup_bench_dir = create_startup_bench_dir(bench, &error);
+        if (!startup_bench_dir) {
+            fprintf(stderr, "gmux: %s\n", error->message);
+            g_error_free(error);
+            return 1;
+        }
+        startup_bench_projects = bench;
+        // A separate instance, even with gmux already running
+        g_application_set_flags(application,
+                                g_application_get_flags(application) | G_APPLICATION_NON_UNIQUE);
+    }
+    return -1;  // continue startup
 }
 
 int main(int argc, char *argv[]) {
@@ -3231,12 +15539,31 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    if (argc > 1 && strcmp(argv[1], "ctl") == 0) {
+        return run_ctl_client(argc - 2, argv + 2);
+    }
+
+    install_shell_termprops();
+
     GtkApplication *app = gtk_application_new("com.gmux.terminal",
                                              G_APPLICATION_DEFAULT_FLAGS);
+    g_application_add_main_option(G_APPLICATION(app), "layout", 0, G_OPTION_FLAG_NONE,
+                                  G_OPTION_ARG_FILENAME,
+                                  "Open the projects and tabs listed in a layout file", "FILE");
+    g_application_add_main_option(G_APPLICATION(app), "startup-bench", 0, G_OPTION_FLAG_NONE,
+                                  G_OPTION_ARG_INT,
+                                  "Start with N generated projects, print the time to the first frame and quit",
+                                  "N");
+    g_signal_connect(app, "handle-local-options", G_CALLBACK(on_handle_local_options), NULL);
     g_signal_connect(app, "activate", G_CALLBACK(activate), NULL);
 
     int status = g_application_run(G_APPLICATION(app), argc, argv);
     g_object_unref(app);
 
+    if (startup_bench_dir) {
+        remove_tree(startup_bench_dir);
+        g_clear_pointer(&startup_bench_dir, g_free);
+    }
+
     return status;
 }